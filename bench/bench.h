@@ -0,0 +1,81 @@
+#ifndef SITD_BENCH_H
+#define SITD_BENCH_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * shared by the benchmarks: every result is one json object per line on
+ * stdout, so runs can be diffed or loaded as-is. logs go to stderr.
+ *
+ * {"bench":"db","case":"get_tunnels","n":10000,"ops":12,"seconds":0.251,
+ *  "ns_per_op":20916666.7,"ops_per_s":47.8}
+ *
+ * p50_ns/p99_ns are only there when the benchmark samples latencies, and
+ * allocs_per_op when it counts heap allocations;
+ * a benchmark that can't run here prints {"bench":...,"skipped":"why"}.
+ */
+
+/* bench_run() grows the batch until one takes at least this long. */
+#define BENCH_MIN_SECONDS 0.2
+
+typedef struct bench_result {
+    const char *bench;
+    const char *name;
+    size_t n;
+    uint64_t ops;
+    double seconds;
+    double p50_ns, p99_ns;
+    bool counted;
+    double allocs_per_op;
+} bench_result_t;
+
+typedef void (*bench_fn_t)(void *arg);
+
+static inline double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void bench_print(const bench_result_t *r) {
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",\"n\":%zu,\"ops\":%llu,\"seconds\":%.6f,\"ns_per_op\":%.1f,\"ops_per_s\":%.1f",
+        r->bench, r->name, r->n, (unsigned long long) r->ops, r->seconds,
+        r->ops ? r->seconds * 1e9 / r->ops : 0, r->seconds > 0 ? r->ops / r->seconds : 0);
+    if (r->p50_ns > 0) printf(",\"p50_ns\":%.0f,\"p99_ns\":%.0f", r->p50_ns, r->p99_ns);
+    if (r->counted) printf(",\"allocs_per_op\":%.2f", r->allocs_per_op);
+    printf("}\n");
+    fflush(stdout);
+}
+
+static inline void bench_report(const char *bench, const char *name, size_t n, uint64_t ops, double seconds) {
+    bench_result_t r = { bench, name, n, ops, seconds, 0, 0, false, 0 };
+    bench_print(&r);
+}
+
+static inline void bench_skip(const char *bench, const char *why) {
+    printf("{\"bench\":\"%s\",\"skipped\":\"%s\"}\n", bench, why);
+    fflush(stdout);
+}
+
+/* calls fn in doubling batches until a batch takes BENCH_MIN_SECONDS, and
+ * reports that batch. */
+static inline void bench_run(const char *bench, const char *name, size_t n, bench_fn_t fn, void *arg) {
+    uint64_t ops = 1;
+    double begin, seconds;
+
+    for (;;) {
+        begin = bench_now();
+        for (uint64_t i = 0; i < ops; i++) fn(arg);
+        seconds = bench_now() - begin;
+
+        if (seconds >= BENCH_MIN_SECONDS || ops >= (UINT64_C(1) << 40)) break;
+        ops *= seconds > 0 && seconds < BENCH_MIN_SECONDS / 16 ? 16 : 2;
+    }
+
+    bench_report(bench, name, n, ops, seconds);
+}
+
+#endif // SITD_BENCH_H
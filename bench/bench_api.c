@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "src/api.h"
+#include "src/db.h"
+#include "src/log.h"
+#include "bench/bench.h"
+
+/*
+ * load test for the api server: serves GET /api/v1/tunnel/:name (db lookup +
+ * json encode) from a seeded temp database and hammers it over keep-alive
+ * connections with 1, 4 and 16 server threads. reports requests/s and
+ * latency percentiles, one case per thread count; n is the tunnel count.
+ *
+ * usage: bench_api [clients] [seconds] [tunnels]
+ */
+
+#define BENCH_PORT 18123
+#define MAX_SAMPLES (1 << 22)
+
+typedef struct client {
+    pthread_t thread;
+    uint16_t port;
+    size_t tunnels;
+    double deadline;
+    double *samples;
+    size_t count;
+    size_t errors;
+} client_t;
+
+static int get_handler(struct MHD_Connection *conn, size_t argc, const api_arg_t *argv, const json_t *req) {
+    (void) req;
+    sit_tunnel_t *tunnel = NULL;
+    char name[IFNAMSIZ];
+    json_t *body;
+    int r;
+
+    if (argc != 1 || api_arg_copy(&argv[0], name, sizeof(name)) != 0 || db_get_tunnel(name, &tunnel) != SIT_DB_OK) return api_respond_error(conn, 404, "ERR_NOT_FOUND", "no such tunnel.");
+
+    sit_tunnel_to_json(tunnel, &body);
+    r = api_respond(conn, 200, body);
+    json_decref(body);
+    free(tunnel);
+
+    return r;
+}
+
+static int seed(size_t tunnels) {
+    sit_tunnel_t *rows = (sit_tunnel_t *) calloc(tunnels, sizeof(sit_tunnel_t));
+    int err;
+
+    if (rows == NULL) return -1;
+
+    for (size_t i = 0; i < tunnels; i++) {
+        sit_tunnel_t *t = &rows[i];
+        snprintf(t->name, sizeof(t->name), "tun%zu", i);
+        t->local.s_addr = htonl(0xc0000201);
+        t->remote.s_addr = htonl(0x0a000000 | (uint32_t) (i & 0xffffff));
+        t->address.addr.s6_addr[0] = 0x20;
+        t->address.addr.s6_addr[1] = 0x01;
+        t->address.addr.s6_addr[2] = 0x0d;
+        t->address.addr.s6_addr[3] = 0xb8;
+        t->address.addr.s6_addr[4] = (uint8_t) (i >> 8);
+        t->address.addr.s6_addr[5] = (uint8_t) i;
+        t->address.addr.s6_addr[15] = 1;
+        t->address.len = 64;
+    }
+
+    err = db_create_tunnels(rows, tunnels, NULL);
+    free(rows);
+
+    return err == SIT_DB_OK ? 0 : -1;
+}
+
+/* reads one response; returns 0 on a 200, -1 otherwise. */
+static int read_response(int fd, char *buf, size_t buf_sz) {
+    size_t len = 0, need = 0;
+    char *body;
+
+    for (;;) {
+        ssize_t n = recv(fd, buf + len, buf_sz - len - 1, 0);
+        if (n <= 0) return -1;
+        len += n;
+        buf[len] = 0;
+
+        body = strstr(buf, "\r\n\r\n");
+        if (body == NULL) continue;
+
+        if (need == 0) {
+            char *cl = strcasestr(buf, "Content-Length:");
+            if (cl == NULL) return -1;
+            need = (body + 4 - buf) + strtoul(cl + 15, NULL, 10);
+        }
+
+        if (len >= need) return strncmp(buf + 9, "200", 3) == 0 ? 0 : -1;
+    }
+}
+
+static void* client_run(void *arg) {
+    client_t *c = (client_t *) arg;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(c->port) };
+    char req[256], buf[8192];
+    int fd = -1, one = 1;
+    unsigned seed = (unsigned) (uintptr_t) c;
+
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    while (bench_now() < c->deadline && c->count < MAX_SAMPLES) {
+        if (fd < 0) {
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+                close(fd);
+                fd = -1;
+                ++c->errors;
+                continue;
+            }
+        }
+
+        int len = snprintf(req, sizeof(req), "GET /api/v1/tunnel/tun%u HTTP/1.1\r\nHost: bench\r\n\r\n", rand_r(&seed) % (unsigned) c->tunnels);
+        double begin = bench_now();
+
+        if (send(fd, req, len, 0) != len || read_response(fd, buf, sizeof(buf)) != 0) {
+            close(fd);
+            fd = -1;
+            ++c->errors;
+            continue;
+        }
+
+        c->samples[c->count++] = bench_now() - begin;
+    }
+
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(uint32_t threads, size_t clients, double seconds, size_t tunnels) {
+    client_t *c = (client_t *) calloc(clients, sizeof(client_t));
+    double *all;
+    size_t total = 0, errors = 0, k = 0;
+    uint16_t port = BENCH_PORT + threads;
+    bench_result_t r = { .bench = "api", .n = tunnels };
+    char name[32];
+
+    if (api_start(port, threads) != 0) return;
+
+    double begin = bench_now();
+    for (size_t i = 0; i < clients; i++) {
+        c[i].port = port;
+        c[i].tunnels = tunnels;
+        c[i].deadline = begin + seconds;
+        c[i].samples = (double *) malloc(MAX_SAMPLES / clients * sizeof(double) + sizeof(double));
+        pthread_create(&c[i].thread, NULL, &client_run, &c[i]);
+    }
+
+    for (size_t i = 0; i < clients; i++) {
+        pthread_join(c[i].thread, NULL);
+        total += c[i].count;
+        errors += c[i].errors;
+    }
+    double elapsed = bench_now() - begin;
+
+    api_stop();
+
+    all = (double *) malloc((total + 1) * sizeof(double));
+    for (size_t i = 0; i < clients; i++) {
+        memcpy(all + k, c[i].samples, c[i].count * sizeof(double));
+        k += c[i].count;
+        free(c[i].samples);
+    }
+    qsort(all, total, sizeof(double), &cmp_double);
+
+    snprintf(name, sizeof(name), "threads_%u", threads);
+    r.name = name;
+    r.ops = total;
+    r.seconds = elapsed;
+    r.p50_ns = total ? all[total / 2] * 1e9 : 0;
+    r.p99_ns = total ? all[(size_t) (total * 0.99)] * 1e9 : 0;
+    bench_print(&r);
+    if (errors != 0) log_error("%zu of %zu request(s) failed with %u thread(s).\n", errors, total, threads);
+
+    free(all);
+    free(c);
+}
+
+int main(int argc, char **argv) {
+    static const uint32_t thread_counts[] = { 1, 4, 16 };
+    size_t clients = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    double seconds = argc > 2 ? atof(argv[2]) : 5;
+    size_t tunnels = argc > 3 ? strtoul(argv[3], NULL, 10) : 10000;
+    char file[] = "/tmp/sitd-bench-XXXXXX";
+    int fd = mkstemp(file);
+
+    if (fd < 0) {
+        log_fatal("mkstemp() failed.\n");
+        return 1;
+    }
+    close(fd);
+
+    /* db_open() creates the schema, then the rows go in as one bulk insert. */
+    if (db_open(file) != SIT_DB_OK || seed(tunnels) != 0) {
+        log_fatal("can't prepare database.\n");
+        unlink(file);
+        return 1;
+    }
+
+    api_register_handler(API_GET, "/api/v1/tunnel/:tunnel_name", &get_handler);
+
+    if (clients > MAX_SAMPLES) clients = MAX_SAMPLES;
+    if (clients == 0) clients = 1;
+
+    for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+        run(thread_counts[i], clients, seconds, tunnels);
+    }
+
+    api_clear_handlers();
+    db_close();
+    unlink(file);
+
+    return 0;
+}
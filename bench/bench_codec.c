@@ -0,0 +1,177 @@
+#include <arpa/inet.h>
+#include <netlink/netlink.h>
+#include <netlink/msg.h>
+#include <netlink/route/route.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "src/nlcodec.h"
+#include "src/log.h"
+#include "bench/bench.h"
+
+/*
+ * what one route message costs to write and to read back, through libnl
+ * objects (the libnl backend) and through nlcodec (the raw backend). no
+ * socket is involved: *_add cases write RTM_NEWROUTE requests into a send
+ * buffer the way route batches do, *_parse cases decode a dumped route.
+ * every result carries the heap allocations made per message.
+ *
+ * usage: bench_codec
+ */
+
+#define IFINDEX 7
+#define GATEWAY "2001:db8::2"
+
+/* the allocator is wrapped so the allocations of a batch can be counted;
+ * glibc's own entry points do the work. */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void *ptr, size_t size);
+
+static uint64_t allocs = 0;
+
+void* malloc(size_t size) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+typedef struct fixture {
+    sit_route_t route;
+    char sndbuf[NLCODEC_BUF_SZ * 4] __attribute__((aligned(NLMSG_ALIGNTO)));
+    size_t sndbuf_len;
+    char reply[NLCODEC_BUF_SZ] __attribute__((aligned(NLMSG_ALIGNTO)));
+    size_t parsed;
+} fixture_t;
+
+typedef void (*codec_fn_t)(fixture_t *f);
+
+/* what route_batch_append() does on the libnl backend. */
+static void route_add_libnl(fixture_t *f) {
+    struct rtnl_route *rtnl_route = rtnl_route_alloc();
+    struct rtnl_nexthop *nexthop = rtnl_route_nh_alloc();
+    struct nl_addr *dst = nl_addr_build(AF_INET6, &f->route.prefix.addr, sizeof(struct in6_addr));
+    struct nl_addr *gw = nl_addr_build(AF_INET6, &f->route.nexthop, sizeof(struct in6_addr));
+    struct nl_msg *msg = NULL;
+    struct nlmsghdr *nlh;
+    size_t len;
+
+    nl_addr_set_prefixlen(dst, f->route.prefix.len);
+    rtnl_route_set_family(rtnl_route, AF_INET6);
+    rtnl_route_set_dst(rtnl_route, dst);
+    rtnl_route_nh_set_ifindex(nexthop, IFINDEX);
+    rtnl_route_nh_set_gateway(nexthop, gw);
+    rtnl_route_add_nexthop(rtnl_route, nexthop);
+    nl_addr_put(dst);
+    nl_addr_put(gw);
+
+    if (rtnl_route_build_add_request(rtnl_route, NLM_F_CREATE | NLM_F_REPLACE, &msg) == 0) {
+        nlh = nlmsg_hdr(msg);
+        nlh->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+        len = NLMSG_ALIGN(nlh->nlmsg_len);
+
+        if (f->sndbuf_len + len > sizeof(f->sndbuf)) f->sndbuf_len = 0;
+        memcpy(f->sndbuf + f->sndbuf_len, nlh, len);
+        f->sndbuf_len += len;
+        nlmsg_free(msg);
+    }
+
+    rtnl_route_put(rtnl_route);
+}
+
+static void route_add_raw(fixture_t *f) {
+    nlcodec_buf_t buf = { f->sndbuf, f->sndbuf_len, sizeof(f->sndbuf) };
+
+    if (nlcodec_route(&buf, RTM_NEWROUTE, 1, IFINDEX, &f->route) != 0) {
+        buf.len = 0;
+        nlcodec_route(&buf, RTM_NEWROUTE, 1, IFINDEX, &f->route);
+    }
+
+    f->sndbuf_len = buf.len;
+}
+
+static void count_route(struct nl_object *obj, void *arg) {
+    fixture_t *f = (fixture_t *) arg;
+    struct rtnl_route *r = (struct rtnl_route *) obj;
+
+    if (rtnl_route_get_dst(r) != NULL && rtnl_route_get_nnexthops(r) == 1) ++f->parsed;
+}
+
+/* how a dump reply turns into objects on the libnl backend. */
+static void route_parse_libnl(fixture_t *f) {
+    struct nl_msg *msg = nlmsg_convert((struct nlmsghdr *) f->reply);
+
+    if (msg == NULL) return;
+    nlmsg_set_proto(msg, NETLINK_ROUTE);
+    nl_msg_parse(msg, &count_route, f);
+    nlmsg_free(msg);
+}
+
+static void route_parse_raw(fixture_t *f) {
+    sit_route_t route;
+    int ifindex;
+
+    if (nlcodec_parse_route((const struct nlmsghdr *) f->reply, &ifindex, &route) == 0) ++f->parsed;
+}
+
+/* bench_run(), keeping the allocation count of the reported batch. */
+static void run_counted(const char *name, codec_fn_t fn, fixture_t *f) {
+    bench_result_t r = { .bench = "codec", .name = name, .n = 1, .ops = 1, .counted = true };
+    uint64_t before;
+    double begin;
+
+    for (;;) {
+        before = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+        begin = bench_now();
+        for (uint64_t i = 0; i < r.ops; i++) fn(f);
+        r.seconds = bench_now() - begin;
+        r.allocs_per_op = (double) (__atomic_load_n(&allocs, __ATOMIC_RELAXED) - before) / r.ops;
+
+        if (r.seconds >= BENCH_MIN_SECONDS || r.ops >= (UINT64_C(1) << 40)) break;
+        r.ops *= r.seconds > 0 && r.seconds < BENCH_MIN_SECONDS / 16 ? 16 : 2;
+    }
+
+    bench_print(&r);
+}
+
+int main() {
+    static fixture_t f;
+    nlcodec_buf_t reply = { f.reply, 0, sizeof(f.reply) };
+    struct nlmsghdr *nlh = (struct nlmsghdr *) f.reply;
+
+    sit_prefix6_parse("2001:db8:100::/48", &f.route.prefix);
+    inet_pton(AF_INET6, GATEWAY, &f.route.nexthop);
+
+    /* a dumped route looks like the request that made it, less the flags. */
+    if (nlcodec_route(&reply, RTM_NEWROUTE, 1, IFINDEX, &f.route) != 0) {
+        log_fatal("can't encode the route.\n");
+        return 1;
+    }
+    nlh->nlmsg_flags = NLM_F_MULTI;
+
+    run_counted("route_add_libnl", &route_add_libnl, &f);
+    run_counted("route_add_raw", &route_add_raw, &f);
+    run_counted("route_parse_libnl", &route_parse_libnl, &f);
+    if (f.parsed == 0) {
+        log_error("libnl parsed no route.\n");
+        return 1;
+    }
+
+    f.parsed = 0;
+    run_counted("route_parse_raw", &route_parse_raw, &f);
+    if (f.parsed == 0) {
+        log_error("nlcodec parsed no route.\n");
+        return 1;
+    }
+
+    return 0;
+}
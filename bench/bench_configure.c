@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netlink/netlink.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "src/sit.h"
+#include "src/log.h"
+#include "bench/bench.h"
+
+/*
+ * whole-tunnel netlink paths in a private network namespace: sit_configure()
+ * creating each tunnel with its address and routes, sit_apply() on tunnels
+ * already in sync, and sit_destroy(). needs CAP_SYS_ADMIN + CAP_NET_ADMIN
+ * and the sit module; without them the run is reported as skipped. n is
+ * the number of routes per tunnel.
+ *
+ * usage: bench_configure [tunnels] [routes_per_tunnel]
+ */
+
+typedef struct fixture {
+    sit_tunnel_t *tunnels;
+    sit_route_t *routes;
+    size_t n_tunnels, n_routes;
+} fixture_t;
+
+static int make_fixture(fixture_t *f, size_t n_tunnels, size_t n_routes) {
+    f->n_tunnels = n_tunnels;
+    f->n_routes = n_routes;
+    f->tunnels = (sit_tunnel_t *) calloc(n_tunnels, sizeof(sit_tunnel_t));
+    f->routes = (sit_route_t *) calloc(n_tunnels * n_routes + 1, sizeof(sit_route_t));
+    if (f->tunnels == NULL || f->routes == NULL) return -1;
+
+    for (size_t i = 0; i < n_tunnels; i++) {
+        sit_tunnel_t *t = &f->tunnels[i];
+
+        snprintf(t->name, sizeof(t->name), "bench%u", (unsigned) i);
+        t->local.s_addr = htonl(0xc0000201);
+        t->remote.s_addr = htonl(0x0a000000 | (uint32_t) (i & 0xffffff));
+        t->address.addr.s6_addr[0] = 0x20;
+        t->address.addr.s6_addr[1] = 0x01;
+        t->address.addr.s6_addr[2] = 0x0d;
+        t->address.addr.s6_addr[3] = 0xb8;
+        t->address.addr.s6_addr[4] = (uint8_t) (i >> 8);
+        t->address.addr.s6_addr[5] = (uint8_t) i;
+        t->address.addr.s6_addr[15] = 1;
+        t->address.len = 64;
+        t->mtu = 1280;
+        t->state = STATE_RUNNING;
+
+        for (size_t j = 0; j < n_routes; j++) {
+            sit_route_t *r = &f->routes[i * n_routes + j];
+
+            r->prefix.addr.s6_addr[0] = 0x30;
+            r->prefix.addr.s6_addr[2] = (uint8_t) (i >> 8);
+            r->prefix.addr.s6_addr[3] = (uint8_t) i;
+            r->prefix.addr.s6_addr[4] = (uint8_t) (j >> 8);
+            r->prefix.addr.s6_addr[5] = (uint8_t) j;
+            r->prefix.len = 48;
+            r->nexthop = t->address.addr;
+            r->nexthop.s6_addr[15] = 2;
+            r->next = j + 1 < n_routes ? r + 1 : NULL;
+        }
+    }
+
+    return 0;
+}
+
+static sit_route_t* routes_of(const fixture_t *f, size_t i) {
+    return f->n_routes == 0 ? NULL : &f->routes[i * f->n_routes];
+}
+
+int main(int argc, char **argv) {
+    size_t n_tunnels = argc > 1 ? strtoul(argv[1], NULL, 10) : 100;
+    size_t n_routes = argc > 2 ? strtoul(argv[2], NULL, 10) : 16;
+    fixture_t f = { 0 };
+    struct nl_sock *sk = NULL;
+    size_t failed = 0;
+    double begin;
+    int ret = 1;
+
+    if (unshare(CLONE_NEWNET) != 0) {
+        bench_skip("configure", "needs CAP_SYS_ADMIN and CAP_NET_ADMIN");
+        return 0;
+    }
+
+    if (n_tunnels == 0 || make_fixture(&f, n_tunnels, n_routes) != 0) {
+        log_fatal("can't build fixtures.\n");
+        goto end;
+    }
+
+    sk = nl_socket_alloc();
+    if (sk == NULL || nl_connect(sk, NETLINK_ROUTE) < 0 || sit_open() != SIT_OK) {
+        log_fatal("can't open netlink socket.\n");
+        goto end;
+    }
+
+    /* the first tunnel tells whether sit links can be made here at all. */
+    if (sit_configure(sk, &f.tunnels[0], routes_of(&f, 0)) != SIT_OK) {
+        bench_skip("configure", "can't create sit links");
+        ret = 0;
+        goto end;
+    }
+    sit_destroy(sk, f.tunnels[0].name);
+
+    begin = bench_now();
+    for (size_t i = 0; i < n_tunnels; i++) {
+        if (sit_configure(sk, &f.tunnels[i], routes_of(&f, i)) != SIT_OK) ++failed;
+    }
+    bench_report("configure", "configure", n_routes, n_tunnels, bench_now() - begin);
+
+    begin = bench_now();
+    for (size_t i = 0; i < n_tunnels; i++) {
+        if (sit_apply(sk, &f.tunnels[i], NULL, routes_of(&f, i), NULL) != SIT_OK) ++failed;
+    }
+    bench_report("configure", "apply_in_sync", n_routes, n_tunnels, bench_now() - begin);
+
+    begin = bench_now();
+    for (size_t i = 0; i < n_tunnels; i++) {
+        if (sit_destroy(sk, f.tunnels[i].name) != SIT_OK) ++failed;
+    }
+    bench_report("configure", "destroy", n_routes, n_tunnels, bench_now() - begin);
+
+    if (failed != 0) log_error("%zu operation(s) failed.\n", failed);
+    ret = failed == 0 ? 0 : 1;
+
+end:
+    sit_close();
+    if (sk != NULL) nl_socket_free(sk);
+    free(f.tunnels);
+    free(f.routes);
+    return ret;
+}
@@ -0,0 +1,176 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "src/db.h"
+#include "src/store.h"
+#include "src/log.h"
+#include "bench/bench.h"
+
+/*
+ * sqlite reads at 1k, 10k and 100k tunnels, each with one route, seeded
+ * into a temp database: the full tunnel and route lists, and single-tunnel
+ * lookups spread over the whole table. the open_* cases are a cold start
+ * of the store, from sqlite and from its snapshot.
+ *
+ * usage: bench_db [max_rows]
+ */
+
+/* an odd stride visits every key before repeating one. */
+#define KEY_STRIDE 7919
+
+typedef struct fixture {
+    const char *snapshot;
+    size_t rows;
+    size_t next;
+    size_t misses;
+} fixture_t;
+
+static size_t next_key(fixture_t *f) {
+    f->next = (f->next + KEY_STRIDE) % f->rows;
+    return f->next;
+}
+
+static void get_tunnels(void *arg) {
+    fixture_t *f = (fixture_t *) arg;
+    sit_tunnel_t *tunnels;
+    size_t count;
+
+    if (db_get_tunnels(&tunnels, &count) != SIT_DB_OK) ++f->misses;
+    else db_free_result_tunnels(tunnels);
+}
+
+static void get_tunnel(void *arg) {
+    fixture_t *f = (fixture_t *) arg;
+    sit_tunnel_t *tunnel;
+    char name[IFNAMSIZ];
+
+    snprintf(name, sizeof(name), "tun%u", (unsigned) next_key(f));
+    if (db_get_tunnel(name, &tunnel) != SIT_DB_OK) ++f->misses;
+    else db_free_result_tunnels(tunnel);
+}
+
+static void get_routes(void *arg) {
+    fixture_t *f = (fixture_t *) arg;
+    sit_route_t *routes;
+
+    /* ids start at 1, in insert order. */
+    if (db_get_routes((uint32_t) next_key(f) + 1, &routes, NULL) != SIT_DB_OK) ++f->misses;
+    else db_free_result_routes(routes);
+}
+
+static void get_all_routes(void *arg) {
+    fixture_t *f = (fixture_t *) arg;
+    sit_route_t *routes;
+    size_t count;
+
+    if (db_get_all_routes(&routes, &count) != SIT_DB_OK) ++f->misses;
+    else db_free_result_routes(routes);
+}
+
+static void open_store(void *arg) {
+    fixture_t *f = (fixture_t *) arg;
+
+    if (store_open(f->snapshot) != SIT_DB_OK) ++f->misses;
+    else store_close();
+}
+
+static int seed(size_t rows) {
+    sit_tunnel_t *tunnels = (sit_tunnel_t *) calloc(rows, sizeof(sit_tunnel_t));
+    sit_route_t *routes = (sit_route_t *) calloc(rows, sizeof(sit_route_t));
+    int err = SIT_DB_FATAL;
+
+    if (tunnels == NULL || routes == NULL) {
+        log_fatal("calloc() failed.\n");
+        goto end;
+    }
+
+    for (size_t i = 0; i < rows; i++) {
+        sit_tunnel_t *t = &tunnels[i];
+        sit_route_t *r = &routes[i];
+
+        snprintf(t->name, sizeof(t->name), "tun%u", (unsigned) i);
+        t->local.s_addr = htonl(0xc0000201);
+        t->remote.s_addr = htonl(0x0a000000 | (uint32_t) (i & 0xffffff));
+        t->address.addr.s6_addr[0] = 0x20;
+        t->address.addr.s6_addr[1] = 0x01;
+        t->address.addr.s6_addr[2] = 0x0d;
+        t->address.addr.s6_addr[3] = 0xb8;
+        t->address.addr.s6_addr[4] = (uint8_t) (i >> 16);
+        t->address.addr.s6_addr[5] = (uint8_t) (i >> 8);
+        t->address.addr.s6_addr[6] = (uint8_t) i;
+        t->address.addr.s6_addr[15] = 1;
+        t->address.len = 64;
+
+        r->prefix.addr.s6_addr[0] = 0x30;
+        r->prefix.addr.s6_addr[1] = (uint8_t) (i >> 16);
+        r->prefix.addr.s6_addr[2] = (uint8_t) (i >> 8);
+        r->prefix.addr.s6_addr[3] = (uint8_t) i;
+        r->prefix.len = 32;
+        r->nexthop = t->address.addr;
+        r->nexthop.s6_addr[15] = 2;
+    }
+
+    err = db_create_tunnels(tunnels, rows, NULL);
+    if (err != SIT_DB_OK) goto end;
+
+    for (size_t i = 0; i < rows; i++) routes[i].tunnel_id = tunnels[i].id;
+    err = db_create_routes(routes, rows, NULL);
+
+end:
+    free(tunnels);
+    free(routes);
+    return err;
+}
+
+static int run(size_t rows) {
+    fixture_t f = { .rows = rows };
+    char file[] = "/tmp/sitd-bench-XXXXXX", snapshot[sizeof(file) + 5];
+    int fd = mkstemp(file), err;
+
+    if (fd < 0) {
+        log_fatal("mkstemp() failed.\n");
+        return -1;
+    }
+    close(fd);
+
+    /* db_open() creates the schema, then the rows go in as one bulk insert. */
+    err = db_open(file);
+    if (err == SIT_DB_OK) err = seed(rows);
+
+    if (err == SIT_DB_OK) {
+        bench_run("db", "get_tunnels", rows, &get_tunnels, &f);
+        bench_run("db", "get_tunnel", rows, &get_tunnel, &f);
+        bench_run("db", "get_routes", rows, &get_routes, &f);
+        bench_run("db", "get_all_routes", rows, &get_all_routes, &f);
+        bench_run("db", "open_sqlite", rows, &open_store, &f);
+
+        /* the first open writes the snapshot the timed ones map. */
+        snprintf(snapshot, sizeof(snapshot), "%s.snap", file);
+        f.snapshot = snapshot;
+        open_store(&f);
+        bench_run("db", "open_snapshot", rows, &open_store, &f);
+        unlink(snapshot);
+        if (f.misses != 0) log_error("%zu lookup(s) failed at %zu rows.\n", f.misses, rows);
+    } else log_fatal("can't prepare database.\n");
+
+    db_close();
+    unlink(file);
+
+    return err == SIT_DB_OK && f.misses == 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    size_t max_rows = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    int ret = 0;
+
+    /* every store open logs its row counts. */
+    log_set_level(LOG_WARN);
+
+    for (size_t rows = 1000; rows <= max_rows; rows *= 10) {
+        if (run(rows) != 0) ret = 1;
+    }
+
+    return ret;
+}
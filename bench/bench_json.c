@@ -0,0 +1,134 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "src/types.h"
+#include "src/log.h"
+#include "bench/bench.h"
+
+/*
+ * the json conversions of types.h, one object per op: encoding a tunnel,
+ * route or stats sample, and decoding a tunnel or route. the *_dump cases
+ * include serializing the encoded object, as a response would.
+ *
+ * usage: bench_json
+ */
+
+typedef struct fixture {
+    sit_tunnel_t tunnel;
+    sit_route_t route;
+    sit_stats_t stats;
+    json_t *tunnel_json;
+    json_t *route_json;
+    size_t bytes;
+} fixture_t;
+
+static void tunnel_encode(void *arg) {
+    fixture_t *f = (fixture_t *) arg;
+    json_t *json;
+
+    if (sit_tunnel_to_json(&f->tunnel, &json) == ERR_OK) json_decref(json);
+}
+
+static void tunnel_dump(void *arg) {
+    fixture_t *f = (fixture_t *) arg;
+    json_t *json;
+    char *text;
+
+    if (sit_tunnel_to_json(&f->tunnel, &json) != ERR_OK) return;
+    text = json_dumps(json, JSON_COMPACT);
+    if (text != NULL) f->bytes += strlen(text);
+    free(text);
+    json_decref(json);
+}
+
+static void tunnel_decode(void *arg) {
+    fixture_t *f = (fixture_t *) arg;
+    sit_tunnel_t *tunnel;
+
+    if (json_to_sit_tunnel(f->tunnel_json, &tunnel) == ERR_OK) free(tunnel);
+}
+
+static void route_encode(void *arg) {
+    fixture_t *f = (fixture_t *) arg;
+    json_t *json;
+
+    if (sit_route_to_json(&f->route, &json) == ERR_OK) json_decref(json);
+}
+
+static void route_decode(void *arg) {
+    fixture_t *f = (fixture_t *) arg;
+    sit_route_t *route;
+
+    if (json_to_sit_route(f->route_json, &route) == ERR_OK) free(route);
+}
+
+static void stats_encode(void *arg) {
+    fixture_t *f = (fixture_t *) arg;
+    json_t *json;
+
+    if (sit_stats_to_json(&f->stats, &json) == ERR_OK) json_decref(json);
+}
+
+static void stats_dump(void *arg) {
+    fixture_t *f = (fixture_t *) arg;
+    json_t *json;
+    char *text;
+
+    if (sit_stats_to_json(&f->stats, &json) != ERR_OK) return;
+    text = json_dumps(json, JSON_COMPACT);
+    if (text != NULL) f->bytes += strlen(text);
+    free(text);
+    json_decref(json);
+}
+
+int main() {
+    fixture_t f;
+
+    memset(&f, 0, sizeof(f));
+
+    set_val_numeric(f.tunnel.id, 42);
+    set_val_string(f.tunnel.name, "sit42", IFNAMSIZ - 1);
+    f.tunnel.local.s_addr = htonl(0xc0000201);
+    f.tunnel.local_isset = true;
+    f.tunnel.remote.s_addr = htonl(0xc633642a);
+    f.tunnel.remote_isset = true;
+    sit_prefix6_parse("2001:db8:42::1/64", &f.tunnel.address);
+    f.tunnel.address_isset = true;
+    set_val_numeric(f.tunnel.mtu, 1480);
+    set_val_numeric(f.tunnel.state, STATE_RUNNING);
+
+    set_val_numeric(f.route.id, 7);
+    set_val_numeric(f.route.tunnel_id, 42);
+    sit_prefix6_parse("2001:db8:4200::/40", &f.route.prefix);
+    f.route.prefix_isset = true;
+    inet_pton(AF_INET6, "2001:db8:42::2", &f.route.nexthop);
+    f.route.nexthop_isset = true;
+
+    strcpy(f.stats.name, "sit42");
+    f.stats.rx_bytes = 123456789012;
+    f.stats.tx_bytes = 98765432109;
+    f.stats.rx_packets = 123456789;
+    f.stats.tx_packets = 98765432;
+    f.stats.rx_bytes_rate = 1234567.5;
+    f.stats.tx_bytes_rate = 7654321.25;
+    f.stats.updated = 1700000000;
+
+    if (sit_tunnel_to_json(&f.tunnel, &f.tunnel_json) != ERR_OK || sit_route_to_json(&f.route, &f.route_json) != ERR_OK) {
+        log_fatal("can't build fixtures.\n");
+        return 1;
+    }
+
+    bench_run("json", "tunnel_encode", 1, &tunnel_encode, &f);
+    bench_run("json", "tunnel_dump", 1, &tunnel_dump, &f);
+    bench_run("json", "tunnel_decode", 1, &tunnel_decode, &f);
+    bench_run("json", "route_encode", 1, &route_encode, &f);
+    bench_run("json", "route_decode", 1, &route_decode, &f);
+    bench_run("json", "stats_encode", 1, &stats_encode, &f);
+    bench_run("json", "stats_dump", 1, &stats_dump, &f);
+
+    json_decref(f.tunnel_json);
+    json_decref(f.route_json);
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "src/api.h"
+#include "src/log.h"
+#include "bench/bench.h"
+
+/*
+ * url dispatch through api_match() with 10, 100 and 1000 registered
+ * patterns, shaped like the real ones: half "/api/v1/rN/:name", half
+ * "/api/v1/rN/:name/item/:id". siblings are searched in turn, so the first
+ * and the last registered pattern bound the cost; a miss walks them all.
+ *
+ * usage: bench_router
+ */
+
+#define PATTERN_SZ 64
+
+typedef struct lookup {
+    api_method_t method;
+    const char *url;
+    size_t matched;
+} lookup_t;
+
+static int null_handler(struct MHD_Connection *conn, size_t argc, const api_arg_t *argv, const json_t *req) {
+    (void) conn;
+    (void) argc;
+    (void) argv;
+    (void) req;
+    return MHD_YES;
+}
+
+static void do_lookup(void *arg) {
+    lookup_t *l = (lookup_t *) arg;
+    api_arg_t args[API_MAX_ARGS];
+    size_t argc;
+
+    if (api_match(l->method, l->url, args, &argc) != NULL) ++l->matched;
+}
+
+static void run(size_t n) {
+    char (*patterns)[PATTERN_SZ] = calloc(n, PATTERN_SZ);
+    char first[PATTERN_SZ], last[PATTERN_SZ];
+    lookup_t cases[4];
+    const char *names[4] = { "first_registered", "last_registered", "miss", "wrong_method" };
+
+    if (patterns == NULL) {
+        log_fatal("calloc() failed.\n");
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (i % 2 == 0) snprintf(patterns[i], PATTERN_SZ, "/api/v1/r%zu/:name", i);
+        else snprintf(patterns[i], PATTERN_SZ, "/api/v1/r%zu/:name/item/:id", i);
+        api_register_handler(API_GET, patterns[i], &null_handler);
+    }
+
+    snprintf(first, sizeof(first), "/api/v1/r0/sit0");
+    snprintf(last, sizeof(last), (n - 1) % 2 == 0 ? "/api/v1/r%zu/sit0" : "/api/v1/r%zu/sit0/item/42", n - 1);
+
+    cases[0] = (lookup_t) { API_GET, first, 0 };
+    cases[1] = (lookup_t) { API_GET, last, 0 };
+    cases[2] = (lookup_t) { API_GET, "/api/v1/nope/sit0", 0 };
+    cases[3] = (lookup_t) { API_POST, first, 0 };
+
+    for (size_t i = 0; i < 4; i++) bench_run("router", names[i], n, &do_lookup, &cases[i]);
+
+    /* the registered strings must outlive the routes. */
+    api_clear_handlers();
+    free(patterns);
+}
+
+int main() {
+    static const size_t sizes[] = { 10, 100, 1000 };
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) run(sizes[i]);
+
+    return 0;
+}
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netlink/netlink.h>
+#include <netlink/route/link.h>
+#include <netlink/route/addr.h>
+#include <netlink/route/route.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "src/sit.h"
+#include "src/log.h"
+#include "bench/bench.h"
+
+/*
+ * measures routes installed per second through sit_add_routes() against a
+ * dummy interface in a private network namespace, next to a baseline of one
+ * synchronous rtnl_route_add() per route. batched runs once per backend
+ * (libnl objects, then nlcodec). needs CAP_SYS_ADMIN + CAP_NET_ADMIN;
+ * without them the run is reported as skipped.
+ *
+ * usage: bench_routes [route_count]
+ */
+
+#define GATEWAY "2001:db8::2"
+
+static int make_link(struct nl_sock *sk, const char *name, const char *addr, int *ifindex) {
+    static const char *kinds[] = { "dummy", "ifb", NULL };
+    struct rtnl_link *link = NULL, *found = NULL;
+    struct rtnl_addr *rtnl_addr = NULL;
+    struct nl_addr *local = NULL;
+    struct nl_cache *cache = NULL;
+    int err = -1;
+
+    for (int i = 0; kinds[i] != NULL && err < 0; i++) {
+        link = rtnl_link_alloc();
+        rtnl_link_set_name(link, name);
+        rtnl_link_set_type(link, kinds[i]);
+        rtnl_link_set_flags(link, IFF_UP);
+        err = rtnl_link_add(sk, link, NLM_F_CREATE);
+        rtnl_link_put(link);
+    }
+
+    if (err < 0) {
+        log_fatal("rtnl_link_add(): %s.\n", nl_geterror(err));
+        return -1;
+    }
+
+    err = rtnl_link_alloc_cache(sk, AF_UNSPEC, &cache);
+    if (err < 0) goto end;
+
+    found = rtnl_link_get_by_name(cache, name);
+    if (found == NULL) {
+        err = -1;
+        goto end;
+    }
+
+    /* dummy links don't come up through the create flags on older kernels. */
+    link = rtnl_link_alloc();
+    rtnl_link_set_flags(link, IFF_UP);
+    rtnl_link_change(sk, found, link, 0);
+    rtnl_link_put(link);
+
+    *ifindex = rtnl_link_get_ifindex(found);
+
+    nl_addr_parse(addr, AF_INET6, &local);
+    rtnl_addr = rtnl_addr_alloc();
+    rtnl_addr_set_ifindex(rtnl_addr, *ifindex);
+    rtnl_addr_set_local(rtnl_addr, local);
+    err = rtnl_addr_add(sk, rtnl_addr, NLM_F_REPLACE);
+
+end:
+    if (err < 0) log_fatal("can't set up %s: %s.\n", name, nl_geterror(err));
+    if (local != NULL) nl_addr_put(local);
+    if (rtnl_addr != NULL) rtnl_addr_put(rtnl_addr);
+    if (found != NULL) rtnl_link_put(found);
+    if (cache != NULL) nl_cache_free(cache);
+    return err < 0 ? -1 : 0;
+}
+
+static sit_route_t* make_routes(size_t count, unsigned block) {
+    sit_route_t *routes = (sit_route_t *) calloc(count, sizeof(sit_route_t));
+    if (routes == NULL) return NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        sit_route_t *r = &routes[i];
+        r->prefix.addr.s6_addr[0] = 0x20;
+        r->prefix.addr.s6_addr[1] = 0x01;
+        r->prefix.addr.s6_addr[2] = 0x0d;
+        r->prefix.addr.s6_addr[3] = 0xb8;
+        r->prefix.addr.s6_addr[4] = (uint8_t) (block >> 8);
+        r->prefix.addr.s6_addr[5] = (uint8_t) block;
+        r->prefix.addr.s6_addr[6] = (uint8_t) (i >> 8);
+        r->prefix.addr.s6_addr[7] = (uint8_t) i;
+        r->prefix.len = 64;
+        inet_pton(AF_INET6, GATEWAY, &r->nexthop);
+        routes[i].next = i + 1 < count ? &routes[i + 1] : NULL;
+    }
+
+    return routes;
+}
+
+static void count_result(const sit_route_t *route, int err, void *data) {
+    (void) route;
+    if (err != SIT_OK) ++*(size_t *) data;
+}
+
+static size_t install_sequential(struct nl_sock *sk, int ifindex, const sit_route_t *route) {
+    size_t failed = 0;
+
+    for (; route != NULL; route = route->next) {
+        struct rtnl_route *rtnl_route = rtnl_route_alloc();
+        struct rtnl_nexthop *nexthop = rtnl_route_nh_alloc();
+        struct nl_addr *dst = nl_addr_build(AF_INET6, &route->prefix.addr, sizeof(struct in6_addr));
+        struct nl_addr *gw = nl_addr_build(AF_INET6, &route->nexthop, sizeof(struct in6_addr));
+
+        nl_addr_set_prefixlen(dst, route->prefix.len);
+        rtnl_route_set_family(rtnl_route, AF_INET6);
+        rtnl_route_set_dst(rtnl_route, dst);
+        rtnl_route_nh_set_ifindex(nexthop, ifindex);
+        rtnl_route_nh_set_gateway(nexthop, gw);
+        rtnl_route_add_nexthop(rtnl_route, nexthop);
+
+        if (rtnl_route_add(sk, rtnl_route, NLM_F_CREATE | NLM_F_REPLACE) < 0) ++failed;
+
+        nl_addr_put(dst);
+        nl_addr_put(gw);
+        rtnl_route_put(rtnl_route);
+    }
+
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+    sit_route_t *batched = NULL, *batched_raw = NULL, *sequential = NULL;
+    struct nl_sock *sk = NULL;
+    int ifindex_a, ifindex_b, ifindex_c, ret = 1;
+    size_t failed = 0;
+    double begin, batched_s, batched_raw_s, sequential_s;
+
+    if (unshare(CLONE_NEWNET) != 0) {
+        bench_skip("routes", "needs CAP_SYS_ADMIN and CAP_NET_ADMIN");
+        return 0;
+    }
+
+    sk = nl_socket_alloc();
+    if (sk == NULL || nl_connect(sk, NETLINK_ROUTE) < 0) {
+        log_fatal("can't open netlink socket.\n");
+        goto end;
+    }
+
+    if (make_link(sk, "bench0", "2001:db8::1/64", &ifindex_a) < 0) goto end;
+    if (make_link(sk, "bench1", "2001:db8::3/64", &ifindex_b) < 0) goto end;
+    if (make_link(sk, "bench2", "2001:db8::4/64", &ifindex_c) < 0) goto end;
+
+    batched = make_routes(count, 0x100);
+    sequential = make_routes(count, 0x200);
+    batched_raw = make_routes(count, 0x300);
+    if (batched == NULL || sequential == NULL || batched_raw == NULL) {
+        log_fatal("calloc() failed.\n");
+        goto end;
+    }
+
+    begin = bench_now();
+    sit_add_routes(sk, ifindex_a, batched, &count_result, &failed);
+    batched_s = bench_now() - begin;
+
+    sit_set_backend(SIT_BACKEND_RAW);
+    begin = bench_now();
+    sit_add_routes(sk, ifindex_c, batched_raw, &count_result, &failed);
+    batched_raw_s = bench_now() - begin;
+    sit_set_backend(SIT_BACKEND_LIBNL);
+
+    begin = bench_now();
+    failed += install_sequential(sk, ifindex_b, sequential);
+    sequential_s = bench_now() - begin;
+
+    bench_report("routes", "batched", count, count, batched_s);
+    bench_report("routes", "batched_raw", count, count, batched_raw_s);
+    bench_report("routes", "sequential", count, count, sequential_s);
+    if (failed != 0) log_error("%zu route(s) failed.\n", failed);
+    ret = failed == 0 ? 0 : 1;
+
+end:
+    free(batched);
+    free(batched_raw);
+    free(sequential);
+    if (sk != NULL) nl_socket_free(sk);
+    return ret;
+}
@@ -1,152 +1,896 @@
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <string.h>
 #include <memory.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include "api.h"
 #include "log.h"
+#include "latency.h"
 #define RECV_BUFFER_SZ 0xffff
+#define RECV_CHUNK_SZ 0x1000
+#define POOL_MAX_CHUNKS 256
+#define POOL_MAX_CONNS 64
+#define MAX_HEADERS 4
+#define HEADER_NAME_SZ 32
+#define HEADER_VALUE_SZ 224
+#define BUCKET_SLOTS 4096
+#define RETRY_AFTER_MAX 60
 
-typedef struct handler_table {
-    const char* url_format;
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+/* registered url patterns are compiled into a trie of path segments. static
+ * segments are tried before the ":param" child, and each node keeps one
+ * handler per method. */
+typedef struct route_node {
+    const char *segment;
+    size_t len;
+    bool routed;
+    struct route_node *children;
+    struct route_node *sibling;
+    struct route_node *param;
+    api_handler_t handlers[API_METHOD_COUNT];
+    size_t max_body[API_METHOD_COUNT];
+    api_class_t classes[API_METHOD_COUNT];
+    const char *wait_args[API_METHOD_COUNT];
+} route_node_t;
+
+/* request and response bodies are kept per connection as chains of pooled
+ * chunks, so concurrent requests never share a buffer and nothing is copied
+ * twice. */
+typedef struct recv_chunk {
+    struct recv_chunk *next;
+    size_t len;
+    char data[RECV_CHUNK_SZ];
+} recv_chunk_t;
+
+typedef struct recv_cursor {
+    const recv_chunk_t *chunk;
+    size_t offset;
+} recv_cursor_t;
+
+typedef struct api_header {
+    char name[HEADER_NAME_SZ];
+    char value[HEADER_VALUE_SZ];
+} api_header_t;
+
+typedef struct api_conn {
+    const route_node_t *route;
     api_handler_t handler;
-    struct handler_table *next;
-} handler_table_t;
+    size_t max_body;
+    api_arg_t args[API_MAX_ARGS];
+    size_t argc;
+    recv_chunk_t *head;
+    recv_chunk_t *tail;
+    size_t size;
+    bool too_large;
+    recv_chunk_t *out_head;
+    recv_chunk_t *out_tail;
+    size_t out_size;
+    recv_cursor_t out;
+    api_stream_next_t stream_next;
+    api_stream_free_t stream_free;
+    void *stream_data;
+    size_t stream_count;
+    bool stream_done;
+    api_header_t headers[MAX_HEADERS];
+    size_t header_count;
+    struct MHD_Connection *connection;
+    api_class_t cls;
+    uint32_t retry_after;
+    bool admitted;
+    struct api_conn *next_waiting;
+    struct api_conn *next_free;
+} api_conn_t;
+
+/* token buckets by client, one per class: an ipv4 address or an ipv6 /64,
+ * since one host usually holds a whole /64. the table is direct-mapped and
+ * clients hashing to the same slot share its tokens, so cycling through
+ * addresses doesn't buy fresh bursts. */
+typedef struct bucket {
+    bool used;
+    double tokens[API_CLASS_COUNT];
+    uint64_t last[API_CLASS_COUNT];
+} bucket_t;
 
-static handler_table_t *handlers = NULL;
-static handler_table_t *handlers_tail = NULL;
+/* requests of a class being served, and the ones suspended until a slot
+ * frees up, oldest first. a finished request hands its slot straight to
+ * the next one waiting. */
+typedef struct admit_class {
+    api_limit_t limit;
+    uint32_t running;
+    uint32_t waiting;
+    api_conn_t *head, *tail;
+} admit_class_t;
+
+typedef enum admit_result {
+    ADMIT_RUN,
+    ADMIT_WAIT,
+    ADMIT_FULL
+} admit_result_t;
+
+static const char *method_names[API_METHOD_COUNT] = { "GET", "POST", "PUT", "DELETE", "PATCH" };
+
+static route_node_t routes = { 0 };
 static struct MHD_Daemon *api_server = NULL;
 
-int api_register_handler(const char* url_format, api_handler_t handler) {
-    if (handlers == NULL) {
-        handlers = (handler_table_t *) malloc(sizeof(handler_table_t));
-        if (handlers == NULL) {
-            log_fatal("malloc() failed.\n");
-            return -1;
-        }
-        handlers_tail = handlers;
+/* the connection whose handler is running on this thread, so api_respond()
+ * can serialize into its chunks. */
+static __thread api_conn_t *current_conn = NULL;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static recv_chunk_t *free_chunks = NULL;
+static api_conn_t *free_conns = NULL;
+static size_t free_chunks_count = 0;
+static size_t free_conns_count = 0;
+
+static pthread_mutex_t admit_lock = PTHREAD_MUTEX_INITIALIZER;
+static admit_class_t classes[API_CLASS_COUNT];
+static bucket_t *buckets = NULL;
+static bool admit_closed = false;
+
+static recv_chunk_t* chunk_get() {
+    recv_chunk_t *chunk;
+
+    pthread_mutex_lock(&pool_lock);
+    chunk = free_chunks;
+    if (chunk != NULL) {
+        free_chunks = chunk->next;
+        --free_chunks_count;
     }
-    handlers_tail->handler = handler;
-    handlers_tail->url_format = url_format;
-    handlers_tail->next = malloc(sizeof(handler_table_t));
-    if (handlers_tail->next == NULL) {
+    pthread_mutex_unlock(&pool_lock);
+
+    if (chunk == NULL) chunk = (recv_chunk_t *) malloc(sizeof(recv_chunk_t));
+    if (chunk == NULL) {
         log_fatal("malloc() failed.\n");
+        return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->len = 0;
+    return chunk;
+}
+
+static api_conn_t* conn_get() {
+    api_conn_t *conn;
+
+    pthread_mutex_lock(&pool_lock);
+    conn = free_conns;
+    if (conn != NULL) {
+        free_conns = conn->next_free;
+        --free_conns_count;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (conn == NULL) conn = (api_conn_t *) malloc(sizeof(api_conn_t));
+    if (conn == NULL) {
+        log_fatal("malloc() failed.\n");
+        return NULL;
+    }
+
+    memset(conn, 0, sizeof(api_conn_t));
+    return conn;
+}
+
+static void chunks_put(recv_chunk_t *chunk) {
+    recv_chunk_t *next;
+
+    while (chunk != NULL) {
+        next = chunk->next;
+        if (free_chunks_count < POOL_MAX_CHUNKS) {
+            chunk->next = free_chunks;
+            free_chunks = chunk;
+            ++free_chunks_count;
+        } else free(chunk);
+        chunk = next;
+    }
+}
+
+static void conn_put(api_conn_t *conn) {
+    if (conn->stream_free != NULL) conn->stream_free(conn->stream_data);
+
+    pthread_mutex_lock(&pool_lock);
+
+    chunks_put(conn->head);
+    chunks_put(conn->out_head);
+
+    if (free_conns_count < POOL_MAX_CONNS) {
+        conn->next_free = free_conns;
+        free_conns = conn;
+        ++free_conns_count;
+        conn = NULL;
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+
+    free(conn);
+}
+
+static void pool_clear() {
+    pthread_mutex_lock(&pool_lock);
+
+    while (free_chunks != NULL) {
+        recv_chunk_t *next = free_chunks->next;
+        free(free_chunks);
+        free_chunks = next;
+    }
+
+    while (free_conns != NULL) {
+        api_conn_t *next = free_conns->next_free;
+        free(free_conns);
+        free_conns = next;
+    }
+
+    free_chunks_count = free_conns_count = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static int conn_append(api_conn_t *conn, const char *data, size_t size) {
+    if (conn->size + size > conn->max_body) {
+        conn->too_large = true;
         return -1;
     }
-    handlers_tail = handlers_tail->next;
-    handlers_tail->next = NULL;
+
+    conn->size += size;
+
+    while (size > 0) {
+        if (conn->tail == NULL || conn->tail->len == RECV_CHUNK_SZ) {
+            recv_chunk_t *chunk = chunk_get();
+            if (chunk == NULL) return -1;
+            if (conn->tail == NULL) conn->head = chunk;
+            else conn->tail->next = chunk;
+            conn->tail = chunk;
+        }
+
+        size_t n = RECV_CHUNK_SZ - conn->tail->len;
+        if (n > size) n = size;
+
+        memcpy(conn->tail->data + conn->tail->len, data, n);
+        conn->tail->len += n;
+        data += n;
+        size -= n;
+    }
 
     return 0;
 }
 
-void api_clear_handlers() {
-    if (handlers == NULL) return;
+/* feeds the chunk chain to json_load_callback() without joining it first. */
+static size_t conn_read(void *buffer, size_t buflen, void *data) {
+    recv_cursor_t *cursor = (recv_cursor_t *) data;
+    size_t n;
+
+    while (cursor->chunk != NULL && cursor->offset == cursor->chunk->len) {
+        cursor->chunk = cursor->chunk->next;
+        cursor->offset = 0;
+    }
+
+    if (cursor->chunk == NULL) return 0;
+
+    n = cursor->chunk->len - cursor->offset;
+    if (n > buflen) n = buflen;
 
-    handler_table_t *handler = handlers, *next = NULL;
+    memcpy(buffer, cursor->chunk->data + cursor->offset, n);
+    cursor->offset += n;
 
-    while (handler != NULL) {
-        if (handler != NULL) next = handler->next;
-        free(handler);
-        handler = next;
+    return n;
+}
+
+/* json_dump_callback() sink: appends to the response chain. */
+static int conn_write(const char *buffer, size_t size, void *data) {
+    api_conn_t *conn = (api_conn_t *) data;
+
+    conn->out_size += size;
+
+    while (size > 0) {
+        if (conn->out_tail == NULL || conn->out_tail->len == RECV_CHUNK_SZ) {
+            /* chunks left over from a reset are refilled before new ones. */
+            recv_chunk_t *chunk = conn->out_tail != NULL ? conn->out_tail->next : conn->out_head;
+            if (chunk == NULL) {
+                chunk = chunk_get();
+                if (chunk == NULL) return -1;
+                if (conn->out_tail == NULL) conn->out_head = chunk;
+                else conn->out_tail->next = chunk;
+            }
+            conn->out_tail = chunk;
+        }
+
+        size_t n = RECV_CHUNK_SZ - conn->out_tail->len;
+        if (n > size) n = size;
+
+        memcpy(conn->out_tail->data + conn->out_tail->len, buffer, n);
+        conn->out_tail->len += n;
+        buffer += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+/* MHD content reader over the response chain. the chunks go back to the
+ * pool in request_completed(), after the last read. */
+static ssize_t conn_send(void *cls, uint64_t pos, char *buf, size_t max) {
+    api_conn_t *conn = (api_conn_t *) cls;
+    recv_cursor_t *cursor = &conn->out;
+    size_t n;
+
+    (void) pos;
+
+    while (cursor->chunk != NULL && cursor->offset == cursor->chunk->len) {
+        cursor->chunk = cursor->chunk->next;
+        cursor->offset = 0;
     }
 
-    handlers = NULL;
+    if (cursor->chunk == NULL) return MHD_CONTENT_READER_END_OF_STREAM;
+
+    n = cursor->chunk->len - cursor->offset;
+    if (n > max) n = max;
+
+    memcpy(buf, cursor->chunk->data + cursor->offset, n);
+    cursor->offset += n;
+
+    return (ssize_t) n;
 }
 
-static void free_args (char **args, size_t url_args_count) {
-    if (args == NULL) return;
-    for (int i = 0; i < url_args_count; i++) free(args[i]);
-    free(args);
+/* empties the response chain but keeps its chunks for the next write. */
+static void conn_out_reset(api_conn_t *conn) {
+    for (recv_chunk_t *chunk = conn->out_head; chunk != NULL; chunk = chunk->next) chunk->len = 0;
+
+    conn->out_tail = NULL;
+    conn->out_size = 0;
+    conn->out.chunk = conn->out_head;
+    conn->out.offset = 0;
 }
 
-static int try_invole_handler(struct MHD_Connection *conn, const char *method, const char *url, const json_t *body) {
-    handler_table_t *table_ptr = handlers;
+/* content reader for streamed arrays: once the chain is drained, it is
+ * refilled with the next few elements, so only about a chunk of output is
+ * held at a time. */
+static ssize_t conn_stream(void *cls, uint64_t pos, char *buf, size_t max) {
+    api_conn_t *conn = (api_conn_t *) cls;
+    json_t *item;
+    int r;
+
+    for (;;) {
+        ssize_t n = conn_send(cls, pos, buf, max);
+        if (n != MHD_CONTENT_READER_END_OF_STREAM || conn->stream_done) return n;
+
+        conn_out_reset(conn);
 
-    while (table_ptr != handlers_tail) {
-        const char *handler_url_ptr = table_ptr->url_format;
-        const char *url_ptr = url;
+        while (conn->out_size < RECV_CHUNK_SZ && !conn->stream_done) {
+            r = conn->stream_next(conn->stream_data, &item);
 
-        char **url_args = NULL;
-        size_t url_args_count = 0;
-        bool mismatch = false;
+            if (r < 0) {
+                log_error("stream aborted after %zu item(s).\n", conn->stream_count);
+                return MHD_CONTENT_READER_END_WITH_ERROR;
+            }
 
-        while (*handler_url_ptr != 0 && *url_ptr != 0) {
-            while (*handler_url_ptr == *url_ptr && *url_ptr != 0) {
-                ++handler_url_ptr;
-                ++url_ptr;
+            if (r == 0) {
+                conn->stream_done = true;
+                r = conn_write("]", 1, conn);
+            } else {
+                r = conn->stream_count++ > 0 ? conn_write(",", 1, conn) : 0;
+                if (r == 0) r = json_dump_callback(item, &conn_write, conn, JSON_COMPACT);
+                json_decref(item);
             }
 
-            if (*handler_url_ptr == 0 || *url_ptr == 0) break;
-
-            if (*handler_url_ptr == ':') { // variable
-                while (*handler_url_ptr != 0 && *handler_url_ptr != '/') handler_url_ptr++;
-
-                const char *var_begin_ptr = url_ptr;
-                while (*url_ptr != 0 && *url_ptr != '/') url_ptr++;
-                size_t arg_sz = url_ptr - var_begin_ptr + 1;
-                
-                if (url_args == NULL) {
-
-                    url_args = (char **) malloc(sizeof(char *));
-                    if (url_args == NULL) {
-                        log_fatal("malloc() failed.\n");
-                        goto err_out;
-                    }
-
-                    url_args[0] = (char *) malloc(arg_sz);
-                    if (url_args[0] == NULL) {
-                        log_fatal("malloc() failed.\n");
-                        goto err_out;
-                    }
-
-                    memcpy(url_args[0], var_begin_ptr, arg_sz);
-                    url_args[0][arg_sz - 1] = 0;
-                    url_args_count = 1;
-                } else {
-                    url_args = (char **) realloc(url_args, (url_args_count + 1) * sizeof(char *));
-
-                    if (url_args == NULL) {
-                        log_fatal("realloc() failed.\n");
-                        goto err_out;
-                    }
-
-                    url_args[url_args_count] = (char *) malloc(arg_sz);
-                    if (url_args[url_args_count] == NULL) {
-                        log_fatal("malloc() failed.\n");
-                        goto err_out;
-                    }
-
-                    memcpy(url_args[url_args_count], var_begin_ptr, arg_sz);
-                    url_args[url_args_count][arg_sz - 1] = 0;
-                    ++url_args_count;
-                }
+            if (r != 0) return MHD_CONTENT_READER_END_WITH_ERROR;
+        }
+
+        conn->out.chunk = conn->out_head;
+    }
+}
+
+static const char* segment_end(const char *segment) {
+    while (*segment != 0 && *segment != '/') ++segment;
+    return segment;
+}
+
+static route_node_t* route_child(route_node_t *node, const char *segment, size_t len) {
+    route_node_t *child;
 
+    if (len > 0 && *segment == ':') {
+        if (node->param == NULL) {
+            node->param = (route_node_t *) calloc(1, sizeof(route_node_t));
+            if (node->param == NULL) {
+                log_fatal("calloc() failed.\n");
+                return NULL;
             }
+            node->param->segment = segment;
+            node->param->len = len;
+        }
+        return node->param;
+    }
+
+    for (child = node->children; child != NULL; child = child->sibling) {
+        if (child->len == len && memcmp(child->segment, segment, len) == 0) return child;
+    }
+
+    child = (route_node_t *) calloc(1, sizeof(route_node_t));
+    if (child == NULL) {
+        log_fatal("calloc() failed.\n");
+        return NULL;
+    }
 
-            
-            if (*handler_url_ptr == *url_ptr) continue;
+    child->segment = segment;
+    child->len = len;
+    child->sibling = node->children;
+    node->children = child;
 
-            mismatch = true;
-            free_args(url_args, url_args_count);
-            url_args = NULL;
-            break;
+    return child;
+}
+
+int api_register_handler(api_method_t method, const char* url_format, api_handler_t handler) {
+    return api_register_handler_sized(method, url_format, handler, RECV_BUFFER_SZ);
+}
+
+/* the trie node of url_format, added along with its parents if missing. */
+static route_node_t* route_node(api_method_t method, const char *url_format) {
+    route_node_t *node = &routes;
+    const char *segment, *end;
+    size_t params = 0;
+
+    if (method >= API_METHOD_COUNT || url_format == NULL || *url_format != '/') {
+        log_error("bad route: %s.\n", url_format == NULL ? "(null)" : url_format);
+        return NULL;
+    }
+
+    for (segment = url_format + 1;; segment = end + 1) {
+        end = segment_end(segment);
+        if (*segment == ':' && ++params > API_MAX_ARGS) {
+            log_error("too many params in route: %s.\n", url_format);
+            return NULL;
         }
 
-        if (!mismatch && *handler_url_ptr == *url_ptr && *url_ptr == 0) {
-            int res = table_ptr->handler(conn, method, url_args_count, (const char**) url_args, body);
-            free_args(url_args, url_args_count);
-            url_args = NULL;
-            return res;
+        node = route_child(node, segment, end - segment);
+        if (node == NULL) return NULL;
+        if (*end == 0) return node;
+    }
+}
+
+int api_register_handler_sized(api_method_t method, const char* url_format, api_handler_t handler, size_t max_body) {
+    route_node_t *node = route_node(method, url_format);
+
+    if (node == NULL) return -1;
+
+    if (node->handlers[method] != NULL) {
+        log_error("%s %s registered twice.\n", method_names[method], url_format);
+        return -1;
+    }
+
+    node->handlers[method] = handler;
+    node->max_body[method] = max_body;
+    node->routed = true;
+
+    return 0;
+}
+
+int api_set_class(api_method_t method, const char *url_format, api_class_t cls) {
+    route_node_t *node = route_node(method, url_format);
+
+    if (node == NULL || cls >= API_CLASS_COUNT) return -1;
+
+    if (node->handlers[method] == NULL) {
+        log_error("%s %s isn't registered.\n", method_names[method], url_format);
+        return -1;
+    }
+
+    node->classes[method] = cls;
+    return 0;
+}
+
+int api_set_wait_arg(api_method_t method, const char *url_format, const char *arg) {
+    route_node_t *node = route_node(method, url_format);
+
+    if (node == NULL) return -1;
+
+    if (node->handlers[method] == NULL) {
+        log_error("%s %s isn't registered.\n", method_names[method], url_format);
+        return -1;
+    }
+
+    node->wait_args[method] = arg;
+    return 0;
+}
+
+void api_set_limit(api_class_t cls, const api_limit_t *limit) {
+    if (cls >= API_CLASS_COUNT) return;
+
+    pthread_mutex_lock(&admit_lock);
+    classes[cls].limit = *limit;
+    pthread_mutex_unlock(&admit_lock);
+}
+
+/* ipv4 clients are kept as v4-mapped addresses, ipv6 ones by their /64. */
+static void client_addr(struct MHD_Connection *connection, struct in6_addr *addr) {
+    const union MHD_ConnectionInfo *info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+
+    memset(addr, 0, sizeof(struct in6_addr));
+    if (info == NULL || info->client_addr == NULL) return;
+
+    if (info->client_addr->sa_family == AF_INET6) {
+        *addr = ((const struct sockaddr_in6 *) info->client_addr)->sin6_addr;
+        if (!IN6_IS_ADDR_V4MAPPED(addr)) memset(&addr->s6_addr[8], 0, 8);
+    } else if (info->client_addr->sa_family == AF_INET) {
+        addr->s6_addr[10] = addr->s6_addr[11] = 0xff;
+        memcpy(&addr->s6_addr[12], &((const struct sockaddr_in *) info->client_addr)->sin_addr, 4);
+    }
+}
+
+/* takes a token from the client's bucket for cls. 0 if there was one,
+ * otherwise the seconds until there will be. */
+static uint32_t bucket_take(struct MHD_Connection *connection, api_class_t cls) {
+    struct in6_addr addr;
+    uint64_t now, h = FNV_OFFSET;
+    uint32_t wait = 0;
+    bucket_t *b;
+
+    if (buckets == NULL || classes[cls].limit.rate <= 0) return 0;
+
+    client_addr(connection, &addr);
+    for (size_t i = 0; i < sizeof(addr); i++) {
+        h ^= addr.s6_addr[i];
+        h *= FNV_PRIME;
+    }
+    now = latency_now();
+
+    pthread_mutex_lock(&admit_lock);
+
+    b = &buckets[h & (BUCKET_SLOTS - 1)];
+    if (!b->used) {
+        b->used = true;
+        for (int i = 0; i < API_CLASS_COUNT; i++) {
+            b->tokens[i] = classes[i].limit.burst > 1 ? classes[i].limit.burst : 1;
+            b->last[i] = now;
         }
+    }
+
+    const api_limit_t *limit = &classes[cls].limit;
+    double burst = limit->burst > 1 ? limit->burst : 1;
+
+    b->tokens[cls] += (double) (now - b->last[cls]) / 1e9 * limit->rate;
+    if (b->tokens[cls] > burst) b->tokens[cls] = burst;
+    b->last[cls] = now;
 
-        table_ptr = table_ptr->next;
+    if (b->tokens[cls] >= 1) b->tokens[cls] -= 1;
+    else {
+        double seconds = (1 - b->tokens[cls]) / limit->rate;
+        wait = seconds >= RETRY_AFTER_MAX ? RETRY_AFTER_MAX : (uint32_t) seconds + 1;
+    }
+
+    pthread_mutex_unlock(&admit_lock);
+
+    return wait;
+}
+
+/* claims a slot of the request's class, or suspends the connection in the
+ * class's queue until admit_release() hands it one. */
+static admit_result_t admit(api_conn_t *conn) {
+    admit_class_t *c = &classes[conn->cls];
+    admit_result_t r = ADMIT_RUN;
+
+    pthread_mutex_lock(&admit_lock);
+
+    if (admit_closed) r = ADMIT_FULL;
+    else if (c->limit.running == 0 || c->running < c->limit.running) {
+        ++c->running;
+        conn->admitted = true;
+    } else if (c->waiting < c->limit.queued) {
+        conn->next_waiting = NULL;
+        if (c->tail == NULL) c->head = conn;
+        else c->tail->next_waiting = conn;
+        c->tail = conn;
+        ++c->waiting;
+
+        /* under the lock, so it can't be resumed before it's suspended. */
+        MHD_suspend_connection(conn->connection);
+        r = ADMIT_WAIT;
+    } else r = ADMIT_FULL;
+
+    pthread_mutex_unlock(&admit_lock);
+
+    return r;
+}
+
+static void admit_release(api_conn_t *conn) {
+    admit_class_t *c = &classes[conn->cls];
+    api_conn_t *next;
+
+    if (!conn->admitted) return;
+    conn->admitted = false;
+
+    pthread_mutex_lock(&admit_lock);
+
+    next = c->head;
+    if (next != NULL) {
+        c->head = next->next_waiting;
+        if (c->head == NULL) c->tail = NULL;
+        --c->waiting;
+        next->admitted = true;
+        MHD_resume_connection(next->connection);
+    } else --c->running;
+
+    pthread_mutex_unlock(&admit_lock);
+}
+
+/* MHD can't stop with connections suspended, so whatever still waits is
+ * resumed and turned away. */
+static void admit_close() {
+    api_conn_t *conn;
+
+    pthread_mutex_lock(&admit_lock);
+
+    admit_closed = true;
+    for (int i = 0; i < API_CLASS_COUNT; i++) {
+        while ((conn = classes[i].head) != NULL) {
+            classes[i].head = conn->next_waiting;
+            conn->retry_after = 1;
+            MHD_resume_connection(conn->connection);
+        }
+        classes[i].tail = NULL;
+        classes[i].waiting = 0;
+    }
+
+    pthread_mutex_unlock(&admit_lock);
+}
+
+static void route_free(route_node_t *node) {
+    route_node_t *child = node->children, *next;
+
+    while (child != NULL) {
+        next = child->sibling;
+        route_free(child);
+        free(child);
+        child = next;
+    }
+
+    if (node->param != NULL) {
+        route_free(node->param);
+        free(node->param);
+    }
+}
+
+void api_clear_handlers() {
+    route_free(&routes);
+    memset(&routes, 0, sizeof(routes));
+}
+
+/* walks the url one segment at a time; backtracks into a ":param" child only
+ * when the static branch dead-ends, so captured slices stay consistent. */
+static const route_node_t* route_match(const route_node_t *node, const char *segment, api_arg_t *args, size_t *argc) {
+    const char *end = segment_end(segment);
+    size_t len = end - segment;
+    const route_node_t *child, *found;
+
+    for (child = node->children; child != NULL; child = child->sibling) {
+        if (child->len != len || memcmp(child->segment, segment, len) != 0) continue;
+        if (*end == 0) {
+            if (child->routed) return child;
+            continue;
+        }
+        found = route_match(child, end + 1, args, argc);
+        if (found != NULL) return found;
+    }
+
+    if (node->param == NULL || len == 0) return NULL;
+
+    args[*argc].ptr = segment;
+    args[*argc].len = len;
+    ++*argc;
+
+    if (*end == 0) found = node->param->routed ? node->param : NULL;
+    else found = route_match(node->param, end + 1, args, argc);
+
+    if (found == NULL) --*argc;
+    return found;
+}
+
+api_handler_t api_match(api_method_t method, const char *url, api_arg_t *args, size_t *argc) {
+    const route_node_t *route;
+
+    *argc = 0;
+    if (method >= API_METHOD_COUNT || *url != '/') return NULL;
+
+    route = route_match(&routes, url + 1, args, argc);
+    return route != NULL ? route->handlers[method] : NULL;
+}
+
+static int method_parse(const char *method) {
+    for (int i = 0; i < API_METHOD_COUNT; i++) {
+        if (strcmp(method, method_names[i]) == 0) return i;
     }
 
-err_out:
     return -1;
 }
 
+int api_arg_copy(const api_arg_t *arg, char *buf, size_t buf_sz) {
+    if (arg->len >= buf_sz) return -1;
+
+    memcpy(buf, arg->ptr, arg->len);
+    buf[arg->len] = 0;
+
+    return 0;
+}
+
+static int queue_response(struct MHD_Connection *connection, uint32_t http_code, struct MHD_Response *response, const char *content_type, const char *allow) {
+    api_conn_t *conn = current_conn;
+    int r;
+
+    MHD_add_response_header(response, "Content-Type", content_type);
+    MHD_add_response_header(response, "Server", "sitd");
+    if (allow != NULL) MHD_add_response_header(response, "Allow", allow);
+    for (size_t i = 0; conn != NULL && i < conn->header_count; i++) {
+        MHD_add_response_header(response, conn->headers[i].name, conn->headers[i].value);
+    }
+
+    r = MHD_queue_response (connection, http_code, response);
+    MHD_destroy_response (response);
+
+    return r;
+}
+
+static int respond(struct MHD_Connection *connection, uint32_t http_code, const json_t *respond_body, const char *allow) {
+    api_conn_t *conn = current_conn;
+    struct MHD_Response *response;
+    char *payload = NULL;
+
+    if (respond_body == NULL) {
+        log_error("respond body null.\n");
+        return MHD_NO;
+    }
+
+    /* inside a request the body is serialized straight into the connection's
+     * chunks and read back by MHD; otherwise MHD takes the dumped string. */
+    if (conn != NULL) {
+        uint64_t start = latency_now();
+        int err = json_dump_callback(respond_body, &conn_write, conn, JSON_COMPACT);
+
+        latency_record(LATENCY_API_ENCODE, start);
+        if (err != 0) {
+            log_error("json_dump_callback() failed.\n");
+            return MHD_NO;
+        }
+        conn->out.chunk = conn->out_head;
+        conn->out.offset = 0;
+        response = MHD_create_response_from_callback(conn->out_size, RECV_CHUNK_SZ, &conn_send, conn, NULL);
+    } else {
+        payload = json_dumps(respond_body, JSON_COMPACT);
+        if (payload == NULL) {
+            log_error("json_dumps() failed.\n");
+            return MHD_NO;
+        }
+        response = MHD_create_response_from_buffer(strlen(payload), (void*) payload, MHD_RESPMEM_MUST_FREE);
+    }
+
+    if (response == NULL) {
+        log_fatal("can't create response.\n");
+        free(payload);
+        return MHD_NO;
+    }
+
+    return queue_response(connection, http_code, response, API_CONTENT_JSON, allow);
+}
+
+int api_respond(struct MHD_Connection *connection, uint32_t http_code, const json_t *respond_body) {
+    return respond(connection, http_code, respond_body, NULL);
+}
+
+int api_respond_error(struct MHD_Connection *connection, uint32_t http_code, const char *code, const char *message) {
+    json_t *body = json_pack("{s:s, s:s}", "message", message, "code", code);
+    if (body == NULL) {
+        log_fatal("json_pack() failed.\n");
+        return MHD_NO;
+    }
+
+    int r = api_respond(connection, http_code, body);
+    json_decref(body);
+
+    return r;
+}
+
+int api_respond_stream(struct MHD_Connection *connection, uint32_t http_code, api_stream_next_t next, void *data, api_stream_free_t free_data) {
+    api_conn_t *conn = current_conn;
+    struct MHD_Response *response;
+
+    if (conn == NULL) {
+        log_error("not in a request.\n");
+        if (free_data != NULL) free_data(data);
+        return MHD_NO;
+    }
+
+    /* from here on data is released with the connection. */
+    conn->stream_next = next;
+    conn->stream_free = free_data;
+    conn->stream_data = data;
+
+    conn_out_reset(conn);
+    if (conn_write("[", 1, conn) != 0) return MHD_NO;
+    conn->out.chunk = conn->out_head;
+
+    response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, RECV_CHUNK_SZ, &conn_stream, conn, NULL);
+    if (response == NULL) {
+        log_fatal("can't create response.\n");
+        return MHD_NO;
+    }
+
+    return queue_response(connection, http_code, response, API_CONTENT_JSON, NULL);
+}
+
+int api_respond_text(struct MHD_Connection *connection, uint32_t http_code, const char *content_type, const char *text, size_t len) {
+    api_conn_t *conn = current_conn;
+    struct MHD_Response *response;
+
+    if (conn != NULL) {
+        conn_out_reset(conn);
+        if (conn_write(text, len, conn) != 0) return MHD_NO;
+        conn->out.chunk = conn->out_head;
+        conn->out.offset = 0;
+        response = MHD_create_response_from_callback(conn->out_size, RECV_CHUNK_SZ, &conn_send, conn, NULL);
+    } else response = MHD_create_response_from_buffer(len, (void *) text, MHD_RESPMEM_MUST_COPY);
+
+    if (response == NULL) {
+        log_fatal("can't create response.\n");
+        return MHD_NO;
+    }
+
+    return queue_response(connection, http_code, response, content_type, NULL);
+}
+
+int api_add_header(struct MHD_Connection *connection, const char *name, const char *value) {
+    api_conn_t *conn = current_conn;
+
+    (void) connection;
+
+    if (conn == NULL || conn->header_count == MAX_HEADERS) {
+        log_error("can't add header %s.\n", name);
+        return -1;
+    }
+
+    if (strlen(name) >= HEADER_NAME_SZ || strlen(value) >= HEADER_VALUE_SZ) {
+        log_error("header %s too long.\n", name);
+        return -1;
+    }
+
+    strcpy(conn->headers[conn->header_count].name, name);
+    strcpy(conn->headers[conn->header_count].value, value);
+    ++conn->header_count;
+
+    return 0;
+}
+
+static int respond_not_allowed(struct MHD_Connection *connection, const route_node_t *route) {
+    char allow[64] = { 0 };
+    json_t *body;
+    int r;
+
+    for (int i = 0; i < API_METHOD_COUNT; i++) {
+        if (route->handlers[i] == NULL) continue;
+        if (*allow != 0) strcat(allow, ", ");
+        strcat(allow, method_names[i]);
+    }
+
+    body = json_pack("{s:s, s:s}", "message", "method not supported.", "code", "ERR_UNKNOW");
+    if (body == NULL) {
+        log_fatal("json_pack() failed.\n");
+        return MHD_NO;
+    }
+
+    r = respond(connection, 405, body, allow);
+    json_decref(body);
+
+    return r;
+}
+
+static int respond_busy(struct MHD_Connection *connection, uint32_t retry_after) {
+    char value[16];
+
+    snprintf(value, sizeof(value), "%u", retry_after);
+    api_add_header(connection, "Retry-After", value);
+
+    return api_respond_error(connection, 429, "ERR_BUSY", "too many requests, retry later.");
+}
+
 static int router (
     void *cls, struct MHD_Connection *connection,
     const char *url,
@@ -154,80 +898,153 @@ static int router (
     const char *upload_data,
     size_t *upload_data_size, void **con_cls
 ) {
-    static int old_conn_marker;
-    static char buffer[RECV_BUFFER_SZ];
-    static char* buffer_ptr;
-    static size_t buffer_size;
-
-    if (*con_cls == NULL) {
-        buffer_size = 0;
-        buffer_ptr = buffer;
-        *con_cls = &old_conn_marker;
+    api_conn_t *conn = (api_conn_t *) *con_cls;
+
+    /* the route is resolved on the first call, so bodies sent to unknown
+     * urls are drained without being buffered. */
+    if (conn == NULL) {
+        int m = method_parse(method);
+
+        conn = conn_get();
+        if (conn == NULL) return MHD_NO;
+        *con_cls = conn;
+
+        conn->route = *url == '/' ? route_match(&routes, url + 1, conn->args, &conn->argc) : NULL;
+        if (conn->route != NULL && m >= 0) {
+            conn->handler = conn->route->handlers[m];
+            conn->max_body = conn->route->max_body[m];
+            conn->cls = conn->route->classes[m];
+        }
+
+        /* checked before the body arrives, so a limited client's upload is
+         * drained like an oversized one. */
+        conn->connection = connection;
+        if (conn->handler != NULL) conn->retry_after = bucket_take(connection, conn->cls);
+
+        /* a waiting request holds its thread meanwhile, so it takes a slot
+         * of its own capped class, whatever its route's. */
+        if (conn->handler != NULL && conn->route->wait_args[m] != NULL) {
+            const char *wait = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, conn->route->wait_args[m]);
+            if (wait != NULL && *wait != 0 && strcmp(wait, "0") != 0) conn->cls = API_CLASS_WAIT;
+        }
+
         return MHD_YES;
     }
 
     if (*upload_data_size != 0) {
-        if (buffer_size + *upload_data_size > RECV_BUFFER_SZ) {
-            log_error("client request body too big.\n");
-            return MHD_NO;
+        /* an oversized upload is drained and reported once it's done. */
+        if (conn->handler != NULL && !conn->too_large && conn->retry_after == 0 && conn_append(conn, upload_data, *upload_data_size) != 0) {
+            if (!conn->too_large) return MHD_NO;
         }
 
-        memcpy(buffer_ptr, upload_data, *upload_data_size);
-        buffer_ptr += *upload_data_size;
-        buffer_size += *upload_data_size;
-
         *upload_data_size = 0;
         return MHD_YES;        
     }
 
     json_error_t err;
-    json_t *body = buffer_size > 0 ? json_loadb(buffer, buffer_size, 0, &err) : NULL;
+    recv_cursor_t cursor = { conn->head, 0 };
+    json_t *body = NULL;
+    uint64_t start;
+    int res;
 
-    if (body == NULL && buffer_size > 0) {
-        log_error("json_loadb(): (%d, %d) %s\n", err.line, err.position, err.text);
-        return MHD_NO;
+    current_conn = conn;
+
+    if (conn->route == NULL) {
+        res = api_respond_error(connection, 404, "ERR_NOT_FOUND", "no such endpoint.");
+        goto end;
     }
 
-    int res = try_invole_handler(connection, method, url, body);
+    if (conn->handler == NULL) {
+        res = respond_not_allowed(connection, conn->route);
+        goto end;
+    }
 
-    json_decref(body);
-    if (res != MHD_YES) {
-        log_error("try_invole_handler(): %s %s: error finding/running handler.\n", method, url);
-        return MHD_NO;
+    if (conn->too_large) {
+        log_error("client request body too big.\n");
+        res = api_respond_error(connection, 413, "ERR_UNKNOW", "request body too big.");
+        goto end;
     }
 
-    return MHD_YES;
-}
+    /* a resumed request comes back through here already admitted. */
+    if (conn->retry_after == 0 && !conn->admitted) {
+        admit_result_t admitted = admit(conn);
 
-int api_respond(struct MHD_Connection *connection, uint32_t http_code, const json_t *respond_body) {
-    if (respond_body == NULL) {
-        log_error("respond body null.\n");
-        return MHD_NO;
+        if (admitted == ADMIT_WAIT) {
+            current_conn = NULL;
+            return MHD_YES;
+        }
+        if (admitted == ADMIT_FULL) conn->retry_after = 1;
     }
 
-    int r;
-    char *payload = json_dumps(respond_body, JSON_COMPACT);
+    if (conn->retry_after > 0) {
+        res = respond_busy(connection, conn->retry_after);
+        goto end;
+    }
 
-    struct MHD_Response *response = MHD_create_response_from_buffer (strlen (payload), (void*) payload, MHD_RESPMEM_MUST_COPY);
-    MHD_add_response_header(response, "Content-Type", "application/json");
-    MHD_add_response_header(response, "Server", "sitd");
-    r = MHD_queue_response (connection, http_code, response);
-    MHD_destroy_response (response);
-    free(payload);
+    if (conn->size > 0) {
+        start = latency_now();
+        body = json_load_callback(&conn_read, &cursor, 0, &err);
+        latency_record(LATENCY_API_DECODE, start);
+    }
 
-    return r;
+    if (body == NULL && conn->size > 0) {
+        log_error("json_load_callback(): (%d, %d) %s\n", err.line, err.position, err.text);
+        res = api_respond_error(connection, 400, "ERR_UNKNOW", "bad json in request body.");
+        goto end;
+    }
+
+    start = latency_now();
+    res = conn->handler(connection, conn->argc, conn->args, body);
+    latency_record(LATENCY_API_HANDLER, start);
+
+    json_decref(body);
+    if (res != MHD_YES) log_error("router(): %s %s: handler failed.\n", method, url);
+
+end:
+    current_conn = NULL;
+    return res == MHD_YES ? MHD_YES : MHD_NO;
+}
+
+static void request_completed(
+    void *cls, struct MHD_Connection *connection,
+    void **con_cls, enum MHD_RequestTerminationCode toe
+) {
+    (void) cls;
+    (void) connection;
+    (void) toe;
+
+    if (*con_cls != NULL) {
+        admit_release((api_conn_t *) *con_cls);
+        conn_put((api_conn_t *) *con_cls);
+    }
+    *con_cls = NULL;
 }
 
-int api_start(uint16_t port) {
+int api_start(uint16_t port, uint32_t threads) {
+    buckets = (bucket_t *) calloc(BUCKET_SLOTS, sizeof(bucket_t));
+    if (buckets == NULL) {
+        log_fatal("calloc() failed.\n");
+        return 1;
+    }
+    admit_closed = false;
+
+    /* with a single thread, requests are served by the epoll loop itself. */
     api_server = MHD_start_daemon(
-        MHD_USE_DUAL_STACK | MHD_USE_EPOLL_INTERNALLY, 
+        MHD_USE_DUAL_STACK | MHD_USE_EPOLL_INTERNALLY | MHD_USE_SUSPEND_RESUME, 
         port, NULL, NULL, &router, NULL, 
-        MHD_OPTION_CONNECTION_TIMEOUT, (uint32_t) 10, MHD_OPTION_END);
+        MHD_OPTION_CONNECTION_TIMEOUT, (uint32_t) 10,
+        MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+        MHD_OPTION_THREAD_POOL_SIZE, (uint32_t) (threads > 1 ? threads : 0),
+        MHD_OPTION_END);
     
     if (api_server == NULL) {
         log_fatal("can't start api server.\n");
+        free(buckets);
+        buckets = NULL;
         return 1;
     }
+
+    log_info("api server listening on port %u with %u thread(s).\n", port, threads > 1 ? threads : 1);
     
     return 0;
 }
@@ -238,7 +1055,13 @@ int api_stop() {
         return 1;
     }
 
+    admit_close();
     MHD_stop_daemon(api_server);
     api_server = NULL;
+    pool_clear();
+
+    free(buckets);
+    buckets = NULL;
+    for (int i = 0; i < API_CLASS_COUNT; i++) classes[i].running = 0;
     return 0;
 }
\ No newline at end of file
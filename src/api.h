@@ -4,14 +4,80 @@
 #include <jansson.h>
 #include <stdint.h>
 
-typedef int (*api_handler_t)(struct MHD_Connection *connection, const char *method, size_t arg_count, const char **url_args, const json_t *request_body);
+#define API_MAX_ARGS 8
+#define API_CONTENT_JSON "application/json"
 
-int api_start(uint16_t port);
+typedef enum api_method {
+    API_GET,
+    API_POST,
+    API_PUT,
+    API_DELETE,
+    API_PATCH,
+    API_METHOD_COUNT
+} api_method_t;
+
+/* admission classes. requests are interactive unless their route is marked
+ * bulk with api_set_class(), which listings and batch endpoints are, so a
+ * flood of them can't crowd out single-object requests. a request asking
+ * to wait, see api_set_wait_arg(), is charged to its route's class budget
+ * but takes a slot of the wait class. */
+typedef enum api_class {
+    API_CLASS_INTERACTIVE,
+    API_CLASS_BULK,
+    API_CLASS_WAIT,
+    API_CLASS_COUNT
+} api_class_t;
+
+/* limits of one class; zero turns a limit off. rate and burst size a token
+ * bucket per client address. at most running requests are served at once,
+ * up to queued more wait for a slot without holding a thread, and anything
+ * past either gets 429 with a Retry-After header. */
+typedef struct api_limit {
+    double rate;
+    double burst;
+    uint32_t running;
+    uint32_t queued;
+} api_limit_t;
+
+/* a url capture, pointing into the request url. not null-terminated. */
+typedef struct api_arg {
+    const char *ptr;
+    size_t len;
+} api_arg_t;
+
+/* yields the next element of a streamed json array: 1 with *item set, 0
+ * at the end, -1 on error. */
+typedef int (*api_stream_next_t)(void *data, json_t **item);
+typedef void (*api_stream_free_t)(void *data);
+
+typedef int (*api_handler_t)(struct MHD_Connection *connection, size_t arg_count, const api_arg_t *url_args, const json_t *request_body);
+
+int api_start(uint16_t port, uint32_t threads);
 int api_stop();
 
-int api_register_handler(const char* url_format, api_handler_t handler);
+int api_register_handler(api_method_t method, const char* url_format, api_handler_t handler);
+int api_register_handler_sized(api_method_t method, const char* url_format, api_handler_t handler, size_t max_body);
 void api_clear_handlers();
 
+/* all three are set before api_start(); route must already be registered. */
+int api_set_class(api_method_t method, const char *url_format, api_class_t cls);
+
+/* requests to the route whose arg query argument is set and not "0" hold
+ * their thread while waiting on background work, so they are admitted in
+ * API_CLASS_WAIT. arg must outlive the route. */
+int api_set_wait_arg(api_method_t method, const char *url_format, const char *arg);
+void api_set_limit(api_class_t cls, const api_limit_t *limit);
+
+/* resolves url the way requests are routed. args must hold API_MAX_ARGS;
+ * null if no handler is registered for it. */
+api_handler_t api_match(api_method_t method, const char *url, api_arg_t *args, size_t *argc);
+
+int api_arg_copy(const api_arg_t *arg, char *buf, size_t buf_sz);
+
 int api_respond(struct MHD_Connection *connection, uint32_t http_code, const json_t *respond_body);
+int api_respond_error(struct MHD_Connection *connection, uint32_t http_code, const char *code, const char *message);
+int api_respond_stream(struct MHD_Connection *connection, uint32_t http_code, api_stream_next_t next, void *data, api_stream_free_t free_data);
+int api_respond_text(struct MHD_Connection *connection, uint32_t http_code, const char *content_type, const char *text, size_t len);
+int api_add_header(struct MHD_Connection *connection, const char *name, const char *value);
 
 #endif // SITD_API_H
\ No newline at end of file
@@ -1,17 +1,34 @@
+#define _GNU_SOURCE
 #include <sqlite3.h>
+#include <arpa/inet.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "log.h"
 #include "db.h"
+#include "latency.h"
 
+#define DB_RESULT_INIT 64
+
+#define DB_SCHEMA_VERSION 1
+#define DB_SCHEMA_VERSION_STR "1"
+
+/* the handle and the prepared statements below are shared by every caller,
+ * so each public entry point holds db_lock for its whole run. sqlite's own
+ * per-connection mutex is redundant with that and is turned off. the lock is
+ * recursive so that db_begin() can keep it across the calls it groups. */
+static pthread_mutex_t db_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 static sqlite3 *db = NULL;
 
 static sqlite3_stmt *stmt_get_tunnels = NULL;
+static sqlite3_stmt *stmt_get_tunnels_page = NULL;
 static sqlite3_stmt *stmt_get_tunnel = NULL;
 static sqlite3_stmt *stmt_insert_tunnel = NULL;
 static sqlite3_stmt *stmt_update_tunnel = NULL;
 
 static sqlite3_stmt *stmt_get_routes = NULL;
+static sqlite3_stmt *stmt_get_all_routes = NULL;
+static sqlite3_stmt *stmt_get_routes_page = NULL;
 static sqlite3_stmt *stmt_get_route = NULL;
 static sqlite3_stmt *stmt_insert_route = NULL;
 static sqlite3_stmt *stmt_update_route = NULL;
@@ -20,55 +37,98 @@ static sqlite3_stmt *stmt_del_tunnel = NULL;
 static sqlite3_stmt *stmt_del_route = NULL;
 
 static sqlite3_stmt *stmt_last_id = NULL;
+static sqlite3_stmt *stmt_get_generation = NULL;
+static sqlite3_stmt *stmt_bump_generation = NULL;
 
 static int db_init();
+static int db_migrate();
+
+/* addresses are stored as raw bytes, prefixes as bytes plus a length. */
+static const char create_tables[] =
+    "PRAGMA foreign_keys=ON;"
+    "CREATE TABLE IF NOT EXISTS `tunnels` ("
+        "`id`       INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE,"
+        "`state`      INTEGER NOT NULL,"
+        "`name`     TEXT NOT NULL UNIQUE,"
+        "`local`    BLOB NOT NULL,"
+        "`remote`   BLOB NOT NULL UNIQUE,"
+        "`address`  BLOB NOT NULL,"
+        "`address_len` INTEGER NOT NULL,"
+        "`mtu`      INTEGER NOT NULL DEFAULT 0,"
+        "UNIQUE (`address`, `address_len`)"
+    ");"
+    "CREATE TABLE IF NOT EXISTS `routes` ("
+        "`id`         INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE,"
+        "`prefix`     BLOB NOT NULL,"
+        "`prefix_len` INTEGER NOT NULL,"
+        "`nexthop`    BLOB NOT NULL,"
+        "`tunnel_id`  INTEGER NOT NULL,"
+        "UNIQUE (`prefix`, `prefix_len`),"
+        "CONSTRAINT   `tunnel_id`"
+            "FOREIGN KEY(`tunnel_id`)"
+            "REFERENCES tunnels ( id )"
+            "ON DELETE CASCADE"
+    ");"
+    /* id is the rowid, which every index carries, so this also serves
+     * the id-ordered route scans and the cascade on tunnel delete. */
+    "CREATE INDEX IF NOT EXISTS `routes_tunnel_id` ON `routes` (`tunnel_id`);"
+    "CREATE TABLE IF NOT EXISTS `meta` (`generation` INTEGER NOT NULL);"
+    "INSERT INTO `meta` (`generation`) SELECT 0 WHERE NOT EXISTS (SELECT 1 FROM `meta`);"
+    "PRAGMA user_version=" DB_SCHEMA_VERSION_STR ";";
 
 int db_open(const char *file) {
+    int err;
+
+    pthread_mutex_lock(&db_lock);
+
     if (db != NULL) {
         log_fatal("database is already opened.\n");
-        return SIT_DB_FATAL;
+        err = SIT_DB_FATAL;
+        goto end;
     }
 
-    int err = sqlite3_open_v2(file, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+    err = sqlite3_open_v2(file, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL);
 
-    if (err == SQLITE_OK) return db_init();
+    if (err == SQLITE_OK) {
+        err = db_init();
+        goto end;
+    }
 
     log_fatal("sqlite3_open_v2(): %s.\n", sqlite3_errmsg(db));
-    return SIT_DB_FATAL;
+    err = SIT_DB_FATAL;
+
+end:
+    pthread_mutex_unlock(&db_lock);
+    return err;
 }
 
 static int db_init() {
     int err;
-    char *errmsg;
+    char *errmsg = NULL;
 
     if (db == NULL) {
         log_fatal("database not yet opened.\n");
         return SIT_DB_FATAL;
     }
 
-    static const char create_tables[] = 
-        "PRAGMA foreign_keys=ON;"
-        "CREATE TABLE IF NOT EXISTS `tunnels` ("
-            "`id`       INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE,"
-            "`state`      INTEGER NOT NULL,"
-            "`name`     TEXT NOT NULL UNIQUE,"
-            "`local`    TEXT NOT NULL,"
-            "`remote`   TEXT NOT NULL UNIQUE,"
-            "`address`  TEXT NOT NULL UNIQUE,"
-            "`mtu`      INTEGER NOT NULL DEFAULT 0"
-        ");"
-        "CREATE TABLE IF NOT EXISTS `routes` ("
-            "`id`         INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE,"
-            "`route`      TEXT NOT NULL UNIQUE,"
-            "`nexthop`    TEXT NOT NULL,"
-            "`tunnel_id`  INTEGER NOT NULL,"
-            "CONSTRAINT   `tunnel_id`"
-                "FOREIGN KEY(`tunnel_id`)"
-                "REFERENCES tunnels ( id )"
-                "ON DELETE CASCADE"
-        ");";
+    /* WAL with synchronous=NORMAL syncs on checkpoints instead of on every
+     * commit; a crash can lose the last commits but never corrupts the db. */
+    static const char pragmas[] =
+        "PRAGMA journal_mode=WAL;"
+        "PRAGMA synchronous=NORMAL;";
+
+    err = sqlite3_exec(db, pragmas, NULL, NULL, &errmsg);
+
+    if (err != SQLITE_OK) {
+        err = SIT_DB_FATAL;
+        log_fatal("sqlite3_exec(): %s.\n", errmsg);
+        goto end;
+    }
+
+    /* foreign keys are still off here, which the migration relies on. */
+    err = db_migrate();
+    if (err != SIT_DB_OK) goto end;
 
-    
     err = sqlite3_exec(db, create_tables, NULL, NULL, &errmsg);
 
     if (err != SQLITE_OK) {
@@ -77,20 +137,25 @@ static int db_init() {
         goto end;
     }
 
-    err = sqlite3_prepare_v2(db, "select * from tunnels", -1, &stmt_get_tunnels, NULL);
+    err = sqlite3_prepare_v2(db, "select * from tunnels order by `id`", -1, &stmt_get_tunnels, NULL);
+    err += sqlite3_prepare_v2(db, "select * from tunnels where `id` > ? order by `id` limit ?", -1, &stmt_get_tunnels_page, NULL);
     err += sqlite3_prepare_v2(db, "select * from tunnels where `name` = ?", -1, &stmt_get_tunnel, NULL);
-    err += sqlite3_prepare_v2(db, "insert into tunnels (`state`, `name`, `local`, `remote`, `address`, `mtu`) values (?, ?, ?, ?, ?, ?)", -1, &stmt_insert_tunnel, NULL);
-    err += sqlite3_prepare_v2(db, "update tunnels set (`state`, `name`, `local`, `remote`, `address`, `mtu`) = (?, ?, ?, ?, ?, ?) where `id` = ?", -1, &stmt_update_tunnel, NULL);
+    err += sqlite3_prepare_v2(db, "insert into tunnels (`state`, `name`, `local`, `remote`, `address`, `address_len`, `mtu`, `id`) values (?, ?, ?, ?, ?, ?, ?, ?)", -1, &stmt_insert_tunnel, NULL);
+    err += sqlite3_prepare_v2(db, "update tunnels set (`state`, `name`, `local`, `remote`, `address`, `address_len`, `mtu`) = (?, ?, ?, ?, ?, ?, ?) where `id` = ?", -1, &stmt_update_tunnel, NULL);
 
     err += sqlite3_prepare_v2(db, "select * from routes where `tunnel_id` = ?", -1, &stmt_get_routes, NULL);
-    err += sqlite3_prepare_v2(db, "select * from routes where `tunnel_id` = ? and `route` = ?", -1, &stmt_get_route, NULL);
-    err += sqlite3_prepare_v2(db, "insert into routes (`route`, `nexthop`, `tunnel_id`) values (?, ?, ?)", -1, &stmt_insert_route, NULL);
-    err += sqlite3_prepare_v2(db, "update routes set (`route`, `nexthop`) = (?, ?) where `tunnel_id` = ?", -1, &stmt_update_route, NULL);
+    err += sqlite3_prepare_v2(db, "select * from routes order by `tunnel_id`, `id`", -1, &stmt_get_all_routes, NULL);
+    err += sqlite3_prepare_v2(db, "select * from routes where `tunnel_id` = ? and `id` > ? order by `id` limit ?", -1, &stmt_get_routes_page, NULL);
+    err += sqlite3_prepare_v2(db, "select * from routes where `tunnel_id` = ? and `prefix` = ? and `prefix_len` = ?", -1, &stmt_get_route, NULL);
+    err += sqlite3_prepare_v2(db, "insert into routes (`prefix`, `prefix_len`, `nexthop`, `tunnel_id`, `id`) values (?, ?, ?, ?, ?)", -1, &stmt_insert_route, NULL);
+    err += sqlite3_prepare_v2(db, "update routes set (`prefix`, `prefix_len`, `nexthop`) = (?, ?, ?) where `tunnel_id` = ?", -1, &stmt_update_route, NULL);
 
     err += sqlite3_prepare_v2(db, "delete from tunnels where `id` = ?", -1, &stmt_del_tunnel, NULL);
-    err += sqlite3_prepare_v2(db, "delete from routes where `tunnel_id` = ? and `route` = ?", -1, &stmt_del_route, NULL);
+    err += sqlite3_prepare_v2(db, "delete from routes where `tunnel_id` = ? and `prefix` = ? and `prefix_len` = ?", -1, &stmt_del_route, NULL);
 
     err += sqlite3_prepare_v2(db, "select last_insert_rowid()", -1, &stmt_last_id, NULL);
+    err += sqlite3_prepare_v2(db, "select `generation` from meta", -1, &stmt_get_generation, NULL);
+    err += sqlite3_prepare_v2(db, "update meta set `generation` = `generation` + 1", -1, &stmt_bump_generation, NULL);
 
     if (err != SQLITE_OK) {
         err = SIT_DB_FATAL;
@@ -104,7 +169,10 @@ end:
 }
 
 int db_close() {
+    pthread_mutex_lock(&db_lock);
+
     if (db == NULL) {
+        pthread_mutex_unlock(&db_lock);
         log_error("database not yet opened.\n");
         return SIT_DB_ERROR;
     }
@@ -117,8 +185,11 @@ int db_close() {
     else db = NULL;
 
     err = sqlite3_finalize(stmt_get_routes);
+    err += sqlite3_finalize(stmt_get_routes_page);
+    err += sqlite3_finalize(stmt_get_all_routes);
     err += sqlite3_finalize(stmt_get_route);
     err += sqlite3_finalize(stmt_get_tunnels);
+    err += sqlite3_finalize(stmt_get_tunnels_page);
     err += sqlite3_finalize(stmt_get_tunnel);
     err += sqlite3_finalize(stmt_insert_route);
     err += sqlite3_finalize(stmt_insert_tunnel);
@@ -127,6 +198,8 @@ int db_close() {
     err += sqlite3_finalize(stmt_del_route);
     err += sqlite3_finalize(stmt_del_tunnel);
     err += sqlite3_finalize(stmt_last_id);
+    err += sqlite3_finalize(stmt_get_generation);
+    err += sqlite3_finalize(stmt_bump_generation);
 
     if (err != SQLITE_OK) {
         log_fatal("sqlite3_finalize(): %s.\n", sqlite3_errmsg(db));
@@ -136,22 +209,92 @@ int db_close() {
     stmt_get_routes = stmt_get_tunnel = stmt_insert_route = 
         stmt_insert_tunnel = stmt_update_route = stmt_update_tunnel = NULL;
 
+    pthread_mutex_unlock(&db_lock);
     return err;
 }
 
-int db_get_tunnels(sit_tunnel_t **tunnels) {
+/* copies a fixed-size address column; a blob of the wrong size leaves the
+ * field unset. */
+static bool column_addr(sqlite3_stmt *stmt, int col, void *addr, size_t size) {
+    const void *blob = sqlite3_column_blob(stmt, col);
+
+    if (blob == NULL || (size_t) sqlite3_column_bytes(stmt, col) != size) return false;
+    memcpy(addr, blob, size);
+
+    return true;
+}
+
+static void tunnel_from_row(sqlite3_stmt *stmt, sit_tunnel_t *tunnel) {
+    memset(tunnel, 0, sizeof(sit_tunnel_t));
+    set_val_numeric(tunnel->id, sqlite3_column_int(stmt, 0));
+    set_val_numeric(tunnel->state, sqlite3_column_int(stmt, 1));
+    set_val_string(tunnel->name, (char *) sqlite3_column_text(stmt, 2), IFNAMSIZ - 1);
+    tunnel->local_isset = column_addr(stmt, 3, &tunnel->local, sizeof(struct in_addr));
+    tunnel->remote_isset = column_addr(stmt, 4, &tunnel->remote, sizeof(struct in_addr));
+    tunnel->address_isset = column_addr(stmt, 5, &tunnel->address.addr, sizeof(struct in6_addr));
+    tunnel->address.len = (uint8_t) sqlite3_column_int(stmt, 6);
+    set_val_numeric(tunnel->mtu, sqlite3_column_int(stmt, 7));
+}
+
+static void route_from_row(sqlite3_stmt *stmt, sit_route_t *route) {
+    memset(route, 0, sizeof(sit_route_t));
+    set_val_numeric(route->id, sqlite3_column_int(stmt, 0));
+    route->prefix_isset = column_addr(stmt, 1, &route->prefix.addr, sizeof(struct in6_addr));
+    route->prefix.len = (uint8_t) sqlite3_column_int(stmt, 2);
+    route->nexthop_isset = column_addr(stmt, 3, &route->nexthop, sizeof(struct in6_addr));
+    set_val_numeric(route->tunnel_id, sqlite3_column_int(stmt, 4));
+}
+
+/* steps a bound statement into one contiguous array, grown by doubling;
+ * db_lock must be held. ->next links each row to the following one so the
+ * result can still be walked as a list, and one free() releases it. */
+static int collect_tunnels(sqlite3_stmt *stmt, sit_tunnel_t **tunnels, size_t *count) {
+    sit_tunnel_t *rows = NULL, *grown;
+    size_t n = 0, cap = 0;
+    uint64_t start = latency_now();
     int err;
-    size_t n = 0;
-    sit_tunnel_t *current = *tunnels, *prev = NULL;
 
-    *tunnels = (sit_tunnel_t *) malloc(sizeof(sit_tunnel_t));
-    if (*tunnels == NULL) {
-        err = SIT_DB_FATAL;
-        log_fatal("malloc() failed.\n");
-        goto end;
+    while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
+        if (err != SQLITE_ROW) {
+            log_error("sqlite3_step(): %s (%d).\n", sqlite3_errmsg(db), err);
+            free(rows);
+            return SIT_DB_ERROR;
+        }
+
+        if (n == cap) {
+            cap = cap == 0 ? DB_RESULT_INIT : cap * 2;
+            grown = (sit_tunnel_t *) realloc(rows, cap * sizeof(sit_tunnel_t));
+            if (grown == NULL) {
+                log_fatal("realloc() failed.\n");
+                free(rows);
+                return SIT_DB_FATAL;
+            }
+            rows = grown;
+        }
+
+        tunnel_from_row(stmt, &rows[n++]);
     }
 
-    memset(current, 0, sizeof(sit_tunnel_t));
+    latency_record(LATENCY_DB_READ, start);
+    if (n == 0) return SIT_DB_NOT_EXIST;
+
+    grown = (sit_tunnel_t *) realloc(rows, n * sizeof(sit_tunnel_t));
+    if (grown != NULL) rows = grown;
+
+    for (size_t i = 0; i + 1 < n; i++) rows[i].next = &rows[i + 1];
+
+    *tunnels = rows;
+    if (count != NULL) *count = n;
+
+    return SIT_DB_OK;
+}
+
+int db_get_tunnels(sit_tunnel_t **tunnels, size_t *count) {
+    int err;
+
+    *tunnels = NULL;
+
+    pthread_mutex_lock(&db_lock);
 
     err = sqlite3_reset(stmt_get_tunnels);
     if (err != SQLITE_OK) {
@@ -160,54 +303,57 @@ int db_get_tunnels(sit_tunnel_t **tunnels) {
         goto end;
     }
 
-    do {
-        err = sqlite3_step(stmt_get_tunnels);
-        if (err == SQLITE_DONE) break;
-        ++n;
+    err = collect_tunnels(stmt_get_tunnels, tunnels, count);
 
-        if (err != SQLITE_ROW) {
-            err = SIT_DB_ERROR;
-            log_error("sqlite3_step(): %s (%d).\n", sqlite3_errmsg(db), err);
-            goto end;
-        }
+end:
+    pthread_mutex_unlock(&db_lock);
+    if (err != SIT_DB_OK) {
+        db_free_result_tunnels(*tunnels);
+        *tunnels = NULL;
+    }
+    return err;
+}
 
-        set_val_numeric(current->id, sqlite3_column_int(stmt_get_tunnels, 0));
-        set_val_numeric(current->state, sqlite3_column_int(stmt_get_tunnels, 1));
-        set_val_string(current->name, (char *) sqlite3_column_text(stmt_get_tunnels, 2), IFNAMSIZ);
-        set_val_string(current->name, (char *) sqlite3_column_text(stmt_get_tunnels, 2), IFNAMSIZ);
-        set_val_string(current->local, (char *) sqlite3_column_text(stmt_get_tunnels, 3), INET_ADDRSTRLEN);
-        set_val_string(current->remote, (char *) sqlite3_column_text(stmt_get_tunnels, 4), INET_ADDRSTRLEN);
-        set_val_string(current->address, (char *) sqlite3_column_text(stmt_get_tunnels, 5), INET6_ADDRSTRLEN + 4);
-        set_val_numeric(current->mtu, sqlite3_column_int(stmt_get_tunnels, 6));
-        
-        prev = current;
-        current->next = (sit_tunnel_t *) malloc(sizeof(sit_tunnel_t));
-        if (current->next == NULL) {
-            log_fatal("malloc() failed.\n");
-            goto end;
-        }
-        current = current->next;
-        memset(current, 0, sizeof(sit_tunnel_t));
+int db_get_tunnels_page(uint32_t after, uint32_t limit, sit_tunnel_t **tunnels) {
+    int err;
+
+    *tunnels = NULL;
+
+    pthread_mutex_lock(&db_lock);
+
+    err = sqlite3_reset(stmt_get_tunnels_page);
+    if (err != SQLITE_OK) {
+        err = SIT_DB_FATAL;
+        log_error("sqlite3_reset(): %s.\n", sqlite3_errmsg(db));
+        goto end;
+    }
 
-    } while (err != SQLITE_DONE);
+    err = sqlite3_bind_int64(stmt_get_tunnels_page, 1, after);
+    err += sqlite3_bind_int64(stmt_get_tunnels_page, 2, limit);
+    if (err != SQLITE_OK) {
+        err = SIT_DB_ERROR;
+        log_error("sqlite3_bind(): %s.\n", sqlite3_errmsg(db));
+        goto end;
+    }
 
-    err = prev == NULL ? SIT_DB_NOT_EXIST : SIT_DB_OK;
+    err = collect_tunnels(stmt_get_tunnels_page, tunnels, NULL);
 
 end:
-    if (prev == NULL) {
-        if (*tunnels != NULL) free(*tunnels);
+    pthread_mutex_unlock(&db_lock);
+    if (err != SIT_DB_OK) {
+        db_free_result_tunnels(*tunnels);
         *tunnels = NULL;
-    } else {
-        if (current != NULL) free(current);
-        prev->next = NULL;
     }
     return err;
 }
 
 int db_get_tunnel(const char* name, sit_tunnel_t **tunnel) {
     *tunnel = NULL;
+    uint64_t start;
     int err;
 
+    pthread_mutex_lock(&db_lock);
+
     err = sqlite3_reset(stmt_get_tunnel);
     if (err != SQLITE_OK) {
         err = SIT_DB_FATAL;
@@ -229,7 +375,9 @@ int db_get_tunnel(const char* name, sit_tunnel_t **tunnel) {
         goto end;
     }
 
+    start = latency_now();
     err = sqlite3_step(stmt_get_tunnel);
+    latency_record(LATENCY_DB_READ, start);
 
     if (err == SQLITE_DONE) {
         err = SIT_DB_NOT_EXIST;
@@ -238,19 +386,16 @@ int db_get_tunnel(const char* name, sit_tunnel_t **tunnel) {
 
     if (err == SQLITE_ROW) {
         *tunnel = (sit_tunnel_t *) malloc(sizeof(sit_tunnel_t));
-        sit_tunnel_t *current = *tunnel;
-        set_val_numeric(current->id, sqlite3_column_int(stmt_get_tunnel, 0));
-        set_val_numeric(current->state, sqlite3_column_int(stmt_get_tunnel, 1));
-        set_val_string(current->name, (char *) sqlite3_column_text(stmt_get_tunnel, 2), IFNAMSIZ);
-        set_val_string(current->name, (char *) sqlite3_column_text(stmt_get_tunnel, 2), IFNAMSIZ);
-        set_val_string(current->local, (char *) sqlite3_column_text(stmt_get_tunnel, 3), INET_ADDRSTRLEN);
-        set_val_string(current->remote, (char *) sqlite3_column_text(stmt_get_tunnel, 4), INET_ADDRSTRLEN);
-        set_val_string(current->address, (char *) sqlite3_column_text(stmt_get_tunnel, 5), INET6_ADDRSTRLEN + 4);
-        set_val_numeric(current->mtu, sqlite3_column_int(stmt_get_tunnel, 6));
-        current->next = NULL;
+        if (*tunnel == NULL) {
+            err = SIT_DB_FATAL;
+            log_fatal("malloc() failed.\n");
+            goto end;
+        }
+        tunnel_from_row(stmt_get_tunnel, *tunnel);
     } else {
         log_error("sqlite3_step(): %s\n", sqlite3_errmsg(db));
-        db = SIT_DB_ERROR;
+        err = SIT_DB_ERROR;
+        goto end;
     }
 
     err = sqlite3_step(stmt_get_tunnel);
@@ -263,6 +408,7 @@ int db_get_tunnel(const char* name, sit_tunnel_t **tunnel) {
     err = SIT_DB_OK;
 
 end:
+    pthread_mutex_unlock(&db_lock);
     if (err != SIT_DB_OK && *tunnel != NULL) {
         free(*tunnel);
         *tunnel = NULL;
@@ -271,11 +417,617 @@ end:
     return err;
 }
 
+/* steps a write statement and resets it right away, so a failed step doesn't
+ * surface again from the next sqlite3_reset(). */
+static int step_write(sqlite3_stmt *stmt) {
+    uint64_t start = latency_now();
+    int err = sqlite3_step(stmt);
+
+    latency_record(LATENCY_DB_WRITE, start);
+
+    if (err == SQLITE_CONSTRAINT) {
+        err = sqlite3_extended_errcode(db) == SQLITE_CONSTRAINT_FOREIGNKEY ? SIT_DB_NOT_EXIST : SIT_DB_ALREADY_EXIST;
+    } else if (err != SQLITE_DONE) {
+        log_error("sqlite3_step(): %s\n", sqlite3_errmsg(db));
+        switch (err & 0xff) {
+            case SQLITE_BUSY:
+            case SQLITE_LOCKED:
+            case SQLITE_IOERR:
+            case SQLITE_FULL:
+            case SQLITE_NOMEM:
+                err = SIT_DB_BUSY;
+                break;
+            default:
+                err = SIT_DB_ERROR;
+        }
+    } else err = SIT_DB_OK;
+
+    sqlite3_reset(stmt);
+    return err;
+}
+
+int db_update_tunnel(const sit_tunnel_t *tunnel) {
+    int err;
+
+    pthread_mutex_lock(&db_lock);
+
+    err = sqlite3_reset(stmt_update_tunnel);
+    if (err != SQLITE_OK) {
+        err = SIT_DB_FATAL;
+        log_error("sqlite3_reset(): %s.\n", sqlite3_errmsg(db));
+        goto end;
+    }
+
+    err = sqlite3_bind_int(stmt_update_tunnel, 1, tunnel->state);
+    err += sqlite3_bind_text(stmt_update_tunnel, 2, tunnel->name, -1, NULL);
+    err += sqlite3_bind_blob(stmt_update_tunnel, 3, &tunnel->local, sizeof(struct in_addr), SQLITE_STATIC);
+    err += sqlite3_bind_blob(stmt_update_tunnel, 4, &tunnel->remote, sizeof(struct in_addr), SQLITE_STATIC);
+    err += sqlite3_bind_blob(stmt_update_tunnel, 5, &tunnel->address.addr, sizeof(struct in6_addr), SQLITE_STATIC);
+    err += sqlite3_bind_int(stmt_update_tunnel, 6, tunnel->address.len);
+    err += sqlite3_bind_int(stmt_update_tunnel, 7, tunnel->mtu);
+    err += sqlite3_bind_int(stmt_update_tunnel, 8, tunnel->id);
+    if (err != SQLITE_OK) {
+        err = SIT_DB_ERROR;
+        log_error("sqlite3_bind(): %s.\n", sqlite3_errmsg(db));
+        goto end;
+    }
+
+    err = step_write(stmt_update_tunnel);
+    if (err != SIT_DB_OK) goto end;
+
+    err = sqlite3_changes(db) == 0 ? SIT_DB_NOT_EXIST : SIT_DB_OK;
+
+end:
+    pthread_mutex_unlock(&db_lock);
+    return err;
+}
+
+/* db_lock must be held by the callers of the helpers below. a row with its
+ * id set keeps it; otherwise sqlite picks one. */
+static int insert_tunnel(const sit_tunnel_t *tunnel) {
+    int err;
+
+    err = sqlite3_reset(stmt_insert_tunnel);
+    if (err != SQLITE_OK) {
+        log_error("sqlite3_reset(): %s.\n", sqlite3_errmsg(db));
+        return SIT_DB_FATAL;
+    }
+
+    err = sqlite3_bind_int(stmt_insert_tunnel, 1, tunnel->state);
+    err += sqlite3_bind_text(stmt_insert_tunnel, 2, tunnel->name, -1, NULL);
+    err += sqlite3_bind_blob(stmt_insert_tunnel, 3, &tunnel->local, sizeof(struct in_addr), SQLITE_STATIC);
+    err += sqlite3_bind_blob(stmt_insert_tunnel, 4, &tunnel->remote, sizeof(struct in_addr), SQLITE_STATIC);
+    err += sqlite3_bind_blob(stmt_insert_tunnel, 5, &tunnel->address.addr, sizeof(struct in6_addr), SQLITE_STATIC);
+    err += sqlite3_bind_int(stmt_insert_tunnel, 6, tunnel->address.len);
+    err += sqlite3_bind_int(stmt_insert_tunnel, 7, tunnel->mtu);
+    err += isset(tunnel->id) ? sqlite3_bind_int64(stmt_insert_tunnel, 8, tunnel->id) : sqlite3_bind_null(stmt_insert_tunnel, 8);
+    if (err != SQLITE_OK) {
+        log_error("sqlite3_bind(): %s.\n", sqlite3_errmsg(db));
+        return SIT_DB_ERROR;
+    }
+
+    return step_write(stmt_insert_tunnel);
+}
+
+static int insert_route(const sit_route_t *route) {
+    int err;
+
+    err = sqlite3_reset(stmt_insert_route);
+    if (err != SQLITE_OK) {
+        log_error("sqlite3_reset(): %s.\n", sqlite3_errmsg(db));
+        return SIT_DB_FATAL;
+    }
+
+    err = sqlite3_bind_blob(stmt_insert_route, 1, &route->prefix.addr, sizeof(struct in6_addr), SQLITE_STATIC);
+    err += sqlite3_bind_int(stmt_insert_route, 2, route->prefix.len);
+    err += sqlite3_bind_blob(stmt_insert_route, 3, &route->nexthop, sizeof(struct in6_addr), SQLITE_STATIC);
+    err += sqlite3_bind_int(stmt_insert_route, 4, route->tunnel_id);
+    err += isset(route->id) ? sqlite3_bind_int64(stmt_insert_route, 5, route->id) : sqlite3_bind_null(stmt_insert_route, 5);
+    if (err != SQLITE_OK) {
+        log_error("sqlite3_bind(): %s.\n", sqlite3_errmsg(db));
+        return SIT_DB_ERROR;
+    }
+
+    return step_write(stmt_insert_route);
+}
+
+static int exec_simple(const char *sql) {
+    char *errmsg = NULL;
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+        log_error("sqlite3_exec(): %s: %s.\n", sql, errmsg);
+        sqlite3_free(errmsg);
+        return SIT_DB_ERROR;
+    }
+
+    return SIT_DB_OK;
+}
+
+int db_create_tunnel(const sit_tunnel_t *tunnel) {
+    int err;
+
+    pthread_mutex_lock(&db_lock);
+    err = insert_tunnel(tunnel);
+    pthread_mutex_unlock(&db_lock);
+
+    return err;
+}
+
+int db_create_route(const sit_route_t *route) {
+    int err;
+
+    pthread_mutex_lock(&db_lock);
+    err = insert_route(route);
+    pthread_mutex_unlock(&db_lock);
+
+    return err;
+}
+
+/* transactions are savepoints, so they nest: a bulk call made between
+ * db_begin() and db_commit() becomes part of the outer transaction. db_lock
+ * stays held from db_begin() until the matching commit or rollback. */
+int db_begin() {
+    int err;
+
+    pthread_mutex_lock(&db_lock);
+
+    err = exec_simple("SAVEPOINT bulk");
+    if (err != SIT_DB_OK) pthread_mutex_unlock(&db_lock);
+
+    return err;
+}
+
+/* only the outermost release syncs, so nested commits show up as the fast
+ * end of the histogram. */
+int db_commit() {
+    uint64_t start = latency_now();
+    int err = exec_simple("RELEASE bulk");
+
+    latency_record(LATENCY_DB_COMMIT, start);
+
+    if (err != SIT_DB_OK) {
+        exec_simple("ROLLBACK TO bulk");
+        exec_simple("RELEASE bulk");
+    }
+
+    pthread_mutex_unlock(&db_lock);
+    return err;
+}
+
+int db_rollback() {
+    int err = exec_simple("ROLLBACK TO bulk");
+
+    if (err == SIT_DB_OK) err = exec_simple("RELEASE bulk");
+
+    pthread_mutex_unlock(&db_lock);
+    return err;
+}
+
+/* all-or-nothing: the rows go in under one transaction, so one sync covers
+ * the whole batch. on failure nothing is written and *failed, if given, is
+ * the index of the offending row. the new ids are written back. */
+int db_create_tunnels(sit_tunnel_t *tunnels, size_t count, size_t *failed) {
+    size_t i = 0;
+    int err;
+
+    err = db_begin();
+    if (err != SIT_DB_OK) return err;
+
+    for (; i < count; i++) {
+        err = insert_tunnel(&tunnels[i]);
+        if (err != SIT_DB_OK) break;
+        set_val_numeric(tunnels[i].id, (uint32_t) sqlite3_last_insert_rowid(db));
+    }
+
+    if (err != SIT_DB_OK) {
+        db_rollback();
+        if (failed != NULL) *failed = i;
+        return err;
+    }
+
+    return db_commit();
+}
+
+int db_create_routes(sit_route_t *routes, size_t count, size_t *failed) {
+    size_t i = 0;
+    int err;
+
+    err = db_begin();
+    if (err != SIT_DB_OK) return err;
+
+    for (; i < count; i++) {
+        err = insert_route(&routes[i]);
+        if (err != SIT_DB_OK) break;
+        set_val_numeric(routes[i].id, (uint32_t) sqlite3_last_insert_rowid(db));
+    }
+
+    if (err != SIT_DB_OK) {
+        db_rollback();
+        if (failed != NULL) *failed = i;
+        return err;
+    }
+
+    return db_commit();
+}
+
+int db_get_generation(uint64_t *generation) {
+    int err;
+
+    pthread_mutex_lock(&db_lock);
+
+    err = sqlite3_step(stmt_get_generation);
+    if (err == SQLITE_ROW) {
+        *generation = (uint64_t) sqlite3_column_int64(stmt_get_generation, 0);
+        err = SIT_DB_OK;
+    } else {
+        log_error("sqlite3_step(): %s.\n", sqlite3_errmsg(db));
+        err = SIT_DB_ERROR;
+    }
+
+    sqlite3_reset(stmt_get_generation);
+    pthread_mutex_unlock(&db_lock);
+    return err;
+}
+
+int db_bump_generation() {
+    int err;
+
+    pthread_mutex_lock(&db_lock);
+    err = step_write(stmt_bump_generation);
+    pthread_mutex_unlock(&db_lock);
+
+    return err;
+}
+
 void db_free_result_tunnels(sit_tunnel_t *tunnels) {
-    sit_tunnel_t *tunnel = tunnels, *next;
-    while (tunnel != NULL) {
-        next = tunnel->next;
-        free(tunnel);
-        tunnel = next;
+    free(tunnels);
+}
+
+static int collect_routes(sqlite3_stmt *stmt, sit_route_t **routes, size_t *count) {
+    sit_route_t *rows = NULL, *grown;
+    size_t n = 0, cap = 0;
+    uint64_t start = latency_now();
+    int err;
+
+    while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
+        if (err != SQLITE_ROW) {
+            log_error("sqlite3_step(): %s (%d).\n", sqlite3_errmsg(db), err);
+            free(rows);
+            return SIT_DB_ERROR;
+        }
+
+        if (n == cap) {
+            cap = cap == 0 ? DB_RESULT_INIT : cap * 2;
+            grown = (sit_route_t *) realloc(rows, cap * sizeof(sit_route_t));
+            if (grown == NULL) {
+                log_fatal("realloc() failed.\n");
+                free(rows);
+                return SIT_DB_FATAL;
+            }
+            rows = grown;
+        }
+
+        route_from_row(stmt, &rows[n++]);
+    }
+
+    latency_record(LATENCY_DB_READ, start);
+    if (n == 0) return SIT_DB_NOT_EXIST;
+
+    grown = (sit_route_t *) realloc(rows, n * sizeof(sit_route_t));
+    if (grown != NULL) rows = grown;
+
+    for (size_t i = 0; i + 1 < n; i++) rows[i].next = &rows[i + 1];
+
+    *routes = rows;
+    if (count != NULL) *count = n;
+
+    return SIT_DB_OK;
+}
+
+int db_get_routes(uint32_t tunnel_id, sit_route_t **routes, size_t *count) {
+    int err;
+
+    *routes = NULL;
+
+    pthread_mutex_lock(&db_lock);
+
+    err = sqlite3_reset(stmt_get_routes);
+    if (err != SQLITE_OK) {
+        err = SIT_DB_FATAL;
+        log_error("sqlite3_reset(): %s.\n", sqlite3_errmsg(db));
+        goto end;
+    }
+
+    err = sqlite3_bind_int(stmt_get_routes, 1, tunnel_id);
+    if (err != SQLITE_OK) {
+        err = SIT_DB_ERROR;
+        log_error("sqlite3_bind_int(): %s.\n", sqlite3_errmsg(db));
+        goto end;
     }
-}
\ No newline at end of file
+
+    err = collect_routes(stmt_get_routes, routes, count);
+
+end:
+    pthread_mutex_unlock(&db_lock);
+    if (err != SIT_DB_OK) {
+        db_free_result_routes(*routes);
+        *routes = NULL;
+    }
+    return err;
+}
+
+int db_get_all_routes(sit_route_t **routes, size_t *count) {
+    int err;
+
+    *routes = NULL;
+
+    pthread_mutex_lock(&db_lock);
+
+    err = sqlite3_reset(stmt_get_all_routes);
+    if (err != SQLITE_OK) {
+        err = SIT_DB_FATAL;
+        log_error("sqlite3_reset(): %s.\n", sqlite3_errmsg(db));
+        goto end;
+    }
+
+    err = collect_routes(stmt_get_all_routes, routes, count);
+
+end:
+    pthread_mutex_unlock(&db_lock);
+    return err;
+}
+
+int db_get_routes_page(uint32_t tunnel_id, uint32_t after, uint32_t limit, sit_route_t **routes) {
+    int err;
+
+    *routes = NULL;
+
+    pthread_mutex_lock(&db_lock);
+
+    err = sqlite3_reset(stmt_get_routes_page);
+    if (err != SQLITE_OK) {
+        err = SIT_DB_FATAL;
+        log_error("sqlite3_reset(): %s.\n", sqlite3_errmsg(db));
+        goto end;
+    }
+
+    err = sqlite3_bind_int64(stmt_get_routes_page, 1, tunnel_id);
+    err += sqlite3_bind_int64(stmt_get_routes_page, 2, after);
+    err += sqlite3_bind_int64(stmt_get_routes_page, 3, limit);
+    if (err != SQLITE_OK) {
+        err = SIT_DB_ERROR;
+        log_error("sqlite3_bind(): %s.\n", sqlite3_errmsg(db));
+        goto end;
+    }
+
+    err = collect_routes(stmt_get_routes_page, routes, NULL);
+
+end:
+    pthread_mutex_unlock(&db_lock);
+    if (err != SIT_DB_OK) {
+        db_free_result_routes(*routes);
+        *routes = NULL;
+    }
+    return err;
+}
+
+int db_get_route(const sit_prefix6_t *prefix, uint32_t tunnel_id, sit_route_t **route) {
+    uint64_t start;
+    int err;
+
+    *route = NULL;
+
+    pthread_mutex_lock(&db_lock);
+
+    err = sqlite3_reset(stmt_get_route);
+    if (err != SQLITE_OK) {
+        err = SIT_DB_FATAL;
+        log_error("sqlite3_reset(): %s.\n", sqlite3_errmsg(db));
+        goto end;
+    }
+
+    err = sqlite3_bind_int(stmt_get_route, 1, tunnel_id);
+    err += sqlite3_bind_blob(stmt_get_route, 2, &prefix->addr, sizeof(struct in6_addr), SQLITE_STATIC);
+    err += sqlite3_bind_int(stmt_get_route, 3, prefix->len);
+    if (err != SQLITE_OK) {
+        err = SIT_DB_ERROR;
+        log_error("sqlite3_bind(): %s.\n", sqlite3_errmsg(db));
+        goto end;
+    }
+
+    start = latency_now();
+    err = sqlite3_step(stmt_get_route);
+    latency_record(LATENCY_DB_READ, start);
+
+    if (err == SQLITE_DONE) {
+        err = SIT_DB_NOT_EXIST;
+        goto end;
+    }
+
+    if (err != SQLITE_ROW) {
+        log_error("sqlite3_step(): %s\n", sqlite3_errmsg(db));
+        err = SIT_DB_ERROR;
+        goto end;
+    }
+
+    *route = (sit_route_t *) malloc(sizeof(sit_route_t));
+    if (*route == NULL) {
+        err = SIT_DB_FATAL;
+        log_fatal("malloc() failed.\n");
+        goto end;
+    }
+
+    route_from_row(stmt_get_route, *route);
+    err = SIT_DB_OK;
+
+end:
+    pthread_mutex_unlock(&db_lock);
+    return err;
+}
+
+void db_free_result_routes(sit_route_t *routes) {
+    free(routes);
+}
+
+/* schema 0 kept addresses as text. the old tables are renamed away, their
+ * rows converted into the current ones under the same ids, and dropped, all
+ * in one transaction. rows that don't parse or collide once converted are
+ * logged and left out. */
+static int migrate_v0() {
+    sqlite3_stmt *old_tunnels = NULL, *old_routes = NULL, *ins_tunnel = NULL, *ins_route = NULL;
+    sit_tunnel_t t;
+    sit_route_t r;
+    size_t tunnels = 0, routes = 0;
+    int err;
+
+    err = exec_simple(
+        "BEGIN;"
+        "ALTER TABLE `tunnels` RENAME TO `tunnels_v0`;"
+        "ALTER TABLE `routes` RENAME TO `routes_v0`;"
+        "DROP INDEX IF EXISTS `routes_tunnel_id`;");
+    if (err != SIT_DB_OK) goto end;
+
+    err = exec_simple(create_tables);
+    if (err != SIT_DB_OK) goto end;
+
+    err = sqlite3_prepare_v2(db, "select `id`, `state`, `name`, `local`, `remote`, `address`, `mtu` from tunnels_v0", -1, &old_tunnels, NULL);
+    err += sqlite3_prepare_v2(db, "select `id`, `route`, `nexthop`, `tunnel_id` from routes_v0", -1, &old_routes, NULL);
+    err += sqlite3_prepare_v2(db, "insert into tunnels (`id`, `state`, `name`, `local`, `remote`, `address`, `address_len`, `mtu`) values (?, ?, ?, ?, ?, ?, ?, ?)", -1, &ins_tunnel, NULL);
+    err += sqlite3_prepare_v2(db, "insert into routes (`id`, `prefix`, `prefix_len`, `nexthop`, `tunnel_id`) select ?, ?, ?, ?, `id` from tunnels where `id` = ?", -1, &ins_route, NULL);
+    if (err != SQLITE_OK) {
+        log_fatal("sqlite3_prepare_v2(): %s.\n", sqlite3_errmsg(db));
+        err = SIT_DB_FATAL;
+        goto end;
+    }
+
+    while ((err = sqlite3_step(old_tunnels)) == SQLITE_ROW) {
+        const char *name = (const char *) sqlite3_column_text(old_tunnels, 2);
+        const char *local = (const char *) sqlite3_column_text(old_tunnels, 3);
+        const char *remote = (const char *) sqlite3_column_text(old_tunnels, 4);
+        const char *address = (const char *) sqlite3_column_text(old_tunnels, 5);
+
+        if (name == NULL || local == NULL || remote == NULL || address == NULL ||
+            inet_pton(AF_INET, local, &t.local) != 1 ||
+            inet_pton(AF_INET, remote, &t.remote) != 1 ||
+            sit_prefix6_parse(address, &t.address) != 0) {
+            log_warn("migration: dropping tunnel %d, bad address.\n", sqlite3_column_int(old_tunnels, 0));
+            continue;
+        }
+
+        err = sqlite3_bind_int(ins_tunnel, 1, sqlite3_column_int(old_tunnels, 0));
+        err += sqlite3_bind_int(ins_tunnel, 2, sqlite3_column_int(old_tunnels, 1));
+        err += sqlite3_bind_text(ins_tunnel, 3, name, -1, NULL);
+        err += sqlite3_bind_blob(ins_tunnel, 4, &t.local, sizeof(struct in_addr), SQLITE_STATIC);
+        err += sqlite3_bind_blob(ins_tunnel, 5, &t.remote, sizeof(struct in_addr), SQLITE_STATIC);
+        err += sqlite3_bind_blob(ins_tunnel, 6, &t.address.addr, sizeof(struct in6_addr), SQLITE_STATIC);
+        err += sqlite3_bind_int(ins_tunnel, 7, t.address.len);
+        err += sqlite3_bind_int(ins_tunnel, 8, sqlite3_column_int(old_tunnels, 6));
+        if (err != SQLITE_OK) {
+            log_error("sqlite3_bind(): %s.\n", sqlite3_errmsg(db));
+            err = SIT_DB_ERROR;
+            goto end;
+        }
+
+        err = step_write(ins_tunnel);
+        if (err == SIT_DB_ALREADY_EXIST) {
+            log_warn("migration: dropping tunnel %d, duplicate address.\n", sqlite3_column_int(old_tunnels, 0));
+            continue;
+        }
+        if (err != SIT_DB_OK) goto end;
+        tunnels++;
+    }
+
+    if (err != SQLITE_DONE) {
+        log_error("sqlite3_step(): %s.\n", sqlite3_errmsg(db));
+        err = SIT_DB_ERROR;
+        goto end;
+    }
+
+    /* routes of a tunnel that was left out go with it. */
+    while ((err = sqlite3_step(old_routes)) == SQLITE_ROW) {
+        const char *prefix = (const char *) sqlite3_column_text(old_routes, 1);
+        const char *nexthop = (const char *) sqlite3_column_text(old_routes, 2);
+
+        if (prefix == NULL || nexthop == NULL ||
+            sit_prefix6_parse(prefix, &r.prefix) != 0 ||
+            inet_pton(AF_INET6, nexthop, &r.nexthop) != 1) {
+            log_warn("migration: dropping route %d, bad address.\n", sqlite3_column_int(old_routes, 0));
+            continue;
+        }
+        sit_prefix6_mask(&r.prefix);
+
+        err = sqlite3_bind_int(ins_route, 1, sqlite3_column_int(old_routes, 0));
+        err += sqlite3_bind_blob(ins_route, 2, &r.prefix.addr, sizeof(struct in6_addr), SQLITE_STATIC);
+        err += sqlite3_bind_int(ins_route, 3, r.prefix.len);
+        err += sqlite3_bind_blob(ins_route, 4, &r.nexthop, sizeof(struct in6_addr), SQLITE_STATIC);
+        err += sqlite3_bind_int(ins_route, 5, sqlite3_column_int(old_routes, 3));
+        if (err != SQLITE_OK) {
+            log_error("sqlite3_bind(): %s.\n", sqlite3_errmsg(db));
+            err = SIT_DB_ERROR;
+            goto end;
+        }
+
+        err = step_write(ins_route);
+        if (err == SIT_DB_ALREADY_EXIST) {
+            log_warn("migration: dropping route %d, duplicate prefix.\n", sqlite3_column_int(old_routes, 0));
+            continue;
+        }
+        if (err != SIT_DB_OK) goto end;
+        routes += sqlite3_changes(db);
+    }
+
+    if (err != SQLITE_DONE) {
+        log_error("sqlite3_step(): %s.\n", sqlite3_errmsg(db));
+        err = SIT_DB_ERROR;
+        goto end;
+    }
+
+    sqlite3_finalize(old_tunnels);
+    sqlite3_finalize(old_routes);
+    old_tunnels = old_routes = NULL;
+
+    err = exec_simple(
+        "DROP TABLE `routes_v0`;"
+        "DROP TABLE `tunnels_v0`;"
+        "COMMIT;");
+    if (err == SIT_DB_OK) log_info("migrated %zu tunnels and %zu routes to schema v%d.\n", tunnels, routes, DB_SCHEMA_VERSION);
+
+end:
+    sqlite3_finalize(old_tunnels);
+    sqlite3_finalize(old_routes);
+    sqlite3_finalize(ins_tunnel);
+    sqlite3_finalize(ins_route);
+    if (err != SIT_DB_OK) {
+        exec_simple("ROLLBACK");
+        err = SIT_DB_FATAL;
+    }
+    return err;
+}
+
+static int db_migrate() {
+    sqlite3_stmt *stmt = NULL;
+    int version = 0, tables = 0, err;
+
+    err = sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, NULL);
+    if (err == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    err += sqlite3_prepare_v2(db, "select count(*) from sqlite_master where `type` = 'table' and `name` = 'tunnels'", -1, &stmt, NULL);
+    if (err == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) tables = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    if (err != SQLITE_OK) {
+        log_fatal("sqlite3_prepare_v2(): %s.\n", sqlite3_errmsg(db));
+        return SIT_DB_FATAL;
+    }
+
+    if (version > DB_SCHEMA_VERSION) {
+        log_fatal("database schema v%d is newer than this build (v%d).\n", version, DB_SCHEMA_VERSION);
+        return SIT_DB_FATAL;
+    }
+
+    /* a fresh file has no tables yet and gets the current schema directly. */
+    if (version == 0 && tables > 0) return migrate_v0();
+
+    return SIT_DB_OK;
+}
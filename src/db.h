@@ -7,22 +7,42 @@
 #define SIT_DB_ALREADY_EXIST 2
 #define SIT_DB_ERROR 3
 #define SIT_DB_FATAL 4
+/* the database was locked or couldn't be written; the same write may
+ * succeed later. */
+#define SIT_DB_BUSY 5
 
 int db_open(const char *file);
 int db_close();
 
-int db_get_tunnels(sit_tunnel_t **tunnels);
+/* list results are contiguous arrays whose ->next links each element to the
+ * following one. count may be null. release them with db_free_result_*(). */
+int db_get_tunnels(sit_tunnel_t **tunnels, size_t *count);
+int db_get_tunnels_page(uint32_t after, uint32_t limit, sit_tunnel_t **tunnels);
 int db_get_tunnel(const char* name, sit_tunnel_t **tunnel);
 
-int db_get_routes(uint32_t tunnel_id, sit_route_t **routes);
-int db_get_route(const char* prefix, uint32_t tunnel_id, sit_route_t **route);
+int db_get_routes(uint32_t tunnel_id, sit_route_t **routes, size_t *count);
+int db_get_all_routes(sit_route_t **routes, size_t *count);
+int db_get_routes_page(uint32_t tunnel_id, uint32_t after, uint32_t limit, sit_route_t **routes);
+int db_get_route(const sit_prefix6_t *prefix, uint32_t tunnel_id, sit_route_t **route);
 
 int db_create_tunnel(const sit_tunnel_t *tunnel);
 int db_create_route(const sit_route_t *route);
+int db_begin();
+int db_commit();
+int db_rollback();
+
+int db_create_tunnels(sit_tunnel_t *tunnels, size_t count, size_t *failed);
+int db_create_routes(sit_route_t *routes, size_t count, size_t *failed);
 
 int db_update_tunnel(const sit_tunnel_t *tunnel);
 int db_update_route(const sit_route_t *route);
 
+/* a counter kept next to the tables for copies of them to check against.
+ * writers bump it in the transaction that changes the rows; edits made to
+ * the file by hand don't. */
+int db_get_generation(uint64_t *generation);
+int db_bump_generation();
+
 void db_free_result_tunnels(sit_tunnel_t *tunnels);
 void db_free_result_routes(sit_route_t *routes);
 
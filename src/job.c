@@ -0,0 +1,400 @@
+#include <netlink/netlink.h>
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "job.h"
+#include "sit.h"
+#include "store.h"
+#include "log.h"
+
+/* must stay above BULK_MAX_TUNNELS, so one bulk request always fits. */
+#define JOB_SLOTS 16384
+#define JOB_BUCKETS 4096
+#define JOB_MAX_WORKERS 64
+
+/* jobs live in a ring indexed by id; a slot is reused once its job is
+ * finished. links are slot numbers plus one, so zero ends a list. */
+typedef struct job {
+    uint64_t id;
+    uint32_t tunnel_id;
+    char name[IFNAMSIZ];
+    char destroy[IFNAMSIZ];
+    sit_prefix6_t replaced;
+    bool replace;
+    job_state_t state;
+    uint32_t requests;
+    int err;
+    bool changed;
+    uint32_t next;
+    uint32_t chain;
+    uint32_t successor;
+} job_t;
+
+static job_t jobs[JOB_SLOTS];
+
+/* the latest unfinished job of each tunnel, chained by tunnel id. a tunnel
+ * has at most one running job and one queued behind it, held as the running
+ * one's successor until it's done. */
+static uint32_t buckets[JOB_BUCKETS];
+static uint32_t ready_head = 0, ready_tail = 0;
+static uint64_t next_id = 1;
+
+/* slots taken by unfinished jobs, and slots held by job_reserve(). */
+static size_t n_unfinished = 0, n_reserved = 0;
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static bool running = false;
+static pthread_t workers[JOB_MAX_WORKERS];
+static struct nl_sock *socks[JOB_MAX_WORKERS];
+static size_t n_workers = 0;
+
+static uint32_t* bucket_of(uint32_t tunnel_id) {
+    return &buckets[tunnel_id % JOB_BUCKETS];
+}
+
+static uint32_t latest(uint32_t tunnel_id) {
+    uint32_t link = *bucket_of(tunnel_id);
+
+    while (link != 0 && jobs[link - 1].tunnel_id != tunnel_id) link = jobs[link - 1].chain;
+    return link;
+}
+
+static void latest_set(uint32_t slot) {
+    uint32_t *head = bucket_of(jobs[slot].tunnel_id);
+
+    jobs[slot].chain = *head;
+    *head = slot + 1;
+}
+
+static void latest_del(uint32_t slot) {
+    uint32_t *link = bucket_of(jobs[slot].tunnel_id);
+
+    while (*link != 0 && *link != slot + 1) link = &jobs[*link - 1].chain;
+    if (*link != 0) *link = jobs[slot].chain;
+    jobs[slot].chain = 0;
+}
+
+static void ready_push(uint32_t slot) {
+    jobs[slot].next = 0;
+    if (ready_tail != 0) jobs[ready_tail - 1].next = slot + 1;
+    else ready_head = slot + 1;
+    ready_tail = slot + 1;
+
+    pthread_cond_signal(&work_cond);
+}
+
+static uint32_t ready_pop() {
+    uint32_t slot = ready_head - 1;
+
+    ready_head = jobs[slot].next;
+    if (ready_head == 0) ready_tail = 0;
+    return slot;
+}
+
+/* the tunnel is read when the job starts, so it applies whatever the store
+ * holds by then. */
+static int job_apply(struct nl_sock *sk, uint32_t tunnel_id, const char *destroy, const sit_prefix6_t *replaced, bool *changed) {
+    sit_tunnel_t *tunnel = NULL;
+    sit_route_t *routes = NULL;
+    bool destroyed = false;
+    int err;
+
+    err = store_get_tunnel_by_id(tunnel_id, &tunnel);
+    if (err != SIT_DB_OK) {
+        log_error("job: tunnel %u is gone.\n", tunnel_id);
+        return err == SIT_DB_NOT_EXIST ? SIT_NOT_EXIST : SIT_ERROR;
+    }
+
+    err = store_get_routes(tunnel_id, &routes, NULL);
+    if (err != SIT_DB_OK && err != SIT_DB_NOT_EXIST) {
+        log_error("%s: can't read routes.\n", tunnel->name);
+        err = SIT_ERROR;
+        goto end;
+    }
+
+    if (destroy[0] != 0) {
+        err = sit_destroy(sk, destroy);
+        if (err != SIT_OK && err != SIT_NOT_EXIST) goto end;
+        destroyed = err == SIT_OK;
+    }
+
+    err = sit_apply(sk, tunnel, replaced, routes, changed);
+    if (destroyed) *changed = true;
+
+end:
+    if (err != SIT_OK) log_error("%s: can't apply.\n", tunnel->name);
+    store_free_result_tunnels(tunnel);
+    store_free_result_routes(routes);
+    return err;
+}
+
+static void* job_worker(void *arg) {
+    struct nl_sock *sk = (struct nl_sock *) arg;
+    char destroy[IFNAMSIZ];
+    sit_prefix6_t replaced;
+    uint32_t slot, tunnel_id;
+    bool changed, replace;
+    int err;
+
+    pthread_mutex_lock(&job_lock);
+
+    for (;;) {
+        while (ready_head == 0 && running) pthread_cond_wait(&work_cond, &job_lock);
+        if (!running) break;
+
+        slot = ready_pop();
+        jobs[slot].state = JOB_RUNNING;
+        tunnel_id = jobs[slot].tunnel_id;
+        strcpy(destroy, jobs[slot].destroy);
+        replaced = jobs[slot].replaced;
+        replace = jobs[slot].replace;
+        pthread_mutex_unlock(&job_lock);
+
+        changed = false;
+        err = job_apply(sk, tunnel_id, destroy, replace ? &replaced : NULL, &changed);
+
+        pthread_mutex_lock(&job_lock);
+        jobs[slot].err = err;
+        jobs[slot].changed = changed;
+        jobs[slot].state = err == SIT_OK ? JOB_DONE : JOB_FAILED;
+        --n_unfinished;
+
+        /* whatever queued up meanwhile can run now. */
+        if (jobs[slot].successor != 0) ready_push(jobs[slot].successor - 1);
+        else latest_del(slot);
+        jobs[slot].successor = 0;
+
+        pthread_cond_broadcast(&done_cond);
+    }
+
+    pthread_mutex_unlock(&job_lock);
+    return NULL;
+}
+
+int job_start(size_t workers_count) {
+    int err;
+
+    if (workers_count == 0) workers_count = 1;
+    if (workers_count > JOB_MAX_WORKERS) workers_count = JOB_MAX_WORKERS;
+
+    pthread_mutex_lock(&job_lock);
+
+    if (running) {
+        pthread_mutex_unlock(&job_lock);
+        return SIT_ERROR;
+    }
+
+    running = true;
+
+    for (; n_workers < workers_count; n_workers++) {
+        struct nl_sock *sk = nl_socket_alloc();
+
+        if (sk == NULL) {
+            log_fatal("nl_socket_alloc() returned null.\n");
+            break;
+        }
+
+        err = nl_connect(sk, NETLINK_ROUTE);
+        if (err < 0) {
+            log_fatal("nl_connect(): %s.\n", nl_geterror(err));
+            nl_socket_free(sk);
+            break;
+        }
+
+        if (pthread_create(&workers[n_workers], NULL, &job_worker, sk) != 0) {
+            log_fatal("pthread_create(): can't start job worker %zu.\n", n_workers);
+            nl_close(sk);
+            nl_socket_free(sk);
+            break;
+        }
+
+        socks[n_workers] = sk;
+    }
+
+    if (n_workers == 0) running = false;
+    pthread_mutex_unlock(&job_lock);
+
+    if (n_workers == 0) return SIT_FATAL;
+
+    log_info("job workers started: %zu.\n", n_workers);
+    return SIT_OK;
+}
+
+/* jobs still queued are dropped; the next startup reconciles every tunnel
+ * anyway. */
+int job_stop() {
+    size_t n;
+
+    pthread_mutex_lock(&job_lock);
+
+    if (!running) {
+        pthread_mutex_unlock(&job_lock);
+        return SIT_ERROR;
+    }
+
+    running = false;
+    n = n_workers;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&job_lock);
+
+    for (size_t i = 0; i < n; i++) {
+        pthread_join(workers[i], NULL);
+        nl_close(socks[i]);
+        nl_socket_free(socks[i]);
+    }
+
+    pthread_mutex_lock(&job_lock);
+    n_workers = 0;
+    n_unfinished = 0;
+    ready_head = ready_tail = 0;
+    memset(buckets, 0, sizeof(buckets));
+    for (size_t i = 0; i < JOB_SLOTS; i++) {
+        if (jobs[i].id == 0 || jobs[i].state >= JOB_DONE) continue;
+        jobs[i].state = JOB_FAILED;
+        jobs[i].err = SIT_ERROR;
+        jobs[i].chain = jobs[i].successor = 0;
+    }
+    pthread_cond_broadcast(&done_cond);
+    pthread_mutex_unlock(&job_lock);
+
+    return SIT_OK;
+}
+
+int job_reserve(size_t n) {
+    int err = SIT_OK;
+
+    pthread_mutex_lock(&job_lock);
+
+    if (!running || n_unfinished + n_reserved + n > JOB_SLOTS) err = SIT_ERROR;
+    else n_reserved += n;
+
+    pthread_mutex_unlock(&job_lock);
+    return err;
+}
+
+void job_release(size_t n) {
+    pthread_mutex_lock(&job_lock);
+    n_reserved -= n;
+    pthread_mutex_unlock(&job_lock);
+}
+
+int job_submit(uint32_t tunnel_id, const char *name, const char *destroy, const sit_prefix6_t *replaced, bool reserved, uint64_t *id) {
+    uint32_t link, slot;
+    job_t *job;
+
+    pthread_mutex_lock(&job_lock);
+
+    if (reserved) --n_reserved;
+
+    if (!running) {
+        pthread_mutex_unlock(&job_lock);
+        return SIT_ERROR;
+    }
+
+    link = latest(tunnel_id);
+
+    /* not started yet, so it will see this change too. a link to destroy
+     * or an address to remove is only taken if there isn't one already:
+     * the first old one is what the kernel has. */
+    if (link != 0 && jobs[link - 1].state == JOB_QUEUED) {
+        job = &jobs[link - 1];
+        ++job->requests;
+        strcpy(job->name, name);
+        if (destroy != NULL && job->destroy[0] == 0) strcpy(job->destroy, destroy);
+        if (replaced != NULL && !job->replace) {
+            job->replaced = *replaced;
+            job->replace = true;
+        }
+
+        *id = job->id;
+        pthread_mutex_unlock(&job_lock);
+        return SIT_OK;
+    }
+
+    /* held slots are kept free for their owners. */
+    if (n_unfinished + n_reserved >= JOB_SLOTS) {
+        pthread_mutex_unlock(&job_lock);
+        log_error("too many unfinished jobs.\n");
+        return SIT_ERROR;
+    }
+
+    /* a slot is free somewhere, so this ends; ids whose slot is still
+     * taken are skipped. */
+    while (jobs[next_id % JOB_SLOTS].id != 0 && jobs[next_id % JOB_SLOTS].state < JOB_DONE) ++next_id;
+    slot = (uint32_t) (next_id % JOB_SLOTS);
+    job = &jobs[slot];
+
+    memset(job, 0, sizeof(job_t));
+    job->id = next_id++;
+    job->tunnel_id = tunnel_id;
+    job->state = JOB_QUEUED;
+    job->requests = 1;
+    ++n_unfinished;
+    strcpy(job->name, name);
+    if (destroy != NULL) strcpy(job->destroy, destroy);
+    if (replaced != NULL) {
+        job->replaced = *replaced;
+        job->replace = true;
+    }
+
+    /* behind a running job of the same tunnel, it waits its turn. */
+    if (link != 0) {
+        latest_del(link - 1);
+        jobs[link - 1].successor = slot + 1;
+    } else ready_push(slot);
+    latest_set(slot);
+
+    *id = job->id;
+    pthread_mutex_unlock(&job_lock);
+
+    return SIT_OK;
+}
+
+int job_wait(uint64_t id, uint32_t timeout_ms, job_info_t *info) {
+    job_t *job = &jobs[id % JOB_SLOTS];
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&job_lock);
+
+    while (timeout_ms > 0 && job->id == id && job->state < JOB_DONE && running) {
+        if (pthread_cond_timedwait(&done_cond, &job_lock, &deadline) == ETIMEDOUT) break;
+    }
+
+    if (id == 0 || job->id != id) {
+        pthread_mutex_unlock(&job_lock);
+        return SIT_NOT_EXIST;
+    }
+
+    info->id = job->id;
+    info->tunnel_id = job->tunnel_id;
+    strcpy(info->name, job->name);
+    info->state = job->state;
+    info->requests = job->requests;
+    info->err = job->err;
+    info->changed = job->changed;
+
+    pthread_mutex_unlock(&job_lock);
+    return SIT_OK;
+}
+
+const char* job_state_name(job_state_t state) {
+    switch (state) {
+        case JOB_QUEUED: return "queued";
+        case JOB_RUNNING: return "running";
+        case JOB_DONE: return "done";
+        case JOB_FAILED: return "failed";
+    }
+
+    return "unknown";
+}
@@ -0,0 +1,54 @@
+#ifndef SITD_JOB_H
+#define SITD_JOB_H
+#include <stddef.h>
+#include "types.h"
+
+/* kernel applies requested through the api. a job brings one tunnel's link,
+ * address and routes in line with the store, reading them when it starts, so
+ * every change queued for a tunnel before then collapses into that one job.
+ * jobs of different tunnels run in parallel on the workers; jobs of the same
+ * tunnel run one at a time. return codes are the SIT_* ones. */
+typedef enum job_state {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+} job_state_t;
+
+typedef struct job_info {
+    uint64_t id;
+    uint32_t tunnel_id;
+    char name[IFNAMSIZ];
+    job_state_t state;
+    uint32_t requests;
+    int err;
+    bool changed;
+} job_info_t;
+
+int job_start(size_t workers);
+int job_stop();
+
+/* holds n job slots for later job_submit() calls, so a change can be turned
+ * away before it is saved instead of being saved and never applied.
+ * SIT_ERROR if that many aren't free. slots not submitted into go back
+ * with job_release(). */
+int job_reserve(size_t n);
+void job_release(size_t n);
+
+/* queues an apply of the tunnel, or joins the one still queued for it.
+ * destroy, if not null, is a link to delete first: the old name on a rename
+ * or restart. replaced, if not null, is the address the tunnel had before,
+ * to be removed from the link. reserved uses up one slot held by
+ * job_reserve(), whatever the outcome. SIT_ERROR if too many jobs are
+ * unfinished. */
+int job_submit(uint32_t tunnel_id, const char *name, const char *destroy, const sit_prefix6_t *replaced, bool reserved, uint64_t *id);
+
+/* info->changed tells whether a finished job had to change the kernel. */
+
+/* waits until the job is finished or timeout_ms went by, then fills *info.
+ * SIT_NOT_EXIST if the id is unknown or was recycled. */
+int job_wait(uint64_t id, uint32_t timeout_ms, job_info_t *info);
+
+const char* job_state_name(job_state_t state);
+
+#endif // SITD_JOB_H
@@ -0,0 +1,276 @@
+#include <pthread.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "latency.h"
+#include "sit.h"
+#include "log.h"
+
+/* values below 2^(SUB_BITS+1) ns get a bucket each; above that every power
+ * of two is split into 2^SUB_BITS buckets. anything past 2^(MAX_MSB+1) ns
+ * (~73 minutes) lands in the last one. */
+#define SUB_BITS 3
+#define SUB (1 << SUB_BITS)
+#define MAX_MSB 41
+#define BUCKETS ((MAX_MSB - SUB_BITS + 2) * SUB)
+#define CACHE_LINE 64
+
+typedef struct hist {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[BUCKETS];
+} hist_t;
+
+/* a thread's histograms. the slot outlives the thread and is handed to the
+ * next thread that starts recording, so short-lived workers don't make the
+ * list grow. */
+typedef struct latency_thread {
+    hist_t hists[LATENCY_OP_COUNT];
+    struct latency_thread *next;
+    int in_use;
+} latency_thread_t;
+
+static const char *op_names[LATENCY_OP_COUNT] = {
+    "nl_link_add", "nl_link_change", "nl_link_del", "nl_addr_add", "nl_addr_del",
+    "nl_route_add", "nl_route_del", "nl_dump",
+    "db_read", "db_write", "db_commit",
+    "api_decode", "api_handler", "api_encode",
+};
+
+static latency_thread_t *threads = NULL;
+static __thread latency_thread_t *self = NULL;
+static pthread_key_t self_key;
+static pthread_once_t self_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_cond = PTHREAD_COND_INITIALIZER;
+static bool running = false;
+static uint32_t interval_s = 0;
+static pthread_t dumper;
+
+static void self_release(void *data) {
+    __atomic_store_n(&((latency_thread_t *) data)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void self_key_create() {
+    if (pthread_key_create(&self_key, &self_release) != 0) log_fatal("pthread_key_create() failed.\n");
+}
+
+static latency_thread_t* self_claim() {
+    latency_thread_t *t;
+    int free_slot = 0;
+
+    pthread_once(&self_once, &self_key_create);
+
+    for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        free_slot = 0;
+        if (__atomic_compare_exchange_n(&t->in_use, &free_slot, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+
+    if (t == NULL) {
+        if (posix_memalign((void **) &t, CACHE_LINE, sizeof(latency_thread_t)) != 0) return NULL;
+        memset(t, 0, sizeof(latency_thread_t));
+        t->in_use = 1;
+        t->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&threads, &t->next, t, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    pthread_setspecific(self_key, t);
+    return t;
+}
+
+static unsigned bucket_of(uint64_t v) {
+    unsigned msb, e;
+
+    if (v < 2 * SUB) return (unsigned) v;
+
+    msb = 63 - (unsigned) __builtin_clzll(v);
+    if (msb > MAX_MSB) return BUCKETS - 1;
+
+    e = msb - SUB_BITS;
+    return (e + 1) * SUB + (unsigned) ((v >> e) & (SUB - 1));
+}
+
+/* highest value that maps to bucket b. */
+static uint64_t bucket_top(unsigned b) {
+    unsigned e;
+
+    if (b < 2 * SUB) return b;
+
+    e = b / SUB - 1;
+    return (((uint64_t) SUB + b % SUB) << e) + ((uint64_t) 1 << e) - 1;
+}
+
+/* only the owning thread writes its counters. */
+static inline void bump(uint64_t *v, uint64_t by) {
+    __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + by, __ATOMIC_RELAXED);
+}
+
+uint64_t latency_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+void latency_record(latency_op_t op, uint64_t start) {
+    uint64_t ns = latency_now() - start;
+    hist_t *h;
+
+    if (self == NULL && (self = self_claim()) == NULL) return;
+
+    h = &self->hists[op];
+    bump(&h->count, 1);
+    bump(&h->sum_ns, ns);
+    bump(&h->buckets[bucket_of(ns)], 1);
+    if (ns > __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED)) __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+const char* latency_op_name(latency_op_t op) {
+    return op < LATENCY_OP_COUNT ? op_names[op] : "unknown";
+}
+
+static void merge(latency_op_t op, hist_t *out) {
+    memset(out, 0, sizeof(hist_t));
+
+    for (latency_thread_t *t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        const hist_t *h = &t->hists[op];
+        uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+
+        out->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        out->sum_ns += __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+        if (max > out->max_ns) out->max_ns = max;
+        for (unsigned b = 0; b < BUCKETS; b++) out->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    }
+}
+
+/* counters are read one by one while threads keep recording, so count is
+ * taken from the buckets to keep the percentiles consistent. without a max
+ * (an interval delta) the top non-empty bucket stands in for it. */
+static void summarize(const hist_t *h, latency_summary_t *s) {
+    static const double q[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t *p[] = { &s->p50_ns, &s->p90_ns, &s->p99_ns, &s->p999_ns };
+    uint64_t seen = 0, count = 0, top = 0;
+    size_t k = 0;
+
+    memset(s, 0, sizeof(latency_summary_t));
+    for (unsigned b = 0; b < BUCKETS; b++) {
+        count += h->buckets[b];
+        if (h->buckets[b] != 0) top = bucket_top(b);
+    }
+    if (count == 0) return;
+
+    s->count = count;
+    s->sum_ns = h->sum_ns;
+    s->max_ns = h->max_ns != 0 && h->max_ns < top ? h->max_ns : top;
+
+    for (unsigned b = 0; b < BUCKETS && k < 4; b++) {
+        seen += h->buckets[b];
+        while (k < 4 && seen >= (uint64_t) (q[k] * count + 0.5) && seen > 0) {
+            *p[k++] = bucket_top(b) < s->max_ns ? bucket_top(b) : s->max_ns;
+        }
+    }
+}
+
+void latency_get(latency_op_t op, latency_summary_t *summary) {
+    hist_t h;
+
+    merge(op, &h);
+    summarize(&h, summary);
+}
+
+static void dump(hist_t *last) {
+    latency_summary_t s;
+    hist_t cur, delta;
+
+    for (int op = 0; op < LATENCY_OP_COUNT; op++) {
+        merge((latency_op_t) op, &cur);
+
+        delta.sum_ns = cur.sum_ns - last[op].sum_ns;
+        delta.max_ns = 0;
+        for (unsigned b = 0; b < BUCKETS; b++) delta.buckets[b] = cur.buckets[b] - last[op].buckets[b];
+        last[op] = cur;
+
+        summarize(&delta, &s);
+        if (s.count == 0) continue;
+
+        log_info("%s: %llu ops, mean %.1fus, p50 %.1fus, p99 %.1fus, max %.1fus.\n", op_names[op], (unsigned long long) s.count,
+            s.sum_ns / 1e3 / s.count, s.p50_ns / 1e3, s.p99_ns / 1e3, s.max_ns / 1e3);
+    }
+}
+
+static void* dump_loop(void *data) {
+    hist_t *last = (hist_t *) data;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&run_lock);
+
+    while (running) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval_s;
+        while (running && pthread_cond_timedwait(&run_cond, &run_lock, &deadline) != ETIMEDOUT);
+        if (!running) break;
+
+        pthread_mutex_unlock(&run_lock);
+        dump(last);
+        pthread_mutex_lock(&run_lock);
+    }
+
+    pthread_mutex_unlock(&run_lock);
+    free(last);
+    return NULL;
+}
+
+int latency_start(uint32_t interval) {
+    hist_t *last;
+    int err = SIT_OK;
+
+    pthread_mutex_lock(&run_lock);
+
+    if (running) {
+        log_fatal("latency dump is already running.\n");
+        err = SIT_FATAL;
+        goto end;
+    }
+
+    last = (hist_t *) calloc(LATENCY_OP_COUNT, sizeof(hist_t));
+    if (last == NULL) {
+        log_fatal("calloc() failed.\n");
+        err = SIT_FATAL;
+        goto end;
+    }
+
+    interval_s = interval;
+    running = true;
+
+    if (pthread_create(&dumper, NULL, &dump_loop, last) != 0) {
+        log_fatal("pthread_create() failed.\n");
+        running = false;
+        free(last);
+        err = SIT_FATAL;
+        goto end;
+    }
+
+    log_info("logging latencies every %us.\n", interval);
+
+end:
+    pthread_mutex_unlock(&run_lock);
+    return err;
+}
+
+int latency_stop() {
+    pthread_mutex_lock(&run_lock);
+    if (!running) {
+        pthread_mutex_unlock(&run_lock);
+        return SIT_OK;
+    }
+    running = false;
+    pthread_cond_signal(&run_cond);
+    pthread_mutex_unlock(&run_lock);
+
+    pthread_join(dumper, NULL);
+    return SIT_OK;
+}
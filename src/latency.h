@@ -0,0 +1,51 @@
+#ifndef SITD_LATENCY_H
+#define SITD_LATENCY_H
+#include <stdint.h>
+
+/* per-thread log-linear latency histograms, one per operation. each thread
+ * records into its own copy with plain relaxed stores, so recording takes no
+ * lock and no atomic read-modify-write; readers merge every thread's copy.
+ * buckets keep 3 significant bits, so reported values are within 12.5%. */
+typedef enum latency_op {
+    LATENCY_NL_LINK_ADD,
+    LATENCY_NL_LINK_CHANGE,
+    LATENCY_NL_LINK_DEL,
+    LATENCY_NL_ADDR_ADD,
+    LATENCY_NL_ADDR_DEL,
+    LATENCY_NL_ROUTE_ADD,
+    LATENCY_NL_ROUTE_DEL,
+    LATENCY_NL_DUMP,
+    LATENCY_DB_READ,
+    LATENCY_DB_WRITE,
+    LATENCY_DB_COMMIT,
+    LATENCY_API_DECODE,
+    LATENCY_API_HANDLER,
+    LATENCY_API_ENCODE,
+    LATENCY_OP_COUNT
+} latency_op_t;
+
+typedef struct latency_summary {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+} latency_summary_t;
+
+/* monotonic ns; pass the value taken before an operation to
+ * latency_record() once it's done. */
+uint64_t latency_now();
+void latency_record(latency_op_t op, uint64_t start);
+
+const char* latency_op_name(latency_op_t op);
+
+/* totals since startup, across all threads. */
+void latency_get(latency_op_t op, latency_summary_t *summary);
+
+/* logs what was recorded in each interval. */
+int latency_start(uint32_t interval);
+int latency_stop();
+
+#endif // SITD_LATENCY_H
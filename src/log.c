@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+#define LOG_RING_SLOTS 4096
+#define LOG_TEXT_SZ 464
+#define LOG_LINE_SZ (LOG_TEXT_SZ + 128)
+#define LOG_OUT_SZ 0x10000
+#define LOG_IDLE_MIN_US 1000
+#define LOG_IDLE_MAX_US 50000
+#define LOG_WAKE_EVERY (LOG_RING_SLOTS / 4)
+#define CACHE_LINE 64
+
+/* set in ring_tail by log_stop(). no slot can be claimed once it is, so
+ * every message in the ring was claimed before the stop. */
+#define LOG_CLOSED (1ull << 63)
+
+/* a bounded mpsc ring. each slot's seq says whose turn it is: a producer may
+ * fill slot i when seq == i, the writer may read it when seq == i + 1, and
+ * hands it back for the next lap by setting seq to i + LOG_RING_SLOTS. */
+typedef struct log_slot {
+    uint64_t seq;
+    int64_t ts;
+    const char *func;
+    int level;
+    uint32_t len;
+    char text[LOG_TEXT_SZ];
+} __attribute__((aligned(CACHE_LINE))) log_slot_t;
+
+static const char *level_names[] = { "DEBUG", "INFO ", "WARN ", "ERROR", "FATAL" };
+static const char *level_keys[] = { "debug", "info", "warn", "error", "fatal" };
+
+int log_level = LOG_INFO;
+
+static log_slot_t ring[LOG_RING_SLOTS];
+static uint64_t ring_tail __attribute__((aligned(CACHE_LINE))) = 0;
+static uint64_t dropped __attribute__((aligned(CACHE_LINE))) = 0;
+static uint64_t ring_head = 0;
+
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int writer_idle = 0;
+static bool running = false;
+static bool ring_ready = false;
+static bool exit_hooked = false;
+static pthread_t writer;
+static char out[LOG_OUT_SZ];
+static size_t out_len = 0;
+
+static int64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        buf += n;
+        len -= (size_t) n;
+    }
+}
+
+/* "2026-01-02T03:04:05.678901Z [INFO ] func: text". */
+static size_t format_line(char *line, int64_t ts, int level, const char *func, const char *text, size_t len) {
+    time_t sec = (time_t) (ts / 1000000000);
+    struct tm tm;
+    size_t n;
+
+    gmtime_r(&sec, &tm);
+    n = strftime(line, LOG_LINE_SZ, "%Y-%m-%dT%H:%M:%S", &tm);
+    n += (size_t) snprintf(line + n, LOG_LINE_SZ - n, ".%06ldZ [%s] %s: ", (long) (ts % 1000000000 / 1000), level_names[level], func);
+    if (n >= LOG_LINE_SZ) n = LOG_LINE_SZ - 1;
+
+    if (len > LOG_LINE_SZ - 1 - n) len = LOG_LINE_SZ - 1 - n;
+    memcpy(line + n, text, len);
+    n += len;
+    if (n == 0 || line[n - 1] != '\n') line[n++] = '\n';
+
+    return n;
+}
+
+static void out_flush() {
+    write_all(STDERR_FILENO, out, out_len);
+    out_len = 0;
+}
+
+static void out_line(int64_t ts, int level, const char *func, const char *text, size_t len) {
+    if (out_len + LOG_LINE_SZ > LOG_OUT_SZ) out_flush();
+    out_len += format_line(out + out_len, ts, level, func, text, len);
+}
+
+/* null with *pos set to LOG_CLOSED if the ring is closed, else null when
+ * it's full. */
+static log_slot_t* slot_claim(uint64_t *pos) {
+    uint64_t p = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        if (p & LOG_CLOSED) {
+            *pos = LOG_CLOSED;
+            return NULL;
+        }
+
+        log_slot_t *slot = &ring[p & (LOG_RING_SLOTS - 1)];
+        int64_t diff = (int64_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - p);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring_tail, &p, p + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos = p;
+                return slot;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else p = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    }
+}
+
+/* a burst shouldn't have to wait out the writer's idle sleep, so every
+ * LOG_WAKE_EVERY-th message wakes it. the signal never blocks; a missed one
+ * only costs the rest of the sleep. */
+static void slot_publish(log_slot_t *slot, uint64_t pos) {
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    if ((pos & (LOG_WAKE_EVERY - 1)) == 0 && __atomic_load_n(&writer_idle, __ATOMIC_RELAXED)) pthread_cond_signal(&idle_cond);
+}
+
+static void writer_sleep(useconds_t us) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long) us * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    pthread_mutex_lock(&idle_lock);
+    __atomic_store_n(&writer_idle, 1, __ATOMIC_RELAXED);
+    pthread_cond_timedwait(&idle_cond, &idle_lock, &deadline);
+    __atomic_store_n(&writer_idle, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+/* returns how many lines were written. */
+static size_t drain() {
+    uint64_t lost;
+    size_t n = 0;
+
+    for (;; n++) {
+        log_slot_t *slot = &ring[ring_head & (LOG_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring_head + 1) break;
+
+        out_line(slot->ts, slot->level, slot->func, slot->text, slot->len);
+        __atomic_store_n(&slot->seq, ring_head + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+        ++ring_head;
+    }
+
+    lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (lost != 0) {
+        char text[64];
+        int len = snprintf(text, sizeof(text), "ring full, dropped %llu message(s).\n", (unsigned long long) lost);
+        out_line(now_ns(), LOG_WARN, "log", text, (size_t) len);
+    }
+
+    if (out_len > 0) out_flush();
+    return n;
+}
+
+static void* writer_loop(void *data) {
+    useconds_t idle = LOG_IDLE_MIN_US;
+    bool stop;
+
+    (void) data;
+
+    /* the ring is checked once more after a stop is seen, so every message
+     * published before log_stop() is written. */
+    do {
+        stop = !__atomic_load_n(&running, __ATOMIC_ACQUIRE);
+        if (drain() > 0) {
+            idle = LOG_IDLE_MIN_US;
+            continue;
+        }
+        if (!stop) {
+            writer_sleep(idle);
+            if (idle < LOG_IDLE_MAX_US) idle *= 2;
+        }
+    } while (!stop);
+
+    return NULL;
+}
+
+static void log_stop_at_exit() {
+    log_stop();
+}
+
+int log_start() {
+    int err = 0;
+
+    pthread_mutex_lock(&run_lock);
+    if (running) goto end;
+
+    /* producers only touch the ring while running, so it's set up once
+     * here and carries on across restarts. */
+    if (!ring_ready) {
+        for (uint64_t i = 0; i < LOG_RING_SLOTS; i++) ring[i].seq = i;
+        ring_ready = true;
+    }
+
+    __atomic_fetch_and(&ring_tail, ~LOG_CLOSED, __ATOMIC_RELAXED);
+    __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+    if (pthread_create(&writer, NULL, &writer_loop, NULL) != 0) {
+        __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&run_lock);
+        log_fatal("pthread_create() failed.\n");
+        return 1;
+    }
+
+    /* early returns from main() still get their last lines out. */
+    if (!exit_hooked) exit_hooked = atexit(&log_stop_at_exit) == 0;
+
+end:
+    pthread_mutex_unlock(&run_lock);
+    return err;
+}
+
+int log_stop() {
+    uint64_t tail;
+
+    pthread_mutex_lock(&run_lock);
+    if (running) {
+        __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+        pthread_join(writer, NULL);
+
+        /* a producer that saw running just before it was cleared may
+         * still publish after the writer's last drain. closing the tail
+         * bounds what it can claim, and those slots are waited for. */
+        tail = __atomic_fetch_or(&ring_tail, LOG_CLOSED, __ATOMIC_ACQ_REL);
+        while (ring_head != tail) {
+            if (drain() == 0) sched_yield();
+        }
+    }
+    pthread_mutex_unlock(&run_lock);
+
+    return 0;
+}
+
+void log_set_level(int level) {
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int log_level_parse(const char *name) {
+    for (int i = LOG_DEBUG; i <= LOG_FATAL; i++) {
+        if (strcasecmp(name, level_keys[i]) == 0) return i;
+    }
+
+    return -1;
+}
+
+/* without the writer thread, or once log_stop() closed the ring, the line
+ * goes straight to stderr. */
+static void emit(int level, const char *func, const char *text, size_t len) {
+    char line[LOG_LINE_SZ];
+    log_slot_t *slot;
+    uint64_t pos = 0;
+
+    if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        slot = slot_claim(&pos);
+        if (slot != NULL) {
+            slot->ts = now_ns();
+            slot->func = func;
+            slot->level = level;
+            slot->len = (uint32_t) len;
+            memcpy(slot->text, text, len);
+            slot_publish(slot, pos);
+            return;
+        }
+        if (pos != LOG_CLOSED) return;
+    }
+
+    fwrite(line, 1, format_line(line, now_ns(), level, func, text, len), stderr);
+}
+
+/* text longer than a slot is cut, keeping the newline. */
+static size_t clamp_text(char *text, int n) {
+    if (n < 0) return 0;
+    if ((size_t) n < LOG_TEXT_SZ) return (size_t) n;
+
+    text[LOG_TEXT_SZ - 2] = '\n';
+    return LOG_TEXT_SZ - 1;
+}
+
+void log_write(int level, const char *func, const char *fmt, ...) {
+    char text[LOG_TEXT_SZ];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+
+    emit(level, func, text, clamp_text(text, n));
+}
+
+/* strings with spaces, quotes or '=' are quoted so the pairs stay
+ * splittable. */
+static int field_str(char *buf, size_t cap, const char *str) {
+    size_t n = 0;
+
+    if (str == NULL) str = "(null)";
+    if (*str != 0 && strpbrk(str, " \t\"=\\") == NULL) return snprintf(buf, cap, "%s", str);
+
+    if (n < cap) buf[n] = '"';
+    ++n;
+    for (; *str != 0; str++) {
+        if (*str == '"' || *str == '\\') {
+            if (n < cap) buf[n] = '\\';
+            ++n;
+        }
+        if (n < cap) buf[n] = *str;
+        ++n;
+    }
+    if (n < cap) buf[n] = '"';
+    ++n;
+    if (cap > 0) buf[n < cap ? n : cap - 1] = 0;
+
+    return (int) n;
+}
+
+void log_write_fields(int level, const char *func, const char *msg, const log_field_t *fields, size_t count) {
+    char text[LOG_TEXT_SZ];
+    size_t n;
+    int r;
+
+    r = snprintf(text, sizeof(text), "%s", msg);
+    n = r < 0 ? 0 : (size_t) r;
+
+    for (size_t i = 0; i < count && n < sizeof(text); i++) {
+        r = snprintf(text + n, sizeof(text) - n, " %s=", fields[i].key);
+        if (r < 0) break;
+        n += (size_t) r;
+        if (n >= sizeof(text)) break;
+
+        if (fields[i].type == LOG_FIELD_STR) r = field_str(text + n, sizeof(text) - n, fields[i].str);
+        else if (fields[i].type == LOG_FIELD_INT) r = snprintf(text + n, sizeof(text) - n, "%lld", (long long) fields[i].i);
+        else r = snprintf(text + n, sizeof(text) - n, "%llu", (unsigned long long) fields[i].u);
+        if (r < 0) break;
+        n += (size_t) r;
+    }
+
+    if (n + 1 < sizeof(text)) {
+        text[n++] = '\n';
+        text[n] = 0;
+    }
+
+    emit(level, func, text, clamp_text(text, (int) n));
+}
@@ -1,11 +1,76 @@
 #ifndef SITD_LOG
 #define SITD_LOG
 #include <stdio.h>
-#define __log(log_level, fmt, ...) fprintf(stderr, "[" log_level "] %s: " fmt, __func__, ## __VA_ARGS__)
-#define log_info(fmt, ...) __log("INFO ", fmt, ## __VA_ARGS__)
-#define log_warn(fmt, ...) __log("WARN ", fmt, ## __VA_ARGS__)
-#define log_error(fmt, ...) __log("ERROR", fmt, ## __VA_ARGS__)
-#define log_fatal(fmt, ...) __log("FATAL", fmt, ## __VA_ARGS__)
-#define log_debug(fmt, ...) __log("DEBUG", fmt, ## __VA_ARGS__)
-
-#endif // SITD_LOG
\ No newline at end of file
+#include <stdint.h>
+
+/* log_*() only formats and timestamps the message into a slot of a
+ * lock-free ring; a background thread started by log_start() writes the
+ * lines in batches, so callers never wait on stderr. when the ring is full
+ * the message is dropped and counted, and the writer reports the count.
+ * before log_start() and after log_stop() lines are written directly.
+ *
+ * levels below LOG_LEVEL_MIN are compiled out; the others are checked
+ * against the runtime level before their arguments are evaluated. */
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+#define LOG_FATAL 4
+
+#ifndef LOG_LEVEL_MIN
+#define LOG_LEVEL_MIN LOG_DEBUG
+#endif
+
+typedef enum log_field_type {
+    LOG_FIELD_STR,
+    LOG_FIELD_INT,
+    LOG_FIELD_UINT,
+} log_field_type_t;
+
+/* a key=value pair appended to the line. keys and strings are copied when
+ * the message is logged. */
+typedef struct log_field {
+    const char *key;
+    log_field_type_t type;
+    union {
+        const char *str;
+        int64_t i;
+        uint64_t u;
+    };
+} log_field_t;
+
+extern int log_level;
+
+int log_start();
+int log_stop();
+void log_set_level(int level);
+int log_level_parse(const char *name);
+
+void log_write(int level, const char *func, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void log_write_fields(int level, const char *func, const char *msg, const log_field_t *fields, size_t count);
+
+#define log_enabled(level) ((level) >= LOG_LEVEL_MIN && (level) >= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+
+#define __log(level, fmt, ...) do { \
+    if (log_enabled(level)) log_write(level, __func__, fmt, ## __VA_ARGS__); \
+} while (0)
+
+#define log_info(fmt, ...) __log(LOG_INFO, fmt, ## __VA_ARGS__)
+#define log_warn(fmt, ...) __log(LOG_WARN, fmt, ## __VA_ARGS__)
+#define log_error(fmt, ...) __log(LOG_ERROR, fmt, ## __VA_ARGS__)
+#define log_fatal(fmt, ...) __log(LOG_FATAL, fmt, ## __VA_ARGS__)
+#define log_debug(fmt, ...) __log(LOG_DEBUG, fmt, ## __VA_ARGS__)
+
+/* log_kv(LOG_ERROR, "route not installed.", LOG_STR("prefix", p), LOG_INT("err", e)); */
+#define LOG_STR(k, v) ((log_field_t) { .key = (k), .type = LOG_FIELD_STR, .str = (v) })
+#define LOG_INT(k, v) ((log_field_t) { .key = (k), .type = LOG_FIELD_INT, .i = (int64_t) (v) })
+#define LOG_UINT(k, v) ((log_field_t) { .key = (k), .type = LOG_FIELD_UINT, .u = (uint64_t) (v) })
+
+#define log_kv(level, msg, ...) do { \
+    if (log_enabled(level)) { \
+        const log_field_t __fields[] = { __VA_ARGS__ }; \
+        log_write_fields(level, __func__, msg, __fields, sizeof(__fields) / sizeof(log_field_t)); \
+    } \
+} while (0)
+
+#endif // SITD_LOG
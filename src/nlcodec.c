@@ -0,0 +1,232 @@
+#include <linux/if.h>
+#include <linux/if_arp.h>
+#include <linux/if_addr.h>
+#include <linux/if_link.h>
+#include <linux/if_tunnel.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+#include "nlcodec.h"
+
+#define SIT_TTL 255
+
+/* starts a message at the end of buf; buf->len only moves in msg_end(), so
+ * a message that runs out of room is simply dropped. */
+static struct nlmsghdr* msg_begin(nlcodec_buf_t *buf, int type, int flags, uint32_t seq, const void *hdr, size_t hdr_len) {
+    struct nlmsghdr *nlh;
+
+    if (buf->len + NLMSG_SPACE(hdr_len) > buf->cap) return NULL;
+
+    nlh = (struct nlmsghdr *) (buf->data + buf->len);
+    memset(nlh, 0, NLMSG_SPACE(hdr_len));
+    nlh->nlmsg_len = NLMSG_LENGTH(hdr_len);
+    nlh->nlmsg_type = (uint16_t) type;
+    nlh->nlmsg_flags = (uint16_t) (NLM_F_REQUEST | flags);
+    nlh->nlmsg_seq = seq;
+    memcpy(NLMSG_DATA(nlh), hdr, hdr_len);
+
+    return nlh;
+}
+
+static void msg_end(nlcodec_buf_t *buf, struct nlmsghdr *nlh) {
+    buf->len += NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+static struct rtattr* attr_put(const nlcodec_buf_t *buf, struct nlmsghdr *nlh, int type, const void *data, size_t len) {
+    size_t off = NLMSG_ALIGN(nlh->nlmsg_len);
+    struct rtattr *rta;
+
+    if ((size_t) ((char *) nlh - buf->data) + off + RTA_SPACE(len) > buf->cap) return NULL;
+
+    rta = (struct rtattr *) ((char *) nlh + off);
+    rta->rta_type = (uint16_t) type;
+    rta->rta_len = (uint16_t) RTA_LENGTH(len);
+    if (len > 0) memcpy(RTA_DATA(rta), data, len);
+    memset((char *) RTA_DATA(rta) + len, 0, RTA_SPACE(len) - RTA_LENGTH(len));
+    nlh->nlmsg_len = (uint32_t) (off + RTA_SPACE(len));
+
+    return rta;
+}
+
+static void nest_end(struct nlmsghdr *nlh, struct rtattr *nest) {
+    nest->rta_len = (uint16_t) ((char *) nlh + nlh->nlmsg_len - (char *) nest);
+}
+
+int nlcodec_link_add(nlcodec_buf_t *buf, uint32_t seq, const sit_tunnel_t *tunnel) {
+    struct ifinfomsg ifi = { .ifi_family = AF_UNSPEC, .ifi_flags = IFF_UP, .ifi_change = IFF_UP };
+    struct rtattr *info = NULL, *data = NULL;
+    struct nlmsghdr *nlh;
+    uint32_t mtu = tunnel->mtu;
+    uint8_t ttl = SIT_TTL;
+    bool ok;
+
+    nlh = msg_begin(buf, RTM_NEWLINK, NLM_F_ACK | NLM_F_CREATE, seq, &ifi, sizeof(ifi));
+    if (nlh == NULL) return -1;
+
+    ok = attr_put(buf, nlh, IFLA_IFNAME, tunnel->name, strnlen(tunnel->name, IFNAMSIZ - 1) + 1) != NULL;
+    if (ok && mtu != 0) ok = attr_put(buf, nlh, IFLA_MTU, &mtu, sizeof(mtu)) != NULL;
+
+    ok = ok && (info = attr_put(buf, nlh, IFLA_LINKINFO, NULL, 0)) != NULL;
+    ok = ok && attr_put(buf, nlh, IFLA_INFO_KIND, "sit", sizeof("sit")) != NULL;
+    ok = ok && (data = attr_put(buf, nlh, IFLA_INFO_DATA, NULL, 0)) != NULL;
+    ok = ok && attr_put(buf, nlh, IFLA_IPTUN_LOCAL, &tunnel->local.s_addr, sizeof(uint32_t)) != NULL;
+    ok = ok && attr_put(buf, nlh, IFLA_IPTUN_REMOTE, &tunnel->remote.s_addr, sizeof(uint32_t)) != NULL;
+    ok = ok && attr_put(buf, nlh, IFLA_IPTUN_TTL, &ttl, sizeof(ttl)) != NULL;
+    if (!ok) return -1;
+
+    nest_end(nlh, data);
+    nest_end(nlh, info);
+    msg_end(buf, nlh);
+
+    return 0;
+}
+
+int nlcodec_link_get(nlcodec_buf_t *buf, uint32_t seq, const char *name) {
+    struct ifinfomsg ifi = { .ifi_family = AF_UNSPEC };
+    struct nlmsghdr *nlh;
+
+    nlh = msg_begin(buf, RTM_GETLINK, NLM_F_ACK, seq, &ifi, sizeof(ifi));
+    if (nlh == NULL || attr_put(buf, nlh, IFLA_IFNAME, name, strnlen(name, IFNAMSIZ - 1) + 1) == NULL) return -1;
+
+    msg_end(buf, nlh);
+    return 0;
+}
+
+/* without a peer, IFA_ADDRESS is the local address too. */
+int nlcodec_addr(nlcodec_buf_t *buf, int cmd, uint32_t seq, int ifindex, const sit_prefix6_t *address) {
+    struct ifaddrmsg ifa = { .ifa_family = AF_INET6, .ifa_prefixlen = address->len, .ifa_index = (uint32_t) ifindex };
+    int flags = cmd == RTM_NEWADDR ? NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE : NLM_F_ACK;
+    struct nlmsghdr *nlh;
+
+    nlh = msg_begin(buf, cmd, flags, seq, &ifa, sizeof(ifa));
+    if (nlh == NULL) return -1;
+
+    if (attr_put(buf, nlh, IFA_LOCAL, &address->addr, sizeof(struct in6_addr)) == NULL) return -1;
+    if (attr_put(buf, nlh, IFA_ADDRESS, &address->addr, sizeof(struct in6_addr)) == NULL) return -1;
+
+    msg_end(buf, nlh);
+    return 0;
+}
+
+int nlcodec_route(nlcodec_buf_t *buf, int cmd, uint32_t seq, int ifindex, const sit_route_t *route) {
+    struct rtmsg rtm = {
+        .rtm_family = AF_INET6,
+        .rtm_dst_len = route->prefix.len,
+        .rtm_table = RT_TABLE_MAIN,
+        .rtm_protocol = RTPROT_STATIC,
+        .rtm_scope = RT_SCOPE_UNIVERSE,
+        .rtm_type = RTN_UNICAST
+    };
+    int flags = cmd == RTM_NEWROUTE ? NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE : NLM_F_ACK;
+    uint32_t table = RT_TABLE_MAIN, oif = (uint32_t) ifindex;
+    struct nlmsghdr *nlh;
+
+    nlh = msg_begin(buf, cmd, flags, seq, &rtm, sizeof(rtm));
+    if (nlh == NULL) return -1;
+
+    if (attr_put(buf, nlh, RTA_TABLE, &table, sizeof(table)) == NULL) return -1;
+    if (attr_put(buf, nlh, RTA_DST, &route->prefix.addr, sizeof(struct in6_addr)) == NULL) return -1;
+    if (attr_put(buf, nlh, RTA_GATEWAY, &route->nexthop, sizeof(struct in6_addr)) == NULL) return -1;
+    if (attr_put(buf, nlh, RTA_OIF, &oif, sizeof(oif)) == NULL) return -1;
+
+    msg_end(buf, nlh);
+    return 0;
+}
+
+int nlcodec_dump(nlcodec_buf_t *buf, int type, uint32_t seq, int ifindex) {
+    struct ifaddrmsg ifa = { .ifa_family = AF_INET6, .ifa_index = (uint32_t) ifindex };
+    struct rtmsg rtm = { .rtm_family = AF_INET6 };
+    uint32_t oif = (uint32_t) ifindex;
+    struct nlmsghdr *nlh;
+
+    if (type == RTM_GETADDR) nlh = msg_begin(buf, type, NLM_F_DUMP, seq, &ifa, sizeof(ifa));
+    else {
+        nlh = msg_begin(buf, type, NLM_F_DUMP, seq, &rtm, sizeof(rtm));
+        if (nlh != NULL && attr_put(buf, nlh, RTA_OIF, &oif, sizeof(oif)) == NULL) return -1;
+    }
+
+    if (nlh == NULL) return -1;
+
+    msg_end(buf, nlh);
+    return 0;
+}
+
+int nlcodec_ack(const struct nlmsghdr *nlh, int *err) {
+    if (nlh->nlmsg_type != NLMSG_ERROR) return 0;
+
+    /* error ACKs echo the request back and may come in truncated; only the
+     * code is needed. */
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(int))) *err = -EBADMSG;
+    else *err = ((const struct nlmsgerr *) NLMSG_DATA(nlh))->error;
+
+    return 1;
+}
+
+int nlcodec_parse_link(const struct nlmsghdr *nlh, int *ifindex, bool *sit) {
+    const struct ifinfomsg *ifi = (const struct ifinfomsg *) NLMSG_DATA(nlh);
+
+    if (nlh->nlmsg_type != RTM_NEWLINK || nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi))) return -1;
+
+    *ifindex = ifi->ifi_index;
+    *sit = ifi->ifi_type == ARPHRD_SIT;
+    return 0;
+}
+
+int nlcodec_parse_addr(const struct nlmsghdr *nlh, int *ifindex, sit_prefix6_t *address, uint8_t *scope) {
+    const struct ifaddrmsg *ifa = (const struct ifaddrmsg *) NLMSG_DATA(nlh);
+    const struct rtattr *rta, *local = NULL, *addr = NULL;
+    int len;
+
+    if (nlh->nlmsg_type != RTM_NEWADDR || nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa))) return -1;
+    if (ifa->ifa_family != AF_INET6) return -1;
+
+    len = (int) IFA_PAYLOAD(nlh);
+    for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (RTA_PAYLOAD(rta) != sizeof(struct in6_addr)) continue;
+        if (rta->rta_type == IFA_LOCAL) local = rta;
+        else if (rta->rta_type == IFA_ADDRESS) addr = rta;
+    }
+
+    if (local == NULL) local = addr;
+    if (local == NULL) return -1;
+
+    *ifindex = (int) ifa->ifa_index;
+    memcpy(&address->addr, RTA_DATA(local), sizeof(struct in6_addr));
+    address->len = ifa->ifa_prefixlen;
+    *scope = ifa->ifa_scope;
+    return 0;
+}
+
+int nlcodec_parse_route(const struct nlmsghdr *nlh, int *ifindex, sit_route_t *route) {
+    const struct rtmsg *rtm = (const struct rtmsg *) NLMSG_DATA(nlh);
+    const struct rtattr *rta, *dst = NULL, *gw = NULL;
+    uint32_t table, oif = 0;
+    int len;
+
+    if (nlh->nlmsg_type != RTM_NEWROUTE || nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*rtm))) return -1;
+    if (rtm->rtm_family != AF_INET6 || rtm->rtm_protocol != RTPROT_STATIC || rtm->rtm_type != RTN_UNICAST) return -1;
+
+    table = rtm->rtm_table;
+    len = (int) RTM_PAYLOAD(nlh);
+    for (rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+            case RTA_DST: dst = rta; break;
+            case RTA_GATEWAY: gw = rta; break;
+            case RTA_OIF: if (RTA_PAYLOAD(rta) == sizeof(oif)) memcpy(&oif, RTA_DATA(rta), sizeof(oif)); break;
+            case RTA_TABLE: if (RTA_PAYLOAD(rta) == sizeof(table)) memcpy(&table, RTA_DATA(rta), sizeof(table)); break;
+            /* more than one nexthop isn't a route sitd made. */
+            case RTA_MULTIPATH: return -1;
+        }
+    }
+
+    if (table != RT_TABLE_MAIN || gw == NULL || RTA_PAYLOAD(gw) != sizeof(struct in6_addr)) return -1;
+    if (dst != NULL && RTA_PAYLOAD(dst) != sizeof(struct in6_addr)) return -1;
+
+    memset(route, 0, sizeof(sit_route_t));
+    if (dst != NULL) memcpy(&route->prefix.addr, RTA_DATA(dst), sizeof(struct in6_addr));
+    route->prefix.len = rtm->rtm_dst_len;
+    memcpy(&route->nexthop, RTA_DATA(gw), sizeof(struct in6_addr));
+    *ifindex = (int) oif;
+    return 0;
+}
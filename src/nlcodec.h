@@ -0,0 +1,53 @@
+#ifndef SITD_NLCODEC_H
+#define SITD_NLCODEC_H
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/netlink.h>
+#include "types.h"
+
+/* the few rtnetlink messages sitd sends, written straight into a caller's
+ * buffer, and the replies it reads, decoded where they lie. nothing here
+ * allocates or touches a socket.
+ *
+ * every encoder appends one request with NLM_F_REQUEST | NLM_F_ACK (dumps
+ * get NLM_F_DUMP instead) and returns 0, or -1 if it doesn't fit; buf is
+ * left as it was then. */
+#define NLCODEC_BUF_SZ 4096
+
+typedef struct nlcodec_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+} nlcodec_buf_t;
+
+/* RTM_NEWLINK creating an up sit link, kind "sit" with local, remote, ttl
+ * 255 and, if set, the mtu. */
+int nlcodec_link_add(nlcodec_buf_t *buf, uint32_t seq, const sit_tunnel_t *tunnel);
+
+/* RTM_GETLINK for one link by name. */
+int nlcodec_link_get(nlcodec_buf_t *buf, uint32_t seq, const char *name);
+
+/* RTM_NEWADDR (create or replace) or RTM_DELADDR. */
+int nlcodec_addr(nlcodec_buf_t *buf, int cmd, uint32_t seq, int ifindex, const sit_prefix6_t *address);
+
+/* RTM_NEWROUTE (create or replace) or RTM_DELROUTE of a static unicast
+ * route in main through nexthop on ifindex. */
+int nlcodec_route(nlcodec_buf_t *buf, int cmd, uint32_t seq, int ifindex, const sit_route_t *route);
+
+/* RTM_GETADDR or RTM_GETROUTE dump of one interface's ipv6 objects. */
+int nlcodec_dump(nlcodec_buf_t *buf, int type, uint32_t seq, int ifindex);
+
+/* 1 and the error (0 or a negative errno) if nlh is an ACK, else 0. */
+int nlcodec_ack(const struct nlmsghdr *nlh, int *err);
+
+/* the rest return 0 if nlh is the kind of object asked for, else -1. */
+int nlcodec_parse_link(const struct nlmsghdr *nlh, int *ifindex, bool *sit);
+
+/* an ipv6 address: its ifindex, IFA_LOCAL (or IFA_ADDRESS) and scope. */
+int nlcodec_parse_addr(const struct nlmsghdr *nlh, int *ifindex, sit_prefix6_t *address, uint8_t *scope);
+
+/* an ipv6 static unicast route in main with a single gateway: the route's
+ * prefix and nexthop, and its output interface. */
+int nlcodec_parse_route(const struct nlmsghdr *nlh, int *ifindex, sit_route_t *route);
+
+#endif // SITD_NLCODEC_H
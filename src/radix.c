@@ -0,0 +1,295 @@
+#include <stdlib.h>
+#include <string.h>
+#include "radix.h"
+#include "log.h"
+
+#define RADIX_NODES_INIT 256
+#define RADIX_ROOT 1
+#define RADIX_MAX_DEPTH 130
+
+/* sub_owner is 0 for an empty subtree and OWNER_MIXED once two owners meet
+ * in it. */
+#define OWNER_MIXED UINT32_MAX
+
+static int bit_at(const struct in6_addr *addr, unsigned i) {
+    return (addr->s6_addr[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+/* length of the common prefix of a and b, up to max bits. */
+static unsigned common_len(const struct in6_addr *a, const struct in6_addr *b, unsigned max) {
+    unsigned i = 0;
+
+    while (i + 8 <= max && a->s6_addr[i >> 3] == b->s6_addr[i >> 3]) i += 8;
+    while (i < max && bit_at(a, i) == bit_at(b, i)) i++;
+
+    return i;
+}
+
+static uint32_t owner_merge(uint32_t a, uint32_t b) {
+    if (a == 0) return b;
+    if (b == 0 || a == b) return a;
+    return OWNER_MIXED;
+}
+
+static void node_update(radix_t *radix, uint32_t n) {
+    radix_node_t *node = &radix->nodes[n];
+    uint32_t sub = node->valued ? node->owner : 0;
+
+    for (int b = 0; b < 2; b++) {
+        if (node->child[b] != 0) sub = owner_merge(sub, radix->nodes[node->child[b]].sub_owner);
+    }
+    node->sub_owner = sub;
+}
+
+/* the key is masked to len, so glue nodes can take any address below them. */
+static uint32_t node_alloc(radix_t *radix, const struct in6_addr *key, uint8_t len) {
+    sit_prefix6_t masked = { .addr = *key, .len = len };
+    uint32_t n;
+
+    if (radix->free_list != 0) {
+        n = radix->free_list;
+        radix->free_list = radix->nodes[n].child[0];
+    } else n = (uint32_t) radix->n_nodes++;
+
+    sit_prefix6_mask(&masked);
+    memset(&radix->nodes[n], 0, sizeof(radix_node_t));
+    radix->nodes[n].key = masked.addr;
+    radix->nodes[n].len = len;
+
+    return n;
+}
+
+static void node_release(radix_t *radix, uint32_t n) {
+    radix->nodes[n].child[0] = radix->free_list;
+    radix->free_list = n;
+}
+
+int radix_init(radix_t *radix) {
+    memset(radix, 0, sizeof(radix_t));
+
+    radix->nodes = (radix_node_t *) calloc(RADIX_NODES_INIT, sizeof(radix_node_t));
+    if (radix->nodes == NULL) {
+        log_fatal("calloc() failed.\n");
+        return -1;
+    }
+
+    /* slot 0 means "no child"; the root is ::/0 and always there. */
+    radix->cap_nodes = RADIX_NODES_INIT;
+    radix->n_nodes = RADIX_ROOT + 1;
+
+    return 0;
+}
+
+void radix_free(radix_t *radix) {
+    free(radix->nodes);
+    memset(radix, 0, sizeof(radix_t));
+}
+
+/* an add takes at most two nodes. */
+int radix_reserve(radix_t *radix, size_t more) {
+    size_t want = radix->n_nodes + 2 * more, cap = radix->cap_nodes;
+    radix_node_t *grown;
+
+    if (want <= cap) return 0;
+    while (cap < want) cap *= 2;
+
+    grown = (radix_node_t *) realloc(radix->nodes, cap * sizeof(radix_node_t));
+    if (grown == NULL) {
+        log_fatal("realloc() failed.\n");
+        return -1;
+    }
+
+    radix->nodes = grown;
+    radix->cap_nodes = cap;
+    return 0;
+}
+
+static void hit_set(const radix_node_t *node, radix_hit_t *hit) {
+    if (hit == NULL) return;
+
+    hit->prefix.addr = node->key;
+    hit->prefix.len = node->len;
+    hit->owner = node->owner;
+    hit->ref = node->ref;
+}
+
+/* somewhere below n there's a prefix not owned by owner; find one. */
+static void find_other(const radix_t *radix, uint32_t n, uint32_t owner, radix_hit_t *hit) {
+    while (n != 0) {
+        const radix_node_t *node = &radix->nodes[n];
+        uint32_t next = 0;
+
+        if (node->valued && node->owner != owner) {
+            hit_set(node, hit);
+            return;
+        }
+
+        for (int b = 0; b < 2 && next == 0; b++) {
+            uint32_t c = node->child[b], sub = c != 0 ? radix->nodes[c].sub_owner : 0;
+            if (sub != 0 && sub != owner) next = c;
+        }
+        n = next;
+    }
+}
+
+static bool subtree_conflict(const radix_t *radix, uint32_t n, uint32_t owner, radix_hit_t *hit) {
+    uint32_t sub = radix->nodes[n].sub_owner;
+
+    if (sub == 0 || sub == owner) return false;
+    find_other(radix, n, owner, hit);
+    return true;
+}
+
+bool radix_conflict(const radix_t *radix, const sit_prefix6_t *prefix, uint32_t owner, radix_hit_t *hit) {
+    uint32_t n = RADIX_ROOT;
+
+    for (;;) {
+        const radix_node_t *node = &radix->nodes[n];
+
+        /* node covers prefix here. */
+        if (node->valued && (node->owner != owner || node->len == prefix->len)) {
+            hit_set(node, hit);
+            return true;
+        }
+
+        if (node->len == prefix->len) {
+            for (int b = 0; b < 2; b++) {
+                if (node->child[b] != 0 && subtree_conflict(radix, node->child[b], owner, hit)) return true;
+            }
+            return false;
+        }
+
+        uint32_t c = node->child[bit_at(&prefix->addr, node->len)];
+        if (c == 0) return false;
+
+        const radix_node_t *child = &radix->nodes[c];
+        unsigned max = child->len < prefix->len ? child->len : prefix->len;
+        if (common_len(&child->key, &prefix->addr, max) < max) return false;
+
+        /* the child lies inside prefix: all of it overlaps. */
+        if (child->len > prefix->len) return subtree_conflict(radix, c, owner, hit);
+
+        n = c;
+    }
+}
+
+bool radix_add(radix_t *radix, const sit_prefix6_t *prefix, uint32_t owner, uint32_t ref) {
+    uint32_t path[RADIX_MAX_DEPTH], n = RADIX_ROOT, leaf;
+    size_t depth = 0;
+
+    for (;;) {
+        radix_node_t *node = &radix->nodes[n];
+        path[depth++] = n;
+
+        if (node->len == prefix->len) {
+            if (node->valued) return false;
+            leaf = n;
+            break;
+        }
+
+        int b = bit_at(&prefix->addr, node->len);
+        uint32_t c = node->child[b];
+
+        if (c == 0) {
+            leaf = node_alloc(radix, &prefix->addr, prefix->len);
+            radix->nodes[n].child[b] = leaf;
+            break;
+        }
+
+        radix_node_t *child = &radix->nodes[c];
+        unsigned max = child->len < prefix->len ? child->len : prefix->len;
+        unsigned common = common_len(&child->key, &prefix->addr, max);
+
+        if (common == child->len) {
+            n = c;
+            continue;
+        }
+
+        if (common == prefix->len) {
+            /* prefix goes between node and child. */
+            leaf = node_alloc(radix, &prefix->addr, prefix->len);
+            radix->nodes[leaf].child[bit_at(&radix->nodes[c].key, prefix->len)] = c;
+        } else {
+            /* they part ways at common; a glue node holds both. */
+            uint32_t glue = node_alloc(radix, &prefix->addr, (uint8_t) common);
+            leaf = node_alloc(radix, &prefix->addr, prefix->len);
+            radix->nodes[glue].child[bit_at(&radix->nodes[c].key, common)] = c;
+            radix->nodes[glue].child[bit_at(&prefix->addr, common)] = leaf;
+            path[depth++] = glue;
+            radix->nodes[n].child[b] = glue;
+            break;
+        }
+
+        radix->nodes[n].child[b] = leaf;
+        break;
+    }
+
+    radix->nodes[leaf].valued = true;
+    radix->nodes[leaf].owner = owner;
+    radix->nodes[leaf].ref = ref;
+
+    node_update(radix, leaf);
+    while (depth > 0) node_update(radix, path[--depth]);
+
+    return true;
+}
+
+void radix_del(radix_t *radix, const sit_prefix6_t *prefix, uint32_t owner, uint32_t ref) {
+    uint32_t path[RADIX_MAX_DEPTH], n = RADIX_ROOT;
+    size_t depth = 0;
+    radix_node_t *node;
+
+    for (;;) {
+        node = &radix->nodes[n];
+        path[depth++] = n;
+
+        if (node->len >= prefix->len) break;
+
+        n = node->child[bit_at(&prefix->addr, node->len)];
+        if (n == 0) return;
+    }
+
+    if (node->len != prefix->len || !node->valued || node->owner != owner || node->ref != ref ||
+        common_len(&node->key, &prefix->addr, prefix->len) != prefix->len) return;
+
+    node->valued = false;
+    node->owner = node->ref = 0;
+
+    /* a node without a value only stays while it joins two children. walk
+     * up once to drop the node and, if it left one, a glue parent. */
+    for (size_t i = depth - 1; i > 0; i--) {
+        uint32_t cur = path[i], parent = path[i - 1];
+        radix_node_t *c = &radix->nodes[cur], *p = &radix->nodes[parent];
+        int slot = p->child[1] == cur;
+
+        if (c->valued || (c->child[0] != 0 && c->child[1] != 0)) break;
+
+        p->child[slot] = c->child[0] != 0 ? c->child[0] : c->child[1];
+        node_release(radix, cur);
+        path[i] = 0;
+    }
+
+    while (depth > 0) {
+        if (path[--depth] != 0) node_update(radix, path[depth]);
+    }
+}
+
+bool radix_lookup(const radix_t *radix, const sit_prefix6_t *prefix, radix_hit_t *hit) {
+    const radix_node_t *best = NULL;
+    uint32_t n = RADIX_ROOT;
+
+    while (n != 0) {
+        const radix_node_t *node = &radix->nodes[n];
+
+        if (node->len > prefix->len || common_len(&node->key, &prefix->addr, node->len) != node->len) break;
+        if (node->valued) best = node;
+        if (node->len == prefix->len) break;
+
+        n = node->child[bit_at(&prefix->addr, node->len)];
+    }
+
+    if (best == NULL) return false;
+
+    hit_set(best, hit);
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef SITD_RADIX_H
+#define SITD_RADIX_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+/* a path-compressed binary trie over IPv6 prefixes. every stored prefix has
+ * an owner (non-zero) and a ref the caller picks; each node also knows
+ * whether everything below it has a single owner, so overlap checks only
+ * walk the prefix's own path. nodes live in one pool addressed by index,
+ * and radix_reserve() makes the adds that follow unable to fail. */
+typedef struct radix_node {
+    struct in6_addr key;
+    uint8_t len;
+    bool valued;
+    uint32_t child[2];
+    uint32_t owner;
+    uint32_t ref;
+    uint32_t sub_owner;
+} radix_node_t;
+
+typedef struct radix {
+    radix_node_t *nodes;
+    size_t n_nodes, cap_nodes;
+    uint32_t free_list;
+} radix_t;
+
+typedef struct radix_hit {
+    sit_prefix6_t prefix;
+    uint32_t owner;
+    uint32_t ref;
+} radix_hit_t;
+
+int radix_init(radix_t *radix);
+void radix_free(radix_t *radix);
+int radix_reserve(radix_t *radix, size_t more);
+
+/* prefixes must be masked. a conflict is the same prefix, or an overlapping
+ * one with another owner; *hit, if given, is one of them. */
+bool radix_conflict(const radix_t *radix, const sit_prefix6_t *prefix, uint32_t owner, radix_hit_t *hit);
+
+/* false if the prefix is already there. */
+bool radix_add(radix_t *radix, const sit_prefix6_t *prefix, uint32_t owner, uint32_t ref);
+
+/* only removes the prefix if owner and ref match. */
+void radix_del(radix_t *radix, const sit_prefix6_t *prefix, uint32_t owner, uint32_t ref);
+
+/* the longest stored prefix covering all of prefix. */
+bool radix_lookup(const radix_t *radix, const sit_prefix6_t *prefix, radix_hit_t *hit);
+
+#endif // SITD_RADIX_H
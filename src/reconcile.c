@@ -0,0 +1,215 @@
+#include <netlink/netlink.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include "reconcile.h"
+#include "sit.h"
+#include "store.h"
+#include "log.h"
+
+#define RECONCILE_MAX_WORKERS 64
+#define RECONCILE_PROGRESS_INTERVAL 1
+
+typedef struct reconcile_job {
+    sit_tunnel_t *tunnel;
+    sit_route_t *routes;
+    int err;
+} reconcile_job_t;
+
+typedef struct reconcile {
+    reconcile_job_t *jobs;
+    size_t count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t next;
+    size_t done;
+    size_t changed;
+    size_t failed;
+    size_t workers_running;
+} reconcile_t;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int reconcile_one(struct nl_sock *sk, const reconcile_job_t *job, bool *changed) {
+    int err = sit_apply(sk, job->tunnel, NULL, job->routes, changed);
+    if (*changed) log_info("%s: brought in sync with the database.\n", job->tunnel->name);
+    return err;
+}
+
+static void* reconcile_worker(void *arg) {
+    reconcile_t *r = (reconcile_t *) arg;
+    struct nl_sock *sk = nl_socket_alloc();
+    int err;
+
+    if (sk == NULL) {
+        log_fatal("nl_socket_alloc() returned null.\n");
+        goto end;
+    }
+
+    err = nl_connect(sk, NETLINK_ROUTE);
+    if (err < 0) {
+        log_fatal("nl_connect(): %s.\n", nl_geterror(err));
+        nl_socket_free(sk);
+        sk = NULL;
+        goto end;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        size_t i = r->next++;
+        pthread_mutex_unlock(&r->lock);
+
+        if (i >= r->count) break;
+
+        bool changed = false;
+        err = reconcile_one(sk, &r->jobs[i], &changed);
+        r->jobs[i].err = err;
+
+        pthread_mutex_lock(&r->lock);
+        ++r->done;
+        if (changed) ++r->changed;
+        if (err != SIT_OK) ++r->failed;
+        pthread_mutex_unlock(&r->lock);
+    }
+
+end:
+    if (sk != NULL) {
+        nl_close(sk);
+        nl_socket_free(sk);
+    }
+
+    pthread_mutex_lock(&r->lock);
+    --r->workers_running;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    return NULL;
+}
+
+/* tunnels and routes both come sorted by tunnel id, so each tunnel's routes
+ * are a run of the route array; the runs are cut apart in place. */
+static int load_jobs(reconcile_t *r, sit_tunnel_t *tunnels, size_t n, sit_route_t *routes, size_t n_routes) {
+    size_t j = 0;
+
+    r->jobs = (reconcile_job_t *) calloc(n, sizeof(reconcile_job_t));
+    if (r->jobs == NULL) {
+        log_fatal("calloc() failed.\n");
+        return SIT_FATAL;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        reconcile_job_t *job = &r->jobs[r->count++];
+        job->tunnel = &tunnels[i];
+
+        while (j < n_routes && routes[j].tunnel_id < tunnels[i].id) ++j;
+        if (j == n_routes || routes[j].tunnel_id != tunnels[i].id) continue;
+
+        job->routes = &routes[j];
+        while (j + 1 < n_routes && routes[j + 1].tunnel_id == tunnels[i].id) ++j;
+        routes[j++].next = NULL;
+    }
+
+    return SIT_OK;
+}
+
+int reconcile_tunnels(sit_tunnel_t *tunnels, size_t n_tunnels, sit_route_t *routes, size_t n_routes, size_t workers, int *results) {
+    pthread_t threads[RECONCILE_MAX_WORKERS];
+    reconcile_t r = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+    };
+    double begin = now();
+    size_t started = 0;
+    int err;
+
+    for (size_t i = 0; results != NULL && i < n_tunnels; i++) results[i] = SIT_FATAL;
+
+    err = load_jobs(&r, tunnels, n_tunnels, routes, n_routes);
+    if (err != SIT_OK) goto end;
+
+    /* jobs a worker never reaches keep this. */
+    for (size_t i = 0; i < r.count; i++) r.jobs[i].err = SIT_FATAL;
+
+    if (workers == 0) workers = 1;
+    if (workers > RECONCILE_MAX_WORKERS) workers = RECONCILE_MAX_WORKERS;
+    if (workers > r.count) workers = r.count;
+
+    log_info("reconciling %zu tunnels with %zu workers.\n", r.count, workers);
+
+    pthread_mutex_lock(&r.lock);
+    for (; started < workers; started++) {
+        ++r.workers_running;
+        if (pthread_create(&threads[started], NULL, &reconcile_worker, &r) != 0) {
+            --r.workers_running;
+            log_error("pthread_create(): can't start worker %zu.\n", started);
+            break;
+        }
+    }
+
+    if (started == 0) {
+        pthread_mutex_unlock(&r.lock);
+        err = SIT_FATAL;
+        goto end;
+    }
+
+    while (r.workers_running > 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += RECONCILE_PROGRESS_INTERVAL;
+
+        if (pthread_cond_timedwait(&r.cond, &r.lock, &deadline) != 0) {
+            log_info("reconciled %zu/%zu tunnels (%zu changed, %zu failed).\n", r.done, r.count, r.changed, r.failed);
+        }
+    }
+    pthread_mutex_unlock(&r.lock);
+
+    for (size_t i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    log_info("reconciled %zu/%zu tunnels in %.3fs: %zu changed, %zu failed.\n", r.done, r.count, now() - begin, r.changed, r.failed);
+    err = r.failed == 0 && r.done == r.count ? SIT_OK : SIT_ERROR;
+
+    for (size_t i = 0; results != NULL && i < r.count; i++) results[i] = r.jobs[i].err;
+
+end:
+    free(r.jobs);
+    return err;
+}
+
+int reconcile_all(size_t workers) {
+    sit_tunnel_t *tunnels = NULL;
+    sit_route_t *routes = NULL;
+    size_t n_tunnels = 0, n_routes = 0;
+    int err;
+
+    err = store_get_tunnels(&tunnels, &n_tunnels);
+    if (err == SIT_DB_NOT_EXIST) {
+        log_info("no tunnels to reconcile.\n");
+        return SIT_OK;
+    }
+
+    if (err != SIT_DB_OK) {
+        log_fatal("store_get_tunnels(): can't load tunnels.\n");
+        return SIT_FATAL;
+    }
+
+    /* all routes are copied out up front, so the workers never touch the
+     * store. */
+    err = store_get_all_routes(&routes, &n_routes);
+    if (err != SIT_DB_OK && err != SIT_DB_NOT_EXIST) {
+        log_fatal("store_get_all_routes(): can't load routes.\n");
+        err = SIT_FATAL;
+        goto end;
+    }
+
+    err = reconcile_tunnels(tunnels, n_tunnels, routes, n_routes, workers, NULL);
+
+end:
+    store_free_result_routes(routes);
+    store_free_result_tunnels(tunnels);
+    return err;
+}
@@ -0,0 +1,12 @@
+#ifndef SITD_RECONCILE_H
+#define SITD_RECONCILE_H
+#include <stddef.h>
+#include "types.h"
+
+/* brings the kernel in line with the given tunnels and routes. both arrays
+ * must be sorted by tunnel id; results, if given, gets a SIT_* code per
+ * tunnel. */
+int reconcile_tunnels(sit_tunnel_t *tunnels, size_t n_tunnels, sit_route_t *routes, size_t n_routes, size_t workers, int *results);
+int reconcile_all(size_t workers);
+
+#endif // SITD_RECONCILE_H
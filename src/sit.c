@@ -1,226 +1,1527 @@
+#define _GNU_SOURCE
 #include <netlink/route/link/sit.h>
 #include <netlink/route/addr.h>
 #include <netlink/route/route.h>
+#include <netlink/cache.h>
 #include <netlink/version.h>
 #include <arpa/inet.h>
 #include <linux/if.h>
+#include <linux/if_arp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
 #include "sit.h"
 #include "log.h"
 #include "types.h"
+#include "latency.h"
+#include "nlcodec.h"
 
 #if LIBNL_VER_NUM < LIBNL_VER(3, 5)
 extern int rtnl_link_is_sit(struct rtnl_link *link);
 #endif
 
+#define EVENT_RCVBUF_SZ (4 << 20)
+#define EVENT_DRAIN_MAX 64
+#define LINK_INDEX_INIT_SZ 256
+
+#define ROUTE_BATCH_SNDBUF_SZ 0x4000
+#define ROUTE_BATCH_WINDOW 128
+#define ROUTE_BATCH_RECV_VLEN 64
+#define ROUTE_BATCH_RECV_SZ 512
+#define ROUTE_BATCH_SOCKBUF_SZ (1 << 20)
+
+#define DUMP_INIT_SZ 16
+
+#define RAW_RECV_SZ 32768
+
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif
+
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK 12
+#endif
+#define LINK_INDEX_EMPTY 0
+#define LINK_INDEX_TOMBSTONE -1
+
+/* name -> ifindex, open addressing. the link itself is then fetched from the
+ * cache's own (ifindex, family) hash table with nl_cache_search(). */
+typedef struct link_index_entry {
+    char name[IFNAMSIZ];
+    int ifindex;
+} link_index_entry_t;
+
+/* guards the cache and its index. libnl refcounts aren't atomic, so links
+ * never leave the lock: sit_get() hands out clones. */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nl_sock *cache_sk = NULL;
+static struct nl_cache_mngr *cache_mngr = NULL;
+static struct nl_cache *link_cache = NULL;
+
+/* set once before anything else runs. */
+static sit_backend_t backend = SIT_BACKEND_LIBNL;
+
+static link_index_entry_t *link_index = NULL;
+static size_t link_index_cap = 0;
+static size_t link_index_used = 0;
+
+static size_t link_index_hash(const char *name) {
+    size_t hash = 2166136261u;
+    while (*name != 0) hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    return hash;
+}
+
+static link_index_entry_t* link_index_find(const char *name) {
+    size_t mask = link_index_cap - 1, i = link_index_hash(name) & mask;
+
+    while (link_index[i].ifindex != LINK_INDEX_EMPTY) {
+        if (link_index[i].ifindex != LINK_INDEX_TOMBSTONE && strncmp(link_index[i].name, name, IFNAMSIZ) == 0) {
+            return &link_index[i];
+        }
+        i = (i + 1) & mask;
+    }
+
+    return NULL;
+}
+
+static int link_index_put(const char *name, int ifindex);
+
+static int link_index_resize(size_t cap) {
+    link_index_entry_t *old = link_index;
+    size_t old_cap = link_index_cap;
+
+    link_index = (link_index_entry_t *) calloc(cap, sizeof(link_index_entry_t));
+    if (link_index == NULL) {
+        log_fatal("calloc() failed.\n");
+        link_index = old;
+        return SIT_FATAL;
+    }
+
+    link_index_cap = cap;
+    link_index_used = 0;
+
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].ifindex > 0) link_index_put(old[i].name, old[i].ifindex);
+    }
+
+    free(old);
+    return SIT_OK;
+}
+
+static int link_index_put(const char *name, int ifindex) {
+    link_index_entry_t *entry = link_index_find(name);
+
+    if (entry != NULL) {
+        entry->ifindex = ifindex;
+        return SIT_OK;
+    }
+
+    if ((link_index_used + 1) * 2 > link_index_cap) {
+        int err = link_index_resize(link_index_cap * 2);
+        if (err != SIT_OK) return err;
+    }
+
+    size_t mask = link_index_cap - 1, i = link_index_hash(name) & mask;
+    while (link_index[i].ifindex > 0) i = (i + 1) & mask;
+
+    /* tombstones are only reclaimed on resize, so they keep counting as used. */
+    if (link_index[i].ifindex == LINK_INDEX_EMPTY) ++link_index_used;
+    strncpy(link_index[i].name, name, IFNAMSIZ - 1);
+    link_index[i].name[IFNAMSIZ - 1] = 0;
+    link_index[i].ifindex = ifindex;
+
+    return SIT_OK;
+}
+
+static void link_index_del(const char *name, int ifindex) {
+    link_index_entry_t *entry = link_index_find(name);
+    if (entry != NULL && entry->ifindex == ifindex) entry->ifindex = LINK_INDEX_TOMBSTONE;
+}
+
+static void link_index_add_obj(struct nl_object *obj, void *arg) {
+    (void) arg;
+    struct rtnl_link *link = (struct rtnl_link *) obj;
+    const char *name = rtnl_link_get_name(link);
+    if (name != NULL) link_index_put(name, rtnl_link_get_ifindex(link));
+}
+
+static int link_index_rebuild() {
+    memset(link_index, 0, link_index_cap * sizeof(link_index_entry_t));
+    link_index_used = 0;
+    nl_cache_foreach(link_cache, &link_index_add_obj, NULL);
+    return SIT_OK;
+}
+
+static void link_cache_change(struct nl_cache *cache, struct nl_object *obj, int action, void *arg) {
+    (void) cache;
+    (void) arg;
+    struct rtnl_link *link = (struct rtnl_link *) obj;
+    const char *name = rtnl_link_get_name(link);
+
+    if (name == NULL) return;
+
+    if (action == NL_ACT_DEL) link_index_del(name, rtnl_link_get_ifindex(link));
+    else link_index_put(name, rtnl_link_get_ifindex(link));
+}
+
+/* apply pending link events to the cache. on overflow (events were dropped by
+ * the kernel) the queued events are drained and the cache is refilled with a
+ * full dump. */
+static int link_cache_sync(struct nl_sock *sk) {
+    int err = nl_cache_mngr_data_ready(cache_mngr);
+    if (err >= 0) return SIT_OK;
+
+    log_warn("nl_cache_mngr_data_ready(): %s, resyncing link cache.\n", nl_geterror(err));
+
+    for (int i = 0; i < EVENT_DRAIN_MAX && err != 0; i++) {
+        err = nl_cache_mngr_data_ready(cache_mngr);
+    }
+
+    err = nl_cache_refill(sk, link_cache);
+    if (err < 0) {
+        log_fatal("nl_cache_refill(): %s.\n", nl_geterror(err));
+        return SIT_FATAL;
+    }
+
+    return link_index_rebuild();
+}
+
+static struct rtnl_link* link_cache_lookup(const char *name) {
+    link_index_entry_t *entry = link_index_find(name);
+    struct rtnl_link *needle, *link;
+
+    if (entry == NULL) return NULL;
+
+    needle = rtnl_link_alloc();
+    if (needle == NULL) {
+        log_fatal("rtnl_link_alloc(): can't allocate.\n");
+        return NULL;
+    }
+
+    rtnl_link_set_ifindex(needle, entry->ifindex);
+    rtnl_link_set_family(needle, AF_UNSPEC);
+    link = (struct rtnl_link *) nl_cache_search(link_cache, (struct nl_object *) needle);
+    rtnl_link_put(needle);
+
+    /* stale entry left behind by a rename. */
+    if (link != NULL && strncmp(rtnl_link_get_name(link), name, IFNAMSIZ) != 0) {
+        entry->ifindex = LINK_INDEX_TOMBSTONE;
+        rtnl_link_put(link);
+        link = NULL;
+    }
+
+    return link;
+}
+
+void sit_set_backend(sit_backend_t b) {
+    backend = b;
+}
+
+int sit_backend_parse(const char *name) {
+    if (strcasecmp(name, "libnl") == 0) return SIT_BACKEND_LIBNL;
+    if (strcasecmp(name, "raw") == 0) return SIT_BACKEND_RAW;
+    return -1;
+}
+
+int sit_open() {
+    int err;
+
+    pthread_mutex_lock(&cache_lock);
+
+    if (cache_mngr != NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        log_fatal("link cache is already opened.\n");
+        return SIT_FATAL;
+    }
+
+    link_index = (link_index_entry_t *) calloc(LINK_INDEX_INIT_SZ, sizeof(link_index_entry_t));
+    if (link_index == NULL) {
+        log_fatal("calloc() failed.\n");
+        return SIT_FATAL;
+    }
+    link_index_cap = LINK_INDEX_INIT_SZ;
+    link_index_used = 0;
+
+    cache_sk = nl_socket_alloc();
+    if (cache_sk == NULL) {
+        log_fatal("nl_socket_alloc() returned null.\n");
+        goto err_out;
+    }
+
+    err = nl_cache_mngr_alloc(cache_sk, NETLINK_ROUTE, 0, &cache_mngr);
+    if (err < 0) {
+        log_fatal("nl_cache_mngr_alloc(): %s.\n", nl_geterror(err));
+        goto err_out;
+    }
+
+    /* the default 32k buffer overflows on any burst of link events. */
+    err = nl_socket_set_buffer_size(cache_sk, EVENT_RCVBUF_SZ, 0);
+    if (err < 0) log_warn("nl_socket_set_buffer_size(): %s.\n", nl_geterror(err));
+
+    err = nl_cache_mngr_add(cache_mngr, "route/link", &link_cache_change, NULL, &link_cache);
+    if (err < 0) {
+        log_fatal("nl_cache_mngr_add(): %s.\n", nl_geterror(err));
+        goto err_out;
+    }
+
+    link_index_rebuild();
+    pthread_mutex_unlock(&cache_lock);
+    return SIT_OK;
+
+err_out:
+    pthread_mutex_unlock(&cache_lock);
+    sit_close();
+    return SIT_FATAL;
+}
+
+int sit_close() {
+    pthread_mutex_lock(&cache_lock);
+
+    /* the manager owns link_cache, but not cache_sk. */
+    if (cache_mngr != NULL) nl_cache_mngr_free(cache_mngr);
+    if (cache_sk != NULL) nl_socket_free(cache_sk);
+    cache_mngr = NULL;
+    cache_sk = NULL;
+    link_cache = NULL;
+
+    free(link_index);
+    link_index = NULL;
+    link_index_cap = link_index_used = 0;
+
+    pthread_mutex_unlock(&cache_lock);
+    return SIT_OK;
+}
+
+typedef struct route_batch {
+    struct nl_sock *sk;
+    int cmd;
+    uint32_t seq_base;
+    uint32_t count;
+    const sit_route_t *pending[ROUTE_BATCH_WINDOW];
+    uint64_t queued[ROUTE_BATCH_WINDOW];
+    size_t outstanding;
+    char sndbuf[ROUTE_BATCH_SNDBUF_SZ];
+    size_t sndbuf_len;
+    sit_route_cb_t cb;
+    void *data;
+    int err;
+} route_batch_t;
+
+/* sequence numbers for batched and raw requests are reserved here rather
+ * than taken from nl_complete_msg(), so libnl's own seq bookkeeping on the
+ * socket is left untouched and the socket can keep being used for
+ * synchronous calls. */
+static uint32_t route_batch_seq = 0x80000000u;
+
+static uint32_t seq_reserve(uint32_t n) {
+    return __atomic_fetch_add(&route_batch_seq, n, __ATOMIC_RELAXED);
+}
+
+static int route_build(const sit_route_t *route, int ifindex, struct rtnl_route **rtnl_route) {
+    struct rtnl_nexthop *nexthop = NULL;
+    struct nl_addr *address = NULL;
+    int err;
+
+    *rtnl_route = rtnl_route_alloc();
+    if (*rtnl_route == NULL) {
+        log_fatal("rtnl_route_alloc(): can't alloc.\n");
+        return SIT_FATAL;
+    }
+
+    rtnl_route_set_family(*rtnl_route, AF_INET6);
+
+    address = nl_addr_build(AF_INET6, &route->prefix.addr, sizeof(struct in6_addr));
+    if (address == NULL) {
+        log_fatal("nl_addr_build(): can't alloc.\n");
+        err = SIT_FATAL;
+        goto err_out;
+    }
+
+    nl_addr_set_prefixlen(address, route->prefix.len);
+    rtnl_route_set_dst(*rtnl_route, address);
+    nl_addr_put(address);
+    address = NULL;
+
+    nexthop = rtnl_route_nh_alloc();
+    if (nexthop == NULL) {
+        log_fatal("rtnl_route_nh_alloc(): can't alloc.\n");
+        err = SIT_FATAL;
+        goto err_out;
+    }
+
+    rtnl_route_nh_set_ifindex(nexthop, ifindex);
+
+    address = nl_addr_build(AF_INET6, &route->nexthop, sizeof(struct in6_addr));
+    if (address == NULL) {
+        log_fatal("nl_addr_build(): can't alloc.\n");
+        err = SIT_FATAL;
+        goto err_out;
+    }
+
+    rtnl_route_nh_set_gateway(nexthop, address);
+    nl_addr_put(address);
+    rtnl_route_add_nexthop(*rtnl_route, nexthop);
+
+    return SIT_OK;
+
+err_out:
+    if (nexthop != NULL) rtnl_route_nh_free(nexthop);
+    rtnl_route_put(*rtnl_route);
+    *rtnl_route = NULL;
+    return err;
+}
+
+static int route_batch_flush(route_batch_t *batch) {
+    if (batch->sndbuf_len == 0) return SIT_OK;
+
+    int err = nl_sendto(batch->sk, batch->sndbuf, batch->sndbuf_len);
+    batch->sndbuf_len = 0;
+
+    if (err < 0) {
+        log_fatal("nl_sendto(): %s.\n", nl_geterror(err));
+        return SIT_FATAL;
+    }
+
+    return SIT_OK;
+}
+
+static void route_batch_ack(route_batch_t *batch, const struct nlmsghdr *nlh) {
+    const struct nlmsgerr *e = (const struct nlmsgerr *) NLMSG_DATA(nlh);
+    uint32_t offset = nlh->nlmsg_seq - batch->seq_base;
+    const sit_route_t *route;
+    int err = SIT_OK;
+
+    if (nlh->nlmsg_type != NLMSG_ERROR || offset >= batch->count) return;
+
+    /* the kernel answers in order and in-flight seqs are contiguous, so they
+     * never span more than ROUTE_BATCH_WINDOW slots. */
+    route = batch->pending[offset % ROUTE_BATCH_WINDOW];
+    if (route == NULL) return;
+
+    if (e->error != 0) {
+        char prefix[SIT_PREFIX6_STRLEN], nexthop[INET6_ADDRSTRLEN];
+        log_kv(LOG_ERROR, batch->cmd == RTM_NEWROUTE ? "route add failed." : "route del failed.",
+            LOG_STR("prefix", sit_prefix6_str(&route->prefix, prefix)),
+            LOG_STR("nexthop", inet_ntop(AF_INET6, &route->nexthop, nexthop, sizeof(nexthop))), LOG_STR("error", strerror(-e->error)));
+        err = SIT_ERROR;
+        batch->err = SIT_ERROR;
+    }
+
+    latency_record(batch->cmd == RTM_NEWROUTE ? LATENCY_NL_ROUTE_ADD : LATENCY_NL_ROUTE_DEL, batch->queued[offset % ROUTE_BATCH_WINDOW]);
+    batch->pending[offset % ROUTE_BATCH_WINDOW] = NULL;
+    --batch->outstanding;
+    if (batch->cb != NULL) batch->cb(route, err, batch->data);
+}
+
+/* read ACKs until at most `until` requests are outstanding. */
+static int route_batch_collect(route_batch_t *batch, size_t until) {
+    static __thread char bufs[ROUTE_BATCH_RECV_VLEN][ROUTE_BATCH_RECV_SZ];
+    struct mmsghdr msgs[ROUTE_BATCH_RECV_VLEN];
+    struct iovec iovs[ROUTE_BATCH_RECV_VLEN];
+    int fd = nl_socket_get_fd(batch->sk);
+
+    while (batch->outstanding > until) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < ROUTE_BATCH_RECV_VLEN; i++) {
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = ROUTE_BATCH_RECV_SZ;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int n = recvmmsg(fd, msgs, ROUTE_BATCH_RECV_VLEN, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_fatal("recvmmsg(): %s.\n", strerror(errno));
+            return SIT_FATAL;
+        }
+
+        /* error ACKs echo the request back and may come in truncated; only
+         * the headers are needed. */
+        for (int i = 0; i < n; i++) {
+            if (msgs[i].msg_len < NLMSG_HDRLEN + sizeof(struct nlmsgerr)) continue;
+            route_batch_ack(batch, (const struct nlmsghdr *) bufs[i]);
+        }
+    }
+
+    return SIT_OK;
+}
+
+/* writes the request for one route into the send buffer, flushing it first
+ * if it's full. the raw backend encodes in place; libnl builds a message
+ * object per route that is copied in. */
+static int route_batch_append(route_batch_t *batch, int ifindex, const sit_route_t *route, uint32_t seq) {
+    struct rtnl_route *rtnl_route = NULL;
+    struct nl_msg *msg = NULL;
+    struct nlmsghdr *nlh;
+    size_t len;
+    int err;
+
+    if (backend == SIT_BACKEND_RAW) {
+        nlcodec_buf_t buf = { batch->sndbuf, batch->sndbuf_len, ROUTE_BATCH_SNDBUF_SZ };
+
+        if (nlcodec_route(&buf, batch->cmd, seq, ifindex, route) != 0) {
+            err = route_batch_flush(batch);
+            if (err != SIT_OK) return err;
+
+            buf.len = 0;
+            if (nlcodec_route(&buf, batch->cmd, seq, ifindex, route) != 0) return SIT_FATAL;
+        }
+
+        batch->sndbuf_len = buf.len;
+        return SIT_OK;
+    }
+
+    err = route_build(route, ifindex, &rtnl_route);
+    if (err != SIT_OK) return err;
+
+    if (batch->cmd == RTM_NEWROUTE) err = rtnl_route_build_add_request(rtnl_route, NLM_F_CREATE | NLM_F_REPLACE, &msg);
+    else err = rtnl_route_build_del_request(rtnl_route, 0, &msg);
+    rtnl_route_put(rtnl_route);
+
+    if (err < 0) {
+        log_fatal("rtnl_route_build_request(): %s.\n", nl_geterror(err));
+        return SIT_FATAL;
+    }
+
+    nlh = nlmsg_hdr(msg);
+    nlh->nlmsg_seq = seq;
+    nlh->nlmsg_pid = nl_socket_get_local_port(batch->sk);
+    nlh->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+    len = NLMSG_ALIGN(nlh->nlmsg_len);
+
+    if (batch->sndbuf_len + len > ROUTE_BATCH_SNDBUF_SZ) {
+        err = route_batch_flush(batch);
+        if (err != SIT_OK) {
+            nlmsg_free(msg);
+            return err;
+        }
+    }
+
+    memcpy(batch->sndbuf + batch->sndbuf_len, nlh, len);
+    batch->sndbuf_len += len;
+    nlmsg_free(msg);
+
+    return SIT_OK;
+}
+
+static void route_batch_abort(route_batch_t *batch) {
+    for (size_t i = 0; i < ROUTE_BATCH_WINDOW; i++) {
+        if (batch->pending[i] == NULL) continue;
+        if (batch->cb != NULL) batch->cb(batch->pending[i], SIT_FATAL, batch->data);
+        batch->pending[i] = NULL;
+    }
+    batch->outstanding = 0;
+}
+
+/* pack RTM_NEWROUTE/RTM_DELROUTE requests for a route list into as few sends
+ * as possible, keeping at most ROUTE_BATCH_WINDOW requests in flight so their
+ * ACKs always fit in the socket receive buffer. */
+static int route_batch_run(struct nl_sock *sk, int ifindex, int cmd, const sit_route_t *route, sit_route_cb_t cb, void *data) {
+    route_batch_t *batch;
+    uint32_t seq;
+    int err;
+
+    batch = (route_batch_t *) calloc(1, sizeof(route_batch_t));
+    if (batch == NULL) {
+        log_fatal("calloc() failed.\n");
+        return SIT_FATAL;
+    }
+
+    for (const sit_route_t *r = route; r != NULL; r = r->next) ++batch->count;
+
+    batch->sk = sk;
+    batch->cmd = cmd;
+    batch->cb = cb;
+    batch->data = data;
+    batch->err = SIT_OK;
+    batch->seq_base = seq = seq_reserve(batch->count);
+
+    err = nl_socket_set_buffer_size(sk, ROUTE_BATCH_SOCKBUF_SZ, ROUTE_BATCH_SOCKBUF_SZ);
+    if (err < 0) log_warn("nl_socket_set_buffer_size(): %s.\n", nl_geterror(err));
+
+    for (; route != NULL; route = route->next) {
+        err = route_batch_append(batch, ifindex, route, seq);
+        if (err == SIT_FATAL) goto abort;
+        if (err != SIT_OK) {
+            batch->err = SIT_ERROR;
+            if (cb != NULL) cb(route, err, data);
+            continue;
+        }
+
+        /* only requests actually sent take a seq, so in-flight seqs stay
+         * gapless. a route's latency runs from here to its ACK. */
+        batch->queued[(seq - batch->seq_base) % ROUTE_BATCH_WINDOW] = latency_now();
+        batch->pending[(seq++ - batch->seq_base) % ROUTE_BATCH_WINDOW] = route;
+        ++batch->outstanding;
+
+        if (batch->outstanding == ROUTE_BATCH_WINDOW) {
+            err = route_batch_flush(batch);
+            if (err == SIT_OK) err = route_batch_collect(batch, ROUTE_BATCH_WINDOW / 2);
+            if (err != SIT_OK) goto abort;
+        }
+    }
+
+    err = route_batch_flush(batch);
+    if (err == SIT_OK) err = route_batch_collect(batch, 0);
+    if (err != SIT_OK) goto abort;
+
+    err = batch->err;
+    free(batch);
+    return err;
+
+abort:
+    route_batch_abort(batch);
+    free(batch);
+    return err;
+}
+
+int sit_add_routes(struct nl_sock *sk, int ifindex, const sit_route_t *route, sit_route_cb_t cb, void *data) {
+    return route_batch_run(sk, ifindex, RTM_NEWROUTE, route, cb, data);
+}
+
+int sit_del_routes(struct nl_sock *sk, int ifindex, const sit_route_t *route, sit_route_cb_t cb, void *data) {
+    return route_batch_run(sk, ifindex, RTM_DELROUTE, route, cb, data);
+}
+
+static void log_route_result(const sit_route_t *route, int err, void *data) {
+    char prefix[SIT_PREFIX6_STRLEN], nexthop[INET6_ADDRSTRLEN];
+
+    (void) data;
+    if (err != SIT_OK) log_kv(LOG_ERROR, "route not installed.", LOG_STR("prefix", sit_prefix6_str(&route->prefix, prefix)),
+        LOG_STR("nexthop", inet_ntop(AF_INET6, &route->nexthop, nexthop, sizeof(nexthop))));
+}
+
+typedef int (*raw_cb_t)(const struct nlmsghdr *nlh, void *arg);
+
+/* sends one request and reads its replies in place until its ACK, or the
+ * end of a dump; cb sees every other message with its seq. 0 or a negative
+ * errno. */
+static int raw_request(struct nl_sock *sk, const nlcodec_buf_t *buf, uint32_t seq, raw_cb_t cb, void *arg) {
+    static __thread char rcvbuf[RAW_RECV_SZ] __attribute__((aligned(NLMSG_ALIGNTO)));
+    int fd = nl_socket_get_fd(sk), err;
+    struct nlmsghdr *nlh;
+    ssize_t n;
+
+    err = nl_sendto(sk, buf->data, buf->len);
+    if (err < 0) return -EIO;
+
+    for (;;) {
+        n = recv(fd, rcvbuf, sizeof(rcvbuf), MSG_TRUNC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        if (n > (ssize_t) sizeof(rcvbuf)) return -EMSGSIZE;
+
+        int len = (int) n;
+        for (nlh = (struct nlmsghdr *) rcvbuf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_seq != seq) continue;
+            if (nlh->nlmsg_type == NLMSG_DONE) return 0;
+            if (nlcodec_ack(nlh, &err)) return err;
+            if (cb != NULL) cb(nlh, arg);
+        }
+    }
+}
+
+typedef struct raw_link {
+    int ifindex;
+    bool sit;
+} raw_link_t;
+
+static int raw_link_collect(const struct nlmsghdr *nlh, void *arg) {
+    raw_link_t *link = (raw_link_t *) arg;
+    return nlcodec_parse_link(nlh, &link->ifindex, &link->sit);
+}
+
+/* sit_configure() without libnl objects: every request is encoded into one
+ * stack buffer, and the new link's ifindex comes from a RTM_GETLINK rather
+ * than the cache. */
+static int configure_raw(struct nl_sock *sk, const sit_tunnel_t *tunnel, const sit_route_t *route) {
+    char data[NLCODEC_BUF_SZ] __attribute__((aligned(NLMSG_ALIGNTO)));
+    nlcodec_buf_t buf = { data, 0, sizeof(data) };
+    raw_link_t link = { 0, false };
+    uint32_t seq = seq_reserve(3);
+    uint64_t start;
+    int err;
+
+    if (nlcodec_link_add(&buf, seq, tunnel) != 0) {
+        log_fatal("nlcodec_link_add(): request too long.\n");
+        return SIT_FATAL;
+    }
+
+    start = latency_now();
+    err = raw_request(sk, &buf, seq, NULL, NULL);
+    latency_record(LATENCY_NL_LINK_ADD, start);
+    if (err < 0) {
+        log_fatal("link add: %s.\n", strerror(-err));
+        return SIT_FATAL;
+    }
+
+    buf.len = 0;
+    if (nlcodec_link_get(&buf, ++seq, tunnel->name) != 0) {
+        log_fatal("nlcodec_link_get(): request too long.\n");
+        return SIT_FATAL;
+    }
+    err = raw_request(sk, &buf, seq, &raw_link_collect, &link);
+    if (err < 0 || link.ifindex == 0 || !link.sit) {
+        log_fatal("can't get interface %s.\n", tunnel->name);
+        return SIT_FATAL;
+    }
+
+    buf.len = 0;
+    if (nlcodec_addr(&buf, RTM_NEWADDR, ++seq, link.ifindex, &tunnel->address) != 0) {
+        log_fatal("nlcodec_addr(): request too long.\n");
+        return SIT_FATAL;
+    }
+
+    start = latency_now();
+    err = raw_request(sk, &buf, seq, NULL, NULL);
+    latency_record(LATENCY_NL_ADDR_ADD, start);
+    if (err < 0) {
+        log_fatal("address add: %s.\n", strerror(-err));
+        return SIT_FATAL;
+    }
+
+    if (route == NULL) return SIT_OK;
+    return sit_add_routes(sk, link.ifindex, route, &log_route_result, NULL);
+}
+
 int sit_configure(struct nl_sock *sk, const sit_tunnel_t *tunnel, const sit_route_t *route) {
-    struct nl_cache *cache = NULL;
-    struct rtnl_link *sit_link;
-    in_addr_t laddr, raddr;
+    struct rtnl_link *sit_link = NULL;
     struct nl_addr* local_addr = NULL;
     struct rtnl_addr* rtnl_addr = NULL;
-    const sit_route_t *route_ptr = route;
+    uint64_t start;
     int err, ifindex;
 
-    /* create sit tunnel */
+    if (backend == SIT_BACKEND_RAW) return configure_raw(sk, tunnel, route);
+
+    /* create sit tunnel */
+
+    sit_link = rtnl_link_sit_alloc();
+    if (sit_link == NULL) {
+        err = SIT_FATAL;
+        log_fatal("rtnl_link_sit_alloc(): can't allocate.\n");
+        goto end;
+    }
+
+    rtnl_link_set_name(sit_link, tunnel->name);
+    rtnl_link_sit_set_local(sit_link, tunnel->local.s_addr);
+    rtnl_link_sit_set_remote(sit_link, tunnel->remote.s_addr);
+    rtnl_link_sit_set_ttl(sit_link, 255);
+    rtnl_link_set_flags(sit_link, IFF_UP);
+
+    if (tunnel->mtu != 0) {
+        rtnl_link_set_mtu(sit_link, tunnel->mtu);
+    }
+
+    start = latency_now();
+    err = rtnl_link_add(sk, sit_link, NLM_F_CREATE);
+    latency_record(LATENCY_NL_LINK_ADD, start);
+    if (err < 0) {
+        err = SIT_FATAL;
+        log_fatal("rtnl_link_add(): %s.\n", nl_geterror(err));
+        goto end;
+    }
+
+    rtnl_link_put(sit_link);
+    sit_link = NULL;
+
+    /* configure tunnel address */
+
+    local_addr = nl_addr_build(AF_INET6, &tunnel->address.addr, sizeof(struct in6_addr));
+    if (local_addr == NULL) {
+        err = SIT_FATAL;
+        log_fatal("nl_addr_build(): can't alloc.\n");
+        goto end;
+    }
+    nl_addr_set_prefixlen(local_addr, tunnel->address.len);
+
+    err = sit_get(sk, tunnel->name, &sit_link);
+    if (err < 0 || sit_link == NULL) {
+        err = SIT_FATAL;
+        log_fatal("sit_get(): can't get interface.\n");
+        goto end;
+    }
+
+    ifindex = rtnl_link_get_ifindex(sit_link);
+    if (ifindex == 0) {
+        log_fatal("rtnl_link_get_ifindex(): can't get interface index.\n");
+        err = SIT_FATAL;
+        goto end;
+    }
+
+    rtnl_addr = rtnl_addr_alloc();
+    rtnl_addr_set_ifindex(rtnl_addr, ifindex);
+    rtnl_addr_set_local(rtnl_addr, local_addr);
+
+    start = latency_now();
+    err = rtnl_addr_add(sk, rtnl_addr, NLM_F_REPLACE);
+    latency_record(LATENCY_NL_ADDR_ADD, start);
+    if (err < 0) {
+        err = SIT_FATAL;
+        log_fatal("rtnl_addr_add(): %s.\n", nl_geterror(err));
+        goto end;
+    }
+
+    /* configure routing */
+
+    if (route != NULL) {
+        err = sit_add_routes(sk, ifindex, route, &log_route_result, NULL);
+        if (err != SIT_OK) goto end;
+    }
+
+end:
+    if (local_addr != NULL) nl_addr_put(local_addr);
+    if (rtnl_addr != NULL) rtnl_addr_put(rtnl_addr);
+    if (sit_link != NULL) rtnl_link_put(sit_link);
+
+    return err;
+}
+
+int sit_destroy(struct nl_sock *sk, const char *name) {
+    int err;
+    struct rtnl_link *sit_link = NULL;
+    uint64_t start;
+
+    err = sit_get(sk, name, &sit_link);
+    if (err != SIT_OK) goto end;
+
+    start = latency_now();
+    err = rtnl_link_delete(sk, sit_link);
+    latency_record(LATENCY_NL_LINK_DEL, start);
+    if (err < 0) {
+        err = SIT_FATAL;
+        log_fatal("rtnl_link_delete(): %s.\n", nl_geterror(err));
+        goto end;
+    }
+
+end:
+    rtnl_link_put(sit_link);
+    return err;
+}
+
+int sit_get(struct nl_sock *sk, const char *name, struct rtnl_link **link) {
+    struct rtnl_link *sit_link = NULL;
+    int err;
+
+    *link = NULL;
 
-    err = inet_pton(AF_INET, tunnel->local, &laddr);
-    if (err != 1) {
-        err = SIT_ERROR;
-        log_error("inet_pton(): bad local address.\n");
-        goto end;
+    pthread_mutex_lock(&cache_lock);
+
+    if (cache_mngr == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        log_fatal("link cache not yet opened.\n");
+        return SIT_FATAL;
     }
 
-    err = inet_pton(AF_INET, tunnel->remote, &raddr);
-    if (err != 1) {
-        err = SIT_ERROR;
-        log_error("inet_pton(): bad remote address.\n");
+    err = link_cache_sync(sk);
+    if (err == SIT_OK) {
+        struct rtnl_link *cached = link_cache_lookup(name);
+        if (cached != NULL) {
+            sit_link = (struct rtnl_link *) nl_object_clone((struct nl_object *) cached);
+            rtnl_link_put(cached);
+        }
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+
+    if (err != SIT_OK) return err;
+
+    if (sit_link == NULL) {
+        log_error("link_cache_lookup(): can't find interface %s.\n", name);
+        return SIT_NOT_EXIST;
+    }
+
+    if (!rtnl_link_is_sit(sit_link)) {
+        log_fatal("rtnl_link_is_sit(): link is not sit.\n");
+        rtnl_link_put(sit_link);
+        return SIT_ERROR;
+    }
+
+    *link = sit_link;
+    return SIT_OK;
+}
+
+int sit_diff(const sit_tunnel_t *tunnel, struct rtnl_link *link) {
+    int diff = 0;
+
+    if (rtnl_link_sit_get_local(link) != tunnel->local.s_addr) diff |= SIT_DIFF_LOCAL;
+    if (rtnl_link_sit_get_remote(link) != tunnel->remote.s_addr) diff |= SIT_DIFF_REMOTE;
+
+    if (tunnel->mtu != 0 && rtnl_link_get_mtu(link) != tunnel->mtu) diff |= SIT_DIFF_MTU;
+    if (rtnl_link_sit_get_ttl(link) != 255) diff |= SIT_DIFF_TTL;
+    if (!(rtnl_link_get_flags(link) & IFF_UP)) diff |= SIT_DIFF_UP;
+
+    return diff;
+}
+
+typedef struct dump {
+    int type;
+    int ifindex;
+    struct nl_object **objs;
+    size_t count;
+    size_t cap;
+    int err;
+} dump_t;
+
+typedef struct route_key {
+    struct in6_addr dst;
+    uint8_t dst_len;
+    struct in6_addr gw;
+    const sit_route_t *route;
+} route_key_t;
+
+static int route_nh_ifindex(struct rtnl_route *route) {
+    if (rtnl_route_get_nnexthops(route) != 1) return 0;
+    return rtnl_route_nh_get_ifindex(rtnl_route_nexthop_n(route, 0));
+}
+
+static void dump_collect(struct nl_object *obj, void *arg) {
+    dump_t *dump = (dump_t *) arg;
+
+    /* older kernels ignore the dump filter, so check again here. */
+    if (dump->type == RTM_GETADDR) {
+        struct rtnl_addr *addr = (struct rtnl_addr *) obj;
+        if (rtnl_addr_get_ifindex(addr) != dump->ifindex || rtnl_addr_get_family(addr) != AF_INET6) return;
+    } else {
+        struct rtnl_route *route = (struct rtnl_route *) obj;
+        if (route_nh_ifindex(route) != dump->ifindex || rtnl_route_get_family(route) != AF_INET6) return;
+    }
+
+    if (dump->count == dump->cap) {
+        size_t cap = dump->cap == 0 ? DUMP_INIT_SZ : dump->cap * 2;
+        struct nl_object **objs = (struct nl_object **) realloc(dump->objs, cap * sizeof(struct nl_object *));
+        if (objs == NULL) {
+            log_fatal("realloc() failed.\n");
+            dump->err = SIT_FATAL;
+            return;
+        }
+        dump->objs = objs;
+        dump->cap = cap;
+    }
+
+    nl_object_get(obj);
+    dump->objs[dump->count++] = obj;
+}
+
+static int dump_valid(struct nl_msg *msg, void *arg) {
+    int err = nl_msg_parse(msg, &dump_collect, arg);
+    if (err < 0 && err != -NLE_OPNOTSUPP) log_warn("nl_msg_parse(): %s.\n", nl_geterror(err));
+    return NL_OK;
+}
+
+static void dump_free(dump_t *dump) {
+    for (size_t i = 0; i < dump->count; i++) nl_object_put(dump->objs[i]);
+    free(dump->objs);
+    dump->objs = NULL;
+    dump->count = dump->cap = 0;
+}
+
+/* dump the IPv6 addresses (RTM_GETADDR) or routes (RTM_GETROUTE) of one
+ * interface. with strict checking the kernel filters on ifindex itself, so
+ * the dump only carries this tunnel's objects. */
+static int dump_ifindex(struct nl_sock *sk, int type, int ifindex, dump_t *dump) {
+    struct nl_msg *msg = NULL;
+    struct nl_cb *cb = NULL;
+    int fd = nl_socket_get_fd(sk), on = 1, off = 0, strict, err;
+    uint64_t start;
+
+    memset(dump, 0, sizeof(dump_t));
+    dump->type = type;
+    dump->ifindex = ifindex;
+
+    strict = setsockopt(fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &on, sizeof(on)) == 0;
+
+    msg = nlmsg_alloc_simple(type, NLM_F_DUMP);
+    if (msg == NULL) {
+        log_fatal("nlmsg_alloc_simple(): can't alloc.\n");
+        err = SIT_FATAL;
         goto end;
     }
 
-    err = rtnl_link_alloc_cache(sk, AF_UNSPEC, &cache);
+    if (type == RTM_GETADDR) {
+        struct ifaddrmsg ifa = { .ifa_family = AF_INET6, .ifa_index = ifindex };
+        err = nlmsg_append(msg, &ifa, sizeof(ifa), NLMSG_ALIGNTO);
+    } else {
+        struct rtmsg rtm = { .rtm_family = AF_INET6 };
+        err = nlmsg_append(msg, &rtm, sizeof(rtm), NLMSG_ALIGNTO);
+        if (err == 0) err = nla_put_u32(msg, RTA_OIF, ifindex);
+    }
+
     if (err < 0) {
+        log_fatal("nlmsg_append(): %s.\n", nl_geterror(err));
         err = SIT_FATAL;
-        log_fatal("rtnl_link_alloc_cache(): %s.\n", nl_geterror(err));
         goto end;
     }
 
-    sit_link = rtnl_link_sit_alloc();
-    if (sit_link == NULL) {
+    cb = nl_cb_clone(nl_socket_get_cb(sk));
+    if (cb == NULL) {
+        log_fatal("nl_cb_clone(): can't alloc.\n");
         err = SIT_FATAL;
-        log_fatal("rtnl_link_sit_alloc(): can't allocate.\n");
         goto end;
     }
 
-    rtnl_link_set_name(sit_link, tunnel->name);
-    rtnl_link_sit_set_local(sit_link, laddr);
-    rtnl_link_sit_set_remote(sit_link, raddr);
-    rtnl_link_sit_set_ttl(sit_link, 255);
-    rtnl_link_set_flags(sit_link, IFF_UP);
-
-    if (tunnel->mtu != 0) {
-        rtnl_link_set_mtu(sit_link, tunnel->mtu);
-    }
+    nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, &dump_valid, dump);
 
-    err = rtnl_link_add(sk, sit_link, NLM_F_CREATE);
+    start = latency_now();
+    err = nl_send_auto(sk, msg);
+    if (err >= 0) err = nl_recvmsgs(sk, cb);
+    latency_record(LATENCY_NL_DUMP, start);
     if (err < 0) {
+        log_fatal("dump: %s.\n", nl_geterror(err));
         err = SIT_FATAL;
-        log_fatal("rtnl_link_add(): %s.\n", nl_geterror(err));
         goto end;
     }
 
-    rtnl_link_put(sit_link);
+    err = dump->err;
 
-    /* configure tunnel address */
+end:
+    if (strict) setsockopt(fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &off, sizeof(off));
+    if (cb != NULL) nl_cb_put(cb);
+    if (msg != NULL) nlmsg_free(msg);
+    if (err != SIT_OK) dump_free(dump);
+    return err;
+}
 
-    err = nl_addr_parse(tunnel->address, AF_INET6, &local_addr);
-    if (err < 0) {
-        err = SIT_ERROR;
-        log_fatal("nl_addr_parse(): %s.\n", nl_geterror(err));
+typedef struct stats_dump {
+    sit_stats_cb_t cb;
+    void *data;
+} stats_dump_t;
+
+/* reads the name and counters straight off the message; building a
+ * rtnl_link per interface would dominate the cost of a large dump. */
+static int stats_valid(struct nl_msg *msg, void *arg) {
+    stats_dump_t *dump = (stats_dump_t *) arg;
+    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+    struct ifinfomsg *ifi = (struct ifinfomsg *) nlmsg_data(nlh);
+    struct nlattr *name, *stats;
+    struct rtnl_link_stats64 counters;
+
+    if (nlh->nlmsg_type != RTM_NEWLINK || ifi->ifi_type != ARPHRD_SIT) return NL_OK;
+
+    name = nlmsg_find_attr(nlh, sizeof(struct ifinfomsg), IFLA_IFNAME);
+    stats = nlmsg_find_attr(nlh, sizeof(struct ifinfomsg), IFLA_STATS64);
+    if (name == NULL || stats == NULL || nla_len(stats) < (int) sizeof(counters)) return NL_OK;
+
+    /* attribute payloads are only 4-byte aligned. */
+    memcpy(&counters, nla_data(stats), sizeof(counters));
+    dump->cb(nla_get_string(name), &counters, dump->data);
+
+    return NL_OK;
+}
+
+int sit_dump_stats(struct nl_sock *sk, sit_stats_cb_t cb, void *data) {
+    stats_dump_t dump = { .cb = cb, .data = data };
+    struct ifinfomsg ifi = { .ifi_family = AF_UNSPEC };
+    struct nl_msg *msg = NULL;
+    struct nlattr *info;
+    struct nl_cb *nl_cb = NULL;
+    int fd = nl_socket_get_fd(sk), on = 1, off = 0, strict, err;
+    uint64_t start;
+
+    strict = setsockopt(fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &on, sizeof(on)) == 0;
+
+    msg = nlmsg_alloc_simple(RTM_GETLINK, NLM_F_DUMP);
+    if (msg == NULL) {
+        log_fatal("nlmsg_alloc_simple(): can't alloc.\n");
+        err = SIT_FATAL;
         goto end;
     }
 
-    sit_link = NULL;
-    err = sit_get(sk, tunnel->name, &sit_link);
-    if (err < 0 || sit_link == NULL) {
+    /* with strict checking the kernel only dumps sit links; otherwise
+     * stats_valid() drops the rest by type. */
+    err = nlmsg_append(msg, &ifi, sizeof(ifi), NLMSG_ALIGNTO);
+    if (err == 0 && strict) {
+        info = nla_nest_start(msg, IFLA_LINKINFO);
+        err = info == NULL ? -NLE_NOMEM : nla_put_string(msg, IFLA_INFO_KIND, "sit");
+        if (err == 0) nla_nest_end(msg, info);
+    }
+
+    if (err < 0) {
+        log_fatal("nlmsg_append(): %s.\n", nl_geterror(err));
         err = SIT_FATAL;
-        log_fatal("sit_get(): can't get interface.\n");
         goto end;
     }
 
-    ifindex = rtnl_link_get_ifindex(sit_link);
-    if (ifindex == 0) {
-        log_fatal("rtnl_link_get_ifindex(): can't get interface index.\n");
+    nl_cb = nl_cb_clone(nl_socket_get_cb(sk));
+    if (nl_cb == NULL) {
+        log_fatal("nl_cb_clone(): can't alloc.\n");
         err = SIT_FATAL;
         goto end;
     }
 
-    rtnl_addr = rtnl_addr_alloc();
-    rtnl_addr_set_ifindex(rtnl_addr, ifindex);
-    rtnl_addr_set_local(rtnl_addr, local_addr);
-    
-    err = rtnl_addr_add(sk, rtnl_addr, NLM_F_REPLACE);
+    nl_cb_set(nl_cb, NL_CB_VALID, NL_CB_CUSTOM, &stats_valid, &dump);
+
+    start = latency_now();
+    err = nl_send_auto(sk, msg);
+    if (err >= 0) err = nl_recvmsgs(sk, nl_cb);
+    latency_record(LATENCY_NL_DUMP, start);
     if (err < 0) {
-        err = SIT_FATAL;
-        log_fatal("rtnl_addr_add(): %s.\n", nl_geterror(err));
+        log_error("stats dump: %s.\n", nl_geterror(err));
+        err = SIT_ERROR;
         goto end;
     }
 
-    /* configure routing */
+    err = SIT_OK;
 
-    while (route_ptr != NULL) {
-        struct rtnl_route *rtnl_route = rtnl_route_alloc();
-        struct rtnl_nexthop *nexthop = rtnl_route_nh_alloc();
-        struct nl_addr* address = NULL;
+end:
+    if (strict) setsockopt(fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &off, sizeof(off));
+    if (nl_cb != NULL) nl_cb_put(nl_cb);
+    if (msg != NULL) nlmsg_free(msg);
+    return err;
+}
 
-        if (rtnl_route == NULL) {
-            err = SIT_FATAL;
-            log_fatal("rtnl_route_alloc(): can't alloc.\n");
-            goto route_end;
-        }
+static int route_key_cmp(const void *a, const void *b) {
+    const route_key_t *ka = (const route_key_t *) a, *kb = (const route_key_t *) b;
+    int r = memcmp(&ka->dst, &kb->dst, sizeof(struct in6_addr));
+    return r != 0 ? r : (int) ka->dst_len - (int) kb->dst_len;
+}
 
-        rtnl_route_set_family(rtnl_route, AF_INET6);
-        err = nl_addr_parse(route_ptr->prefix, AF_INET6, &address);
-        if (err < 0) {
-            err = SIT_ERROR;
-            log_error("nl_addr_parse(): %s.\n", nl_geterror(err));
-            goto route_end;
+static int apply_link(struct nl_sock *sk, const sit_tunnel_t *tunnel, struct rtnl_link *link, int diff) {
+    struct rtnl_link *change;
+    uint64_t start;
+    int err;
+
+    if (diff & (SIT_DIFF_LOCAL | SIT_DIFF_REMOTE | SIT_DIFF_TTL)) {
+        /* the kernel rebuilds all tunnel parameters from whatever a change
+         * carries, so local, remote and ttl always go together. */
+        change = rtnl_link_sit_alloc();
+        if (change != NULL) {
+            rtnl_link_sit_set_local(change, tunnel->local.s_addr);
+            rtnl_link_sit_set_remote(change, tunnel->remote.s_addr);
+            rtnl_link_sit_set_ttl(change, 255);
         }
+    } else change = rtnl_link_alloc();
+
+    if (change == NULL) {
+        log_fatal("rtnl_link_alloc(): can't allocate.\n");
+        return SIT_FATAL;
+    }
+
+    if (diff & SIT_DIFF_MTU) rtnl_link_set_mtu(change, tunnel->mtu);
+    if (diff & SIT_DIFF_UP) rtnl_link_set_flags(change, IFF_UP);
+
+    start = latency_now();
+    err = rtnl_link_change(sk, link, change, 0);
+    latency_record(LATENCY_NL_LINK_CHANGE, start);
+    rtnl_link_put(change);
+
+    if (err < 0) {
+        log_error("rtnl_link_change(): %s.\n", nl_geterror(err));
+        return SIT_ERROR;
+    }
+
+    return SIT_OK;
+}
+
+/* like dump_ifindex(), but cb reads each message where it lies. */
+static int raw_dump(struct nl_sock *sk, int type, int ifindex, raw_cb_t cb, void *arg) {
+    char data[NLCODEC_BUF_SZ] __attribute__((aligned(NLMSG_ALIGNTO)));
+    nlcodec_buf_t buf = { data, 0, sizeof(data) };
+    int fd = nl_socket_get_fd(sk), on = 1, off = 0, strict, err;
+    uint32_t seq = seq_reserve(1);
+    uint64_t start;
+
+    if (nlcodec_dump(&buf, type, seq, ifindex) != 0) {
+        log_fatal("nlcodec_dump(): request too long.\n");
+        return SIT_FATAL;
+    }
+
+    strict = setsockopt(fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &on, sizeof(on)) == 0;
+
+    start = latency_now();
+    err = raw_request(sk, &buf, seq, cb, arg);
+    latency_record(LATENCY_NL_DUMP, start);
+
+    if (strict) setsockopt(fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &off, sizeof(off));
+
+    if (err < 0) {
+        log_fatal("dump: %s.\n", strerror(-err));
+        return SIT_FATAL;
+    }
+
+    return SIT_OK;
+}
+
+static bool same_address(const sit_prefix6_t *a, const sit_prefix6_t *b) {
+    return a->len == b->len && memcmp(&a->addr, &b->addr, sizeof(struct in6_addr)) == 0;
+}
+
+typedef struct raw_addrs {
+    int ifindex;
+    const sit_prefix6_t *want, *replaced;
+    bool present, stale;
+} raw_addrs_t;
+
+static int raw_addr_collect(const struct nlmsghdr *nlh, void *arg) {
+    raw_addrs_t *addrs = (raw_addrs_t *) arg;
+    sit_prefix6_t address;
+    uint8_t scope;
+    int ifindex;
+
+    if (nlcodec_parse_addr(nlh, &ifindex, &address, &scope) != 0) return 0;
+    if (ifindex != addrs->ifindex || scope == RT_SCOPE_LINK) return 0;
+
+    if (same_address(&address, addrs->want)) addrs->present = true;
+    else if (addrs->replaced != NULL && same_address(&address, addrs->replaced)) addrs->stale = true;
+
+    return 0;
+}
+
+static int raw_addr_request(struct nl_sock *sk, int cmd, int ifindex, const sit_prefix6_t *address) {
+    char data[NLCODEC_BUF_SZ] __attribute__((aligned(NLMSG_ALIGNTO)));
+    nlcodec_buf_t buf = { data, 0, sizeof(data) };
+    uint32_t seq = seq_reserve(1);
+    uint64_t start;
+    int err;
+
+    if (nlcodec_addr(&buf, cmd, seq, ifindex, address) != 0) {
+        log_fatal("nlcodec_addr(): request too long.\n");
+        return SIT_FATAL;
+    }
+
+    start = latency_now();
+    err = raw_request(sk, &buf, seq, NULL, NULL);
+    latency_record(cmd == RTM_NEWADDR ? LATENCY_NL_ADDR_ADD : LATENCY_NL_ADDR_DEL, start);
+    if (err < 0) {
+        log_error("%s: %s.\n", cmd == RTM_NEWADDR ? "address add" : "address del", strerror(-err));
+        return SIT_ERROR;
+    }
+
+    return SIT_OK;
+}
 
-        rtnl_route_set_dst(rtnl_route, address);
-        nl_addr_put(address);
-        address = NULL;
+static int apply_address_raw(struct nl_sock *sk, const sit_tunnel_t *tunnel, const sit_prefix6_t *replaced, int ifindex, bool *changed) {
+    raw_addrs_t addrs = { .ifindex = ifindex, .want = &tunnel->address, .replaced = replaced };
+    int err;
+
+    err = raw_dump(sk, RTM_GETADDR, ifindex, &raw_addr_collect, &addrs);
+    if (err != SIT_OK) return err;
+
+    if (addrs.stale) {
+        err = raw_addr_request(sk, RTM_DELADDR, ifindex, replaced);
+        if (err != SIT_OK) return err;
+        *changed = true;
+    }
+
+    if (addrs.present) return SIT_OK;
+
+    err = raw_addr_request(sk, RTM_NEWADDR, ifindex, &tunnel->address);
+    if (err == SIT_OK) *changed = true;
+    return err;
+}
 
-        if (nexthop == NULL) {
+/* only the address sitd put there before is removed; addresses added by
+ * hand are left alone. */
+static int apply_address(struct nl_sock *sk, const sit_tunnel_t *tunnel, const sit_prefix6_t *replaced, int ifindex, bool *changed) {
+    struct nl_addr *local = NULL, *old = NULL;
+    struct rtnl_addr *rtnl_addr = NULL;
+    bool present = false;
+    uint64_t start;
+    dump_t dump = { 0 };
+    int err;
+
+    if (replaced != NULL && same_address(replaced, &tunnel->address)) replaced = NULL;
+    if (backend == SIT_BACKEND_RAW) return apply_address_raw(sk, tunnel, replaced, ifindex, changed);
+
+    local = nl_addr_build(AF_INET6, &tunnel->address.addr, sizeof(struct in6_addr));
+    if (local == NULL) {
+        log_fatal("nl_addr_build(): can't alloc.\n");
+        return SIT_FATAL;
+    }
+    nl_addr_set_prefixlen(local, tunnel->address.len);
+
+    if (replaced != NULL) {
+        old = nl_addr_build(AF_INET6, &replaced->addr, sizeof(struct in6_addr));
+        if (old == NULL) {
+            log_fatal("nl_addr_build(): can't alloc.\n");
             err = SIT_FATAL;
-            log_fatal("rtnl_route_nh_alloc(): can't alloc.\n");
-            goto route_end;
+            goto end;
         }
+        nl_addr_set_prefixlen(old, replaced->len);
+    }
 
-        rtnl_route_nh_set_ifindex(nexthop, ifindex);
+    err = dump_ifindex(sk, RTM_GETADDR, ifindex, &dump);
+    if (err != SIT_OK) goto end;
 
-        err = nl_addr_parse(route_ptr->nexthop, AF_INET6, &address);
-        if (err < 0) {
-            err = SIT_ERROR;
-            log_fatal("nl_addr_parse(): %s.\n", nl_geterror(err));
-            goto route_end;
+    for (size_t i = 0; i < dump.count; i++) {
+        struct rtnl_addr *addr = (struct rtnl_addr *) dump.objs[i];
+
+        if (rtnl_addr_get_scope(addr) == RT_SCOPE_LINK) continue;
+
+        if (nl_addr_cmp(rtnl_addr_get_local(addr), local) == 0) {
+            present = true;
+            continue;
         }
 
-        rtnl_route_nh_set_gateway(nexthop, address);
-        nl_addr_put(address);
-        address = NULL;
-        rtnl_route_add_nexthop(rtnl_route, nexthop);
+        if (old == NULL || nl_addr_cmp(rtnl_addr_get_local(addr), old) != 0) continue;
 
-        err = rtnl_route_add(sk, rtnl_route, NLM_F_CREATE | NLM_F_REPLACE);
+        start = latency_now();
+        err = rtnl_addr_delete(sk, addr, 0);
+        latency_record(LATENCY_NL_ADDR_DEL, start);
         if (err < 0) {
-            err = SIT_FATAL;
-            log_fatal("rtnl_route_add(): %s.\n", nl_geterror(err));
-            goto route_end;
+            log_error("rtnl_addr_delete(): %s.\n", nl_geterror(err));
+            err = SIT_ERROR;
+            goto end;
         }
+        *changed = true;
+    }
 
-route_end:
-        if (address != NULL) nl_addr_put(address);
-        if (rtnl_route != NULL) rtnl_route_put(rtnl_route);
-        route_ptr = route_ptr->next;
-        if (err != SIT_OK) goto end;
+    err = SIT_OK;
+    if (present) goto end;
+
+    rtnl_addr = rtnl_addr_alloc();
+    if (rtnl_addr == NULL) {
+        log_fatal("rtnl_addr_alloc(): can't allocate.\n");
+        err = SIT_FATAL;
+        goto end;
+    }
+
+    rtnl_addr_set_ifindex(rtnl_addr, ifindex);
+    rtnl_addr_set_local(rtnl_addr, local);
+
+    start = latency_now();
+    err = rtnl_addr_add(sk, rtnl_addr, NLM_F_REPLACE);
+    latency_record(LATENCY_NL_ADDR_ADD, start);
+    if (err < 0) {
+        log_error("rtnl_addr_add(): %s.\n", nl_geterror(err));
+        err = SIT_ERROR;
+        goto end;
     }
 
+    *changed = true;
+    err = SIT_OK;
+
 end:
-    if (local_addr != NULL) nl_addr_put(local_addr);
+    dump_free(&dump);
     if (rtnl_addr != NULL) rtnl_addr_put(rtnl_addr);
-    if (cache != NULL) nl_cache_free(cache);
-    if (sit_link != NULL) rtnl_link_put(sit_link);
-
+    if (old != NULL) nl_addr_put(old);
+    nl_addr_put(local);
     return err;
 }
 
-int sit_destroy(struct nl_sock *sk, const char *name) {
+/* only static unicast routes in main are ours; the connected and
+ * link-local routes the kernel adds on its own are left alone. */
+static int have_routes_libnl(struct nl_sock *sk, int ifindex, route_key_t **have, size_t *n_have) {
+    dump_t dump;
     int err;
-    struct rtnl_link *sit_link;
 
-    err = sit_get(sk, name, &sit_link);
-    if (err != SIT_OK) goto end;
+    err = dump_ifindex(sk, RTM_GETROUTE, ifindex, &dump);
+    if (err != SIT_OK) return err;
 
-    err = rtnl_link_delete(sk, sit_link);
-    if (err < 0) {
-        err = SIT_FATAL;
-        log_fatal("rtnl_link_delete(): %s.\n", nl_geterror(err));
-        goto end;
+    *have = (route_key_t *) calloc(dump.count + 1, sizeof(route_key_t));
+    if (*have == NULL) {
+        log_fatal("calloc() failed.\n");
+        dump_free(&dump);
+        return SIT_FATAL;
     }
 
-end:
-    rtnl_link_put(sit_link);
-    return err;
+    for (size_t i = 0; i < dump.count; i++) {
+        struct rtnl_route *r = (struct rtnl_route *) dump.objs[i];
+        struct nl_addr *dst = rtnl_route_get_dst(r), *gw;
+
+        if (rtnl_route_get_table(r) != RT_TABLE_MAIN || rtnl_route_get_protocol(r) != RTPROT_STATIC) continue;
+        if (rtnl_route_get_type(r) != RTN_UNICAST || dst == NULL) continue;
+
+        gw = rtnl_route_nh_get_gateway(rtnl_route_nexthop_n(r, 0));
+        if (gw == NULL || nl_addr_get_len(gw) != sizeof(struct in6_addr)) continue;
+
+        route_key_t *key = &(*have)[(*n_have)++];
+        memset(&key->dst, 0, sizeof(struct in6_addr));
+        memcpy(&key->dst, nl_addr_get_binary_addr(dst), nl_addr_get_len(dst));
+        key->dst_len = nl_addr_get_prefixlen(dst);
+        memcpy(&key->gw, nl_addr_get_binary_addr(gw), sizeof(struct in6_addr));
+    }
+
+    dump_free(&dump);
+    return SIT_OK;
 }
 
-int sit_get(struct nl_sock *sk, const char *name, struct rtnl_link **link) {
-    struct nl_cache *cache;
+typedef struct raw_routes {
+    int ifindex;
+    route_key_t *keys;
+    size_t count;
+    size_t cap;
     int err;
+} raw_routes_t;
 
-    *link = NULL;
+static int raw_route_collect(const struct nlmsghdr *nlh, void *arg) {
+    raw_routes_t *routes = (raw_routes_t *) arg;
+    sit_route_t route;
+    route_key_t *keys;
+    int ifindex;
 
-    err = rtnl_link_alloc_cache(sk, AF_UNSPEC, &cache);
-    if (err < 0) {
-        err = SIT_FATAL;
-        log_fatal("rtnl_link_alloc_cache(): %s.\n", nl_geterror(err));
-        goto end;
+    if (nlcodec_parse_route(nlh, &ifindex, &route) != 0 || ifindex != routes->ifindex) return 0;
+
+    if (routes->count == routes->cap) {
+        size_t cap = routes->cap == 0 ? DUMP_INIT_SZ : routes->cap * 2;
+        keys = (route_key_t *) realloc(routes->keys, (cap + 1) * sizeof(route_key_t));
+        if (keys == NULL) {
+            log_fatal("realloc() failed.\n");
+            routes->err = SIT_FATAL;
+            return -1;
+        }
+        routes->keys = keys;
+        routes->cap = cap;
     }
 
-    struct rtnl_link *sit_link = rtnl_link_get_by_name(cache, name);
-    if (sit_link == NULL) {
-        log_error("rtnl_link_get_by_name(): can't find interface %s.\n", name);
-        err = SIT_NOT_EXIST;
-        goto end;
+    keys = &routes->keys[routes->count++];
+    memset(keys, 0, sizeof(route_key_t));
+    keys->dst = route.prefix.addr;
+    keys->dst_len = route.prefix.len;
+    keys->gw = route.nexthop;
+
+    return 0;
+}
+
+/* the same selection as have_routes_libnl(), made by nlcodec_parse_route(). */
+static int have_routes_raw(struct nl_sock *sk, int ifindex, route_key_t **have, size_t *n_have) {
+    raw_routes_t routes = { .ifindex = ifindex, .err = SIT_OK };
+    int err;
+
+    err = raw_dump(sk, RTM_GETROUTE, ifindex, &raw_route_collect, &routes);
+    if (err == SIT_OK) err = routes.err;
+    if (err == SIT_OK && routes.keys == NULL) {
+        routes.keys = (route_key_t *) calloc(1, sizeof(route_key_t));
+        if (routes.keys == NULL) {
+            log_fatal("calloc() failed.\n");
+            err = SIT_FATAL;
+        }
     }
 
-    if (!rtnl_link_is_sit(sit_link)) {
-        err = SIT_ERROR;
-        log_fatal("rtnl_link_is_sit(): link is not sit.\n");
+    if (err != SIT_OK) {
+        free(routes.keys);
+        return err;
+    }
+
+    *have = routes.keys;
+    *n_have = routes.count;
+    return SIT_OK;
+}
+
+static int apply_routes(struct nl_sock *sk, const sit_route_t *route, int ifindex, bool *changed) {
+    route_key_t *want = NULL, *have = NULL;
+    sit_route_t *add = NULL, *del = NULL;
+    size_t n_want = 0, n_have = 0, n_add = 0, n_del = 0, i, j;
+    int err, ret = SIT_OK;
+
+    for (const sit_route_t *r = route; r != NULL; r = r->next) ++n_want;
+
+    if (backend == SIT_BACKEND_RAW) err = have_routes_raw(sk, ifindex, &have, &n_have);
+    else err = have_routes_libnl(sk, ifindex, &have, &n_have);
+    if (err != SIT_OK) return err;
+
+    want = (route_key_t *) calloc(n_want + 1, sizeof(route_key_t));
+    add = (sit_route_t *) calloc(n_want + 1, sizeof(sit_route_t));
+    del = (sit_route_t *) calloc(n_have + 1, sizeof(sit_route_t));
+    if (want == NULL || add == NULL || del == NULL) {
+        log_fatal("calloc() failed.\n");
+        ret = SIT_FATAL;
         goto end;
     }
 
-    *link = sit_link;
+    n_want = 0;
+    for (const sit_route_t *r = route; r != NULL; r = r->next) {
+        route_key_t *key = &want[n_want];
+        key->dst = r->prefix.addr;
+        key->dst_len = r->prefix.len;
+        key->gw = r->nexthop;
+        key->route = r;
+        ++n_want;
+    }
+
+    qsort(want, n_want, sizeof(route_key_t), &route_key_cmp);
+    qsort(have, n_have, sizeof(route_key_t), &route_key_cmp);
+
+    for (i = 0, j = 0; i < n_want || j < n_have;) {
+        int cmp = i == n_want ? 1 : j == n_have ? -1 : route_key_cmp(&want[i], &have[j]);
+
+        if (cmp == 0 && memcmp(&want[i].gw, &have[j].gw, sizeof(struct in6_addr)) == 0) {
+            ++i;
+            ++j;
+            continue;
+        }
+
+        if (cmp <= 0) {
+            /* missing, or a different nexthop: NLM_F_REPLACE covers both. */
+            sit_route_t *r = &add[n_add];
+            *r = *want[i].route;
+            r->next = NULL;
+            if (n_add++ > 0) add[n_add - 2].next = r;
+            ++i;
+            if (cmp == 0) ++j;
+            continue;
+        }
+
+        sit_route_t *r = &del[n_del];
+        r->prefix.addr = have[j].dst;
+        r->prefix.len = have[j].dst_len;
+        r->nexthop = have[j].gw;
+        if (n_del++ > 0) del[n_del - 2].next = r;
+        ++j;
+    }
+
+    if (n_del > 0) {
+        err = sit_del_routes(sk, ifindex, del, &log_route_result, NULL);
+        if (err != SIT_OK) ret = err;
+        *changed = true;
+    }
+
+    if (n_add > 0) {
+        err = sit_add_routes(sk, ifindex, add, &log_route_result, NULL);
+        if (err != SIT_OK) ret = err;
+        *changed = true;
+    }
 
 end:
-    nl_cache_free(cache);
-    return err;
-}
\ No newline at end of file
+    free(want);
+    free(have);
+    free(add);
+    free(del);
+    return ret;
+}
+
+int sit_apply(struct nl_sock *sk, const sit_tunnel_t *tunnel, const sit_prefix6_t *replaced, const sit_route_t *route, bool *changed) {
+    struct rtnl_link *link = NULL;
+    bool dummy;
+    int err, diff, ifindex;
+
+    if (changed == NULL) changed = &dummy;
+    *changed = false;
+
+    err = sit_get(sk, tunnel->name, &link);
+
+    if (tunnel->state == STETE_STOPPED) {
+        if (err != SIT_OK) return err == SIT_NOT_EXIST ? SIT_OK : err;
+        rtnl_link_put(link);
+        *changed = true;
+        return sit_destroy(sk, tunnel->name);
+    }
+
+    if (err == SIT_NOT_EXIST) {
+        *changed = true;
+        return sit_configure(sk, tunnel, route);
+    }
+
+    if (err != SIT_OK) return err;
+
+    ifindex = rtnl_link_get_ifindex(link);
+    diff = sit_diff(tunnel, link);
+
+    if (diff != 0) {
+        err = apply_link(sk, tunnel, link, diff);
+        *changed = true;
+    }
+
+    rtnl_link_put(link);
+    if (err != SIT_OK) return err;
+
+    err = apply_address(sk, tunnel, replaced, ifindex, changed);
+    if (err != SIT_OK) return err;
+
+    return apply_routes(sk, route, ifindex, changed);
+}
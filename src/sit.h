@@ -1,7 +1,9 @@
 #ifndef SITD_SIT_H
 #define SITD_SIT_H
 #include <stdint.h>
+#include <stdbool.h>
 #include <netlink/route/link.h>
+#include <linux/if_link.h>
 #include "types.h"
 
 #define SIT_OK 0
@@ -9,8 +11,41 @@
 #define SIT_ERROR 2
 #define SIT_FATAL 3
 
+#define SIT_DIFF_LOCAL 0x01
+#define SIT_DIFF_REMOTE 0x02
+#define SIT_DIFF_MTU 0x04
+#define SIT_DIFF_TTL 0x08
+#define SIT_DIFF_UP 0x10
+
+/* how requests are built and replies read: through libnl's objects, or
+ * encoded in place by nlcodec. set it before anything else runs. */
+typedef enum sit_backend {
+    SIT_BACKEND_LIBNL,
+    SIT_BACKEND_RAW,
+} sit_backend_t;
+
+typedef void (*sit_route_cb_t)(const sit_route_t *route, int err, void *data);
+typedef void (*sit_stats_cb_t)(const char *name, const struct rtnl_link_stats64 *stats, void *data);
+
+void sit_set_backend(sit_backend_t backend);
+int sit_backend_parse(const char *name);
+
+int sit_open();
+int sit_close();
+
 int sit_get(struct nl_sock *sk, const char *name, struct rtnl_link **link);
 int sit_configure(struct nl_sock *sk, const sit_tunnel_t *tunnel, const sit_route_t *route);
 int sit_destroy(struct nl_sock *sk, const char *name);
+int sit_diff(const sit_tunnel_t *tunnel, struct rtnl_link *link);
+
+/* replaced, if not null, is an address sitd put on the link before; it is
+ * removed. other addresses on the link are left alone. */
+int sit_apply(struct nl_sock *sk, const sit_tunnel_t *tunnel, const sit_prefix6_t *replaced, const sit_route_t *route, bool *changed);
+
+int sit_add_routes(struct nl_sock *sk, int ifindex, const sit_route_t *route, sit_route_cb_t cb, void *data);
+int sit_del_routes(struct nl_sock *sk, int ifindex, const sit_route_t *route, sit_route_cb_t cb, void *data);
+
+/* one RTM_GETLINK dump; cb gets the counters of every sit link. */
+int sit_dump_stats(struct nl_sock *sk, sit_stats_cb_t cb, void *data);
 
 #endif // SITD_SIT_H
\ No newline at end of file
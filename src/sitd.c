@@ -1,77 +1,1037 @@
-#include <netlink/netlink.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 #include "sit.h"
 #include "log.h"
 #include "db.h"
+#include "store.h"
 #include "api.h"
+#include "reconcile.h"
+#include "stats.h"
+#include "latency.h"
+#include "watch.h"
+#include "job.h"
 
-int tunnel_api_handler (struct MHD_Connection *conn, const char *method, size_t argc, const char **argv, const json_t *req) {
-    log_debug("tunnel_api: %s, args: \n", method);
-    for (int i = 0; i < argc; i++) {
-        log_debug("arg %d: %s\n", i, argv[i]);
+#define DB_FILE "test.db"
+#define SNAPSHOT_SUFFIX ".snap"
+#define API_PORT 8123
+#define LIST_PAGE_MAX 1000
+#define LIST_STREAM_PAGE 256
+#define HEADER_LINK_SZ 128
+#define HEADER_ETAG_SZ 48
+#define LIST_CACHE_SLOTS 64
+#define LIST_CACHE_MAX (8 << 20)
+#define LIST_CACHE_CHUNK 4096
+#define BULK_MAX_TUNNELS 10000
+#define BULK_MAX_BODY (32 << 20)
+#define API_RATE 50
+#define BULK_RATE 5
+#define BULK_QUEUE 64
+#define WAIT_QUEUE 64
+#define STATS_INTERVAL 10
+#define LATENCY_INTERVAL 60
+#define WATCH_HOLDOFF 100
+#define JOB_WORKERS 8
+#define JOB_WAIT_MAX 60000
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+static int respond_err(struct MHD_Connection *conn, uint32_t http_code, sit_err_t code, const char *message) {
+    return api_respond_error(conn, http_code, sit_strerror(code), message);
+}
+
+/* nothing was saved: a change is only taken once its apply can be queued. */
+static int respond_jobs_full(struct MHD_Connection *conn) {
+    api_add_header(conn, "Retry-After", "1");
+    return respond_err(conn, 503, ERR_BUSY, "too many unfinished jobs, retry later.");
+}
+
+static int respond_tunnel(struct MHD_Connection *conn, uint32_t http_code, const sit_tunnel_t *tunnel) {
+    json_t *body;
+
+    if (sit_tunnel_to_json(tunnel, &body) != ERR_OK) return respond_err(conn, 500, ERR_UNKNOW, "can't encode tunnel.");
+
+    int r = api_respond(conn, http_code, body);
+    json_decref(body);
+
+    return r;
+}
+
+static int respond_job(struct MHD_Connection *conn, uint32_t http_code, const job_info_t *info) {
+    char location[HEADER_LINK_SZ];
+    json_t *body;
+
+    body = json_pack("{s:I, s:s, s:s, s:i}", "id", (json_int_t) info->id, "tunnel", info->name,
+        "state", job_state_name(info->state), "requests", (int) info->requests);
+    if (body == NULL) return respond_err(conn, 500, ERR_UNKNOW, "can't encode job.");
+
+    snprintf(location, sizeof(location), "/api/v1/job/%llu", (unsigned long long) info->id);
+    api_add_header(conn, "Location", location);
+
+    int r = api_respond(conn, http_code, body);
+    json_decref(body);
+
+    return r;
+}
+
+/* reads an optional unsigned query argument; -1 if it's malformed or out of
+ * [min, max]. */
+static int query_u32(struct MHD_Connection *conn, const char *key, uint32_t min, uint32_t max, uint32_t *value) {
+    const char *arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, key);
+    char *end;
+
+    if (arg == NULL) return 0;
+
+    unsigned long v = strtoul(arg, &end, 10);
+    if (*arg == 0 || *end != 0 || v < min || v > max) return -1;
+
+    *value = (uint32_t) v;
+    return 1;
+}
+
+/* without a limit the whole list is streamed a page at a time, so only one
+ * page is in memory however many rows there are. */
+typedef struct list_stream {
+    uint32_t tunnel_id;
+    uint32_t after;
+    sit_tunnel_t *tunnels, *tunnel;
+    sit_route_t *routes, *route;
+} list_stream_t;
+
+static void list_stream_free(void *data) {
+    list_stream_t *ls = (list_stream_t *) data;
+
+    store_free_result_tunnels(ls->tunnels);
+    store_free_result_routes(ls->routes);
+    free(ls);
+}
+
+static int tunnel_stream_next(void *data, json_t **item) {
+    list_stream_t *ls = (list_stream_t *) data;
+    int err;
+
+    if (ls->tunnel == NULL) {
+        store_free_result_tunnels(ls->tunnels);
+        err = store_get_tunnels_page(ls->after, LIST_STREAM_PAGE, &ls->tunnels);
+        if (err == SIT_DB_NOT_EXIST) return 0;
+        if (err != SIT_DB_OK) return -1;
+        ls->tunnel = ls->tunnels;
     }
 
-    // echo
-    return api_respond(conn, 200, req);
+    if (sit_tunnel_to_json(ls->tunnel, item) != ERR_OK) return -1;
 
+    ls->after = ls->tunnel->id;
+    ls->tunnel = ls->tunnel->next;
+    return 1;
 }
 
-int route_api_handler (struct MHD_Connection *conn, const char *method, size_t argc, const char **argv, const json_t *req) {
-    log_debug("route_api: %s, args: \n", method);
-    for (int i = 0; i < argc; i++) {
-        log_debug("arg %d: %s\n", i, argv[i]);
+static int route_stream_next(void *data, json_t **item) {
+    list_stream_t *ls = (list_stream_t *) data;
+    int err;
+
+    if (ls->route == NULL) {
+        store_free_result_routes(ls->routes);
+        err = store_get_routes_page(ls->tunnel_id, ls->after, LIST_STREAM_PAGE, &ls->routes);
+        if (err == SIT_DB_NOT_EXIST) return 0;
+        if (err != SIT_DB_OK) return -1;
+        ls->route = ls->routes;
     }
 
-    // echo
-    return api_respond(conn, 200, req);
+    if (sit_route_to_json(ls->route, item) != ERR_OK) return -1;
+
+    ls->after = ls->route->id;
+    ls->route = ls->route->next;
+    return 1;
+}
+
+static int list_stream(struct MHD_Connection *conn, uint32_t tunnel_id, uint32_t after) {
+    list_stream_t *ls = (list_stream_t *) calloc(1, sizeof(list_stream_t));
+
+    if (ls == NULL) {
+        log_fatal("calloc() failed.\n");
+        return respond_err(conn, 500, ERR_UNKNOW, "out of memory.");
+    }
+
+    ls->tunnel_id = tunnel_id;
+    ls->after = after;
+
+    return api_respond_stream(conn, 200, tunnel_id == 0 ? &tunnel_stream_next : &route_stream_next, ls, &list_stream_free);
+}
+
+/* whole listings, serialized at the generation they were read at. slot 0
+ * holds the tunnel list, the others route lists by tunnel id. a listing
+ * bigger than LIST_CACHE_MAX is left out and streamed every time. */
+typedef struct list_cache {
+    pthread_mutex_t lock;
+    uint32_t tunnel_id;
+    uint64_t generation;
+    bool tried;
+    bool filled;
+    char *data;
+    size_t len, cap;
+} list_cache_t;
+
+static list_cache_t list_cache[LIST_CACHE_SLOTS];
+
+/* generations start over with the process, so etags carry its start time
+ * too and one from an earlier run never matches. */
+static uint64_t etag_epoch = 0;
+
+static void list_cache_init() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    etag_epoch = (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+
+    for (size_t i = 0; i < LIST_CACHE_SLOTS; i++) pthread_mutex_init(&list_cache[i].lock, NULL);
+}
+
+static void list_cache_clear() {
+    for (size_t i = 0; i < LIST_CACHE_SLOTS; i++) {
+        free(list_cache[i].data);
+        pthread_mutex_destroy(&list_cache[i].lock);
+    }
+    memset(list_cache, 0, sizeof(list_cache));
+}
+
+/* json_dump_callback() sink: appends to the slot, up to LIST_CACHE_MAX. */
+static int list_cache_write(const char *buffer, size_t size, void *data) {
+    list_cache_t *c = (list_cache_t *) data;
+
+    if (c->len + size > LIST_CACHE_MAX) return -1;
+
+    if (c->len + size > c->cap) {
+        size_t cap = c->cap > 0 ? c->cap : LIST_CACHE_CHUNK;
+        while (cap < c->len + size) cap *= 2;
+        if (cap > LIST_CACHE_MAX) cap = LIST_CACHE_MAX;
+
+        char *grown = (char *) realloc(c->data, cap);
+        if (grown == NULL) {
+            log_fatal("realloc() failed.\n");
+            return -1;
+        }
+        c->data = grown;
+        c->cap = cap;
+    }
+
+    memcpy(c->data + c->len, buffer, size);
+    c->len += size;
+    return 0;
+}
+
+/* serializes the listing the way list_stream() would send it. */
+static int list_cache_fill(list_cache_t *c, uint32_t tunnel_id) {
+    list_stream_t ls = { .tunnel_id = tunnel_id };
+    api_stream_next_t next = tunnel_id == 0 ? &tunnel_stream_next : &route_stream_next;
+    size_t count = 0;
+    json_t *item;
+    int r, err;
+
+    c->len = 0;
+    err = list_cache_write("[", 1, c);
+
+    while (err == 0 && (r = next(&ls, &item)) != 0) {
+        if (r < 0) {
+            err = -1;
+            break;
+        }
+        err = count++ > 0 ? list_cache_write(",", 1, c) : 0;
+        if (err == 0) err = json_dump_callback(item, &list_cache_write, c, JSON_COMPACT);
+        json_decref(item);
+    }
+
+    if (err == 0) err = list_cache_write("]", 1, c);
+
+    store_free_result_tunnels(ls.tunnels);
+    store_free_result_routes(ls.routes);
+    return err;
+}
+
+/* the whole listing from the cache, refilled first if it's from an older
+ * generation. a write landing during the fill may make the bytes newer than
+ * generation, never older, so an etag can't outlive what it was sent with. */
+static int list_cached(struct MHD_Connection *conn, uint32_t tunnel_id, uint64_t generation) {
+    list_cache_t *c = &list_cache[tunnel_id == 0 ? 0 : 1 + (tunnel_id - 1) % (LIST_CACHE_SLOTS - 1)];
+    int r;
+
+    pthread_mutex_lock(&c->lock);
+
+    if (!c->tried || c->tunnel_id != tunnel_id || c->generation != generation) {
+        uint64_t start = latency_now();
+
+        c->tunnel_id = tunnel_id;
+        c->generation = generation;
+        c->tried = true;
+        c->filled = list_cache_fill(c, tunnel_id) == 0;
+        if (!c->filled) {
+            free(c->data);
+            c->data = NULL;
+            c->len = c->cap = 0;
+        }
+        latency_record(LATENCY_API_ENCODE, start);
+    }
+
+    if (c->filled) {
+        r = api_respond_text(conn, 200, API_CONTENT_JSON, c->data, c->len);
+        pthread_mutex_unlock(&c->lock);
+        return r;
+    }
+
+    pthread_mutex_unlock(&c->lock);
+    return list_stream(conn, tunnel_id, 0);
+}
+
+/* the etag names a generation, so it holds for every page of a listing. */
+static void etag_format(char *etag, size_t size, uint64_t generation) {
+    snprintf(etag, size, "\"%" PRIx64 "-%" PRIx64 "\"", etag_epoch, generation);
+}
+
+/* true when the client already has this version, or any version for "*". */
+static bool etag_matches(struct MHD_Connection *conn, const char *etag) {
+    const char *match = MHD_lookup_connection_value(conn, MHD_HEADER_KIND, "If-None-Match");
+
+    if (match == NULL) return false;
+    return strcmp(match, "*") == 0 || strstr(match, etag) != NULL;
+}
+
+/* sends a 304 when the client's copy is current; otherwise the etag goes
+ * out with the listing and -1 is returned. */
+static int respond_not_modified(struct MHD_Connection *conn, uint64_t generation) {
+    char etag[HEADER_ETAG_SZ];
+
+    etag_format(etag, sizeof(etag), generation);
+    api_add_header(conn, "ETag", etag);
+    if (!etag_matches(conn, etag)) return -1;
+
+    return api_respond_text(conn, 304, API_CONTENT_JSON, "", 0);
+}
+
+/* a full page may have more behind it; point at it with a Link header. */
+static void add_next_link(struct MHD_Connection *conn, const char *base, uint32_t limit, uint32_t last_id) {
+    char link[HEADER_LINK_SZ];
+
+    snprintf(link, sizeof(link), "<%s?limit=%u&after=%u>; rel=\"next\"", base, limit, last_id);
+    api_add_header(conn, "Link", link);
+}
+
+static int tunnel_list(struct MHD_Connection *conn) {
+    sit_tunnel_t *tunnels = NULL;
+    uint32_t limit = 0, after = 0, count = 0, last_id = 0;
+    uint64_t generation;
+    json_t *body, *item;
+    int err, r;
+
+    if (query_u32(conn, "after", 0, UINT32_MAX, &after) < 0 || query_u32(conn, "limit", 1, LIST_PAGE_MAX, &limit) < 0) {
+        return respond_err(conn, 400, ERR_UNKNOW, "bad limit or after.");
+    }
+
+    generation = store_get_generation();
+    r = respond_not_modified(conn, generation);
+    if (r >= 0) return r;
+
+    if (limit == 0 && after == 0) return list_cached(conn, 0, generation);
+    if (limit == 0) return list_stream(conn, 0, after);
+
+    err = store_get_tunnels_page(after, limit, &tunnels);
+    if (err != SIT_DB_OK && err != SIT_DB_NOT_EXIST) return respond_err(conn, 500, ERR_UNKNOW, "can't read tunnels.");
+
+    body = json_array();
+    for (sit_tunnel_t *t = tunnels; t != NULL; t = t->next, ++count) {
+        if (sit_tunnel_to_json(t, &item) == ERR_OK) json_array_append_new(body, item);
+        last_id = t->id;
+    }
+
+    if (count == limit) add_next_link(conn, "/api/v1/tunnel/", limit, last_id);
+
+    r = api_respond(conn, 200, body);
+    json_decref(body);
+    store_free_result_tunnels(tunnels);
+
+    return r;
+}
+
+static int route_list(struct MHD_Connection *conn, const char *name) {
+    sit_route_t *routes = NULL;
+    uint32_t tunnel_id, limit = 0, after = 0, count = 0, last_id = 0;
+    uint64_t generation;
+    char base[HEADER_LINK_SZ];
+    json_t *body, *item;
+    int err, r;
+
+    if (query_u32(conn, "after", 0, UINT32_MAX, &after) < 0 || query_u32(conn, "limit", 1, LIST_PAGE_MAX, &limit) < 0) {
+        return respond_err(conn, 400, ERR_UNKNOW, "bad limit or after.");
+    }
+
+    err = store_get_tunnel_generation(name, &tunnel_id, &generation);
+    if (err == SIT_DB_NOT_EXIST) return respond_err(conn, 404, ERR_NOT_FOUND, "no such tunnel.");
+    if (err != SIT_DB_OK) return respond_err(conn, 500, ERR_UNKNOW, "can't read tunnel.");
+
+    r = respond_not_modified(conn, generation);
+    if (r >= 0) return r;
+
+    if (limit == 0 && after == 0) return list_cached(conn, tunnel_id, generation);
+    if (limit == 0) return list_stream(conn, tunnel_id, after);
+
+    err = store_get_routes_page(tunnel_id, after, limit, &routes);
+    if (err != SIT_DB_OK && err != SIT_DB_NOT_EXIST) return respond_err(conn, 500, ERR_UNKNOW, "can't read routes.");
+
+    body = json_array();
+    for (sit_route_t *rt = routes; rt != NULL; rt = rt->next, ++count) {
+        if (sit_route_to_json(rt, &item) == ERR_OK) json_array_append_new(body, item);
+        last_id = rt->id;
+    }
+
+    if (count == limit) {
+        snprintf(base, sizeof(base), "/api/v1/tunnel/%s/route/", name);
+        add_next_link(conn, base, limit, last_id);
+    }
+
+    r = api_respond(conn, 200, body);
+    json_decref(body);
+    store_free_result_routes(routes);
+
+    return r;
+}
+
+static int tunnel_get(struct MHD_Connection *conn, const char *name) {
+    sit_tunnel_t *tunnel = NULL;
+    int err, r;
+
+    err = store_get_tunnel(name, &tunnel);
+    if (err == SIT_DB_NOT_EXIST) return respond_err(conn, 404, ERR_NOT_FOUND, "no such tunnel.");
+    if (err != SIT_DB_OK) return respond_err(conn, 500, ERR_UNKNOW, "can't read tunnel.");
+
+    r = respond_tunnel(conn, 200, tunnel);
+    free(tunnel);
+
+    return r;
+}
+
+static int tunnel_stats(struct MHD_Connection *conn, const char *name) {
+    sit_stats_t stats;
+    uint32_t id;
+    json_t *body;
+    int err, r;
+
+    err = store_get_tunnel_id(name, &id);
+    if (err == SIT_DB_NOT_EXIST) return respond_err(conn, 404, ERR_NOT_FOUND, "no such tunnel.");
+    if (err != SIT_DB_OK) return respond_err(conn, 500, ERR_UNKNOW, "can't read tunnel.");
+
+    if (stats_get(id, &stats) != SIT_OK) return respond_err(conn, 404, ERR_NOT_FOUND, "no stats for this tunnel yet.");
+    if (sit_stats_to_json(&stats, &body) != ERR_OK) return respond_err(conn, 500, ERR_UNKNOW, "can't encode stats.");
+
+    r = api_respond(conn, 200, body);
+    json_decref(body);
+
+    return r;
+}
+
+static int metrics(struct MHD_Connection *conn) {
+    char *text;
+    size_t len;
+    int r;
+
+    if (stats_metrics(&text, &len) != SIT_OK) return respond_err(conn, 500, ERR_UNKNOW, "can't build metrics.");
+
+    r = api_respond_text(conn, 200, METRICS_CONTENT_TYPE, text, len);
+    free(text);
+
+    return r;
+}
+
+/* the tunnel serving address (or the /len prefix around it): the route with
+ * the longest matching prefix, else the tunnel whose address network holds
+ * it. */
+static int lookup(struct MHD_Connection *conn, const char *address) {
+    sit_prefix6_t prefix, match;
+    sit_tunnel_t *tunnel = NULL;
+    sit_route_t *route = NULL;
+    json_t *body = NULL, *item;
+    char buf[SIT_PREFIX6_STRLEN];
+    uint32_t len = 128;
+    int err, r;
+
+    if (sit_prefix6_parse(address, &prefix) != 0 || strchr(address, '/') != NULL) return respond_err(conn, 400, ERR_UNKNOW, "bad address.");
+    if (query_u32(conn, "len", 0, 128, &len) < 0) return respond_err(conn, 400, ERR_UNKNOW, "bad prefix length.");
+
+    prefix.len = (uint8_t) len;
+    sit_prefix6_mask(&prefix);
+
+    err = store_lookup(&prefix, &tunnel, &route);
+    if (err == SIT_DB_NOT_EXIST) return respond_err(conn, 404, ERR_NOT_FOUND, "no tunnel serves this address.");
+    if (err != SIT_DB_OK) return respond_err(conn, 500, ERR_UNKNOW, "can't look up address.");
+
+    if (route != NULL) match = route->prefix;
+    else {
+        match = tunnel->address;
+        sit_prefix6_mask(&match);
+    }
+
+    body = json_pack("{s:s, s:s}", "prefix", sit_prefix6_str(&match, buf), "kind", route != NULL ? "route" : "address");
+    if (body == NULL || sit_tunnel_to_json(tunnel, &item) != ERR_OK || json_object_set_new(body, "tunnel", item) != 0 ||
+        (route != NULL && (sit_route_to_json(route, &item) != ERR_OK || json_object_set_new(body, "route", item) != 0))) {
+        r = respond_err(conn, 500, ERR_UNKNOW, "can't encode lookup.");
+        goto end;
+    }
+
+    r = api_respond(conn, 200, body);
+
+end:
+    json_decref(body);
+    store_free_result_tunnels(tunnel);
+    store_free_result_routes(route);
+    return r;
+}
+
+static int tunnel_put(struct MHD_Connection *conn, const char *name, const json_t *req) {
+    sit_tunnel_t *tunnel = NULL, *update = NULL;
+    tunnel_state_t action = STATE_RELOADING;
+    sit_prefix6_t replaced;
+    bool moved;
+    uint32_t wait = 0;
+    uint64_t job_id;
+    job_info_t info;
+    int err, r;
+
+    if (query_u32(conn, "wait", 0, JOB_WAIT_MAX, &wait) < 0) return respond_err(conn, 400, ERR_UNKNOW, "bad wait.");
+
+    err = json_to_sit_tunnel(req, &update);
+    if (err != ERR_OK) return respond_err(conn, 400, err, "bad tunnel.");
+
+    /* restarting and reloading are actions on a running tunnel. */
+    if (isset(update->state) && (update->state == STATE_RESTARTING || update->state == STATE_RELOADING)) {
+        action = update->state;
+        update->state = STATE_RUNNING;
+    }
+
+    if (job_reserve(1) != SIT_OK) {
+        r = respond_jobs_full(conn);
+        goto end;
+    }
+
+    /* patched under the store's lock, so concurrent requests each keep
+     * their fields. */
+    err = store_patch_tunnel(name, update, &tunnel, &replaced);
+    if (err != SIT_DB_OK) job_release(1);
+    if (err == SIT_DB_NOT_EXIST) {
+        r = respond_err(conn, 404, ERR_NOT_FOUND, "no such tunnel.");
+        goto end;
+    }
+    if (err == SIT_DB_ALREADY_EXIST) {
+        r = respond_err(conn, 409, ERR_EXIST, "name, remote or address already in use, or address overlaps another tunnel's prefix.");
+        goto end;
+    }
+    if (err != SIT_DB_OK) {
+        r = respond_err(conn, 500, ERR_UNKNOW, "can't update tunnel.");
+        goto end;
+    }
+
+    /* a renamed link can't be changed in place. */
+    if (strcmp(name, tunnel->name) != 0) action = STATE_RESTARTING;
+
+    /* the old address is ours to remove; anything else on the link isn't. */
+    moved = replaced.len != tunnel->address.len || memcmp(&replaced.addr, &tunnel->address.addr, sizeof(struct in6_addr)) != 0;
+
+    /* the kernel is changed by a job worker; without a wait the request is
+     * answered right away. */
+    err = job_submit(tunnel->id, tunnel->name, action == STATE_RESTARTING ? name : NULL, moved ? &replaced : NULL, true, &job_id);
+    if (err != SIT_OK) {
+        r = respond_err(conn, 503, ERR_UNKNOW, "tunnel saved, but can't queue its apply.");
+        goto end;
+    }
+
+    err = job_wait(job_id, wait, &info);
+    if (err != SIT_OK) {
+        r = respond_err(conn, 500, ERR_UNKNOW, "tunnel saved, but its job is gone.");
+        goto end;
+    }
+
+    if (info.state == JOB_FAILED) {
+        r = respond_err(conn, 500, ERR_UNKNOW, "tunnel saved, but can't apply it.");
+        goto end;
+    }
+
+    if (info.state != JOB_DONE) {
+        r = respond_job(conn, 202, &info);
+        goto end;
+    }
+
+    r = respond_tunnel(conn, 200, tunnel);
+
+end:
+    free(update);
+    free(tunnel);
+    return r;
+}
+
+static void bulk_fail(json_t *result, sit_err_t code, const char *message) {
+    json_object_set_new(result, "code", json_string(sit_strerror(code)));
+    json_object_set_new(result, "message", json_string(message));
 }
 
-int main () {
-    /*struct nl_sock *sk;
+/* parses one bulk item into *tunnel and appends its routes; on error,
+ * *bad_route is the index of the offending route or -1. */
+static sit_err_t bulk_parse(const json_t *item, sit_tunnel_t *tunnel, sit_route_t *routes, size_t *n_routes, int *bad_route) {
+    const json_t *routes_json = json_object_get(item, "routes"), *route_json;
+    sit_tunnel_t *t = NULL;
+    sit_route_t *r = NULL;
+    size_t i;
     int err;
-    sit_tunnel_t *tunnels, *tunnel;
-    sk = nl_socket_alloc();
 
-    if (sk == NULL) {
-        log_fatal("nl_socket_alloc() returned null.\n");
+    *bad_route = -1;
+
+    err = json_to_sit_tunnel(item, &t);
+    if (err != ERR_OK) return err;
+
+    if (!isset(t->name)) err = ERR_BAD_NAME;
+    else if (!isset(t->local)) err = ERR_BAD_LOCAL;
+    else if (!isset(t->remote)) err = ERR_BAD_REMOTE;
+    else if (!isset(t->address)) err = ERR_BAD_ADDRESS;
+    else if (isset(t->state) && t->state != STATE_RUNNING && t->state != STETE_STOPPED) err = ERR_BAD_STATE;
+
+    *tunnel = *t;
+    free(t);
+    if (err != ERR_OK) return err;
+
+    if (routes_json == NULL) return ERR_OK;
+    if (!json_is_array(routes_json)) return ERR_UNKNOW;
+
+    json_array_foreach(routes_json, i, route_json) {
+        *bad_route = (int) i;
+
+        err = json_to_sit_route(route_json, &r);
+        if (err != ERR_OK) return err;
+
+        if (!isset(r->prefix)) err = ERR_BAD_PREFIX;
+        else if (!isset(r->nexthop)) err = ERR_BAD_NEXTHOP;
+
+        routes[(*n_routes)++] = *r;
+        free(r);
+        if (err != ERR_OK) return err;
+    }
+
+    *bad_route = -1;
+    return ERR_OK;
+}
+
+/* validates every item first, adds them all to the store at once, then
+ * queues a job per tunnel to program the kernel. */
+static int bulk_provision(struct MHD_Connection *conn, const json_t *req) {
+    sit_tunnel_t *tunnels = NULL;
+    sit_route_t *routes = NULL;
+    size_t *owner = NULL;
+    uint64_t *job_ids = NULL, deadline, left;
+    size_t n, m = 0, k = 0, i, failed, bad_tunnel;
+    json_t *results = NULL, *item, *result, *body;
+    bool bad = false, pending = false;
+    int err, r, bad_route;
+    uint32_t code = 200, wait = 0;
+    job_info_t info;
+
+    if (query_u32(conn, "wait", 0, JOB_WAIT_MAX, &wait) < 0) return respond_err(conn, 400, ERR_UNKNOW, "bad wait.");
+
+    n = json_array_size(req);
+    if (!json_is_array(req) || n == 0 || n > BULK_MAX_TUNNELS) {
+        return respond_err(conn, 400, ERR_UNKNOW, "expected an array of 1 to 10000 tunnels.");
+    }
+
+    json_array_foreach(req, i, item) m += json_array_size(json_object_get(item, "routes"));
+
+    tunnels = (sit_tunnel_t *) calloc(n, sizeof(sit_tunnel_t));
+    routes = (sit_route_t *) calloc(m + 1, sizeof(sit_route_t));
+    owner = (size_t *) calloc(m + 1, sizeof(size_t));
+    job_ids = (uint64_t *) calloc(n, sizeof(uint64_t));
+    results = json_array();
+    if (tunnels == NULL || routes == NULL || owner == NULL || job_ids == NULL || results == NULL) {
+        log_fatal("calloc() failed.\n");
+        r = respond_err(conn, 500, ERR_UNKNOW, "out of memory.");
         goto end;
     }
 
-    err = nl_connect(sk, NETLINK_ROUTE);
-    if (err < 0) {
-        log_fatal("nl_connect(): %s.\n", nl_geterror(err));
+    json_array_foreach(req, i, item) {
+        size_t first = k;
+
+        err = bulk_parse(item, &tunnels[i], routes, &k, &bad_route);
+        for (size_t j = first; j < k; j++) owner[j] = i;
+
+        result = json_object();
+        if (json_is_string(json_object_get(item, "name"))) json_object_set(result, "name", json_object_get(item, "name"));
+        json_object_set_new(result, "code", json_string(sit_strerror(ERR_OK)));
+        if (err != ERR_OK) {
+            bulk_fail(result, err, bad_route < 0 ? "bad tunnel." : "bad route.");
+            if (bad_route >= 0) json_object_set_new(result, "route", json_integer(bad_route));
+            bad = true;
+        }
+        json_array_append_new(results, result);
+    }
+
+    if (bad) {
+        code = 400;
+        goto respond;
+    }
+
+    m = k;
+
+    if (job_reserve(n) != SIT_OK) {
+        r = respond_jobs_full(conn);
         goto end;
     }
 
-    db_open("test.db");
-    db_get_tunnels(&tunnels);
+    err = store_create_tunnels(tunnels, n, routes, m, owner, &bad_tunnel, &failed);
+    if (err != SIT_DB_OK) job_release(n);
+    if (err == SIT_DB_ALREADY_EXIST && failed != SIZE_MAX) {
+        /* report the route by its index within its own tunnel. */
+        for (k = failed; k > 0 && owner[k - 1] == owner[failed]; k--);
+        result = json_array_get(results, owner[failed]);
+        json_object_set_new(result, "route", json_integer((json_int_t) (failed - k)));
+        bulk_fail(result, ERR_EXIST, "route already exists or overlaps another tunnel's prefix.");
+    } else if (err == SIT_DB_ALREADY_EXIST) {
+        bulk_fail(json_array_get(results, bad_tunnel), ERR_EXIST, "name, remote or address already in use, or address overlaps another tunnel's prefix.");
+    }
 
-    tunnel = tunnels;
+    if (err == SIT_DB_ALREADY_EXIST) {
+        code = 409;
+        goto respond;
+    }
 
-    while (tunnel != NULL) {
-        sit_destroy(sk, tunnel->name);
-        sit_configure(sk, tunnel, NULL);
-        log_debug("%d name: %s, l: %s, r: %s, a: %s, m: %d, s: %d\n", tunnel->id, tunnel->name, tunnel->remote, tunnel->local, tunnel->address, tunnel->mtu, tunnel->state);
-        tunnel = tunnel->next;
+    if (err != SIT_DB_OK) {
+        r = respond_err(conn, 500, ERR_UNKNOW, "can't write tunnels.");
+        goto end;
     }
 
-    db_free_result_tunnels(tunnels);
-    db_close();
+    for (i = 0; i < n; i++) {
+        result = json_array_get(results, i);
+        if (job_submit(tunnels[i].id, tunnels[i].name, NULL, NULL, true, &job_ids[i]) != SIT_OK) {
+            job_ids[i] = 0;
+            bulk_fail(result, ERR_UNKNOW, "tunnel saved, but can't queue its apply.");
+        } else json_object_set_new(result, "job", json_integer((json_int_t) job_ids[i]));
+    }
+
+    /* one deadline for the whole request, not one per tunnel. */
+    deadline = latency_now() / 1000000 + wait;
+    for (i = 0; i < n; i++) {
+        if (job_ids[i] == 0) continue;
+
+        left = latency_now() / 1000000;
+        left = left < deadline ? deadline - left : 0;
+        if (job_wait(job_ids[i], (uint32_t) left, &info) != SIT_OK) continue;
+
+        result = json_array_get(results, i);
+        json_object_set_new(result, "state", json_string(job_state_name(info.state)));
+        if (info.state == JOB_FAILED) bulk_fail(result, ERR_UNKNOW, "tunnel saved, but can't apply it.");
+        else if (info.state != JOB_DONE) pending = true;
+    }
+
+    if (pending) code = 202;
+
+respond:
+    body = json_pack("{s:O}", "results", results);
+    if (code >= 400) {
+        json_object_set_new(body, "code", json_string(sit_strerror(code == 409 ? ERR_EXIST : ERR_UNKNOW)));
+        json_object_set_new(body, "message", json_string("nothing was created."));
+    }
+    r = api_respond(conn, code, body);
+    json_decref(body);
 
 end:
-    if (sk != NULL) {
-        nl_close(sk);
-        nl_socket_free(sk);
-        return err;
-    }*/
-
-    api_register_handler("/api/v1/tunnel/:tunnel_name", &tunnel_api_handler);
-    api_register_handler("/api/v1/tunnel/", &tunnel_api_handler);
-    api_register_handler("/api/v1/tunnel/:tunnel_name/route/:route", &route_api_handler);
-    api_register_handler("/api/v1/tunnel/:tunnel_name/route/", &route_api_handler);
-    api_start(8123);
+    json_decref(results);
+    free(tunnels);
+    free(routes);
+    free(owner);
+    free(job_ids);
+    return r;
+}
+
+/* url captures aren't null-terminated; names longer than a link name can't
+ * exist anyway. */
+static int arg_name(const api_arg_t *arg, char *name) {
+    return api_arg_copy(arg, name, IFNAMSIZ);
+}
+
+int bulk_handler (struct MHD_Connection *conn, size_t argc, const api_arg_t *argv, const json_t *req) {
+    (void) argc;
+    (void) argv;
+
+    return bulk_provision(conn, req);
+}
+
+int tunnel_list_handler (struct MHD_Connection *conn, size_t argc, const api_arg_t *argv, const json_t *req) {
+    (void) argc;
+    (void) argv;
+    (void) req;
+
+    return tunnel_list(conn);
+}
+
+int tunnel_get_handler (struct MHD_Connection *conn, size_t argc, const api_arg_t *argv, const json_t *req) {
+    char name[IFNAMSIZ];
+
+    (void) argc;
+    (void) req;
+
+    if (arg_name(&argv[0], name) != 0) return respond_err(conn, 404, ERR_NOT_FOUND, "no such tunnel.");
+    return tunnel_get(conn, name);
+}
+
+/* one entry per operation, keyed by its name; counts since startup. */
+static int latency_report(struct MHD_Connection *conn) {
+    latency_summary_t summary;
+    json_t *body, *item;
+    int r;
+
+    body = json_object();
+    if (body == NULL) return respond_err(conn, 500, ERR_UNKNOW, "out of memory.");
+
+    for (int op = 0; op < LATENCY_OP_COUNT; op++) {
+        latency_get((latency_op_t) op, &summary);
+        item = json_pack("{s:I, s:I, s:I, s:I, s:I, s:I, s:I}",
+            "count", (json_int_t) summary.count, "sum_ns", (json_int_t) summary.sum_ns, "max_ns", (json_int_t) summary.max_ns,
+            "p50_ns", (json_int_t) summary.p50_ns, "p90_ns", (json_int_t) summary.p90_ns,
+            "p99_ns", (json_int_t) summary.p99_ns, "p999_ns", (json_int_t) summary.p999_ns);
+        if (item == NULL || json_object_set_new(body, latency_op_name((latency_op_t) op), item) != 0) {
+            json_decref(body);
+            return respond_err(conn, 500, ERR_UNKNOW, "can't encode latencies.");
+        }
+    }
+
+    r = api_respond(conn, 200, body);
+    json_decref(body);
+
+    return r;
+}
+
+int tunnel_stats_handler (struct MHD_Connection *conn, size_t argc, const api_arg_t *argv, const json_t *req) {
+    char name[IFNAMSIZ];
+
+    (void) argc;
+    (void) req;
+
+    if (arg_name(&argv[0], name) != 0) return respond_err(conn, 404, ERR_NOT_FOUND, "no such tunnel.");
+    return tunnel_stats(conn, name);
+}
+
+int metrics_handler (struct MHD_Connection *conn, size_t argc, const api_arg_t *argv, const json_t *req) {
+    (void) argc;
+    (void) argv;
+    (void) req;
+
+    return metrics(conn);
+}
+
+int latency_handler (struct MHD_Connection *conn, size_t argc, const api_arg_t *argv, const json_t *req) {
+    (void) argc;
+    (void) argv;
+    (void) req;
+
+    return latency_report(conn);
+}
+
+int lookup_handler (struct MHD_Connection *conn, size_t argc, const api_arg_t *argv, const json_t *req) {
+    char address[INET6_ADDRSTRLEN];
+
+    (void) argc;
+    (void) req;
+
+    if (api_arg_copy(&argv[0], address, sizeof(address)) != 0) return respond_err(conn, 400, ERR_UNKNOW, "bad address.");
+    return lookup(conn, address);
+}
+
+int job_handler (struct MHD_Connection *conn, size_t argc, const api_arg_t *argv, const json_t *req) {
+    char arg[24], *end;
+    uint32_t wait = 0;
+    job_info_t info;
+
+    (void) argc;
+    (void) req;
+
+    if (api_arg_copy(&argv[0], arg, sizeof(arg)) != 0) return respond_err(conn, 404, ERR_NOT_FOUND, "no such job.");
+    if (query_u32(conn, "wait", 0, JOB_WAIT_MAX, &wait) < 0) return respond_err(conn, 400, ERR_UNKNOW, "bad wait.");
+
+    unsigned long long id = strtoull(arg, &end, 10);
+    if (*arg == 0 || *end != 0 || job_wait(id, wait, &info) != SIT_OK) return respond_err(conn, 404, ERR_NOT_FOUND, "no such job.");
+
+    return respond_job(conn, 200, &info);
+}
+
+int tunnel_put_handler (struct MHD_Connection *conn, size_t argc, const api_arg_t *argv, const json_t *req) {
+    char name[IFNAMSIZ];
+
+    (void) argc;
+
+    if (arg_name(&argv[0], name) != 0) return respond_err(conn, 404, ERR_NOT_FOUND, "no such tunnel.");
+    return tunnel_put(conn, name, req);
+}
+
+int route_list_handler (struct MHD_Connection *conn, size_t argc, const api_arg_t *argv, const json_t *req) {
+    char name[IFNAMSIZ];
+
+    (void) argc;
+    (void) req;
+
+    if (arg_name(&argv[0], name) != 0) return respond_err(conn, 404, ERR_NOT_FOUND, "no such tunnel.");
+    return route_list(conn, name);
+}
+
+int route_api_handler (struct MHD_Connection *conn, size_t argc, const api_arg_t *argv, const json_t *req) {
+    log_debug("route_api: args: \n");
+    for (size_t i = 0; i < argc; i++) {
+        log_debug("arg %zu: %.*s\n", i, (int) argv[i].len, argv[i].ptr);
+    }
+
+    // echo
+    return req == NULL ? respond_err(conn, 400, ERR_UNKNOW, "no request body.") : api_respond(conn, 200, req);
+}
+
+static void usage(const char *me) {
+    fprintf(stderr, "usage: %s [-d db_file] [-S snapshot_file] [-p port] [-t api_threads] [-s stats_interval] [-l latency_log_interval] [-w watch_holdoff_ms] [-j job_workers] [-n libnl|raw] [-r api_rate] [-b bulk_rate] [-v log_level]\n", me);
+}
+
+int main (int argc, char **argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *db_file = DB_FILE, *snapshot_file = NULL;
+    char snapshot_default[PATH_MAX];
+    uint16_t port = API_PORT;
+    uint32_t threads = cpus > 0 ? (uint32_t) cpus : 1;
+    uint32_t stats_interval = STATS_INTERVAL;
+    uint32_t latency_interval = LATENCY_INTERVAL;
+    uint32_t watch_holdoff = WATCH_HOLDOFF;
+    uint32_t job_workers = JOB_WORKERS;
+    uint32_t api_rate = API_RATE, bulk_rate = BULK_RATE;
+    api_limit_t limit;
+    int opt, level, backend, ret = 1;
+
+    while ((opt = getopt(argc, argv, "d:S:p:t:s:l:w:j:n:r:b:v:h")) != -1) {
+        switch (opt) {
+            case 'd': db_file = optarg; break;
+            case 'S': snapshot_file = optarg; break;
+            case 'p': port = (uint16_t) atoi(optarg); break;
+            case 't': threads = (uint32_t) atoi(optarg); break;
+            case 's': stats_interval = (uint32_t) atoi(optarg); break;
+            case 'l': latency_interval = (uint32_t) atoi(optarg); break;
+            case 'w': watch_holdoff = (uint32_t) atoi(optarg); break;
+            case 'j': job_workers = (uint32_t) atoi(optarg); break;
+            case 'r': api_rate = (uint32_t) atoi(optarg); break;
+            case 'b': bulk_rate = (uint32_t) atoi(optarg); break;
+            case 'n':
+                backend = sit_backend_parse(optarg);
+                if (backend < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                sit_set_backend((sit_backend_t) backend);
+                break;
+            case 'v':
+                level = log_level_parse(optarg);
+                if (level < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                log_set_level(level);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    /* next to the database unless given; an empty name turns it off. */
+    if (snapshot_file == NULL) {
+        snprintf(snapshot_default, sizeof(snapshot_default), "%s" SNAPSHOT_SUFFIX, db_file);
+        snapshot_file = snapshot_default;
+    }
+    if (snapshot_file[0] == 0) snapshot_file = NULL;
+
+    log_start();
+    list_cache_init();
+
+    if (sit_open() != SIT_OK) return 1;
+
+    if (db_open(db_file) != SIT_DB_OK) {
+        sit_close();
+        return 1;
+    }
+
+    if (store_open(snapshot_file) != SIT_DB_OK) {
+        db_close();
+        sit_close();
+        return 1;
+    }
+
+    reconcile_all(cpus > 0 ? (size_t) cpus : 1);
+
+    if (job_start(job_workers) != SIT_OK) {
+        store_close();
+        db_close();
+        sit_close();
+        return 1;
+    }
+
+    /* started after the full pass, which repairs whatever drifted while
+     * sitd wasn't running, and after the job workers it repairs through;
+     * 0 turns it off. */
+    if (watch_holdoff > 0 && watch_start(watch_holdoff) != SIT_OK) goto stop;
+
+    /* 0 turns collection off; the endpoints then have nothing to report. */
+    if (stats_interval > 0 && stats_start(stats_interval) != SIT_OK) goto stop;
+    if (latency_interval > 0 && latency_start(latency_interval) != SIT_OK) goto stop;
+
+    api_register_handler_sized(API_POST, "/api/v1/bulk", &bulk_handler, BULK_MAX_BODY);
+    api_register_handler(API_GET, "/api/v1/tunnel/", &tunnel_list_handler);
+    api_register_handler(API_GET, "/api/v1/tunnel/:tunnel_name", &tunnel_get_handler);
+    api_register_handler(API_PUT, "/api/v1/tunnel/:tunnel_name", &tunnel_put_handler);
+    api_register_handler(API_GET, "/api/v1/tunnel/:tunnel_name/stats", &tunnel_stats_handler);
+    api_register_handler(API_GET, "/api/v1/tunnel/:tunnel_name/route/", &route_list_handler);
+    api_register_handler(API_GET, "/metrics", &metrics_handler);
+    api_register_handler(API_GET, "/api/v1/latency", &latency_handler);
+    api_register_handler(API_GET, "/api/v1/lookup/:address", &lookup_handler);
+    api_register_handler(API_GET, "/api/v1/job/:job_id", &job_handler);
+    for (api_method_t m = API_GET; m < API_METHOD_COUNT; m++) {
+        api_register_handler(m, "/api/v1/tunnel/:tunnel_name/route/:route", &route_api_handler);
+        if (m != API_GET) api_register_handler(m, "/api/v1/tunnel/:tunnel_name/route/", &route_api_handler);
+    }
+
+    /* listings and batches are held to a smaller budget and half the
+     * threads, so single-object requests always find one free. */
+    api_set_class(API_POST, "/api/v1/bulk", API_CLASS_BULK);
+    api_set_class(API_GET, "/api/v1/tunnel/", API_CLASS_BULK);
+    api_set_class(API_GET, "/api/v1/tunnel/:tunnel_name/route/", API_CLASS_BULK);
+    api_set_class(API_GET, "/metrics", API_CLASS_BULK);
+
+    /* a request waiting on its jobs sits on a thread for up to a minute;
+     * those get a quarter of the threads. their budget is still their
+     * route's, so the wait class has none of its own. */
+    api_set_wait_arg(API_PUT, "/api/v1/tunnel/:tunnel_name", "wait");
+    api_set_wait_arg(API_POST, "/api/v1/bulk", "wait");
+    api_set_wait_arg(API_GET, "/api/v1/job/:job_id", "wait");
+
+    limit = (api_limit_t) { api_rate, 2.0 * api_rate, 0, 0 };
+    api_set_limit(API_CLASS_INTERACTIVE, &limit);
+    limit = (api_limit_t) { bulk_rate, 2.0 * bulk_rate, threads > 1 ? threads / 2 : 1, BULK_QUEUE };
+    api_set_limit(API_CLASS_BULK, &limit);
+    limit = (api_limit_t) { 0, 0, threads > 3 ? threads / 4 : 1, WAIT_QUEUE };
+    api_set_limit(API_CLASS_WAIT, &limit);
+
+    if (api_start(port, threads) != 0) goto stop;
+
     getchar();
     api_stop();
+    ret = 0;
+
+    /* every stop below is a no-op for a module that didn't start. */
+stop:
     api_clear_handlers();
+    list_cache_clear();
+    watch_stop();
+    job_stop();
+    latency_stop();
+    stats_stop();
+    store_close();
+    db_close();
+    sit_close();
+    log_stop();
 
-    return 0;
-}
\ No newline at end of file
+    return ret;
+}
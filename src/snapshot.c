@@ -0,0 +1,268 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "snapshot.h"
+#include "db.h"
+#include "log.h"
+
+#define SNAPSHOT_MAGIC "SITSNAP"
+#define SNAPSHOT_VERSION 1
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+/* every part is a multiple of 8 bytes, so records stay aligned in the map
+ * and the checksum can run a word at a time. fields are in host order; a
+ * file moved to another kind of host fails the size checks. */
+typedef struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t tunnel_size;
+    uint32_t route_size;
+    uint64_t generation;
+    uint64_t n_tunnels;
+    uint64_t n_routes;
+    uint64_t checksum;
+} snapshot_header_t;
+
+typedef struct snapshot_tunnel {
+    uint32_t id;
+    uint32_t state;
+    uint32_t mtu;
+    struct in_addr local;
+    struct in_addr remote;
+    struct in6_addr address;
+    uint8_t address_len;
+    char name[IFNAMSIZ];
+    uint8_t pad[3];
+} snapshot_tunnel_t;
+
+typedef struct snapshot_route {
+    uint32_t id;
+    uint32_t tunnel_id;
+    struct in6_addr prefix;
+    struct in6_addr nexthop;
+    uint8_t prefix_len;
+    uint8_t pad[7];
+} snapshot_route_t;
+
+static size_t snapshot_size(size_t n_tunnels, size_t n_routes) {
+    return sizeof(snapshot_header_t) + n_tunnels * sizeof(snapshot_tunnel_t) + n_routes * sizeof(snapshot_route_t);
+}
+
+static snapshot_tunnel_t* tunnel_at(const snapshot_t *snap, size_t i) {
+    return (snapshot_tunnel_t *) (snap->data + sizeof(snapshot_header_t)) + i;
+}
+
+static snapshot_route_t* route_at(const snapshot_t *snap, size_t i) {
+    return (snapshot_route_t *) tunnel_at(snap, snap->n_tunnels) + i;
+}
+
+/* fnv-1a over 64-bit words, with the checksum field read as zero. */
+static uint64_t checksum(const char *data, size_t size) {
+    const uint64_t *w = (const uint64_t *) data;
+    size_t skip = offsetof(snapshot_header_t, checksum) / sizeof(uint64_t);
+    uint64_t h = FNV_OFFSET;
+
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+        h ^= i == skip ? 0 : w[i];
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
+
+int snapshot_alloc(snapshot_t *snap, size_t n_tunnels, size_t n_routes, uint64_t generation) {
+    snapshot_header_t *header;
+
+    memset(snap, 0, sizeof(snapshot_t));
+    snap->size = snapshot_size(n_tunnels, n_routes);
+    snap->data = (char *) calloc(1, snap->size);
+    if (snap->data == NULL) {
+        log_fatal("calloc() failed.\n");
+        return SIT_DB_FATAL;
+    }
+
+    snap->n_tunnels = n_tunnels;
+    snap->n_routes = n_routes;
+    snap->generation = generation;
+
+    header = (snapshot_header_t *) snap->data;
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->header_size = sizeof(snapshot_header_t);
+    header->tunnel_size = sizeof(snapshot_tunnel_t);
+    header->route_size = sizeof(snapshot_route_t);
+    header->generation = generation;
+    header->n_tunnels = n_tunnels;
+    header->n_routes = n_routes;
+
+    return SIT_DB_OK;
+}
+
+void snapshot_set_tunnel(snapshot_t *snap, size_t i, const sit_tunnel_t *tunnel) {
+    snapshot_tunnel_t *t = tunnel_at(snap, i);
+
+    t->id = tunnel->id;
+    t->state = (uint32_t) tunnel->state;
+    t->mtu = tunnel->mtu;
+    t->local = tunnel->local;
+    t->remote = tunnel->remote;
+    t->address = tunnel->address.addr;
+    t->address_len = tunnel->address.len;
+    memcpy(t->name, tunnel->name, IFNAMSIZ - 1);
+}
+
+void snapshot_set_route(snapshot_t *snap, size_t i, const sit_route_t *route) {
+    snapshot_route_t *r = route_at(snap, i);
+
+    r->id = route->id;
+    r->tunnel_id = route->tunnel_id;
+    r->prefix = route->prefix.addr;
+    r->prefix_len = route->prefix.len;
+    r->nexthop = route->nexthop;
+}
+
+/* no fsync: a file cut short or half-written by a crash fails the checksum
+ * and is rebuilt from the database, which is all a sync would prevent. */
+int snapshot_write(snapshot_t *snap, const char *file) {
+    char tmp[PATH_MAX];
+    size_t done = 0;
+    ssize_t n;
+    int fd;
+
+    ((snapshot_header_t *) snap->data)->checksum = checksum(snap->data, snap->size);
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int) sizeof(tmp)) {
+        log_error("snapshot path too long: %s.\n", file);
+        return SIT_DB_ERROR;
+    }
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_error("open(): %s: %s.\n", tmp, strerror(errno));
+        return SIT_DB_ERROR;
+    }
+
+    while (done < snap->size) {
+        n = write(fd, snap->data + done, snap->size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            log_error("write(): %s: %s.\n", tmp, strerror(errno));
+            close(fd);
+            unlink(tmp);
+            return SIT_DB_ERROR;
+        }
+        done += (size_t) n;
+    }
+
+    close(fd);
+
+    if (rename(tmp, file) != 0) {
+        log_error("rename(): %s: %s.\n", file, strerror(errno));
+        unlink(tmp);
+        return SIT_DB_ERROR;
+    }
+
+    return SIT_DB_OK;
+}
+
+static bool header_ok(const snapshot_header_t *header, size_t size) {
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) return false;
+    if (header->version != SNAPSHOT_VERSION || header->header_size != sizeof(snapshot_header_t)) return false;
+    if (header->tunnel_size != sizeof(snapshot_tunnel_t) || header->route_size != sizeof(snapshot_route_t)) return false;
+
+    /* counts are checked one at a time first, so the sum can't wrap. */
+    if (header->n_tunnels > size / sizeof(snapshot_tunnel_t) || header->n_routes > size / sizeof(snapshot_route_t)) return false;
+    return snapshot_size(header->n_tunnels, header->n_routes) == size;
+}
+
+int snapshot_map(snapshot_t *snap, const char *file) {
+    const snapshot_header_t *header;
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset(snap, 0, sizeof(snapshot_t));
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) return SIT_DB_NOT_EXIST;
+        log_error("open(): %s: %s.\n", file, strerror(errno));
+        return SIT_DB_ERROR;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(snapshot_header_t)) {
+        close(fd);
+        log_warn("snapshot %s is truncated.\n", file);
+        return SIT_DB_ERROR;
+    }
+
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_error("mmap(): %s: %s.\n", file, strerror(errno));
+        return SIT_DB_ERROR;
+    }
+
+    snap->data = (char *) map;
+    snap->size = (size_t) st.st_size;
+    snap->mapped = true;
+
+    header = (const snapshot_header_t *) map;
+    if (!header_ok(header, snap->size) || header->checksum != checksum(snap->data, snap->size)) {
+        log_warn("snapshot %s is damaged or from another version.\n", file);
+        snapshot_free(snap);
+        return SIT_DB_ERROR;
+    }
+
+    snap->n_tunnels = header->n_tunnels;
+    snap->n_routes = header->n_routes;
+    snap->generation = header->generation;
+
+    return SIT_DB_OK;
+}
+
+void snapshot_get_tunnel(const snapshot_t *snap, size_t i, sit_tunnel_t *tunnel) {
+    const snapshot_tunnel_t *t = tunnel_at(snap, i);
+
+    memset(tunnel, 0, sizeof(sit_tunnel_t));
+    set_val_numeric(tunnel->id, t->id);
+    set_val_numeric(tunnel->state, (tunnel_state_t) t->state);
+    memcpy(tunnel->name, t->name, IFNAMSIZ - 1);
+    tunnel->name_isset = true;
+    set_val_numeric(tunnel->local, t->local);
+    set_val_numeric(tunnel->remote, t->remote);
+    tunnel->address.addr = t->address;
+    tunnel->address.len = t->address_len;
+    tunnel->address_isset = true;
+    set_val_numeric(tunnel->mtu, t->mtu);
+}
+
+void snapshot_get_route(const snapshot_t *snap, size_t i, sit_route_t *route) {
+    const snapshot_route_t *r = route_at(snap, i);
+
+    memset(route, 0, sizeof(sit_route_t));
+    set_val_numeric(route->id, r->id);
+    set_val_numeric(route->tunnel_id, r->tunnel_id);
+    route->prefix.addr = r->prefix;
+    route->prefix.len = r->prefix_len;
+    route->prefix_isset = true;
+    set_val_numeric(route->nexthop, r->nexthop);
+}
+
+void snapshot_free(snapshot_t *snap) {
+    if (snap->data == NULL) return;
+
+    if (snap->mapped) munmap(snap->data, snap->size);
+    else free(snap->data);
+
+    memset(snap, 0, sizeof(snapshot_t));
+}
@@ -0,0 +1,43 @@
+#ifndef SITD_SNAPSHOT_H
+#define SITD_SNAPSHOT_H
+#include <stddef.h>
+#include "types.h"
+
+/* a binary image of every tunnel and route, written next to the database so
+ * startup can map it instead of reading sqlite row by row. fixed-size
+ * records follow a header carrying the format version, record sizes, counts,
+ * the database generation the rows match and a checksum over the file; a
+ * file that fails any of those checks is never used.
+ *
+ * tunnels are in id order, routes grouped by tunnel and in id order within
+ * it, as the store keeps them. return codes are the SIT_DB_* ones. */
+typedef struct snapshot {
+    char *data;
+    size_t size;
+    size_t n_tunnels;
+    size_t n_routes;
+    uint64_t generation;
+    bool mapped;
+} snapshot_t;
+
+/* an empty image with room for the given rows, to be filled in with the
+ * setters and then written. */
+int snapshot_alloc(snapshot_t *snap, size_t n_tunnels, size_t n_routes, uint64_t generation);
+void snapshot_set_tunnel(snapshot_t *snap, size_t i, const sit_tunnel_t *tunnel);
+void snapshot_set_route(snapshot_t *snap, size_t i, const sit_route_t *route);
+
+/* seals the image and replaces file with it: it's written under a temporary
+ * name and renamed over, so readers see the old file or the new one. */
+int snapshot_write(snapshot_t *snap, const char *file);
+
+/* maps file read-only. SIT_DB_NOT_EXIST if there is none, SIT_DB_ERROR if
+ * it's from another version or damaged. */
+int snapshot_map(snapshot_t *snap, const char *file);
+
+/* decoded into a row with every field set and ->next null. */
+void snapshot_get_tunnel(const snapshot_t *snap, size_t i, sit_tunnel_t *tunnel);
+void snapshot_get_route(const snapshot_t *snap, size_t i, sit_route_t *route);
+
+void snapshot_free(snapshot_t *snap);
+
+#endif // SITD_SNAPSHOT_H
@@ -0,0 +1,381 @@
+#include <netlink/netlink.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+#include "sit.h"
+#include "store.h"
+#include "log.h"
+
+#define STATS_SLOTS_INIT 256
+#define STATS_SAMPLES_INIT 256
+#define METRICS_BUF_INIT 0x10000
+
+typedef struct stats_slot {
+    sit_stats_t stats;
+    double at;
+    uint64_t round;
+} stats_slot_t;
+
+typedef struct sample {
+    uint32_t id;
+    char name[IFNAMSIZ];
+    struct rtnl_link_stats64 counters;
+} sample_t;
+
+typedef struct metric {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+} metric_t;
+
+typedef struct text_buf {
+    char *data;
+    size_t len, cap;
+    bool failed;
+} text_buf_t;
+
+static const metric_t metrics[] = {
+    { "sitd_tunnel_receive_bytes_total", "counter", "Bytes received on the tunnel.", offsetof(sit_stats_t, rx_bytes) },
+    { "sitd_tunnel_transmit_bytes_total", "counter", "Bytes sent on the tunnel.", offsetof(sit_stats_t, tx_bytes) },
+    { "sitd_tunnel_receive_packets_total", "counter", "Packets received on the tunnel.", offsetof(sit_stats_t, rx_packets) },
+    { "sitd_tunnel_transmit_packets_total", "counter", "Packets sent on the tunnel.", offsetof(sit_stats_t, tx_packets) },
+    { "sitd_tunnel_receive_errors_total", "counter", "Receive errors on the tunnel.", offsetof(sit_stats_t, rx_errors) },
+    { "sitd_tunnel_transmit_errors_total", "counter", "Transmit errors on the tunnel.", offsetof(sit_stats_t, tx_errors) },
+    { "sitd_tunnel_receive_dropped_total", "counter", "Received packets dropped on the tunnel.", offsetof(sit_stats_t, rx_dropped) },
+    { "sitd_tunnel_transmit_dropped_total", "counter", "Outgoing packets dropped on the tunnel.", offsetof(sit_stats_t, tx_dropped) },
+};
+
+/* slots are indexed by tunnel id. a slot is current when its round is the
+ * last one; tunnels whose link is gone simply fall behind. */
+static pthread_rwlock_t stats_lock = PTHREAD_RWLOCK_INITIALIZER;
+static stats_slot_t *slots = NULL;
+static size_t n_slots = 0;
+static uint64_t round_no = 0;
+static size_t round_links = 0;
+static double round_seconds = 0;
+
+/* collector thread only. */
+static struct nl_sock *stats_sk = NULL;
+static sample_t *samples = NULL;
+static size_t n_samples = 0, cap_samples = 0;
+
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_cond = PTHREAD_COND_INITIALIZER;
+static bool running = false;
+static uint32_t interval_s = 0;
+static pthread_t collector;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* links that aren't tunnels we know of are skipped. */
+static void collect_sample(const char *name, const struct rtnl_link_stats64 *counters, void *data) {
+    uint32_t id;
+
+    (void) data;
+
+    if (store_get_tunnel_id(name, &id) != SIT_DB_OK) return;
+
+    if (n_samples == cap_samples) {
+        size_t cap = cap_samples == 0 ? STATS_SAMPLES_INIT : cap_samples * 2;
+        sample_t *grown = (sample_t *) realloc(samples, cap * sizeof(sample_t));
+        if (grown == NULL) {
+            log_fatal("realloc() failed.\n");
+            return;
+        }
+        samples = grown;
+        cap_samples = cap;
+    }
+
+    samples[n_samples].id = id;
+    strncpy(samples[n_samples].name, name, IFNAMSIZ - 1);
+    samples[n_samples].name[IFNAMSIZ - 1] = 0;
+    samples[n_samples].counters = *counters;
+    ++n_samples;
+}
+
+static int reserve_slots(size_t want) {
+    size_t cap = n_slots == 0 ? STATS_SLOTS_INIT : n_slots;
+    stats_slot_t *grown;
+
+    if (want <= n_slots) return SIT_OK;
+    while (cap < want) cap *= 2;
+
+    grown = (stats_slot_t *) realloc(slots, cap * sizeof(stats_slot_t));
+    if (grown == NULL) {
+        log_fatal("realloc() failed.\n");
+        return SIT_FATAL;
+    }
+
+    memset(&grown[n_slots], 0, (cap - n_slots) * sizeof(stats_slot_t));
+    slots = grown;
+    n_slots = cap;
+
+    return SIT_OK;
+}
+
+/* a counter that went backwards belongs to a recreated link. */
+static double rate(uint64_t cur, uint64_t prev, double dt) {
+    return cur >= prev && dt > 0 ? (cur - prev) / dt : 0;
+}
+
+static void update_slot(stats_slot_t *slot, const sample_t *sample, double at, int64_t wall) {
+    const struct rtnl_link_stats64 *c = &sample->counters;
+    sit_stats_t *s = &slot->stats;
+    bool prev = slot->round != 0 && slot->round + 1 == round_no;
+    double dt = at - slot->at;
+
+    s->rx_bytes_rate = prev ? rate(c->rx_bytes, s->rx_bytes, dt) : 0;
+    s->tx_bytes_rate = prev ? rate(c->tx_bytes, s->tx_bytes, dt) : 0;
+    s->rx_packets_rate = prev ? rate(c->rx_packets, s->rx_packets, dt) : 0;
+    s->tx_packets_rate = prev ? rate(c->tx_packets, s->tx_packets, dt) : 0;
+
+    memcpy(s->name, sample->name, IFNAMSIZ);
+    s->rx_bytes = c->rx_bytes;
+    s->tx_bytes = c->tx_bytes;
+    s->rx_packets = c->rx_packets;
+    s->tx_packets = c->tx_packets;
+    s->rx_errors = c->rx_errors;
+    s->tx_errors = c->tx_errors;
+    s->rx_dropped = c->rx_dropped;
+    s->tx_dropped = c->tx_dropped;
+    s->updated = wall;
+
+    slot->at = at;
+    slot->round = round_no;
+}
+
+/* the dump runs without stats_lock; only folding the samples in holds it. */
+static void collect() {
+    double start = now(), at;
+    int64_t wall = (int64_t) time(NULL);
+    int err;
+
+    n_samples = 0;
+    err = sit_dump_stats(stats_sk, &collect_sample, NULL);
+    if (err != SIT_OK) return;
+    at = now();
+
+    pthread_rwlock_wrlock(&stats_lock);
+
+    ++round_no;
+    for (size_t i = 0; i < n_samples; i++) {
+        if (reserve_slots((size_t) samples[i].id + 1) != SIT_OK) break;
+        update_slot(&slots[samples[i].id], &samples[i], at, wall);
+    }
+    round_links = n_samples;
+    round_seconds = now() - start;
+
+    pthread_rwlock_unlock(&stats_lock);
+}
+
+static void* collect_loop(void *data) {
+    struct timespec deadline;
+
+    (void) data;
+
+    pthread_mutex_lock(&run_lock);
+
+    while (running) {
+        pthread_mutex_unlock(&run_lock);
+        collect();
+        pthread_mutex_lock(&run_lock);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval_s;
+        while (running && pthread_cond_timedwait(&run_cond, &run_lock, &deadline) != ETIMEDOUT);
+    }
+
+    pthread_mutex_unlock(&run_lock);
+    return NULL;
+}
+
+int stats_start(uint32_t interval) {
+    int err;
+
+    pthread_mutex_lock(&run_lock);
+
+    if (running) {
+        log_fatal("stats collector is already running.\n");
+        err = SIT_FATAL;
+        goto end;
+    }
+
+    stats_sk = nl_socket_alloc();
+    if (stats_sk == NULL) {
+        log_fatal("nl_socket_alloc() returned null.\n");
+        err = SIT_FATAL;
+        goto end;
+    }
+
+    err = nl_connect(stats_sk, NETLINK_ROUTE);
+    if (err < 0) {
+        log_fatal("nl_connect(): %s.\n", nl_geterror(err));
+        nl_socket_free(stats_sk);
+        stats_sk = NULL;
+        err = SIT_FATAL;
+        goto end;
+    }
+
+    interval_s = interval;
+    running = true;
+
+    if (pthread_create(&collector, NULL, &collect_loop, NULL) != 0) {
+        log_fatal("pthread_create() failed.\n");
+        running = false;
+        nl_close(stats_sk);
+        nl_socket_free(stats_sk);
+        stats_sk = NULL;
+        err = SIT_FATAL;
+        goto end;
+    }
+
+    log_info("collecting tunnel stats every %us.\n", interval);
+    err = SIT_OK;
+
+end:
+    pthread_mutex_unlock(&run_lock);
+    return err;
+}
+
+int stats_stop() {
+    pthread_mutex_lock(&run_lock);
+    if (!running) {
+        pthread_mutex_unlock(&run_lock);
+        return SIT_OK;
+    }
+    running = false;
+    pthread_cond_signal(&run_cond);
+    pthread_mutex_unlock(&run_lock);
+
+    pthread_join(collector, NULL);
+
+    nl_close(stats_sk);
+    nl_socket_free(stats_sk);
+    stats_sk = NULL;
+    free(samples);
+    samples = NULL;
+    n_samples = cap_samples = 0;
+
+    pthread_rwlock_wrlock(&stats_lock);
+    free(slots);
+    slots = NULL;
+    n_slots = 0;
+    round_no = 0;
+    pthread_rwlock_unlock(&stats_lock);
+
+    return SIT_OK;
+}
+
+int stats_get(uint32_t tunnel_id, sit_stats_t *stats) {
+    int err = SIT_NOT_EXIST;
+
+    pthread_rwlock_rdlock(&stats_lock);
+    if (tunnel_id < n_slots && round_no != 0 && slots[tunnel_id].round == round_no) {
+        *stats = slots[tunnel_id].stats;
+        err = SIT_OK;
+    }
+    pthread_rwlock_unlock(&stats_lock);
+
+    return err;
+}
+
+static void buf_printf(text_buf_t *buf, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (buf->failed) return;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, ap);
+        va_end(ap);
+
+        if (n < 0) {
+            buf->failed = true;
+            return;
+        }
+
+        if ((size_t) n < buf->cap - buf->len) break;
+
+        char *grown = (char *) realloc(buf->data, buf->cap * 2);
+        if (grown == NULL) {
+            log_fatal("realloc() failed.\n");
+            buf->failed = true;
+            return;
+        }
+        buf->data = grown;
+        buf->cap *= 2;
+    }
+
+    buf->len += (size_t) n;
+}
+
+/* label values escape backslash and double quote. */
+static const char* label_value(const char *name, char *out) {
+    char *p = out;
+
+    for (; *name != 0; name++) {
+        if (*name == '\\' || *name == '"') *p++ = '\\';
+        *p++ = *name;
+    }
+    *p = 0;
+
+    return out;
+}
+
+int stats_metrics(char **text, size_t *len) {
+    text_buf_t buf = { .cap = METRICS_BUF_INIT };
+    store_status_t store;
+    char label[IFNAMSIZ * 2];
+
+    buf.data = (char *) malloc(buf.cap);
+    if (buf.data == NULL) {
+        log_fatal("malloc() failed.\n");
+        return SIT_FATAL;
+    }
+
+    pthread_rwlock_rdlock(&stats_lock);
+
+    for (size_t m = 0; m < sizeof(metrics) / sizeof(metric_t); m++) {
+        buf_printf(&buf, "# HELP %s %s\n# TYPE %s %s\n", metrics[m].name, metrics[m].help, metrics[m].name, metrics[m].type);
+
+        for (size_t i = 0; round_no != 0 && i < n_slots; i++) {
+            if (slots[i].round != round_no) continue;
+
+            const sit_stats_t *s = &slots[i].stats;
+            uint64_t value = *(const uint64_t *) ((const char *) s + metrics[m].offset);
+            buf_printf(&buf, "%s{tunnel=\"%s\"} %llu\n", metrics[m].name, label_value(s->name, label), (unsigned long long) value);
+        }
+    }
+
+    buf_printf(&buf, "# HELP sitd_stats_tunnels Tunnels seen by the last collection.\n# TYPE sitd_stats_tunnels gauge\nsitd_stats_tunnels %zu\n", round_links);
+    buf_printf(&buf, "# HELP sitd_stats_collect_seconds Time the last collection took.\n# TYPE sitd_stats_collect_seconds gauge\nsitd_stats_collect_seconds %.6f\n", round_seconds);
+    buf_printf(&buf, "# HELP sitd_stats_collections_total Collections run since start.\n# TYPE sitd_stats_collections_total counter\nsitd_stats_collections_total %llu\n", (unsigned long long) round_no);
+
+    pthread_rwlock_unlock(&stats_lock);
+
+    store_get_status(&store);
+    buf_printf(&buf, "# HELP sitd_store_unpersisted_changes Changes not yet written to the database.\n# TYPE sitd_store_unpersisted_changes gauge\nsitd_store_unpersisted_changes %llu\n", (unsigned long long) store.unpersisted);
+    buf_printf(&buf, "# HELP sitd_store_write_failing Whether the last database write failed and is being retried.\n# TYPE sitd_store_write_failing gauge\nsitd_store_write_failing %d\n", store.failing ? 1 : 0);
+    buf_printf(&buf, "# HELP sitd_store_write_failures_total Database writes that failed and were retried.\n# TYPE sitd_store_write_failures_total counter\nsitd_store_write_failures_total %llu\n", (unsigned long long) store.write_failures);
+    buf_printf(&buf, "# HELP sitd_store_dropped_changes_total Changes the database refused for good and that were dropped.\n# TYPE sitd_store_dropped_changes_total counter\nsitd_store_dropped_changes_total %llu\n", (unsigned long long) store.dropped);
+
+    if (buf.failed) {
+        free(buf.data);
+        return SIT_FATAL;
+    }
+
+    *text = buf.data;
+    *len = buf.len;
+    return SIT_OK;
+}
@@ -0,0 +1,19 @@
+#ifndef SITD_STATS_H
+#define SITD_STATS_H
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+/* samples the counters of every sit link with one link dump per interval
+ * and keeps the latest sample of each tunnel in a flat array indexed by
+ * tunnel id. return codes are the SIT_* ones. */
+int stats_start(uint32_t interval);
+int stats_stop();
+
+/* SIT_NOT_EXIST unless the tunnel's link showed up in the last dump. */
+int stats_get(uint32_t tunnel_id, sit_stats_t *stats);
+
+/* prometheus text format of the last sample; free() *text. */
+int stats_metrics(char **text, size_t *len);
+
+#endif // SITD_STATS_H
@@ -0,0 +1,1217 @@
+#include <pthread.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "store.h"
+#include "radix.h"
+#include "snapshot.h"
+#include "latency.h"
+#include "log.h"
+
+#define STORE_ROWS_INIT 64
+#define STORE_INDEX_INIT 1024
+#define STORE_ADJ_INIT 4
+
+/* a snapshot is written once writes have been quiet this long, so a burst
+ * of small changes costs one rewrite rather than one each. */
+#define STORE_SNAPSHOT_HOLDOFF_MS 1000
+
+/* how long the flusher waits before retrying ops the database refused. */
+#define STORE_RETRY_MS 1000
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+/* open addressing with linear probing over row numbers. a slot holds the row
+ * plus one, so zero marks it empty. tables stay at most half full, and a
+ * delete shifts the rest of its run back instead of leaving a tombstone. */
+typedef struct index {
+    uint32_t *slots;
+    size_t mask;
+    size_t used;
+    const void* (*key)(uint32_t row);
+    uint64_t (*hash)(const void *key);
+    bool (*eq)(const void *a, const void *b);
+} index_t;
+
+typedef struct entry {
+    sit_tunnel_t tunnel;
+    uint32_t *routes;
+    size_t n_routes, cap_routes;
+    uint64_t generation;
+} entry_t;
+
+typedef enum op_type {
+    OP_CREATE,
+    OP_UPDATE,
+} op_type_t;
+
+typedef struct op {
+    op_type_t type;
+    sit_tunnel_t *tunnels;
+    size_t n_tunnels;
+    sit_route_t *routes;
+    size_t n_routes;
+    uint64_t seq;
+    struct op *next;
+} op_t;
+
+/* entries are kept in id order; ids only grow, so new ones are appended.
+ * entry->routes are rows of route_rows, also in id order. */
+static pthread_rwlock_t store_lock = PTHREAD_RWLOCK_INITIALIZER;
+static entry_t *entries = NULL;
+static size_t n_entries = 0, cap_entries = 0;
+static sit_route_t *route_rows = NULL;
+static size_t n_route_rows = 0, cap_route_rows = 0;
+static uint32_t next_tunnel_id = 1, next_route_id = 1;
+
+/* bumped under the write lock by every change; an entry keeps the value
+ * of the last change to it or its routes. read without the lock. */
+static uint64_t store_generation = 0;
+
+static index_t by_name, by_remote, by_address, by_prefix;
+
+/* route prefixes (ref: row plus one) and tunnel address networks (ref: 0),
+ * owned by their tunnel's id. */
+static radix_t prefixes;
+
+/* ops are queued under store_lock, so the database sees them in the order
+ * they were applied here. */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flushed_cond = PTHREAD_COND_INITIALIZER;
+static op_t *queue_head = NULL, *queue_tail = NULL;
+static uint64_t queued = 0, flushed = 0;
+static bool stopping = false, flusher_running = false;
+
+/* failing is set while the last write attempt left ops to retry;
+ * write_failures counts such attempts. dropped counts ops the database
+ * refused for good. */
+static bool failing = false;
+static uint64_t write_failures = 0, dropped = 0;
+static pthread_t flusher;
+
+/* where snapshots go, or null. stale asks the flusher for one as soon as
+ * it starts. diverged is set once ops are dropped, refused or left over at
+ * shutdown: the database then lags the store, and a snapshot of the store
+ * would claim a generation it doesn't match. */
+static char *snapshot_file = NULL;
+static bool stale = false, diverged = false;
+
+static uint64_t hash_bytes(const void *data, size_t len, uint64_t h) {
+    const uint8_t *p = (const uint8_t *) data;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
+
+static uint64_t hash_name(const void *key) {
+    return hash_bytes(key, strlen((const char *) key), FNV_OFFSET);
+}
+
+static uint64_t hash_in_addr(const void *key) {
+    return hash_bytes(key, sizeof(struct in_addr), FNV_OFFSET);
+}
+
+static uint64_t hash_prefix6(const void *key) {
+    const sit_prefix6_t *p = (const sit_prefix6_t *) key;
+    return hash_bytes(&p->len, 1, hash_bytes(&p->addr, sizeof(struct in6_addr), FNV_OFFSET));
+}
+
+static bool eq_name(const void *a, const void *b) {
+    return strcmp((const char *) a, (const char *) b) == 0;
+}
+
+static bool eq_in_addr(const void *a, const void *b) {
+    return ((const struct in_addr *) a)->s_addr == ((const struct in_addr *) b)->s_addr;
+}
+
+static bool eq_prefix6(const void *a, const void *b) {
+    const sit_prefix6_t *pa = (const sit_prefix6_t *) a, *pb = (const sit_prefix6_t *) b;
+    return pa->len == pb->len && memcmp(&pa->addr, &pb->addr, sizeof(struct in6_addr)) == 0;
+}
+
+static const void* key_name(uint32_t row) { return entries[row].tunnel.name; }
+static const void* key_remote(uint32_t row) { return &entries[row].tunnel.remote; }
+static const void* key_address(uint32_t row) { return &entries[row].tunnel.address; }
+static const void* key_prefix(uint32_t row) { return &route_rows[row].prefix; }
+
+static int index_init(index_t *idx, const void* (*key)(uint32_t), uint64_t (*hash)(const void*), bool (*eq)(const void*, const void*)) {
+    idx->slots = (uint32_t *) calloc(STORE_INDEX_INIT, sizeof(uint32_t));
+    if (idx->slots == NULL) {
+        log_fatal("calloc() failed.\n");
+        return SIT_DB_FATAL;
+    }
+
+    idx->mask = STORE_INDEX_INIT - 1;
+    idx->used = 0;
+    idx->key = key;
+    idx->hash = hash;
+    idx->eq = eq;
+
+    return SIT_DB_OK;
+}
+
+static void index_free(index_t *idx) {
+    free(idx->slots);
+    memset(idx, 0, sizeof(index_t));
+}
+
+/* the matching row plus one, or 0. */
+static uint32_t index_find(const index_t *idx, const void *key) {
+    for (size_t i = idx->hash(key) & idx->mask; idx->slots[i] != 0; i = (i + 1) & idx->mask) {
+        if (idx->eq(idx->key(idx->slots[i] - 1), key)) return idx->slots[i];
+    }
+
+    return 0;
+}
+
+static void index_place(uint32_t *slots, size_t mask, uint64_t hash, uint32_t slot) {
+    size_t i = hash & mask;
+
+    while (slots[i] != 0) i = (i + 1) & mask;
+    slots[i] = slot;
+}
+
+/* grows the table until want rows fit, so the adds that follow can't fail. */
+static int index_reserve(index_t *idx, size_t want) {
+    size_t cap = idx->mask + 1;
+    uint32_t *slots;
+
+    if (want * 2 <= cap) return SIT_DB_OK;
+    while (want * 2 > cap) cap *= 2;
+
+    slots = (uint32_t *) calloc(cap, sizeof(uint32_t));
+    if (slots == NULL) {
+        log_fatal("calloc() failed.\n");
+        return SIT_DB_FATAL;
+    }
+
+    for (size_t i = 0; i <= idx->mask; i++) {
+        if (idx->slots[i] != 0) index_place(slots, cap - 1, idx->hash(idx->key(idx->slots[i] - 1)), idx->slots[i]);
+    }
+
+    free(idx->slots);
+    idx->slots = slots;
+    idx->mask = cap - 1;
+
+    return SIT_DB_OK;
+}
+
+static void index_add(index_t *idx, uint32_t row) {
+    index_place(idx->slots, idx->mask, idx->hash(idx->key(row)), row + 1);
+    ++idx->used;
+}
+
+/* must run while the row still holds the key it was added with. */
+static void index_del(index_t *idx, uint32_t row) {
+    size_t i = idx->hash(idx->key(row)) & idx->mask, j, home;
+
+    while (idx->slots[i] != row + 1) {
+        if (idx->slots[i] == 0) return;
+        i = (i + 1) & idx->mask;
+    }
+
+    /* a later row of the run moves into the gap unless its home slot lies
+     * between the gap and where it sits now. */
+    for (j = (i + 1) & idx->mask; idx->slots[j] != 0; j = (j + 1) & idx->mask) {
+        home = idx->hash(idx->key(idx->slots[j] - 1)) & idx->mask;
+        if (((j - home) & idx->mask) >= ((j - i) & idx->mask)) {
+            idx->slots[i] = idx->slots[j];
+            i = j;
+        }
+    }
+
+    idx->slots[i] = 0;
+    --idx->used;
+}
+
+/* the network a tunnel's address sits on. */
+static sit_prefix6_t tunnel_net(const sit_tunnel_t *tunnel) {
+    sit_prefix6_t net = tunnel->address;
+
+    sit_prefix6_mask(&net);
+    return net;
+}
+
+static void index_tunnel(uint32_t row) {
+    index_add(&by_name, row);
+    index_add(&by_remote, row);
+    index_add(&by_address, row);
+}
+
+static void unindex_tunnel(uint32_t row) {
+    index_del(&by_name, row);
+    index_del(&by_remote, row);
+    index_del(&by_address, row);
+}
+
+static int reserve_tunnels(size_t want) {
+    size_t cap = cap_entries == 0 ? STORE_ROWS_INIT : cap_entries;
+    entry_t *grown;
+
+    if (want > cap_entries) {
+        while (cap < want) cap *= 2;
+
+        grown = (entry_t *) realloc(entries, cap * sizeof(entry_t));
+        if (grown == NULL) {
+            log_fatal("realloc() failed.\n");
+            return SIT_DB_FATAL;
+        }
+        entries = grown;
+        cap_entries = cap;
+    }
+
+    if (index_reserve(&by_name, want) != SIT_DB_OK) return SIT_DB_FATAL;
+    if (index_reserve(&by_remote, want) != SIT_DB_OK) return SIT_DB_FATAL;
+    return index_reserve(&by_address, want);
+}
+
+static int reserve_routes(size_t want) {
+    size_t cap = cap_route_rows == 0 ? STORE_ROWS_INIT : cap_route_rows;
+    sit_route_t *grown;
+
+    if (want > cap_route_rows) {
+        while (cap < want) cap *= 2;
+
+        grown = (sit_route_t *) realloc(route_rows, cap * sizeof(sit_route_t));
+        if (grown == NULL) {
+            log_fatal("realloc() failed.\n");
+            return SIT_DB_FATAL;
+        }
+        route_rows = grown;
+        cap_route_rows = cap;
+    }
+
+    return index_reserve(&by_prefix, want);
+}
+
+static int entry_add_route(entry_t *e, uint32_t row) {
+    uint32_t *grown;
+
+    if (e->n_routes == e->cap_routes) {
+        size_t cap = e->cap_routes == 0 ? STORE_ADJ_INIT : e->cap_routes * 2;
+
+        grown = (uint32_t *) realloc(e->routes, cap * sizeof(uint32_t));
+        if (grown == NULL) {
+            log_fatal("realloc() failed.\n");
+            return SIT_DB_FATAL;
+        }
+        e->routes = grown;
+        e->cap_routes = cap;
+    }
+
+    e->routes[e->n_routes++] = row;
+    return SIT_DB_OK;
+}
+
+/* index of the first entry with an id above after. */
+static size_t entry_after(uint32_t after) {
+    size_t lo = 0, hi = n_entries;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].tunnel.id <= after) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo;
+}
+
+static entry_t* entry_by_id(uint32_t id) {
+    size_t i = id == 0 ? n_entries : entry_after(id - 1);
+    return i < n_entries && entries[i].tunnel.id == id ? &entries[i] : NULL;
+}
+
+static int copy_tunnels(const entry_t *from, size_t n, sit_tunnel_t **tunnels, size_t *count) {
+    sit_tunnel_t *rows;
+
+    if (n == 0) return SIT_DB_NOT_EXIST;
+
+    rows = (sit_tunnel_t *) malloc(n * sizeof(sit_tunnel_t));
+    if (rows == NULL) {
+        log_fatal("malloc() failed.\n");
+        return SIT_DB_FATAL;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        rows[i] = from[i].tunnel;
+        rows[i].next = i + 1 < n ? &rows[i + 1] : NULL;
+    }
+
+    *tunnels = rows;
+    if (count != NULL) *count = n;
+
+    return SIT_DB_OK;
+}
+
+/* links each copy to the next slot; the caller ends the list. */
+static void copy_routes(const uint32_t *from, size_t n, sit_route_t *rows) {
+    for (size_t i = 0; i < n; i++) {
+        rows[i] = route_rows[from[i]];
+        rows[i].next = &rows[i + 1];
+    }
+}
+
+static int alloc_routes(size_t n, sit_route_t **routes) {
+    if (n == 0) return SIT_DB_NOT_EXIST;
+
+    *routes = (sit_route_t *) malloc(n * sizeof(sit_route_t));
+    if (*routes == NULL) {
+        log_fatal("malloc() failed.\n");
+        return SIT_DB_FATAL;
+    }
+
+    return SIT_DB_OK;
+}
+
+static void enqueue(op_t *op) {
+    pthread_mutex_lock(&queue_lock);
+
+    if (queue_tail != NULL) queue_tail->next = op;
+    else queue_head = op;
+    queue_tail = op;
+    op->seq = ++queued;
+
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void op_free(op_t *op) {
+    free(op->tunnels);
+    free(op->routes);
+    free(op);
+}
+
+static op_t* op_alloc(op_type_t type, const sit_tunnel_t *tunnels, size_t n_tunnels, const sit_route_t *routes, size_t n_routes) {
+    op_t *op = (op_t *) calloc(1, sizeof(op_t));
+
+    if (op == NULL) goto fail;
+
+    op->type = type;
+    op->n_tunnels = n_tunnels;
+    op->n_routes = n_routes;
+    op->tunnels = (sit_tunnel_t *) malloc(n_tunnels * sizeof(sit_tunnel_t));
+    if (op->tunnels == NULL) goto fail;
+    memcpy(op->tunnels, tunnels, n_tunnels * sizeof(sit_tunnel_t));
+
+    if (n_routes > 0) {
+        op->routes = (sit_route_t *) malloc(n_routes * sizeof(sit_route_t));
+        if (op->routes == NULL) goto fail;
+        memcpy(op->routes, routes, n_routes * sizeof(sit_route_t));
+    }
+
+    return op;
+
+fail:
+    log_fatal("malloc() failed.\n");
+    if (op != NULL) op_free(op);
+    return NULL;
+}
+
+static int write_op(op_t *op) {
+    int err;
+
+    if (op->type == OP_UPDATE) return db_update_tunnel(op->tunnels);
+
+    err = db_begin();
+    if (err != SIT_DB_OK) return err;
+
+    err = db_create_tunnels(op->tunnels, op->n_tunnels, NULL);
+    if (err == SIT_DB_OK && op->n_routes > 0) err = db_create_routes(op->routes, op->n_routes, NULL);
+
+    if (err != SIT_DB_OK) {
+        db_rollback();
+        return err;
+    }
+
+    return db_commit();
+}
+
+/* everything that queued up while the last batch was being written goes in
+ * as one transaction, in order. an op the database refuses for good, like a
+ * constraint it breaks, would fail every retry, so it is dropped and
+ * counted in *lost. the first op that fails for a passing reason ends the
+ * batch: it and everything after it are returned to be retried, so a later
+ * change never lands before an earlier one. if the transaction itself
+ * fails, the whole batch is returned. */
+static op_t* write_ops(op_t *ops, size_t *lost) {
+    op_t **link = &ops, *rest, *next;
+    int err;
+
+    *lost = 0;
+    if (db_begin() != SIT_DB_OK) return ops;
+
+    while ((rest = *link) != NULL) {
+        err = write_op(rest);
+        if (err == SIT_DB_OK) {
+            link = &rest->next;
+            continue;
+        }
+
+        if (err == SIT_DB_BUSY) {
+            log_error("can't persist %s of %s, retrying.\n", rest->type == OP_UPDATE ? "update" : "creation", rest->tunnels[0].name);
+            break;
+        }
+
+        log_error("database refused %s of %s, dropped; the database is behind until restart.\n", rest->type == OP_UPDATE ? "update" : "creation", rest->tunnels[0].name);
+        *link = rest->next;
+        op_free(rest);
+        ++*lost;
+    }
+
+    if (rest == ops) {
+        db_rollback();
+        return ops;
+    }
+
+    err = db_bump_generation();
+    if (err == SIT_DB_OK) err = db_commit();
+    else db_rollback();
+
+    if (err != SIT_DB_OK) {
+        log_error("can't commit, retrying.\n");
+        return ops;
+    }
+
+    for (; ops != rest; ops = next) {
+        next = ops->next;
+        op_free(ops);
+    }
+
+    return rest;
+}
+
+/* only called with no write in flight: before the flusher starts, or from
+ * it between batches. the store matches the database exactly when nothing
+ * is queued, which holds for as long as store_lock is held. */
+static void store_snapshot() {
+    snapshot_t snap;
+    uint64_t generation, start = latency_now();
+    size_t n = 0;
+    bool idle;
+    int err;
+
+    if (snapshot_file == NULL || diverged) return;
+    if (db_get_generation(&generation) != SIT_DB_OK) return;
+
+    pthread_rwlock_rdlock(&store_lock);
+
+    pthread_mutex_lock(&queue_lock);
+    idle = queue_head == NULL;
+    pthread_mutex_unlock(&queue_lock);
+
+    err = idle ? snapshot_alloc(&snap, n_entries, n_route_rows, generation) : SIT_DB_ERROR;
+    if (err == SIT_DB_OK) {
+        for (size_t i = 0; i < n_entries; i++) {
+            snapshot_set_tunnel(&snap, i, &entries[i].tunnel);
+            for (size_t j = 0; j < entries[i].n_routes; j++) snapshot_set_route(&snap, n++, &route_rows[entries[i].routes[j]]);
+        }
+    }
+
+    pthread_rwlock_unlock(&store_lock);
+
+    if (err != SIT_DB_OK) return;
+
+    if (snapshot_write(&snap, snapshot_file) == SIT_DB_OK) {
+        log_debug("snapshot of generation %llu written in %.1f ms.\n", (unsigned long long) generation, (latency_now() - start) / 1e6);
+    }
+    snapshot_free(&snap);
+}
+
+static void deadline(struct timespec *due, long ms) {
+    clock_gettime(CLOCK_REALTIME, due);
+    due->tv_sec += ms / 1000;
+    due->tv_nsec += (ms % 1000) * 1000000;
+    if (due->tv_nsec >= 1000000000) {
+        ++due->tv_sec;
+        due->tv_nsec -= 1000000000;
+    }
+}
+
+static void* flush_loop(void *data) {
+    struct timespec due, retry;
+    op_t *ops, *rest, *last;
+    uint64_t batch;
+    size_t lost;
+    bool dirty = stale;
+
+    (void) data;
+
+    clock_gettime(CLOCK_REALTIME, &due);
+    pthread_mutex_lock(&queue_lock);
+
+    for (;;) {
+        while (queue_head == NULL && !stopping) {
+            if (!dirty) {
+                pthread_cond_wait(&queue_cond, &queue_lock);
+                continue;
+            }
+
+            if (pthread_cond_timedwait(&queue_cond, &queue_lock, &due) != ETIMEDOUT) continue;
+
+            pthread_mutex_unlock(&queue_lock);
+            store_snapshot();
+            pthread_mutex_lock(&queue_lock);
+            dirty = false;
+        }
+        if (queue_head == NULL) break;
+
+        /* after a failure, wait before trying the database again. */
+        if (failing) {
+            deadline(&retry, STORE_RETRY_MS);
+            while (!stopping && pthread_cond_timedwait(&queue_cond, &queue_lock, &retry) != ETIMEDOUT);
+        }
+
+        ops = queue_head;
+        queue_head = queue_tail = NULL;
+        batch = queued;
+        pthread_mutex_unlock(&queue_lock);
+
+        rest = write_ops(ops, &lost);
+
+        pthread_mutex_lock(&queue_lock);
+        failing = rest != NULL;
+        if (lost > 0) {
+            dropped += lost;
+            diverged = true;
+        }
+
+        if (rest != NULL && stopping) {
+            /* nothing will retry them, and the database now lags the store. */
+            for (lost = 0; rest != NULL; rest = ops, lost++) {
+                ops = rest->next;
+                op_free(rest);
+            }
+            log_error("%zu change(s) not persisted; the database is behind until restart.\n", lost);
+            diverged = true;
+        } else if (rest != NULL) {
+            /* back to the front of the queue, ahead of anything newer. */
+            ++write_failures;
+            for (last = rest; last->next != NULL; last = last->next);
+            last->next = queue_head;
+            if (queue_head == NULL) queue_tail = last;
+            queue_head = rest;
+            batch = rest->seq - 1;
+        }
+
+        if (batch > flushed) {
+            flushed = batch;
+            pthread_cond_broadcast(&flushed_cond);
+
+            if (!dirty) {
+                deadline(&due, STORE_SNAPSHOT_HOLDOFF_MS);
+                dirty = true;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&queue_lock);
+
+    /* the queue is drained, so whatever is left pending goes out now. */
+    if (dirty) store_snapshot();
+    return NULL;
+}
+
+static void store_clear() {
+    for (size_t i = 0; i < n_entries; i++) free(entries[i].routes);
+    free(entries);
+    free(route_rows);
+    entries = NULL;
+    route_rows = NULL;
+    n_entries = cap_entries = n_route_rows = cap_route_rows = 0;
+    next_tunnel_id = next_route_id = 1;
+    __atomic_store_n(&store_generation, 0, __ATOMIC_RELEASE);
+
+    index_free(&by_name);
+    index_free(&by_remote);
+    index_free(&by_address);
+    index_free(&by_prefix);
+    radix_free(&prefixes);
+
+    free(snapshot_file);
+    snapshot_file = NULL;
+    stale = diverged = false;
+}
+
+static int store_load_begin(size_t n_tunnels, size_t n_routes) {
+    int err;
+
+    err = index_init(&by_name, &key_name, &hash_name, &eq_name);
+    if (err == SIT_DB_OK) err = index_init(&by_remote, &key_remote, &hash_in_addr, &eq_in_addr);
+    if (err == SIT_DB_OK) err = index_init(&by_address, &key_address, &hash_prefix6, &eq_prefix6);
+    if (err == SIT_DB_OK) err = index_init(&by_prefix, &key_prefix, &hash_prefix6, &eq_prefix6);
+    if (err == SIT_DB_OK && radix_init(&prefixes) != 0) err = SIT_DB_FATAL;
+    if (err == SIT_DB_OK) err = reserve_tunnels(n_tunnels);
+    if (err == SIT_DB_OK) err = reserve_routes(n_routes);
+    if (err == SIT_DB_OK && radix_reserve(&prefixes, n_tunnels + n_routes) != 0) err = SIT_DB_FATAL;
+
+    return err;
+}
+
+/* rows come in id order, all tunnels first; routes are grouped by tunnel.
+ * overlaps that predate the check are kept, but only the first of them is
+ * found by lookups. */
+static void store_load_tunnel(const sit_tunnel_t *tunnel) {
+    sit_prefix6_t net = tunnel_net(tunnel);
+    entry_t *e = &entries[n_entries];
+
+    memset(e, 0, sizeof(entry_t));
+    e->tunnel = *tunnel;
+    e->tunnel.next = NULL;
+    index_tunnel((uint32_t) n_entries++);
+    if (tunnel->id >= next_tunnel_id) next_tunnel_id = tunnel->id + 1;
+
+    if (radix_conflict(&prefixes, &net, tunnel->id, NULL)) log_warn("address of %s overlaps another prefix.\n", tunnel->name);
+    else radix_add(&prefixes, &net, tunnel->id, 0);
+}
+
+/* *e caches the owner of the previous route. */
+static int store_load_route(const sit_route_t *route, entry_t **e) {
+    if (*e == NULL || (*e)->tunnel.id != route->tunnel_id) *e = entry_by_id(route->tunnel_id);
+    if (*e == NULL) {
+        log_warn("route %u belongs to no tunnel, skipped.\n", route->id);
+        return SIT_DB_OK;
+    }
+
+    route_rows[n_route_rows] = *route;
+    route_rows[n_route_rows].next = NULL;
+    if (entry_add_route(*e, (uint32_t) n_route_rows) != SIT_DB_OK) return SIT_DB_FATAL;
+
+    if (radix_conflict(&prefixes, &route->prefix, (*e)->tunnel.id, NULL)) log_warn("route %u overlaps another prefix.\n", route->id);
+    else radix_add(&prefixes, &route->prefix, (*e)->tunnel.id, (uint32_t) n_route_rows + 1);
+
+    index_add(&by_prefix, (uint32_t) n_route_rows++);
+    if (route->id >= next_route_id) next_route_id = route->id + 1;
+
+    return SIT_DB_OK;
+}
+
+static int store_load_db() {
+    sit_tunnel_t *tunnels = NULL;
+    sit_route_t *routes = NULL;
+    size_t n_tunnels = 0, n_routes = 0;
+    entry_t *e = NULL;
+    int err;
+
+    err = db_get_tunnels(&tunnels, &n_tunnels);
+    if (err != SIT_DB_OK && err != SIT_DB_NOT_EXIST) {
+        log_fatal("db_get_tunnels(): can't load tunnels.\n");
+        return SIT_DB_FATAL;
+    }
+
+    err = db_get_all_routes(&routes, &n_routes);
+    if (err != SIT_DB_OK && err != SIT_DB_NOT_EXIST) {
+        log_fatal("db_get_all_routes(): can't load routes.\n");
+        db_free_result_tunnels(tunnels);
+        return SIT_DB_FATAL;
+    }
+
+    err = store_load_begin(n_tunnels, n_routes);
+    for (size_t i = 0; err == SIT_DB_OK && i < n_tunnels; i++) store_load_tunnel(&tunnels[i]);
+    for (size_t i = 0; err == SIT_DB_OK && i < n_routes; i++) err = store_load_route(&routes[i], &e);
+
+    db_free_result_tunnels(tunnels);
+    db_free_result_routes(routes);
+    return err;
+}
+
+static int store_load_snapshot(const snapshot_t *snap) {
+    sit_tunnel_t tunnel;
+    sit_route_t route;
+    entry_t *e = NULL;
+    int err;
+
+    err = store_load_begin(snap->n_tunnels, snap->n_routes);
+    for (size_t i = 0; err == SIT_DB_OK && i < snap->n_tunnels; i++) {
+        snapshot_get_tunnel(snap, i, &tunnel);
+        store_load_tunnel(&tunnel);
+    }
+    for (size_t i = 0; err == SIT_DB_OK && i < snap->n_routes; i++) {
+        snapshot_get_route(snap, i, &route);
+        err = store_load_route(&route, &e);
+    }
+
+    return err;
+}
+
+/* the snapshot is only trusted when it was taken at the generation the
+ * database is at now; otherwise the rows come from sqlite and a fresh
+ * snapshot replaces it. */
+static int store_load(const char *file) {
+    snapshot_t snap;
+    uint64_t generation;
+    int err;
+
+    if (file == NULL) return store_load_db();
+
+    snapshot_file = strdup(file);
+    if (snapshot_file == NULL) {
+        log_fatal("strdup() failed.\n");
+        return SIT_DB_FATAL;
+    }
+
+    err = db_get_generation(&generation);
+    if (err != SIT_DB_OK) return SIT_DB_FATAL;
+
+    err = snapshot_map(&snap, file);
+    if (err == SIT_DB_OK && snap.generation == generation) {
+        err = store_load_snapshot(&snap);
+        snapshot_free(&snap);
+        if (err == SIT_DB_OK) log_info("loaded from snapshot %s.\n", file);
+        return err;
+    }
+
+    if (err == SIT_DB_OK) log_info("snapshot %s is stale, loading from the database.\n", file);
+    snapshot_free(&snap);
+
+    stale = true;
+    return store_load_db();
+}
+
+int store_open(const char *snapshot) {
+    int err;
+
+    pthread_rwlock_wrlock(&store_lock);
+
+    err = store_load(snapshot);
+    if (err != SIT_DB_OK) {
+        store_clear();
+        goto end;
+    }
+
+    stopping = failing = false;
+    if (pthread_create(&flusher, NULL, &flush_loop, NULL) != 0) {
+        log_fatal("pthread_create() failed.\n");
+        store_clear();
+        err = SIT_DB_FATAL;
+        goto end;
+    }
+    flusher_running = true;
+
+    log_info("loaded %zu tunnels and %zu routes.\n", n_entries, n_route_rows);
+
+end:
+    pthread_rwlock_unlock(&store_lock);
+    return err;
+}
+
+int store_flush() {
+    pthread_mutex_lock(&queue_lock);
+
+    uint64_t target = queued;
+    while (flusher_running && flushed < target) pthread_cond_wait(&flushed_cond, &queue_lock);
+
+    pthread_mutex_unlock(&queue_lock);
+    return SIT_DB_OK;
+}
+
+void store_get_status(store_status_t *status) {
+    pthread_mutex_lock(&queue_lock);
+    status->unpersisted = queued - flushed;
+    status->write_failures = write_failures;
+    status->dropped = dropped;
+    status->failing = failing;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+int store_close() {
+    pthread_mutex_lock(&queue_lock);
+    if (!flusher_running) {
+        pthread_mutex_unlock(&queue_lock);
+        log_error("store not yet opened.\n");
+        return SIT_DB_ERROR;
+    }
+    stopping = true;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    /* the flusher drains the queue before it exits. */
+    pthread_join(flusher, NULL);
+
+    pthread_mutex_lock(&queue_lock);
+    flusher_running = false;
+    pthread_cond_broadcast(&flushed_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    pthread_rwlock_wrlock(&store_lock);
+    store_clear();
+    pthread_rwlock_unlock(&store_lock);
+
+    return SIT_DB_OK;
+}
+
+int store_get_tunnels(sit_tunnel_t **tunnels, size_t *count) {
+    int err;
+
+    *tunnels = NULL;
+
+    pthread_rwlock_rdlock(&store_lock);
+    err = copy_tunnels(entries, n_entries, tunnels, count);
+    pthread_rwlock_unlock(&store_lock);
+
+    return err;
+}
+
+int store_get_tunnels_page(uint32_t after, uint32_t limit, sit_tunnel_t **tunnels) {
+    size_t first;
+    int err;
+
+    *tunnels = NULL;
+
+    pthread_rwlock_rdlock(&store_lock);
+    first = entry_after(after);
+    err = copy_tunnels(&entries[first], n_entries - first < limit ? n_entries - first : limit, tunnels, NULL);
+    pthread_rwlock_unlock(&store_lock);
+
+    return err;
+}
+
+int store_get_tunnel(const char *name, sit_tunnel_t **tunnel) {
+    uint32_t slot;
+    int err = SIT_DB_NOT_EXIST;
+
+    *tunnel = NULL;
+
+    pthread_rwlock_rdlock(&store_lock);
+    slot = index_find(&by_name, name);
+    if (slot != 0) err = copy_tunnels(&entries[slot - 1], 1, tunnel, NULL);
+    pthread_rwlock_unlock(&store_lock);
+
+    return err;
+}
+
+int store_get_tunnel_id(const char *name, uint32_t *id) {
+    uint32_t slot;
+
+    pthread_rwlock_rdlock(&store_lock);
+    slot = index_find(&by_name, name);
+    if (slot != 0) *id = entries[slot - 1].tunnel.id;
+    pthread_rwlock_unlock(&store_lock);
+
+    return slot != 0 ? SIT_DB_OK : SIT_DB_NOT_EXIST;
+}
+
+uint64_t store_get_generation() {
+    return __atomic_load_n(&store_generation, __ATOMIC_ACQUIRE);
+}
+
+int store_get_tunnel_generation(const char *name, uint32_t *id, uint64_t *gen) {
+    uint32_t slot;
+
+    pthread_rwlock_rdlock(&store_lock);
+    slot = index_find(&by_name, name);
+    if (slot != 0) {
+        *id = entries[slot - 1].tunnel.id;
+        *gen = entries[slot - 1].generation;
+    }
+    pthread_rwlock_unlock(&store_lock);
+
+    return slot != 0 ? SIT_DB_OK : SIT_DB_NOT_EXIST;
+}
+
+int store_get_tunnel_by_id(uint32_t id, sit_tunnel_t **tunnel) {
+    const entry_t *e;
+    int err = SIT_DB_NOT_EXIST;
+
+    *tunnel = NULL;
+
+    pthread_rwlock_rdlock(&store_lock);
+    e = entry_by_id(id);
+    if (e != NULL) err = copy_tunnels(e, 1, tunnel, NULL);
+    pthread_rwlock_unlock(&store_lock);
+
+    return err;
+}
+
+int store_get_routes(uint32_t tunnel_id, sit_route_t **routes, size_t *count) {
+    const entry_t *e;
+    int err = SIT_DB_NOT_EXIST;
+
+    *routes = NULL;
+
+    pthread_rwlock_rdlock(&store_lock);
+
+    e = entry_by_id(tunnel_id);
+    if (e != NULL) err = alloc_routes(e->n_routes, routes);
+    if (err == SIT_DB_OK) {
+        copy_routes(e->routes, e->n_routes, *routes);
+        (*routes)[e->n_routes - 1].next = NULL;
+        if (count != NULL) *count = e->n_routes;
+    }
+
+    pthread_rwlock_unlock(&store_lock);
+    return err;
+}
+
+int store_get_all_routes(sit_route_t **routes, size_t *count) {
+    size_t n = 0;
+    int err;
+
+    *routes = NULL;
+
+    pthread_rwlock_rdlock(&store_lock);
+
+    err = alloc_routes(n_route_rows, routes);
+    if (err == SIT_DB_OK) {
+        for (size_t i = 0; i < n_entries; i++) {
+            copy_routes(entries[i].routes, entries[i].n_routes, *routes + n);
+            n += entries[i].n_routes;
+        }
+        (*routes)[n - 1].next = NULL;
+        if (count != NULL) *count = n;
+    }
+
+    pthread_rwlock_unlock(&store_lock);
+    return err;
+}
+
+int store_get_routes_page(uint32_t tunnel_id, uint32_t after, uint32_t limit, sit_route_t **routes) {
+    const entry_t *e;
+    size_t lo = 0, hi = 0, n = 0;
+    int err = SIT_DB_NOT_EXIST;
+
+    *routes = NULL;
+
+    pthread_rwlock_rdlock(&store_lock);
+
+    e = entry_by_id(tunnel_id);
+    if (e != NULL) {
+        hi = e->n_routes;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (route_rows[e->routes[mid]].id <= after) lo = mid + 1;
+            else hi = mid;
+        }
+        n = e->n_routes - lo < limit ? e->n_routes - lo : limit;
+        err = alloc_routes(n, routes);
+    }
+
+    if (err == SIT_DB_OK) {
+        copy_routes(&e->routes[lo], n, *routes);
+        (*routes)[n - 1].next = NULL;
+    }
+
+    pthread_rwlock_unlock(&store_lock);
+    return err;
+}
+
+/* drops the rows appended since first and first_route. */
+static void store_truncate(size_t first, size_t first_route) {
+    while (n_route_rows > first_route) {
+        const sit_route_t *r = &route_rows[--n_route_rows];
+        radix_del(&prefixes, &r->prefix, r->tunnel_id, (uint32_t) n_route_rows + 1);
+        index_del(&by_prefix, (uint32_t) n_route_rows);
+    }
+
+    while (n_entries > first) {
+        const sit_tunnel_t *t = &entries[--n_entries].tunnel;
+        sit_prefix6_t net = tunnel_net(t);
+
+        radix_del(&prefixes, &net, t->id, 0);
+        unindex_tunnel((uint32_t) n_entries);
+        free(entries[n_entries].routes);
+    }
+}
+
+int store_create_tunnels(sit_tunnel_t *tunnels, size_t n_tunnels, sit_route_t *routes, size_t n_routes,
+    const size_t *owner, size_t *bad_tunnel, size_t *bad_route) {
+    size_t first, first_route, i;
+    op_t *op;
+    int err;
+
+    *bad_tunnel = *bad_route = SIZE_MAX;
+
+    pthread_rwlock_wrlock(&store_lock);
+
+    first = n_entries;
+    first_route = n_route_rows;
+
+    err = reserve_tunnels(n_entries + n_tunnels);
+    if (err == SIT_DB_OK) err = reserve_routes(n_route_rows + n_routes);
+    if (err == SIT_DB_OK && radix_reserve(&prefixes, n_tunnels + n_routes) != 0) err = SIT_DB_FATAL;
+    if (err != SIT_DB_OK) goto end;
+
+    /* each row is indexed as soon as it's in, so duplicates and overlaps
+     * within the batch are caught as well. */
+    for (i = 0; i < n_tunnels; i++) {
+        sit_tunnel_t *t = &tunnels[i];
+        sit_prefix6_t net = tunnel_net(t);
+        uint32_t id = next_tunnel_id + (uint32_t) i;
+
+        if (index_find(&by_name, t->name) != 0 || index_find(&by_remote, &t->remote) != 0 || index_find(&by_address, &t->address) != 0 ||
+            radix_conflict(&prefixes, &net, id, NULL)) {
+            *bad_tunnel = i;
+            err = SIT_DB_ALREADY_EXIST;
+            goto end;
+        }
+
+        set_val_numeric(t->id, id);
+        memset(&entries[n_entries], 0, sizeof(entry_t));
+        entries[n_entries].tunnel = *t;
+        entries[n_entries].tunnel.next = NULL;
+        index_tunnel((uint32_t) n_entries++);
+        radix_add(&prefixes, &net, id, 0);
+    }
+
+    for (i = 0; i < n_routes; i++) {
+        sit_route_t *r = &routes[i];
+
+        if (index_find(&by_prefix, &r->prefix) != 0 || radix_conflict(&prefixes, &r->prefix, tunnels[owner[i]].id, NULL)) {
+            *bad_route = i;
+            err = SIT_DB_ALREADY_EXIST;
+            goto end;
+        }
+
+        set_val_numeric(r->id, next_route_id + (uint32_t) i);
+        set_val_numeric(r->tunnel_id, tunnels[owner[i]].id);
+        route_rows[n_route_rows] = *r;
+        route_rows[n_route_rows].next = NULL;
+
+        err = entry_add_route(&entries[first + owner[i]], (uint32_t) n_route_rows);
+        if (err != SIT_DB_OK) goto end;
+        radix_add(&prefixes, &r->prefix, r->tunnel_id, (uint32_t) n_route_rows + 1);
+        index_add(&by_prefix, (uint32_t) n_route_rows++);
+    }
+
+    op = op_alloc(OP_CREATE, tunnels, n_tunnels, routes, n_routes);
+    if (op == NULL) {
+        err = SIT_DB_FATAL;
+        goto end;
+    }
+
+    next_tunnel_id += (uint32_t) n_tunnels;
+    next_route_id += (uint32_t) n_routes;
+    __atomic_store_n(&store_generation, store_generation + 1, __ATOMIC_RELEASE);
+    for (i = first; i < n_entries; i++) entries[i].generation = store_generation;
+    enqueue(op);
+
+end:
+    if (err != SIT_DB_OK) store_truncate(first, first_route);
+    pthread_rwlock_unlock(&store_lock);
+    return err;
+}
+
+/* called with the write lock held. */
+static int update_tunnel(entry_t *e, const sit_tunnel_t *tunnel) {
+    sit_prefix6_t net = tunnel_net(tunnel), old_net;
+    bool moved;
+    uint32_t row = (uint32_t) (e - entries), slot;
+    op_t *op;
+
+    if (((slot = index_find(&by_name, tunnel->name)) != 0 && slot != row + 1) ||
+        ((slot = index_find(&by_remote, &tunnel->remote)) != 0 && slot != row + 1) ||
+        ((slot = index_find(&by_address, &tunnel->address)) != 0 && slot != row + 1)) {
+        return SIT_DB_ALREADY_EXIST;
+    }
+
+    old_net = tunnel_net(&e->tunnel);
+    moved = !eq_prefix6(&net, &old_net);
+    if (moved && radix_conflict(&prefixes, &net, tunnel->id, NULL)) return SIT_DB_ALREADY_EXIST;
+
+    if (radix_reserve(&prefixes, 1) != 0) return SIT_DB_FATAL;
+
+    op = op_alloc(OP_UPDATE, tunnel, 1, NULL, 0);
+    if (op == NULL) return SIT_DB_FATAL;
+
+    unindex_tunnel(row);
+    e->tunnel = *tunnel;
+    e->tunnel.next = NULL;
+    index_tunnel(row);
+
+    if (moved) {
+        radix_del(&prefixes, &old_net, tunnel->id, 0);
+        radix_add(&prefixes, &net, tunnel->id, 0);
+    }
+
+    __atomic_store_n(&store_generation, store_generation + 1, __ATOMIC_RELEASE);
+    e->generation = store_generation;
+    enqueue(op);
+
+    return SIT_DB_OK;
+}
+
+int store_update_tunnel(const sit_tunnel_t *tunnel) {
+    entry_t *e;
+    int err;
+
+    pthread_rwlock_wrlock(&store_lock);
+
+    e = entry_by_id(tunnel->id);
+    err = e != NULL ? update_tunnel(e, tunnel) : SIT_DB_NOT_EXIST;
+
+    pthread_rwlock_unlock(&store_lock);
+    return err;
+}
+
+int store_patch_tunnel(const char *name, const sit_tunnel_t *patch, sit_tunnel_t **tunnel, sit_prefix6_t *replaced) {
+    sit_tunnel_t t;
+    uint32_t slot;
+    int err;
+
+    *tunnel = NULL;
+
+    pthread_rwlock_wrlock(&store_lock);
+
+    slot = index_find(&by_name, name);
+    if (slot == 0) {
+        err = SIT_DB_NOT_EXIST;
+        goto end;
+    }
+
+    t = entries[slot - 1].tunnel;
+    *replaced = t.address;
+    if (isset(patch->name)) strcpy(t.name, patch->name);
+    if (isset(patch->local)) t.local = patch->local;
+    if (isset(patch->remote)) t.remote = patch->remote;
+    if (isset(patch->address)) t.address = patch->address;
+    if (isset(patch->mtu)) t.mtu = patch->mtu;
+    if (isset(patch->state)) t.state = patch->state;
+
+    err = update_tunnel(&entries[slot - 1], &t);
+    if (err == SIT_DB_OK) err = copy_tunnels(&entries[slot - 1], 1, tunnel, NULL);
+
+end:
+    pthread_rwlock_unlock(&store_lock);
+    return err;
+}
+
+int store_lookup(const sit_prefix6_t *prefix, sit_tunnel_t **tunnel, sit_route_t **route) {
+    radix_hit_t hit;
+    const entry_t *e = NULL;
+    int err = SIT_DB_NOT_EXIST;
+
+    *tunnel = NULL;
+    *route = NULL;
+
+    pthread_rwlock_rdlock(&store_lock);
+
+    if (radix_lookup(&prefixes, prefix, &hit)) e = entry_by_id(hit.owner);
+    if (e != NULL) err = copy_tunnels(e, 1, tunnel, NULL);
+    if (err == SIT_DB_OK && hit.ref != 0) {
+        err = alloc_routes(1, route);
+        if (err == SIT_DB_OK) {
+            **route = route_rows[hit.ref - 1];
+            (*route)->next = NULL;
+        } else {
+            free(*tunnel);
+            *tunnel = NULL;
+        }
+    }
+
+    pthread_rwlock_unlock(&store_lock);
+    return err;
+}
+
+void store_free_result_tunnels(sit_tunnel_t *tunnels) {
+    free(tunnels);
+}
+
+void store_free_result_routes(sit_route_t *routes) {
+    free(routes);
+}
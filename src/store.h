@@ -0,0 +1,72 @@
+#ifndef SITD_STORE_H
+#define SITD_STORE_H
+#include <stddef.h>
+#include "types.h"
+#include "db.h"
+
+/* the authoritative copy of every tunnel and route, loaded from the database
+ * by store_open(). reads and uniqueness checks never touch sqlite; changes
+ * are applied here first and written behind by a flusher thread that groups
+ * whatever queued up during the previous commit into one transaction.
+ *
+ * with a snapshot file, store_open() maps that instead when it matches the
+ * database, and the flusher rewrites it once writes have settled.
+ *
+ * return codes are the SIT_DB_* ones. list results are contiguous arrays
+ * whose ->next links each element to the following one; count may be null.
+ * release them with store_free_result_*(). */
+int store_open(const char *snapshot);
+int store_close();
+int store_flush();
+
+/* write-behind progress. unpersisted counts changes not yet in the
+ * database; while failing, they are retried every second. dropped counts
+ * changes the database refused for good; it lacks them until restart. */
+typedef struct store_status {
+    uint64_t unpersisted;
+    uint64_t write_failures;
+    uint64_t dropped;
+    bool failing;
+} store_status_t;
+
+void store_get_status(store_status_t *status);
+
+int store_get_tunnels(sit_tunnel_t **tunnels, size_t *count);
+int store_get_tunnels_page(uint32_t after, uint32_t limit, sit_tunnel_t **tunnels);
+int store_get_tunnel(const char *name, sit_tunnel_t **tunnel);
+int store_get_tunnel_id(const char *name, uint32_t *id);
+int store_get_tunnel_by_id(uint32_t id, sit_tunnel_t **tunnel);
+
+/* change counters for cached listings: the store's goes up with every
+ * change, a tunnel's is the store's at the last change to it or its routes.
+ * both start over at store_open(); the store's is read without locking. */
+uint64_t store_get_generation();
+int store_get_tunnel_generation(const char *name, uint32_t *id, uint64_t *generation);
+
+int store_get_routes(uint32_t tunnel_id, sit_route_t **routes, size_t *count);
+int store_get_all_routes(sit_route_t **routes, size_t *count);
+int store_get_routes_page(uint32_t tunnel_id, uint32_t after, uint32_t limit, sit_route_t **routes);
+
+/* all-or-nothing. routes[k] belongs to tunnels[owner[k]]. ids are assigned
+ * and written back, along with each route's tunnel_id. prefixes and address
+ * networks of different tunnels may not overlap. on a conflict,
+ * *bad_tunnel or *bad_route is the index of the offending row and the other
+ * one is SIZE_MAX. */
+int store_create_tunnels(sit_tunnel_t *tunnels, size_t n_tunnels, sit_route_t *routes, size_t n_routes,
+    const size_t *owner, size_t *bad_tunnel, size_t *bad_route);
+int store_update_tunnel(const sit_tunnel_t *tunnel);
+
+/* store_update_tunnel() on the fields set in patch, read and written under
+ * one lock so concurrent patches don't lose each other's fields. *tunnel is
+ * the result and *replaced the address it had before. */
+int store_patch_tunnel(const char *name, const sit_tunnel_t *patch, sit_tunnel_t **tunnel, sit_prefix6_t *replaced);
+
+/* longest-prefix match over route prefixes and tunnel address networks.
+ * *route is the matching route, or null when prefix falls in the tunnel's
+ * own network. both are freed with store_free_result_*(). */
+int store_lookup(const sit_prefix6_t *prefix, sit_tunnel_t **tunnel, sit_route_t **route);
+
+void store_free_result_tunnels(sit_tunnel_t *tunnels);
+void store_free_result_routes(sit_route_t *routes);
+
+#endif // SITD_STORE_H
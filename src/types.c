@@ -0,0 +1,245 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "types.h"
+#include "log.h"
+
+static const char *err_names[] = {
+    "ERR_OK",
+    "ERR_UNKNOW",
+    "ERR_BAD_STATE",
+    "ERR_BAD_NAME",
+    "ERR_BAD_LOCAL",
+    "ERR_BAD_REMOTE",
+    "ERR_BAD_ADDRESS",
+    "ERR_BAD_MTU",
+    "ERR_BAD_PREFIX",
+    "ERR_BAD_NEXTHOP",
+    "ERR_NOT_FOUND",
+    "ERR_EXIST",
+    "ERR_BUSY"
+};
+
+static const char *state_names[] = {
+    "running",
+    "stopped",
+    "restarting",
+    "reloading"
+};
+
+const char* sit_strerror(sit_err_t err) {
+    if ((size_t) err >= sizeof(err_names) / sizeof(err_names[0])) return err_names[ERR_UNKNOW];
+    return err_names[err];
+}
+
+/* "addr" or "addr/len"; a bare address is a /128. */
+int sit_prefix6_parse(const char *str, sit_prefix6_t *prefix) {
+    char buf[SIT_PREFIX6_STRLEN];
+    char *slash, *end;
+    long len = 128;
+
+    if (strlen(str) >= sizeof(buf)) return -1;
+    strcpy(buf, str);
+
+    slash = strchr(buf, '/');
+    if (slash != NULL) {
+        *slash = 0;
+        len = strtol(slash + 1, &end, 10);
+        if (*end != 0 || end == slash + 1 || len < 0 || len > 128) return -1;
+    }
+
+    if (inet_pton(AF_INET6, buf, &prefix->addr) != 1) return -1;
+    prefix->len = (uint8_t) len;
+
+    return 0;
+}
+
+/* clears the host bits, the way the kernel stores a route destination. */
+void sit_prefix6_mask(sit_prefix6_t *prefix) {
+    for (int i = 0; i < 16; i++) {
+        int bits = prefix->len - i * 8;
+        if (bits >= 8) continue;
+        prefix->addr.s6_addr[i] &= bits <= 0 ? 0 : (uint8_t) (0xff << (8 - bits));
+    }
+}
+
+/* buf must hold SIT_PREFIX6_STRLEN bytes. */
+const char* sit_prefix6_str(const sit_prefix6_t *prefix, char *buf) {
+    inet_ntop(AF_INET6, &prefix->addr, buf, INET6_ADDRSTRLEN);
+    snprintf(buf + strlen(buf), SIT_PREFIX6_STRLEN - strlen(buf), "/%u", prefix->len);
+    return buf;
+}
+
+/* copy a json string field into a fixed buffer, rejecting wrong types and
+ * anything that doesn't fit. returns 1 if copied, 0 if absent, -1 if bad. */
+static int get_string(const json_t *json, const char *key, char *dst, size_t dst_sz) {
+    const json_t *val = json_object_get(json, key);
+
+    if (val == NULL) return 0;
+    if (!json_is_string(val) || json_string_length(val) >= dst_sz) return -1;
+
+    strcpy(dst, json_string_value(val));
+    return 1;
+}
+
+int sit_tunnel_to_json(const sit_tunnel_t *tunnel, json_t **json) {
+    char buf[SIT_PREFIX6_STRLEN];
+
+    *json = json_object();
+    if (*json == NULL) {
+        log_fatal("json_object() failed.\n");
+        return ERR_UNKNOW;
+    }
+
+    if (isset(tunnel->name)) json_object_set_new(*json, "name", json_string(tunnel->name));
+    if (isset(tunnel->state) && (size_t) tunnel->state < sizeof(state_names) / sizeof(state_names[0])) {
+        json_object_set_new(*json, "state", json_string(state_names[tunnel->state]));
+    }
+    if (isset(tunnel->local)) json_object_set_new(*json, "local", json_string(inet_ntop(AF_INET, &tunnel->local, buf, sizeof(buf))));
+    if (isset(tunnel->remote)) json_object_set_new(*json, "remote", json_string(inet_ntop(AF_INET, &tunnel->remote, buf, sizeof(buf))));
+    if (isset(tunnel->address)) json_object_set_new(*json, "address", json_string(sit_prefix6_str(&tunnel->address, buf)));
+    if (isset(tunnel->mtu) && tunnel->mtu != 0) json_object_set_new(*json, "mtu", json_integer(tunnel->mtu));
+
+    return ERR_OK;
+}
+
+int sit_route_to_json(const sit_route_t *route, json_t **json) {
+    char buf[SIT_PREFIX6_STRLEN];
+
+    *json = json_object();
+    if (*json == NULL) {
+        log_fatal("json_object() failed.\n");
+        return ERR_UNKNOW;
+    }
+
+    if (isset(route->prefix)) json_object_set_new(*json, "prefix", json_string(sit_prefix6_str(&route->prefix, buf)));
+    if (isset(route->nexthop)) json_object_set_new(*json, "nexthop", json_string(inet_ntop(AF_INET6, &route->nexthop, buf, sizeof(buf))));
+
+    return ERR_OK;
+}
+
+int sit_stats_to_json(const sit_stats_t *stats, json_t **json) {
+    *json = json_pack("{s:s, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:f, s:f, s:f, s:f, s:I}",
+        "name", stats->name,
+        "rx_bytes", (json_int_t) stats->rx_bytes, "tx_bytes", (json_int_t) stats->tx_bytes,
+        "rx_packets", (json_int_t) stats->rx_packets, "tx_packets", (json_int_t) stats->tx_packets,
+        "rx_errors", (json_int_t) stats->rx_errors, "tx_errors", (json_int_t) stats->tx_errors,
+        "rx_dropped", (json_int_t) stats->rx_dropped, "tx_dropped", (json_int_t) stats->tx_dropped,
+        "rx_bytes_rate", stats->rx_bytes_rate, "tx_bytes_rate", stats->tx_bytes_rate,
+        "rx_packets_rate", stats->rx_packets_rate, "tx_packets_rate", stats->tx_packets_rate,
+        "updated", (json_int_t) stats->updated);
+
+    if (*json == NULL) {
+        log_fatal("json_pack() failed.\n");
+        return ERR_UNKNOW;
+    }
+
+    return ERR_OK;
+}
+
+int json_to_sit_tunnel(const json_t *json, sit_tunnel_t **tunnel) {
+    char buf[SIT_PREFIX6_STRLEN];
+    sit_tunnel_t *t;
+    const json_t *val;
+    int r, err = ERR_OK;
+
+    *tunnel = NULL;
+    if (!json_is_object(json)) return ERR_UNKNOW;
+
+    t = (sit_tunnel_t *) calloc(1, sizeof(sit_tunnel_t));
+    if (t == NULL) {
+        log_fatal("calloc() failed.\n");
+        return ERR_UNKNOW;
+    }
+
+    r = get_string(json, "name", t->name, IFNAMSIZ);
+    if (r < 0 || (r == 1 && t->name[0] == 0)) {
+        err = ERR_BAD_NAME;
+        goto end;
+    }
+    t->name_isset = r == 1;
+
+    val = json_object_get(json, "state");
+    if (val != NULL) {
+        size_t i;
+        for (i = 0; i < sizeof(state_names) / sizeof(state_names[0]); i++) {
+            if (json_is_string(val) && strcmp(json_string_value(val), state_names[i]) == 0) break;
+        }
+        if (i == sizeof(state_names) / sizeof(state_names[0])) {
+            err = ERR_BAD_STATE;
+            goto end;
+        }
+        set_val_numeric(t->state, (tunnel_state_t) i);
+    }
+
+    r = get_string(json, "local", buf, INET_ADDRSTRLEN);
+    if (r < 0 || (r == 1 && inet_pton(AF_INET, buf, &t->local) != 1)) {
+        err = ERR_BAD_LOCAL;
+        goto end;
+    }
+    t->local_isset = r == 1;
+
+    r = get_string(json, "remote", buf, INET_ADDRSTRLEN);
+    if (r < 0 || (r == 1 && inet_pton(AF_INET, buf, &t->remote) != 1)) {
+        err = ERR_BAD_REMOTE;
+        goto end;
+    }
+    t->remote_isset = r == 1;
+
+    r = get_string(json, "address", buf, SIT_PREFIX6_STRLEN);
+    if (r < 0 || (r == 1 && sit_prefix6_parse(buf, &t->address) != 0)) {
+        err = ERR_BAD_ADDRESS;
+        goto end;
+    }
+    t->address_isset = r == 1;
+
+    val = json_object_get(json, "mtu");
+    if (val != NULL) {
+        if (!json_is_integer(val) || json_integer_value(val) < 0 || json_integer_value(val) > 65535) {
+            err = ERR_BAD_MTU;
+            goto end;
+        }
+        set_val_numeric(t->mtu, (uint32_t) json_integer_value(val));
+    }
+
+end:
+    if (err != ERR_OK) free(t);
+    else *tunnel = t;
+    return err;
+}
+
+int json_to_sit_route(const json_t *json, sit_route_t **route) {
+    char buf[SIT_PREFIX6_STRLEN];
+    sit_route_t *r;
+    int got, err = ERR_OK;
+
+    *route = NULL;
+    if (!json_is_object(json)) return ERR_UNKNOW;
+
+    r = (sit_route_t *) calloc(1, sizeof(sit_route_t));
+    if (r == NULL) {
+        log_fatal("calloc() failed.\n");
+        return ERR_UNKNOW;
+    }
+
+    got = get_string(json, "prefix", buf, SIT_PREFIX6_STRLEN);
+    if (got < 0 || (got == 1 && sit_prefix6_parse(buf, &r->prefix) != 0)) {
+        err = ERR_BAD_PREFIX;
+        goto end;
+    }
+    sit_prefix6_mask(&r->prefix);
+    r->prefix_isset = got == 1;
+
+    got = get_string(json, "nexthop", buf, INET6_ADDRSTRLEN);
+    if (got < 0 || (got == 1 && inet_pton(AF_INET6, buf, &r->nexthop) != 1)) {
+        err = ERR_BAD_NEXTHOP;
+        goto end;
+    }
+    r->nexthop_isset = got == 1;
+
+end:
+    if (err != ERR_OK) free(r);
+    else *route = r;
+    return err;
+}
@@ -9,17 +9,44 @@
 
 typedef enum tunnel_state {
     STATE_RUNNING,
-    STETE_STOPPED
+    STETE_STOPPED,
+    STATE_RESTARTING, // request only, never stored.
+    STATE_RELOADING // request only, never stored.
 } tunnel_state_t;
 
+typedef enum sit_err {
+    ERR_OK,
+    ERR_UNKNOW,
+    ERR_BAD_STATE,
+    ERR_BAD_NAME,
+    ERR_BAD_LOCAL,
+    ERR_BAD_REMOTE,
+    ERR_BAD_ADDRESS,
+    ERR_BAD_MTU,
+    ERR_BAD_PREFIX,
+    ERR_BAD_NEXTHOP,
+    ERR_NOT_FOUND,
+    ERR_EXIST,
+    ERR_BUSY
+} sit_err_t;
+
 #define field(type, name) type name; bool name##_isset
 #define array_field(type, len, name) type name[len]; bool name##_isset
 
+/* addresses are kept in binary form; text only exists at the api edge and
+ * in logs. */
+typedef struct sit_prefix6 {
+    struct in6_addr addr;
+    uint8_t len;
+} sit_prefix6_t;
+
+#define SIT_PREFIX6_STRLEN (INET6_ADDRSTRLEN + 4)
+
 typedef struct sit_route {
     field(uint32_t, id);
     field(uint32_t, tunnel_id);
-    array_field(char, INET6_ADDRSTRLEN + 4, prefix);
-    array_field(char, INET6_ADDRSTRLEN, nexthop);
+    field(sit_prefix6_t, prefix);
+    field(struct in6_addr, nexthop);
     struct sit_route *next;
 } sit_route_t;
 
@@ -27,20 +54,40 @@ typedef struct sit_tunnel {
     field(uint32_t, id);
     field(tunnel_state_t, state);
     array_field(char, IFNAMSIZ, name);
-    array_field(char, INET_ADDRSTRLEN, local);
-    array_field(char, INET_ADDRSTRLEN, remote);
-    array_field(char, INET6_ADDRSTRLEN + 4, address);
+    field(struct in_addr, local);
+    field(struct in_addr, remote);
+    field(sit_prefix6_t, address);
     field(uint32_t, mtu);
     struct sit_tunnel *next;
 } sit_tunnel_t;
 
+/* traffic counters of a tunnel link, as of its last sample; the rates are per
+ * second over the interval before it. */
+typedef struct sit_stats {
+    char name[IFNAMSIZ];
+    uint64_t rx_bytes, tx_bytes;
+    uint64_t rx_packets, tx_packets;
+    uint64_t rx_errors, tx_errors;
+    uint64_t rx_dropped, tx_dropped;
+    double rx_bytes_rate, tx_bytes_rate;
+    double rx_packets_rate, tx_packets_rate;
+    int64_t updated;
+} sit_stats_t;
+
 #define set_val_numeric(obj_path, value) {obj_path = value; obj_path##_isset = true;}
 #define set_val_string(obj_path, src, length) {strncpy(obj_path, src, length); obj_path##_isset = true;}
 #define isset(obj_path) ( obj_path##_isset )
 
+const char* sit_strerror(sit_err_t err);
+
+int sit_prefix6_parse(const char *str, sit_prefix6_t *prefix);
+void sit_prefix6_mask(sit_prefix6_t *prefix);
+const char* sit_prefix6_str(const sit_prefix6_t *prefix, char *buf);
+
 int sit_tunnel_to_json(const sit_tunnel_t *tunnel, json_t **json);
 int sit_route_to_json(const sit_route_t *route, json_t **json);
 int json_to_sit_route(const json_t *json, sit_route_t **route);
-int json_to_sit_tunnel(const json_t *json, sit_route_t **route);
+int json_to_sit_tunnel(const json_t *json, sit_tunnel_t **tunnel);
+int sit_stats_to_json(const sit_stats_t *stats, json_t **json);
 
 #endif // SITD_TYPES_H
\ No newline at end of file
@@ -0,0 +1,599 @@
+#include <netlink/netlink.h>
+#include <netlink/msg.h>
+#include <netlink/attr.h>
+#include <netlink/route/rtnl.h>
+#include <linux/if.h>
+#include <linux/if_arp.h>
+#include <linux/if_link.h>
+#include <linux/if_tunnel.h>
+#include <linux/rtnetlink.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "watch.h"
+#include "sit.h"
+#include "store.h"
+#include "job.h"
+#include "log.h"
+
+#define WATCH_RCVBUF_SZ (4 << 20)
+#define WATCH_SLOTS_INIT 256
+#define WATCH_PENDING_INIT 64
+#define WATCH_RATE 50
+#define WATCH_BURST 50
+#define WATCH_FLAP_WINDOW 10000
+#define WATCH_BACKOFF_MIN 1000
+#define WATCH_BACKOFF_MAX 60000
+#define WATCH_JOB_POLL 50
+
+#define DRIFT_LINK 0x01
+#define DRIFT_ADDRESS 0x02
+#define DRIFT_ROUTES 0x04
+
+/* indexed by tunnel id; times are monotonic milliseconds. a slot with drift
+ * set or a repair job outstanding is in the pending list. */
+typedef struct watch_slot {
+    int ifindex;
+    uint8_t drift;
+    uint8_t job_drift;
+    uint64_t job;
+    uint64_t due;
+    uint64_t repaired;
+    uint32_t backoff;
+} watch_slot_t;
+
+/* watcher thread only. */
+static struct nl_sock *event_sk = NULL, *query_sk = NULL;
+static watch_slot_t *slots = NULL;
+static size_t n_slots = 0;
+static uint32_t *pending = NULL;
+static size_t n_pending = 0, cap_pending = 0;
+static double tokens = 0;
+static uint64_t refilled = 0;
+static uint64_t resync_due = 0;
+
+/* id of the last tunnel an unfinished resync queued, or 0; a retry goes on
+ * from there. again is set when events are dropped during it, so a full
+ * pass follows. */
+static uint32_t resync_cursor = 0;
+static bool resync_again = false;
+
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool running = false;
+static int wake_fd = -1;
+static uint32_t holdoff_ms = 0;
+static pthread_t watcher;
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static watch_slot_t* slot_get(uint32_t id) {
+    size_t cap = n_slots == 0 ? WATCH_SLOTS_INIT : n_slots;
+    watch_slot_t *grown;
+
+    if (id < n_slots) return &slots[id];
+    while (cap <= id) cap *= 2;
+
+    grown = (watch_slot_t *) realloc(slots, cap * sizeof(watch_slot_t));
+    if (grown == NULL) {
+        log_fatal("realloc() failed.\n");
+        return NULL;
+    }
+
+    memset(&grown[n_slots], 0, (cap - n_slots) * sizeof(watch_slot_t));
+    slots = grown;
+    n_slots = cap;
+
+    return &slots[id];
+}
+
+/* the first event starts the holdoff; later ones only add to what's to be
+ * checked, so a burst of them costs one repair. */
+static void mark(uint32_t id, uint8_t drift) {
+    watch_slot_t *slot = slot_get(id);
+    uint64_t due;
+
+    if (slot == NULL) return;
+
+    if (slot->drift == 0) {
+        if (slot->job == 0 && n_pending == cap_pending) {
+            size_t cap = cap_pending == 0 ? WATCH_PENDING_INIT : cap_pending * 2;
+            uint32_t *grown = (uint32_t *) realloc(pending, cap * sizeof(uint32_t));
+            if (grown == NULL) {
+                log_fatal("realloc() failed.\n");
+                return;
+            }
+            pending = grown;
+            cap_pending = cap;
+        }
+
+        if (slot->job == 0) pending[n_pending++] = id;
+        due = now_ms() + holdoff_ms;
+        slot->due = slot->repaired + slot->backoff > due ? slot->repaired + slot->backoff : due;
+    }
+
+    slot->drift |= drift;
+}
+
+static bool link_drifted(const sit_tunnel_t *tunnel, const struct ifinfomsg *ifi, struct nlattr **tb) {
+    struct nlattr *info[IFLA_INFO_MAX + 1], *data[IFLA_IPTUN_MAX + 1];
+
+    if (tunnel->state == STETE_STOPPED || !(ifi->ifi_flags & IFF_UP)) return true;
+    if (tunnel->mtu != 0 && tb[IFLA_MTU] != NULL && nla_get_u32(tb[IFLA_MTU]) != tunnel->mtu) return true;
+
+    if (tb[IFLA_LINKINFO] == NULL || nla_parse_nested(info, IFLA_INFO_MAX, tb[IFLA_LINKINFO], NULL) < 0) return false;
+    if (info[IFLA_INFO_DATA] == NULL || nla_parse_nested(data, IFLA_IPTUN_MAX, info[IFLA_INFO_DATA], NULL) < 0) return false;
+
+    if (data[IFLA_IPTUN_LOCAL] != NULL && nla_get_u32(data[IFLA_IPTUN_LOCAL]) != tunnel->local.s_addr) return true;
+    if (data[IFLA_IPTUN_REMOTE] != NULL && nla_get_u32(data[IFLA_IPTUN_REMOTE]) != tunnel->remote.s_addr) return true;
+    if (data[IFLA_IPTUN_TTL] != NULL && nla_get_u8(data[IFLA_IPTUN_TTL]) != 255) return true;
+
+    return false;
+}
+
+/* a sit link that isn't named after any tunnel, but had been: it was
+ * renamed behind our back. */
+static void link_renamed(int ifindex) {
+    for (size_t id = 0; id < n_slots; id++) {
+        if (slots[id].ifindex != ifindex) continue;
+        slots[id].ifindex = 0;
+        mark((uint32_t) id, DRIFT_LINK);
+    }
+}
+
+/* messages are read raw, like the stats dump; only sit links matter. */
+static void link_event(struct nlmsghdr *nlh) {
+    struct nlattr *tb[IFLA_MAX + 1];
+    struct ifinfomsg *ifi;
+    sit_tunnel_t *tunnel = NULL;
+    watch_slot_t *slot;
+
+    if (!nlmsg_valid_hdr(nlh, sizeof(struct ifinfomsg))) return;
+
+    ifi = (struct ifinfomsg *) nlmsg_data(nlh);
+    if (ifi->ifi_type != ARPHRD_SIT) return;
+    if (nlmsg_parse(nlh, sizeof(struct ifinfomsg), tb, IFLA_MAX, NULL) < 0 || tb[IFLA_IFNAME] == NULL) return;
+
+    if (store_get_tunnel(nla_get_string(tb[IFLA_IFNAME]), &tunnel) != SIT_DB_OK) {
+        if (nlh->nlmsg_type == RTM_NEWLINK) link_renamed(ifi->ifi_index);
+        return;
+    }
+
+    slot = slot_get(tunnel->id);
+    if (slot == NULL) goto end;
+
+    if (nlh->nlmsg_type == RTM_DELLINK) {
+        slot->ifindex = 0;
+        if (tunnel->state != STETE_STOPPED) mark(tunnel->id, DRIFT_LINK);
+    } else {
+        slot->ifindex = ifi->ifi_index;
+        if (link_drifted(tunnel, ifi, tb)) mark(tunnel->id, DRIFT_LINK);
+    }
+
+end:
+    store_free_result_tunnels(tunnel);
+}
+
+/* only the removal of a tunnel's own address counts; the kernel's
+ * link-local ones come and go with the link. */
+static void addr_event(struct nlmsghdr *nlh) {
+    struct ifaddrmsg *ifa;
+    struct nlattr *addr;
+    sit_prefix6_t prefix;
+    sit_tunnel_t *tunnel = NULL;
+    sit_route_t *route = NULL;
+
+    if (!nlmsg_valid_hdr(nlh, sizeof(struct ifaddrmsg))) return;
+
+    ifa = (struct ifaddrmsg *) nlmsg_data(nlh);
+    if (ifa->ifa_family != AF_INET6) return;
+
+    addr = nlmsg_find_attr(nlh, sizeof(struct ifaddrmsg), IFA_ADDRESS);
+    if (addr == NULL || nla_len(addr) < (int) sizeof(struct in6_addr)) return;
+
+    memcpy(&prefix.addr, nla_data(addr), sizeof(struct in6_addr));
+    prefix.len = 128;
+
+    if (store_lookup(&prefix, &tunnel, &route) != SIT_DB_OK) return;
+
+    if (tunnel->state != STETE_STOPPED && tunnel->address.len == ifa->ifa_prefixlen &&
+        memcmp(&tunnel->address.addr, &prefix.addr, sizeof(struct in6_addr)) == 0) {
+        mark(tunnel->id, DRIFT_ADDRESS);
+    }
+
+    store_free_result_tunnels(tunnel);
+    store_free_result_routes(route);
+}
+
+static void route_event(struct nlmsghdr *nlh) {
+    struct rtmsg *rtm;
+    struct nlattr *dst;
+    sit_prefix6_t prefix;
+    sit_tunnel_t *tunnel = NULL;
+    sit_route_t *route = NULL;
+
+    if (!nlmsg_valid_hdr(nlh, sizeof(struct rtmsg))) return;
+
+    rtm = (struct rtmsg *) nlmsg_data(nlh);
+    if (rtm->rtm_family != AF_INET6 || rtm->rtm_table != RT_TABLE_MAIN) return;
+
+    memset(&prefix, 0, sizeof(prefix));
+    prefix.len = rtm->rtm_dst_len;
+
+    dst = nlmsg_find_attr(nlh, sizeof(struct rtmsg), RTA_DST);
+    if (dst != NULL && nla_len(dst) >= (int) sizeof(struct in6_addr)) memcpy(&prefix.addr, nla_data(dst), sizeof(struct in6_addr));
+    else if (prefix.len != 0) return;
+
+    if (store_lookup(&prefix, &tunnel, &route) != SIT_DB_OK) return;
+
+    if (route != NULL && tunnel->state != STETE_STOPPED && route->prefix.len == prefix.len &&
+        memcmp(&route->prefix.addr, &prefix.addr, sizeof(struct in6_addr)) == 0) {
+        mark(tunnel->id, DRIFT_ROUTES);
+    }
+
+    store_free_result_tunnels(tunnel);
+    store_free_result_routes(route);
+}
+
+static int watch_valid(struct nl_msg *msg, void *arg) {
+    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+
+    (void) arg;
+
+    switch (nlh->nlmsg_type) {
+        case RTM_NEWLINK:
+        case RTM_DELLINK: link_event(nlh); break;
+        case RTM_DELADDR: addr_event(nlh); break;
+        case RTM_DELROUTE: route_event(nlh); break;
+    }
+
+    return NL_OK;
+}
+
+/* the replies come in through watch_valid() like any event: they fill in
+ * the ifindexes and catch whatever drifted before the subscription. */
+static void request_links() {
+    int err = nl_rtgen_request(event_sk, RTM_GETLINK, AF_UNSPEC, NLM_F_DUMP);
+    if (err < 0) log_error("nl_rtgen_request(): %s.\n", nl_geterror(err));
+}
+
+/* link events alone are often transient, e.g. a link that's being
+ * recreated; the link cache tells whether it's still off. */
+static bool link_in_sync(const sit_tunnel_t *tunnel) {
+    struct rtnl_link *link = NULL;
+    bool in_sync;
+    int err;
+
+    err = sit_get(query_sk, tunnel->name, &link);
+    if (err != SIT_OK && err != SIT_NOT_EXIST) return false;
+
+    if (tunnel->state == STETE_STOPPED) in_sync = err == SIT_NOT_EXIST;
+    else in_sync = err == SIT_OK && sit_diff(tunnel, link) == 0;
+
+    if (link != NULL) rtnl_link_put(link);
+    return in_sync;
+}
+
+static void refill(uint64_t now) {
+    tokens += (double) (now - refilled) * WATCH_RATE / 1000;
+    if (tokens > WATCH_BURST) tokens = WATCH_BURST;
+    refilled = now;
+}
+
+/* repairs are applied by a job, so they queue behind and coalesce with
+ * whatever the api already asked for the tunnel, and never run alongside
+ * another apply of it. */
+static void repair(uint32_t id, watch_slot_t *slot, uint64_t now) {
+    sit_tunnel_t *tunnel = NULL;
+
+    if (store_get_tunnel_by_id(id, &tunnel) != SIT_DB_OK) {
+        slot->drift = 0;
+        goto end;
+    }
+
+    if (slot->drift == DRIFT_LINK && link_in_sync(tunnel)) {
+        slot->drift = 0;
+        goto end;
+    }
+
+    if (tokens < 1) goto end;
+
+    if (job_submit(id, tunnel->name, NULL, NULL, false, &slot->job) != SIT_OK) {
+        log_error("%s: can't queue a repair, retrying.\n", tunnel->name);
+        slot->job = 0;
+        slot->due = now + WATCH_BACKOFF_MIN;
+        goto end;
+    }
+
+    tokens -= 1;
+    slot->job_drift = slot->drift;
+    slot->drift = 0;
+    slot->due = now + WATCH_JOB_POLL;
+
+end:
+    store_free_result_tunnels(tunnel);
+}
+
+/* looks at the outcome of the slot's repair job once it's finished; false
+ * while it's still queued or running. */
+static bool repair_done(watch_slot_t *slot, uint64_t now) {
+    job_info_t info;
+
+    if (job_wait(slot->job, 0, &info) != SIT_OK) {
+        /* recycled: long finished, nothing more to learn. */
+        slot->job = 0;
+        return true;
+    }
+
+    if (info.state < JOB_DONE) {
+        if (slot->drift == 0 || slot->due < now + WATCH_JOB_POLL) slot->due = now + WATCH_JOB_POLL;
+        return false;
+    }
+
+    slot->job = 0;
+    if (info.err == SIT_OK && !info.changed) return true;
+
+    /* drifting again right after a repair means something else keeps
+     * changing the tunnel; back off rather than fight it. */
+    if (slot->repaired != 0 && now - slot->repaired < WATCH_FLAP_WINDOW) {
+        slot->backoff = slot->backoff == 0 ? WATCH_BACKOFF_MIN : slot->backoff * 2;
+        if (slot->backoff > WATCH_BACKOFF_MAX) slot->backoff = WATCH_BACKOFF_MAX;
+        else log_warn("%s: drifted again, repairing it at most every %ums.\n", info.name, slot->backoff);
+    } else slot->backoff = 0;
+    slot->repaired = now;
+
+    if (info.err == SIT_OK) {
+        log_info("%s: repaired drift.\n", info.name);
+        return true;
+    }
+
+    log_error("%s: can't repair drift, retrying.\n", info.name);
+    slot->drift |= slot->job_drift;
+    slot->due = now + (slot->backoff > WATCH_BACKOFF_MIN ? slot->backoff : WATCH_BACKOFF_MIN);
+    return true;
+}
+
+static void run_due(uint64_t now) {
+    size_t kept = 0;
+
+    refill(now);
+
+    for (size_t i = 0; i < n_pending; i++) {
+        uint32_t id = pending[i];
+        watch_slot_t *slot = &slots[id];
+
+        /* a finished repair may leave the slot due again later. */
+        if (slot->due <= now && (slot->job == 0 || repair_done(slot, now))) {
+            if (slot->drift != 0 && slot->due <= now) repair(id, slot, now);
+        }
+        if (slot->drift != 0 || slot->job != 0) pending[kept++] = id;
+    }
+
+    n_pending = kept;
+}
+
+/* the kernel dropped events, so nothing is known about what changed: every
+ * tunnel gets a job. outstanding repairs are forgotten, their jobs run on.
+ * tunnels come in id order, so a retry skips the ones already queued. */
+static void resync() {
+    sit_tunnel_t *tunnels = NULL;
+    size_t n = 0, queued = 0, first;
+    uint64_t job;
+    int err;
+
+    resync_due = 0;
+
+    if (resync_cursor == 0) {
+        for (size_t i = 0; i < n_pending; i++) {
+            slots[pending[i]].drift = 0;
+            slots[pending[i]].job = 0;
+        }
+        n_pending = 0;
+    }
+
+    err = store_get_tunnels(&tunnels, &n);
+    if (err != SIT_DB_OK && err != SIT_DB_NOT_EXIST) {
+        resync_due = now_ms() + WATCH_BACKOFF_MIN;
+        return;
+    }
+
+    while (queued < n && tunnels[queued].id <= resync_cursor) queued++;
+    for (first = queued; queued < n; queued++) {
+        if (job_submit(tunnels[queued].id, tunnels[queued].name, NULL, NULL, false, &job) != SIT_OK) break;
+        resync_cursor = tunnels[queued].id;
+    }
+
+    if (queued < n) {
+        log_error("queued %zu of %zu tunnels for resync, retrying.\n", queued - first, n - first);
+        resync_due = now_ms() + WATCH_BACKOFF_MIN;
+    } else {
+        resync_cursor = 0;
+        if (resync_again) resync_due = now_ms() + holdoff_ms;
+        resync_again = false;
+    }
+
+    store_free_result_tunnels(tunnels);
+    request_links();
+}
+
+static int next_timeout(uint64_t now) {
+    uint64_t next = resync_due != 0 ? resync_due : UINT64_MAX;
+
+    for (size_t i = 0; i < n_pending; i++) {
+        if (slots[pending[i]].due < next) next = slots[pending[i]].due;
+    }
+
+    if (next == UINT64_MAX) return -1;
+    if (next <= now) return tokens < 1 ? 1000 / WATCH_RATE : 0;
+    return next - now > INT32_MAX ? INT32_MAX : (int) (next - now);
+}
+
+static void* watch_loop(void *data) {
+    struct pollfd fds[2] = {
+        { .fd = wake_fd, .events = POLLIN },
+        { .fd = nl_socket_get_fd(event_sk), .events = POLLIN }
+    };
+    int err;
+
+    (void) data;
+
+    for (;;) {
+        if (poll(fds, 2, next_timeout(now_ms())) < 0 && errno != EINTR) {
+            log_fatal("poll(): %s.\n", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) break;
+
+        /* one datagram per wakeup; the socket is non-blocking. */
+        if (fds[1].revents & POLLIN) {
+            err = nl_recvmsgs_default(event_sk);
+            if (err == -NLE_NOMEM) {
+                if (resync_due == 0) log_warn("kernel dropped events, resyncing all tunnels.\n");
+                if (resync_cursor != 0) resync_again = true;
+                resync_due = now_ms() + holdoff_ms;
+            } else if (err < 0 && err != -NLE_AGAIN) log_error("nl_recvmsgs(): %s.\n", nl_geterror(err));
+        }
+
+        if (resync_due != 0 && resync_due <= now_ms()) resync();
+        run_due(now_ms());
+    }
+
+    return NULL;
+}
+
+static struct nl_sock* open_sk() {
+    struct nl_sock *sk = nl_socket_alloc();
+    int err;
+
+    if (sk == NULL) {
+        log_fatal("nl_socket_alloc() returned null.\n");
+        return NULL;
+    }
+
+    err = nl_connect(sk, NETLINK_ROUTE);
+    if (err < 0) {
+        log_fatal("nl_connect(): %s.\n", nl_geterror(err));
+        nl_socket_free(sk);
+        return NULL;
+    }
+
+    return sk;
+}
+
+static void close_sk(struct nl_sock **sk) {
+    if (*sk == NULL) return;
+    nl_close(*sk);
+    nl_socket_free(*sk);
+    *sk = NULL;
+}
+
+static void watch_free() {
+    close_sk(&event_sk);
+    close_sk(&query_sk);
+    if (wake_fd >= 0) close(wake_fd);
+    wake_fd = -1;
+
+    free(slots);
+    slots = NULL;
+    n_slots = 0;
+    free(pending);
+    pending = NULL;
+    n_pending = cap_pending = 0;
+    resync_due = 0;
+    resync_cursor = 0;
+    resync_again = false;
+}
+
+static int open_event_sk() {
+    int err;
+
+    event_sk = open_sk();
+    if (event_sk == NULL) return SIT_FATAL;
+
+    nl_socket_disable_seq_check(event_sk);
+    nl_socket_modify_cb(event_sk, NL_CB_VALID, NL_CB_CUSTOM, &watch_valid, NULL);
+
+    err = nl_socket_set_buffer_size(event_sk, WATCH_RCVBUF_SZ, 0);
+    if (err < 0) log_warn("nl_socket_set_buffer_size(): %s.\n", nl_geterror(err));
+
+    err = nl_socket_add_memberships(event_sk, RTNLGRP_LINK, RTNLGRP_IPV6_IFADDR, RTNLGRP_IPV6_ROUTE, 0);
+    if (err == 0) err = nl_socket_set_nonblocking(event_sk);
+    if (err < 0) {
+        log_fatal("can't subscribe to events: %s.\n", nl_geterror(err));
+        return SIT_FATAL;
+    }
+
+    return SIT_OK;
+}
+
+int watch_start(uint32_t holdoff) {
+    int err;
+
+    pthread_mutex_lock(&run_lock);
+
+    if (running) {
+        log_fatal("drift watcher is already running.\n");
+        err = SIT_FATAL;
+        goto end;
+    }
+
+    err = open_event_sk();
+    if (err == SIT_OK && (query_sk = open_sk()) == NULL) err = SIT_FATAL;
+    if (err != SIT_OK) goto err_out;
+
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        log_fatal("eventfd(): %s.\n", strerror(errno));
+        err = SIT_FATAL;
+        goto err_out;
+    }
+
+    holdoff_ms = holdoff;
+    refilled = now_ms();
+    tokens = WATCH_BURST;
+    request_links();
+
+    if (pthread_create(&watcher, NULL, &watch_loop, NULL) != 0) {
+        log_fatal("pthread_create() failed.\n");
+        err = SIT_FATAL;
+        goto err_out;
+    }
+
+    running = true;
+    log_info("watching for drift, repairing after %ums.\n", holdoff);
+    goto end;
+
+err_out:
+    watch_free();
+
+end:
+    pthread_mutex_unlock(&run_lock);
+    return err;
+}
+
+int watch_stop() {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&run_lock);
+    if (!running) {
+        pthread_mutex_unlock(&run_lock);
+        return SIT_OK;
+    }
+    running = false;
+    pthread_mutex_unlock(&run_lock);
+
+    if (write(wake_fd, &one, sizeof(one)) != sizeof(one)) log_error("write(): %s.\n", strerror(errno));
+    pthread_join(watcher, NULL);
+
+    watch_free();
+    return SIT_OK;
+}
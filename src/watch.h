@@ -0,0 +1,14 @@
+#ifndef SITD_WATCH_H
+#define SITD_WATCH_H
+#include <stdint.h>
+
+/* listens for link, ipv6 address and ipv6 route events and re-applies only
+ * the tunnels whose kernel state drifted from the store. events for the same
+ * tunnel are coalesced for holdoff milliseconds, repairs are rate limited and
+ * a tunnel that keeps drifting is backed off. repairs and resyncs are
+ * applied as jobs, so job_start() must come first. return codes are the
+ * SIT_* ones. */
+int watch_start(uint32_t holdoff);
+int watch_stop();
+
+#endif // SITD_WATCH_H